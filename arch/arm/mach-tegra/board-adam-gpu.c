@@ -492,6 +492,7 @@ int __init adam_gpu_register_devices(void)
         adam_panel_early_suspender.suspend = adam_panel_early_suspend;
         adam_panel_early_suspender.resume = adam_panel_late_resume;
         adam_panel_early_suspender.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+        adam_panel_early_suspender.async = true;
         register_early_suspend(&adam_panel_early_suspender);
 #endif
 
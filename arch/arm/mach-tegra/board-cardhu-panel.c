@@ -1227,6 +1227,7 @@ int __init cardhu_panel_init(void)
 	cardhu_panel_early_suspender.suspend = cardhu_panel_early_suspend;
 	cardhu_panel_early_suspender.resume = cardhu_panel_late_resume;
 	cardhu_panel_early_suspender.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+	cardhu_panel_early_suspender.async = true;
 	register_early_suspend(&cardhu_panel_early_suspender);
 #endif
 
@@ -786,6 +786,7 @@ int __init enterprise_panel_init(void)
 	enterprise_panel_early_suspender.suspend = enterprise_panel_early_suspend;
 	enterprise_panel_early_suspender.resume = enterprise_panel_late_resume;
 	enterprise_panel_early_suspender.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+	enterprise_panel_early_suspender.async = true;
 	register_early_suspend(&enterprise_panel_early_suspender);
 #endif
 
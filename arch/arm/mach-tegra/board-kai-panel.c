@@ -679,6 +679,7 @@ int __init kai_panel_init(void)
 	kai_panel_early_suspender.suspend = kai_panel_early_suspend;
 	kai_panel_early_suspender.resume = kai_panel_late_resume;
 	kai_panel_early_suspender.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+	kai_panel_early_suspender.async = true;
 	register_early_suspend(&kai_panel_early_suspender);
 #endif
 
@@ -579,6 +579,7 @@ int __init shuttle_gpu_register_devices(void)
 	shuttle_panel_early_suspender.suspend = shuttle_panel_early_suspend;
 	shuttle_panel_early_suspender.resume = shuttle_panel_late_resume;
 	shuttle_panel_early_suspender.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+	shuttle_panel_early_suspender.async = true;
 	register_early_suspend(&shuttle_panel_early_suspender);
 #endif 
 	
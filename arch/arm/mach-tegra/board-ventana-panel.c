@@ -407,6 +407,7 @@ int __init ventana_panel_init(void)
 	ventana_panel_early_suspender.suspend = ventana_panel_early_suspend;
 	ventana_panel_early_suspender.resume = ventana_panel_late_resume;
 	ventana_panel_early_suspender.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+	ventana_panel_early_suspender.async = true;
 	register_early_suspend(&ventana_panel_early_suspender);
 #endif
 
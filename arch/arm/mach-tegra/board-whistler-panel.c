@@ -355,6 +355,7 @@ int __init whistler_panel_init(void)
 	whistler_panel_early_suspender.suspend = whistler_panel_early_suspend;
 	whistler_panel_early_suspender.resume = whistler_panel_late_resume;
 	whistler_panel_early_suspender.level = EARLY_SUSPEND_LEVEL_DISABLE_FB;
+	whistler_panel_early_suspender.async = true;
 	register_early_suspend(&whistler_panel_early_suspender);
 #endif
 
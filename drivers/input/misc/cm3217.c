@@ -961,6 +961,7 @@ static int cm3217_probe(struct i2c_client *client,
 
 	lpi->early_suspend.level =
 			EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
+	lpi->early_suspend.async = true;
 	lpi->early_suspend.suspend = cm3217_early_suspend;
 	lpi->early_suspend.resume = cm3217_late_resume;
 	register_early_suspend(&lpi->early_suspend);
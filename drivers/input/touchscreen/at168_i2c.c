@@ -299,6 +299,7 @@ static int at168_probe(struct i2c_client *client,
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	touch->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
+	touch->early_suspend.async = true;
 	touch->early_suspend.suspend = at168_early_suspend;
 	touch->early_suspend.resume = at168_late_resume;
 	register_early_suspend(&touch->early_suspend);
@@ -1652,6 +1652,7 @@ static int __devinit mxt_probe(struct i2c_client *client,
 
 #if defined(CONFIG_HAS_EARLYSUSPEND)
 	data->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
+	data->early_suspend.async = true;
 	data->early_suspend.suspend = mxt_early_suspend;
 	data->early_suspend.resume = mxt_early_resume;
 	register_early_suspend(&data->early_suspend);
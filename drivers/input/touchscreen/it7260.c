@@ -1323,6 +1323,7 @@ static int it7260_ts_probe(
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	ts->early_suspend.level = EARLY_SUSPEND_LEVEL_STOP_DRAWING - 1;
+	ts->early_suspend.async = true;
 	ts->early_suspend.suspend = it7260_ts_early_suspend;
 	ts->early_suspend.resume = it7260_ts_late_resume;
 	register_early_suspend(&ts->early_suspend);
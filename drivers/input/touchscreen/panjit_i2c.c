@@ -217,6 +217,7 @@ static int pj_probe(struct i2c_client *client,
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	touch->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
+	touch->early_suspend.async = true;
 	touch->early_suspend.suspend = pj_early_suspend;
 	touch->early_suspend.resume = pj_late_resume;
 	register_early_suspend(&touch->early_suspend);
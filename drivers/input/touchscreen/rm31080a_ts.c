@@ -1442,6 +1442,7 @@ struct rm31080_ts *rm31080_input_init(struct device *dev, unsigned int irq,
         mutex_init(&ts->access_mutex);
     #if defined(CONFIG_HAS_EARLYSUSPEND)
         ts->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
+        ts->early_suspend.async = true;
         ts->early_suspend.suspend = rm31080_early_suspend;
         ts->early_suspend.resume = rm31080_early_resume;
         register_early_suspend(&ts->early_suspend);
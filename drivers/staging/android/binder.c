@@ -32,22 +32,56 @@
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/vmalloc.h>
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking overview:
+ *
+ * There is no global lock serializing binder operations.  Each
+ * binder_proc carries three locks which must be acquired in the order
+ * shown, and a lock belonging to one proc must never be nested under a
+ * lock of the same level or below belonging to another proc:
+ *
+ * 1) proc->outer_lock (mutex): protects the refs_by_desc/refs_by_node
+ *    trees and the fields of the binder_ref objects in them.
+ * 2) node->lock (spinlock): protects the refs list of a binder_node and,
+ *    for dead nodes, its reference counts.
+ * 3) proc->inner_lock (spinlock): protects the threads and nodes trees,
+ *    every todo list owned by the proc (proc->todo, thread->todo,
+ *    node->async_todo, proc->delivered_death), thread transaction stacks,
+ *    looper state and error codes, and the reference counts and state
+ *    bits of the nodes owned by the proc.
+ *
+ * proc->alloc_lock (mutex) protects the buffer allocator and nests
+ * outside of mmap_sem; it is never taken while holding any of the locks
+ * above.  binder_lru_lock protects binder_lru_pages and nests inside
+ * alloc_lock; the shrinker takes inner_lock inside it to pin a proc.
+ * proc->files_lock protects proc->files.
+ *
+ * Objects that other procs may point at are kept alive by temporary
+ * references: proc->tmp_ref, thread->tmp_ref and node->tmp_refs.
+ */
+
+static DEFINE_MUTEX(binder_procs_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_MUTEX(binder_context_mgr_node_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
+static DEFINE_SPINLOCK(binder_lru_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static LIST_HEAD(binder_lru_pages);
+static int binder_lru_count;
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -146,22 +180,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_REPLY_SG) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -177,24 +211,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry))
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -212,6 +249,7 @@ struct binder_work {
 
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -222,6 +260,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -258,8 +297,10 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* allocated entry by address */
+		struct list_head free_entry; /* free entry by size class */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -270,9 +311,31 @@ struct binder_buffer {
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size; /* sg list and buffers after the offsets */
+	size_t sg_count;
 	uint8_t data[0];
 };
 
+/*
+ * Free buffers are kept on segregated lists by size: list 0 holds buffers
+ * smaller than 1 << BINDER_FREE_LIST_MIN_SHIFT bytes and each following
+ * list holds buffers up to twice as large as the previous one.  The last
+ * list also takes everything larger.
+ */
+#define BINDER_FREE_LIST_MIN_SHIFT	6
+#define BINDER_FREE_LIST_COUNT		16
+
+/*
+ * Pages of freed buffers stay mapped, both in the kernel and in the
+ * proc's vma, on binder_lru_pages until they are reused by a later
+ * allocation or reclaimed by binder_shrink().
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -289,17 +352,23 @@ struct binder_proc {
 	struct vm_area_struct *vma;
 	struct task_struct *tsk;
 	struct files_struct *files;
+	struct mutex files_lock;
 	struct hlist_node deferred_work_node;
 	int deferred_work;
+	int tmp_ref;
+	int is_dead;
+	struct mutex outer_lock;
+	spinlock_t inner_lock;
+	struct mutex alloc_lock;
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
 	struct list_head buffers;
-	struct rb_root free_buffers;
+	struct list_head free_lists[BINDER_FREE_LIST_COUNT];
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -336,10 +405,13 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	atomic_t tmp_ref;
+	int is_dead;
 };
 
 struct binder_transaction {
 	int debug_id;
+	spinlock_t lock; /* protects from, to_proc and to_thread */
 	struct binder_work work;
 	struct binder_thread *from;
 	struct binder_transaction *from_parent;
@@ -525,13 +597,16 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_free_list_index(size_t size)
+{
+	int index = fls(size >> BINDER_FREE_LIST_MIN_SHIFT);
+
+	return min(index, BINDER_FREE_LIST_COUNT - 1);
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
-	struct rb_node **p = &proc->free_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
 	size_t new_buffer_size;
 
 	BUG_ON(!new_buffer->free);
@@ -542,20 +617,8 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (new_buffer_size < buffer_size)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
-	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
+	list_add(&new_buffer->free_entry,
+		 &proc->free_lists[binder_free_list_index(new_buffer_size)]);
 }
 
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
@@ -607,6 +670,31 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+/* Both helpers must be called with proc->alloc_lock held. */
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (list_empty(&page->lru)) {
+		list_add_tail(&page->lru, &binder_lru_pages);
+		binder_lru_count++;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+static bool binder_lru_del(struct binder_lru_page *page)
+{
+	bool on_lru = false;
+
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&page->lru)) {
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		on_lru = true;
+	}
+	spin_unlock(&binder_lru_lock);
+	return on_lru;
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,8 +702,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int need_map = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -624,9 +713,22 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
+	if (allocate == 0)
+		goto free_range;
+
+	/*
+	 * Pages still cached on the lru are reused as they are, so the mm
+	 * is only needed if some page has to be populated.
+	 */
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr == NULL) {
+			need_map = 1;
+			break;
+		}
+	}
+
+	if (need_map && vma == NULL)
 		mm = get_task_mm(proc->tsk);
 
 	if (mm) {
@@ -634,10 +736,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
-	if (vma == NULL) {
+	if (need_map && vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
 		goto err_no_vma;
@@ -648,16 +747,19 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr) {
+			WARN_ON(!binder_lru_del(page));
+			continue;
+		}
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -667,7 +769,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -683,20 +785,26 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
+	/* keep the pages mapped until they are reused or reclaimed */
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		BUG_ON(page->page_ptr == NULL);
+		binder_lru_add(page);
+	}
+	return 0;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
+	/* the pages before the failed one are mapped but unused now */
+	for (page_addr -= PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE)
+		binder_lru_add(&proc->pages[(page_addr - proc->buffer) /
+					    PAGE_SIZE]);
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -705,17 +813,122 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * Unmaps and frees a page that was taken off the lru.  Called with
+ * proc->alloc_lock held; if the mm cannot be locked without blocking the
+ * page goes back on the lru and -EAGAIN is returned.
+ */
+static int binder_free_lru_page(struct binder_proc *proc,
+				struct binder_lru_page *page)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	void *page_addr = proc->buffer +
+		(page - proc->pages) * PAGE_SIZE;
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm == NULL)
+		goto err_no_mm;
+	if (!down_read_trylock(&mm->mmap_sem))
+		goto err_mmap_sem_busy;
+
+	if (proc->vma)
+		zap_page_range(proc->vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, PAGE_SIZE, NULL);
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+	return 0;
+
+err_mmap_sem_busy:
+	mmput(mm);
+err_no_mm:
+	binder_lru_add(page);
+	return -EAGAIN;
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc);
+
+static int binder_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	int nr_to_scan = sc->nr_to_scan;
+	int rem;
+
+	if (nr_to_scan <= 0)
+		return binder_lru_count;
+
+	spin_lock(&binder_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&binder_lru_pages)) {
+		page = list_first_entry(&binder_lru_pages,
+					struct binder_lru_page, lru);
+		proc = page->proc;
+		/*
+		 * The proc cannot go away while its pages are on the lru,
+		 * binder_free_proc() takes them off with alloc_lock held.
+		 * It can as soon as we drop alloc_lock though, while
+		 * mutex_unlock() may still be touching it, so hold a
+		 * temporary reference unless binder_free_proc() is already
+		 * on its way.
+		 */
+		spin_lock(&proc->inner_lock);
+		if (proc->is_dead && !proc->tmp_ref) {
+			spin_unlock(&proc->inner_lock);
+			list_move_tail(&page->lru, &binder_lru_pages);
+			continue;
+		}
+		proc->tmp_ref++;
+		spin_unlock(&proc->inner_lock);
+
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&page->lru, &binder_lru_pages);
+			spin_unlock(&binder_lru_lock);
+			binder_proc_dec_tmpref(proc);
+			spin_lock(&binder_lru_lock);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		binder_free_lru_page(proc, page);
+		mutex_unlock(&proc->alloc_lock);
+		binder_proc_dec_tmpref(proc);
+
+		spin_lock(&binder_lru_lock);
+	}
+	rem = binder_lru_count;
+	spin_unlock(&binder_lru_lock);
+
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: shrink %lu, %x, return %d\n",
+		     sc->nr_to_scan, sc->gfp_mask, rem);
+	return rem;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS
+};
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     size_t extra_buffers_size,
+						     int is_async)
+{
+	struct binder_buffer *buffer = NULL;
+	struct binder_buffer *tmp;
+	size_t buffer_size = 0;
+	size_t tmp_size;
 	void *has_page_addr;
 	void *end_page_addr;
+	size_t data_offsets_size;
 	size_t size;
+	int index;
 
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
@@ -723,14 +936,22 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	size = ALIGN(data_size, sizeof(void *)) +
+	data_offsets_size = ALIGN(data_size, sizeof(void *)) +
 		ALIGN(offsets_size, sizeof(void *));
 
-	if (size < data_size || size < offsets_size) {
+	if (data_offsets_size < data_size ||
+	    data_offsets_size < offsets_size) {
 		binder_user_error("binder: %d: got transaction with invalid "
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size = data_offsets_size + ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < data_offsets_size || size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra_buffers_size %zd\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -740,30 +961,37 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
+	/*
+	 * Only the size class of the request can hold buffers that are too
+	 * small, so look for the best fit there and otherwise take the
+	 * first buffer of the next non-empty class.
+	 */
+	index = binder_free_list_index(size);
+	list_for_each_entry(tmp, &proc->free_lists[index], free_entry) {
+		BUG_ON(!tmp->free);
+		tmp_size = binder_buffer_size(proc, tmp);
+		if (tmp_size < size)
+			continue;
+		if (buffer == NULL || tmp_size < buffer_size) {
+			buffer = tmp;
+			buffer_size = tmp_size;
+			if (buffer_size == size)
+				break;
+		}
+	}
+	while (buffer == NULL && ++index < BINDER_FREE_LIST_COUNT) {
+		if (list_empty(&proc->free_lists[index]))
+			continue;
+		buffer = list_first_entry(&proc->free_lists[index],
+					  struct binder_buffer, free_entry);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
 	}
-	if (best_fit == NULL) {
+	if (buffer == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -771,7 +999,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (buffer_size != size) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -785,7 +1013,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	list_del(&buffer->free_entry);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -799,6 +1027,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		     "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
+	buffer->sg_count = 0;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -811,6 +1041,21 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 extra_buffers_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -868,15 +1113,16 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
 	buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -907,7 +1153,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			list_del(&next->free_entry);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -916,15 +1162,66 @@ static void binder_free_buf(struct binder_proc *proc,
 						struct binder_buffer, entry);
 		if (prev->free) {
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
+			list_del(&prev->free_entry);
 			buffer = prev;
 		}
 	}
 	binder_insert_free_buffer(proc, buffer);
 }
 
-static struct binder_node *binder_get_node(struct binder_proc *proc,
-					   void __user *ptr)
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	binder_free_buf_locked(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+/*
+ * Looks up the buffer userspace asked to free and clears allow_user_free
+ * so that a second BC_FREE_BUFFER racing with this one cannot free it
+ * twice.  Returns NULL if there is no such buffer and ERR_PTR(-EPERM) if
+ * it has not been returned to userspace yet.
+ */
+static struct binder_buffer *binder_buffer_prepare_to_free(
+	struct binder_proc *proc, void __user *user_ptr)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_buffer_lookup(proc, user_ptr);
+	if (buffer && !buffer->allow_user_free)
+		buffer = ERR_PTR(-EPERM);
+	else if (buffer)
+		buffer->allow_user_free = 0;
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
+static void binder_node_inner_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+	if (node->proc)
+		spin_lock(&node->proc->inner_lock);
+}
+
+static void binder_node_inner_unlock(struct binder_node *node)
+{
+	struct binder_proc *proc = node->proc;
+
+	if (proc)
+		spin_unlock(&proc->inner_lock);
+	spin_unlock(&node->lock);
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+static struct binder_node *binder_get_node_ilocked(struct binder_proc *proc,
+						   void __user *ptr)
 {
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
@@ -936,20 +1233,48 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 			n = n->rb_left;
 		else if (ptr > node->ptr)
 			n = n->rb_right;
-		else
+		else {
+			node->tmp_refs++;
 			return node;
+		}
 	}
 	return NULL;
 }
 
+/*
+ * Returns the node with a temporary reference held, which the caller
+ * must drop with binder_put_node().
+ */
+static struct binder_node *binder_get_node(struct binder_proc *proc,
+					   void __user *ptr)
+{
+	struct binder_node *node;
+
+	spin_lock(&proc->inner_lock);
+	node = binder_get_node_ilocked(proc, ptr);
+	spin_unlock(&proc->inner_lock);
+	return node;
+}
+
+/*
+ * Creates the node for @fp, or for the context manager when @fp is NULL.
+ * If another thread created the node first, that node is returned
+ * instead.  Like binder_get_node(), the caller gets a temporary reference.
+ */
 static struct binder_node *binder_new_node(struct binder_proc *proc,
-					   void __user *ptr,
-					   void __user *cookie)
+					   struct flat_binder_object *fp)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
-	struct binder_node *node;
+	struct binder_node *node, *new_node;
+	void __user *ptr = fp ? fp->binder : NULL;
+	void __user *cookie = fp ? fp->cookie : NULL;
+
+	new_node = kzalloc(sizeof(*new_node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
 
+	spin_lock(&proc->inner_lock);
 	while (*p) {
 		parent = *p;
 		node = rb_entry(parent, struct binder_node, rb_node);
@@ -958,23 +1283,32 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			node->tmp_refs++;
+			spin_unlock(&proc->inner_lock);
+			kfree(new_node);
+			return node;
+		}
 	}
 
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
+	node->tmp_refs++;
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
+	spin_lock_init(&node->lock);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
 	node->work.type = BINDER_WORK_NODE;
+	if (fp) {
+		node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+		node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+	}
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	spin_unlock(&proc->inner_lock);
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -982,8 +1316,9 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+static int binder_inc_node_nilocked(struct binder_node *node, int strong,
+				    int internal,
+				    struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1017,50 +1352,127 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+/*
+ * target_list, if given, must be a todo list of node->proc, since it is
+ * only protected by that proc's inner lock.
+ */
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	int ret;
+
+	binder_node_inner_lock(node);
+	ret = binder_inc_node_nilocked(node, strong, internal, target_list);
+	binder_node_inner_unlock(node);
+	return ret;
+}
+
+/*
+ * Returns true if the node has become unreferenced and was unlinked, in
+ * which case the caller must free it after dropping the node locks.
+ */
+static bool binder_dec_node_nilocked(struct binder_node *node,
+				     int strong, int internal)
 {
+	struct binder_proc *proc = node->proc;
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
 		else
 			node->local_strong_refs--;
 		if (node->local_strong_refs || node->internal_strong_refs)
-			return 0;
+			return false;
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
-			return 0;
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
+			return false;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			list_add_tail(&node->work.entry, &proc->todo);
+			wake_up_interruptible(&proc->wait);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
+		    !node->local_weak_refs && !node->tmp_refs) {
 			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
+			if (proc) {
+				rb_erase(&node->rb_node, &proc->nodes);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: refless node %d deleted\n",
 					     node->debug_id);
 			} else {
+				spin_lock(&binder_dead_nodes_lock);
+				/*
+				 * the debugfs dump takes temporary refs on
+				 * dead nodes with only this lock held
+				 */
+				if (node->tmp_refs) {
+					spin_unlock(&binder_dead_nodes_lock);
+					return false;
+				}
 				hlist_del(&node->dead_node);
+				spin_unlock(&binder_dead_nodes_lock);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			return true;
 		}
 	}
+	return false;
+}
 
-	return 0;
+static void binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	free_node = binder_dec_node_nilocked(node, strong, internal);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 }
 
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+	if (node->proc)
+		spin_lock(&node->proc->inner_lock);
+	else
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs++;
+	if (node->proc)
+		spin_unlock(&node->proc->inner_lock);
+	else
+		spin_unlock(&binder_dead_nodes_lock);
+	spin_unlock(&node->lock);
+}
 
+static void binder_put_node(struct binder_node *node)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	if (!node->proc)
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs--;
+	BUG_ON(node->tmp_refs < 0);
+	if (!node->proc)
+		spin_unlock(&binder_dead_nodes_lock);
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+/*
+ * The ref lookup and refcounting helpers below must be called with
+ * proc->outer_lock held for the proc owning the ref.
+ */
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
 {
@@ -1103,7 +1515,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1132,7 +1544,9 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		spin_lock(&node->lock);
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		spin_unlock(&node->lock);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1149,6 +1563,8 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	bool free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1156,16 +1572,22 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	binder_node_inner_lock(ref->node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_nilocked(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_nilocked(ref->node, 0, 1);
+	binder_node_inner_unlock(ref->node);
+	if (free_node)
+		binder_free_node(ref->node);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1207,12 +1629,8 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 			return -EINVAL;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
@@ -1228,19 +1646,105 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+static void binder_free_proc(struct binder_proc *proc);
+static void binder_free_thread(struct binder_thread *thread);
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	spin_lock(&proc->inner_lock);
+	proc->tmp_ref--;
+	if (proc->is_dead && RB_EMPTY_ROOT(&proc->threads) &&
+	    !proc->tmp_ref) {
+		spin_unlock(&proc->inner_lock);
+		binder_free_proc(proc);
+		return;
+	}
+	spin_unlock(&proc->inner_lock);
+}
+
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
+{
+	/*
+	 * The count is atomic so it can be raised under t->lock, but it can
+	 * only drop to zero with the inner lock held.
+	 */
+	spin_lock(&thread->proc->inner_lock);
+	if (atomic_dec_and_test(&thread->tmp_ref) && thread->is_dead) {
+		spin_unlock(&thread->proc->inner_lock);
+		binder_free_thread(thread);
+		return;
+	}
+	spin_unlock(&thread->proc->inner_lock);
+}
+
+/*
+ * Returns the sending thread of @t with a temporary reference held, or
+ * NULL if it is gone.
+ */
+static struct binder_thread *binder_get_txn_from(struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	spin_lock(&t->lock);
+	from = t->from;
+	if (from)
+		atomic_inc(&from->tmp_ref);
+	spin_unlock(&t->lock);
+	return from;
+}
+
+/*
+ * Like binder_get_txn_from(), but also returns with the inner lock of the
+ * sender's proc held, after checking that the sender has not been
+ * released in the meantime.
+ */
+static struct binder_thread *binder_get_txn_from_and_acq_inner(
+	struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	from = binder_get_txn_from(t);
+	if (!from)
+		return NULL;
+	spin_lock(&from->proc->inner_lock);
+	if (t->from) {
+		BUG_ON(from != t->from);
+		return from;
+	}
+	spin_unlock(&from->proc->inner_lock);
+	binder_thread_dec_tmpref(from);
+	return NULL;
+}
+
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
+{
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	spin_lock(&t->lock);
+	t->from = NULL;
+	spin_unlock(&t->lock);
+}
+
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc;
+
+	spin_lock(&t->lock);
+	target_proc = t->to_proc;
+	spin_unlock(&t->lock);
+	/*
+	 * t->buffer is only cleared under the inner lock of the proc that
+	 * owns the buffer, and t->to_proc is cleared along with it.
+	 */
+	if (target_proc) {
+		spin_lock(&target_proc->inner_lock);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		spin_unlock(&target_proc->inner_lock);
 	}
-	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1251,7 +1755,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	struct binder_thread *target_thread;
 	BUG_ON(t->flags & TF_ONE_WAY);
 	while (1) {
-		target_thread = t->from;
+		target_thread = binder_get_txn_from_and_acq_inner(t);
 		if (target_thread) {
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
@@ -1266,16 +1770,20 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					      t->debug_id, target_thread->proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				spin_unlock(&target_thread->proc->inner_lock);
+				binder_free_transaction(t);
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
 					"already\n", target_thread->proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
+				spin_unlock(&target_thread->proc->inner_lock);
 			}
+			binder_thread_dec_tmpref(target_thread);
 			return;
 		} else {
 			struct binder_transaction *next = t->from_parent;
@@ -1285,7 +1793,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     "for transaction %d, target dead\n",
 				     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1344,11 +1852,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad handle %ld\n", debug_id,
 				       fp->handle);
@@ -1358,13 +1871,17 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        ref %d desc %d (node %d)\n",
 				     ref->debug_id, ref->desc, ref->node->debug_id);
 			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			mutex_unlock(&proc->outer_lock);
 		} break;
 
 		case BINDER_TYPE_FD:
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        fd %ld\n", fp->handle);
-			if (failed_at)
+			if (failed_at) {
+				mutex_lock(&proc->files_lock);
 				task_close_fd(proc, fp->handle);
+				mutex_unlock(&proc->files_lock);
+			}
 			break;
 
 		default:
@@ -1377,12 +1894,17 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       const struct iovec __user *sg_buffers,
+			       size_t sg_count)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	struct iovec sg_iovstack[UIO_FASTIOV];
+	struct iovec *sg_iov = sg_iovstack;
+	size_t extra_buffers_size = 0;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
 	struct list_head *target_list;
@@ -1400,16 +1922,21 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		long saved_priority;
+
+		spin_lock(&proc->inner_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			spin_unlock(&proc->inner_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		saved_priority = in_reply_to->saved_priority;
 		if (in_reply_to->to_thread != thread) {
+			spin_lock(&in_reply_to->lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
 				" transaction %d has target %d:%d\n",
@@ -1418,12 +1945,17 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&in_reply_to->lock);
+			spin_unlock(&proc->inner_lock);
+			binder_set_nice(saved_priority);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
-		target_thread = in_reply_to->from;
+		spin_unlock(&proc->inner_lock);
+		binder_set_nice(saved_priority);
+		target_thread = binder_get_txn_from_and_acq_inner(in_reply_to);
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
@@ -1436,16 +1968,27 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			spin_unlock(&target_thread->proc->inner_lock);
+			binder_thread_dec_tmpref(target_thread);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		target_proc->tmp_ref++;
+		spin_unlock(&target_proc->inner_lock);
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
+
+			mutex_lock(&proc->outer_lock);
 			ref = binder_get_ref(proc, tr->target.handle);
+			if (ref) {
+				target_node = ref->node;
+				binder_inc_node_tmpref(target_node);
+			}
+			mutex_unlock(&proc->outer_lock);
 			if (ref == NULL) {
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
@@ -1453,24 +1996,36 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_invalid_target_handle;
 			}
-			target_node = ref->node;
 		} else {
+			mutex_lock(&binder_context_mgr_node_lock);
 			target_node = binder_context_mgr_node;
+			if (target_node)
+				binder_inc_node_tmpref(target_node);
+			mutex_unlock(&binder_context_mgr_node_lock);
 			if (target_node == NULL) {
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
 		}
 		e->to_node = target_node->debug_id;
+		spin_lock(&target_node->lock);
 		target_proc = target_node->proc;
+		if (target_proc) {
+			spin_lock(&target_proc->inner_lock);
+			target_proc->tmp_ref++;
+			spin_unlock(&target_proc->inner_lock);
+		}
+		spin_unlock(&target_node->lock);
 		if (target_proc == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		spin_lock(&proc->inner_lock);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
-			struct binder_transaction *tmp;
+			struct binder_transaction *tmp, *match = NULL;
 			tmp = thread->transaction_stack;
 			if (tmp->to_thread != thread) {
+				spin_lock(&tmp->lock);
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1478,15 +2033,22 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&tmp->lock);
+				spin_unlock(&proc->inner_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
 			while (tmp) {
+				spin_lock(&tmp->lock);
 				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
+					match = tmp;
+				spin_unlock(&tmp->lock);
 				tmp = tmp->from_parent;
 			}
+			if (match)
+				target_thread = binder_get_txn_from(match);
 		}
+		spin_unlock(&proc->inner_lock);
 	}
 	if (target_thread) {
 		e->to_thread = target_thread->pid;
@@ -1498,6 +2060,26 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	e->to_proc = target_proc->pid;
 
+	if (sg_count) {
+		ssize_t sg_size;
+		size_t i;
+
+		sg_size = rw_copy_check_uvector(WRITE, sg_buffers, sg_count,
+						ARRAY_SIZE(sg_iovstack),
+						sg_iovstack, &sg_iov);
+		if (sg_size < 0) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid sg list, %zd\n",
+				proc->pid, thread->pid, sg_size);
+			return_error = BR_FAILED_REPLY;
+			goto err_bad_sg_list;
+		}
+		extra_buffers_size = sg_count * sizeof(struct iovec);
+		for (i = 0; i < sg_count; i++)
+			extra_buffers_size += ALIGN(sg_iov[i].iov_len,
+						    sizeof(void *));
+	}
+
 	/* TODO: reuse incoming transaction for reply */
 	t = kzalloc(sizeof(*t), GFP_KERNEL);
 	if (t == NULL) {
@@ -1505,6 +2087,7 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_alloc_t_failed;
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION);
+	spin_lock_init(&t->lock);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
@@ -1513,7 +2096,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1544,7 +2127,8 @@ static void binder_transaction(struct binder_proc *proc,
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
@@ -1570,6 +2154,33 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
+	if (sg_count) {
+		/*
+		 * The sg list for the target goes first, followed by the
+		 * buffers themselves, each copied straight from the sender.
+		 */
+		struct iovec *sg_list = (void *)offp +
+			ALIGN(tr->offsets_size, sizeof(void *));
+		void *sg_ptr = sg_list + sg_count;
+		size_t i;
+
+		for (i = 0; i < sg_count; i++) {
+			if (copy_from_user(sg_ptr, sg_iov[i].iov_base,
+					   sg_iov[i].iov_len)) {
+				binder_user_error("binder: %d:%d got "
+					"transaction with invalid sg "
+					"buffer %zd\n",
+					proc->pid, thread->pid, i);
+				return_error = BR_FAILED_REPLY;
+				goto err_copy_data_failed;
+			}
+			sg_list[i].iov_base = sg_ptr +
+				target_proc->user_buffer_offset;
+			sg_list[i].iov_len = sg_iov[i].iov_len;
+			sg_ptr += ALIGN(sg_iov[i].iov_len, sizeof(void *));
+		}
+		t->buffer->sg_count = sg_count;
+	}
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1596,13 +2207,11 @@ static void binder_transaction(struct binder_proc *proc,
 			struct binder_ref *ref;
 			struct binder_node *node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
+				node = binder_new_node(proc, fp);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1610,10 +2219,15 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
+			mutex_lock(&target_proc->outer_lock);
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				mutex_unlock(&target_proc->outer_lock);
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1629,11 +2243,21 @@ static void binder_transaction(struct binder_proc *proc,
 				     "        node %d u%p -> ref %d desc %d\n",
 				     node->debug_id, node->ptr, ref->debug_id,
 				     ref->desc);
+			mutex_unlock(&target_proc->outer_lock);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+			struct binder_node *node;
+			int ref_debug_id;
+			uint32_t ref_desc;
+			bool same_proc;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1641,22 +2265,35 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			node = ref->node;
+			ref_debug_id = ref->debug_id;
+			ref_desc = ref->desc;
+			binder_inc_node_tmpref(node);
+			mutex_unlock(&proc->outer_lock);
+
+			spin_lock(&node->lock);
+			same_proc = node->proc == target_proc;
+			spin_unlock(&node->lock);
+			if (same_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inc_node(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
+					     ref_debug_id, ref_desc, node->debug_id,
+					     node->ptr);
 			} else {
 				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
+
+				mutex_lock(&target_proc->outer_lock);
+				new_ref = binder_get_ref_for_node(target_proc, node);
 				if (new_ref == NULL) {
+					mutex_unlock(&target_proc->outer_lock);
+					binder_put_node(node);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
@@ -1664,9 +2301,11 @@ static void binder_transaction(struct binder_proc *proc,
 				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+					     ref_debug_id, ref_desc, new_ref->debug_id,
+					     new_ref->desc, node->debug_id);
+				mutex_unlock(&target_proc->outer_lock);
 			}
+			binder_put_node(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1694,13 +2333,16 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_fget_failed;
 			}
+			mutex_lock(&target_proc->files_lock);
 			target_fd = task_get_unused_fd_flags(target_proc, O_CLOEXEC);
+			if (target_fd >= 0)
+				task_fd_install(target_proc, target_fd, file);
+			mutex_unlock(&target_proc->files_lock);
 			if (target_fd < 0) {
 				fput(file);
 				return_error = BR_FAILED_REPLY;
 				goto err_get_unused_fd_failed;
 			}
-			task_fd_install(target_proc, target_fd, file);
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        fd %ld -> %d\n", fp->handle, target_fd);
 			/* TODO: fput? */
@@ -1715,31 +2357,80 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	/*
+	 * Queue the completion before the transaction becomes visible to
+	 * the target, so a fast reply cannot overtake it.
+	 */
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	spin_lock(&proc->inner_lock);
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	if (!reply && !(t->flags & TF_ONE_WAY)) {
+		t->need_reply = 1;
+		t->from_parent = thread->transaction_stack;
+		thread->transaction_stack = t;
+	}
+	spin_unlock(&proc->inner_lock);
+
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
+		spin_lock(&target_proc->inner_lock);
+		if (target_thread->is_dead) {
+			spin_unlock(&target_proc->inner_lock);
+			goto err_dead_proc_or_thread;
+		}
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+		list_add_tail(&t->work.entry, target_list);
+		spin_unlock(&target_proc->inner_lock);
+		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
-		t->need_reply = 1;
-		t->from_parent = thread->transaction_stack;
-		thread->transaction_stack = t;
+		spin_lock(&target_proc->inner_lock);
+		if (target_proc->is_dead ||
+		    (target_thread && target_thread->is_dead)) {
+			spin_unlock(&target_proc->inner_lock);
+			spin_lock(&proc->inner_lock);
+			binder_pop_transaction_ilocked(thread, t);
+			spin_unlock(&proc->inner_lock);
+			goto err_dead_proc_or_thread;
+		}
+		list_add_tail(&t->work.entry, target_list);
+		spin_unlock(&target_proc->inner_lock);
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
+		spin_lock(&target_node->lock);
+		spin_lock(&target_proc->inner_lock);
+		if (target_proc->is_dead) {
+			spin_unlock(&target_proc->inner_lock);
+			spin_unlock(&target_node->lock);
+			goto err_dead_proc_or_thread;
+		}
 		if (target_node->has_async_transaction) {
 			target_list = &target_node->async_todo;
 			target_wait = NULL;
 		} else
 			target_node->has_async_transaction = 1;
+		list_add_tail(&t->work.entry, target_list);
+		spin_unlock(&target_proc->inner_lock);
+		spin_unlock(&target_node->lock);
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_node)
+		binder_put_node(target_node);
+	binder_proc_dec_tmpref(target_proc);
+	if (sg_iov != sg_iovstack)
+		kfree(sg_iov);
 	return;
 
+err_dead_proc_or_thread:
+	return_error = BR_DEAD_REPLY;
+	spin_lock(&proc->inner_lock);
+	list_del(&tcomplete->entry);
+	spin_unlock(&proc->inner_lock);
 err_get_unused_fd_failed:
 err_fget_failed:
 err_fd_not_allowed:
@@ -1759,11 +2450,21 @@ err_alloc_tcomplete_failed:
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
+err_bad_sg_list:
+	if (sg_iov != sg_iovstack)
+		kfree(sg_iov);
 err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_node)
+		binder_put_node(target_node);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
+
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1775,12 +2476,24 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
+	spin_lock(&proc->inner_lock);
+	/*
+	 * A failed reply may have been delivered to this thread while it
+	 * was busy here; park it in return_error2 like
+	 * binder_send_failed_reply() does.
+	 */
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
+	if (in_reply_to)
 		thread->return_error = BR_TRANSACTION_COMPLETE;
-		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	else
 		thread->return_error = return_error;
+	spin_unlock(&proc->inner_lock);
+	if (in_reply_to)
+		binder_send_failed_reply(in_reply_to, return_error);
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1795,9 +2508,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1806,16 +2519,25 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		case BC_DECREFS: {
 			uint32_t target;
 			struct binder_ref *ref;
+			struct binder_node *ctx_mgr_node = NULL;
 			const char *debug_string;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (target == 0 && binder_context_mgr_node &&
+			if (target == 0 &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
+				mutex_lock(&binder_context_mgr_node_lock);
+				ctx_mgr_node = binder_context_mgr_node;
+				if (ctx_mgr_node)
+					binder_inc_node_tmpref(ctx_mgr_node);
+				mutex_unlock(&binder_context_mgr_node_lock);
+			}
+			mutex_lock(&proc->outer_lock);
+			if (ctx_mgr_node) {
 				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
-				if (ref->desc != target) {
+					       ctx_mgr_node);
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1826,6 +2548,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
+				if (ctx_mgr_node)
+					binder_put_node(ctx_mgr_node);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1854,6 +2579,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&proc->outer_lock);
+			if (ctx_mgr_node)
+				binder_put_node(ctx_mgr_node);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1887,35 +2615,44 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_put_node(node);
 				break;
 			}
+			binder_node_inner_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
+					binder_node_inner_unlock(node);
 					binder_user_error("binder: %d:%d "
 						"BC_ACQUIRE_DONE node %d has "
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_strong_ref = 0;
 			} else {
 				if (node->pending_weak_ref == 0) {
+					binder_node_inner_unlock(node);
 					binder_user_error("binder: %d:%d "
 						"BC_INCREFS_DONE node %d has "
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			/* cannot free the node, we hold a temporary ref */
+			binder_dec_node_nilocked(node, cmd == BC_ACQUIRE_DONE, 0);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_node_inner_unlock(node);
+			binder_put_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1933,20 +2670,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
-			buffer = binder_buffer_lookup(proc, data_ptr);
+			buffer = binder_buffer_prepare_to_free(proc, data_ptr);
 			if (buffer == NULL) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
-			if (!buffer->allow_user_free) {
+			if (IS_ERR(buffer)) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			spin_lock(&proc->inner_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1956,26 +2694,45 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			spin_unlock(&proc->inner_lock);
 			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
+				struct binder_node *buf_node = buffer->target_node;
+
+				binder_node_inner_lock(buf_node);
+				BUG_ON(!buf_node->has_async_transaction);
+				if (list_empty(&buf_node->async_todo))
+					buf_node->has_async_transaction = 0;
 				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+					list_move_tail(buf_node->async_todo.next, &thread->todo);
+				binder_node_inner_unlock(buf_node);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
 			break;
 		}
 
-		case BC_TRANSACTION:
-		case BC_REPLY: {
-			struct binder_transaction_data tr;
+		case BC_TRANSACTION:
+		case BC_REPLY: {
+			struct binder_transaction_data tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   NULL, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
 
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers,
+					   tr.buffers_count);
 			break;
 		}
 
@@ -1983,6 +2740,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2000,11 +2758,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2013,12 +2773,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			spin_unlock(&proc->inner_lock);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2026,7 +2789,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			uint32_t target;
 			void __user *cookie;
 			struct binder_ref *ref;
-			struct binder_ref_death *death;
+			struct binder_ref_death *death = NULL;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2034,8 +2797,25 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+				/* allocate up front, the node lock is a spinlock */
+				death = kzalloc(sizeof(*death), GFP_KERNEL);
+				if (death == NULL) {
+					spin_lock(&proc->inner_lock);
+					thread->return_error = BR_ERROR;
+					spin_unlock(&proc->inner_lock);
+					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+						     "binder: %d:%d "
+						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
+						     proc->pid, thread->pid);
+					break;
+				}
+			}
+			mutex_lock(&proc->outer_lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
+				kfree(death);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2055,6 +2835,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     cookie, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak, ref->node->debug_id);
 
+			spin_lock(&ref->node->lock);
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
 					binder_user_error("binder: %d:%"
@@ -2062,15 +2843,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
-					break;
-				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-						     "binder: %d:%d "
-						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
-						     proc->pid, thread->pid);
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->outer_lock);
+					kfree(death);
 					break;
 				}
 				binder_stats_created(BINDER_STAT_DEATH);
@@ -2079,12 +2854,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					spin_lock(&proc->inner_lock);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					spin_unlock(&proc->inner_lock);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2093,6 +2870,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->outer_lock);
 					break;
 				}
 				death = ref->death;
@@ -2104,9 +2883,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					spin_unlock(&ref->node->lock);
+					mutex_unlock(&proc->outer_lock);
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2119,7 +2901,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			spin_unlock(&ref->node->lock);
+			mutex_unlock(&proc->outer_lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2129,6 +2914,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2140,6 +2926,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2156,6 +2943,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
 		} break;
 
 		default:
@@ -2172,9 +2960,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2209,22 +2997,35 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
+		uint32_t return_error = BR_OK;
+		uint32_t return_error2 = BR_OK;
+
 		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+			return_error2 = thread->return_error2;
+			thread->return_error2 = BR_OK;
+		}
+		/* leave return_error for the next read if it does not fit */
+		if (return_error2 == BR_OK ||
+		    end - ptr >= 2 * sizeof(uint32_t)) {
+			return_error = thread->return_error;
+			thread->return_error = BR_OK;
+		}
+		spin_unlock(&proc->inner_lock);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(uint32_t);
+		}
+		if (return_error != BR_OK) {
+			if (put_user(return_error, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
-			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2232,7 +3033,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2256,10 +3057,11 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	spin_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2267,27 +3069,55 @@ retry:
 	while (1) {
 		uint32_t cmd;
 		struct binder_transaction_data tr;
+		struct binder_transaction_data_sg tr_sg;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		struct binder_thread *t_from;
+		uint32_t ret_cmd;
+		void *ret_data;
+		size_t ret_size;
+		struct list_head *list;
 
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
+			spin_unlock(&proc->inner_lock);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
+			break;
+		}
+		w = list_first_entry(list, struct binder_work, entry);
+		if (w->type == BINDER_WORK_TRANSACTION &&
+		    container_of(w, struct binder_transaction,
+				 work)->buffer->sg_count &&
+		    end - ptr < sizeof(struct binder_transaction_data_sg) + 4) {
+			spin_unlock(&proc->inner_lock);
 			break;
+		}
+		/*
+		 * Other threads may be reading proc->todo too, so the work
+		 * item is taken off the list before the lock is dropped.
+		 */
+		list_del_init(&w->entry);
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
+			spin_unlock(&proc->inner_lock);
 			t = container_of(w, struct binder_transaction, work);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			spin_unlock(&proc->inner_lock);
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2297,86 +3127,117 @@ retry:
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
-			uint32_t cmd = BR_NOOP;
-			const char *cmd_name;
+			uint32_t cmds[2];
+			int ncmds = 0;
+			int i;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
+			/*
+			 * node->refs is only stable under node->lock, but a
+			 * ref cannot be added without holding a temporary
+			 * reference on the node first.
+			 */
+			int weak = !hlist_empty(&node->refs) || node->local_weak_refs ||
+				   node->tmp_refs || strong;
+
+			/*
+			 * Handle every pending state change at once: the
+			 * work item is off the list, and leaving it there
+			 * would let another looper deliver the next command
+			 * out of order.
+			 */
 			if (weak && !node->has_weak_ref) {
-				cmd = BR_INCREFS;
-				cmd_name = "BR_INCREFS";
+				cmds[ncmds++] = BR_INCREFS;
 				node->has_weak_ref = 1;
 				node->pending_weak_ref = 1;
 				node->local_weak_refs++;
-			} else if (strong && !node->has_strong_ref) {
-				cmd = BR_ACQUIRE;
-				cmd_name = "BR_ACQUIRE";
+			}
+			if (strong && !node->has_strong_ref) {
+				cmds[ncmds++] = BR_ACQUIRE;
 				node->has_strong_ref = 1;
 				node->pending_strong_ref = 1;
 				node->local_strong_refs++;
-			} else if (!strong && node->has_strong_ref) {
-				cmd = BR_RELEASE;
-				cmd_name = "BR_RELEASE";
+			}
+			if (!strong && node->has_strong_ref) {
+				cmds[ncmds++] = BR_RELEASE;
 				node->has_strong_ref = 0;
-			} else if (!weak && node->has_weak_ref) {
-				cmd = BR_DECREFS;
-				cmd_name = "BR_DECREFS";
+			}
+			if (!weak && node->has_weak_ref) {
+				cmds[ncmds++] = BR_DECREFS;
 				node->has_weak_ref = 0;
 			}
-			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
+			if (!weak && !strong) {
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p deleted\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
+				rb_erase(&node->rb_node, &proc->nodes);
+				spin_unlock(&proc->inner_lock);
+				/*
+				 * Wait for anyone still unlocking the node
+				 * after dropping the last reference.
+				 */
+				spin_lock(&node->lock);
+				spin_unlock(&node->lock);
+				binder_free_node(node);
+			} else {
+				if (ncmds == 0)
+					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+						     "binder: %d:%d node %d u%p c%p state unchanged\n",
+						     proc->pid, thread->pid, node_debug_id,
+						     node_ptr, node_cookie);
+				spin_unlock(&proc->inner_lock);
+			}
+
+			for (i = 0; i < ncmds; i++) {
+				if (put_user(cmds[i], (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
-				binder_stat_br(proc, thread, cmd);
+				binder_stat_br(proc, thread, cmds[i]);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
-			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p deleted\n",
-						     proc->pid, thread->pid, node->debug_id,
-						     node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
-				} else {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p state unchanged\n",
-						     proc->pid, thread->pid, node->debug_id, node->ptr,
-						     node->cookie);
-				}
+					     proc->pid, thread->pid,
+					     cmds[i] == BR_INCREFS ? "BR_INCREFS" :
+					     cmds[i] == BR_ACQUIRE ? "BR_ACQUIRE" :
+					     cmds[i] == BR_RELEASE ? "BR_RELEASE" :
+					     "BR_DECREFS",
+					     node_debug_id, node_ptr, node_cookie);
 			}
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
-			uint32_t cmd;
+			void __user *cookie;
 
 			death = container_of(w, struct binder_ref_death, work);
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
+			cookie = death->cookie;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
-			else
+				spin_unlock(&proc->inner_lock);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
 				cmd = BR_DEAD_BINDER;
+				list_add(&w->entry, &proc->delivered_death);
+				spin_unlock(&proc->inner_lock);
+			}
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
@@ -2385,17 +3246,14 @@ retry:
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			spin_unlock(&proc->inner_lock);
+			break;
 		}
 
 		if (!t)
@@ -2423,8 +3281,9 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
-		if (t->from) {
-			struct task_struct *sender = t->from->proc->tsk;
+		t_from = binder_get_txn_from(t);
+		if (t_from) {
+			struct task_struct *sender = t_from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
 							current->nsproxy->pid_ns);
 		} else {
@@ -2439,35 +3298,59 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (t->buffer->sg_count) {
+			tr_sg.transaction_data = tr;
+			tr_sg.buffers = tr.data.ptr.offsets +
+				ALIGN(t->buffer->offsets_size, sizeof(void *));
+			tr_sg.buffers_count = t->buffer->sg_count;
+			ret_cmd = (cmd == BR_TRANSACTION) ?
+				BR_TRANSACTION_SG : BR_REPLY_SG;
+			ret_data = &tr_sg;
+			ret_size = sizeof(tr_sg);
+		} else {
+			ret_cmd = cmd;
+			ret_data = &tr;
+			ret_size = sizeof(tr);
+		}
+
+		if (put_user(ret_cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), ret_data, ret_size)) {
+			if (t_from)
+				binder_thread_dec_tmpref(t_from);
+			/* put it back so the transaction is not lost */
+			spin_lock(&proc->inner_lock);
+			list_add(&t->work.entry, list);
+			spin_unlock(&proc->inner_lock);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
-		ptr += sizeof(tr);
+		ptr += ret_size;
 
-		binder_stat_br(proc, thread, cmd);
+		binder_stat_br(proc, thread, ret_cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
 			     proc->pid, thread->pid,
 			     (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" :
 			     "BR_REPLY",
-			     t->debug_id, t->from ? t->from->proc->pid : 0,
-			     t->from ? t->from->pid : 0, cmd,
+			     t->debug_id, t_from ? t_from->proc->pid : 0,
+			     t_from ? t_from->pid : 0, cmd,
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		if (t_from)
+			binder_thread_dec_tmpref(t_from);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			spin_lock(&proc->inner_lock);
 			t->to_parent = thread->transaction_stack;
+			spin_lock(&t->lock);
 			t->to_thread = thread;
+			spin_unlock(&t->lock);
 			thread->transaction_stack = t;
+			spin_unlock(&proc->inner_lock);
 		} else {
-			t->buffer->transaction = NULL;
-			kfree(t);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION);
+			binder_free_transaction(t);
 		}
 		break;
 	}
@@ -2475,27 +3358,39 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spin_unlock(&proc->inner_lock);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		spin_unlock(&proc->inner_lock);
 	return 0;
 }
 
-static void binder_release_work(struct list_head *list)
+static void binder_release_work(struct binder_proc *proc,
+				struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
+
+	while (1) {
+		spin_lock(&proc->inner_lock);
+		if (list_empty(list)) {
+			spin_unlock(&proc->inner_lock);
+			break;
+		}
 		w = list_first_entry(list, struct binder_work, entry);
 		list_del_init(&w->entry);
+		spin_unlock(&proc->inner_lock);
+
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			struct binder_transaction *t;
@@ -2508,6 +3403,14 @@ static void binder_release_work(struct list_head *list)
 			kfree(w);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
+		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
+			struct binder_ref_death *death;
+
+			/* the ref no longer points at it */
+			death = container_of(w, struct binder_ref_death, work);
+			kfree(death);
+			binder_stats_deleted(BINDER_STAT_DEATH);
+		} break;
 		default:
 			break;
 		}
@@ -2515,7 +3418,8 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+static struct binder_thread *binder_get_thread_ilocked(
+	struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2530,38 +3434,81 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
+			return thread;
 	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
+	if (new_thread == NULL)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	atomic_set(&thread->tmp_ref, 0);
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	spin_lock(&proc->inner_lock);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	spin_unlock(&proc->inner_lock);
+	if (thread == NULL) {
+		new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+		if (new_thread == NULL)
 			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+		spin_lock(&proc->inner_lock);
+		thread = binder_get_thread_ilocked(proc, new_thread);
+		spin_unlock(&proc->inner_lock);
+		if (thread != new_thread)
+			kfree(new_thread);
 	}
 	return thread;
 }
 
-static int binder_free_thread(struct binder_proc *proc,
-			      struct binder_thread *thread)
+static void binder_free_thread(struct binder_thread *thread)
+{
+	struct binder_proc *proc = thread->proc;
+
+	kfree(thread);
+	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_proc_dec_tmpref(proc);
+}
+
+static int binder_thread_release(struct binder_proc *proc,
+				 struct binder_thread *thread)
 {
 	struct binder_transaction *t;
 	struct binder_transaction *send_reply = NULL;
+	struct binder_transaction *last_t;
 	int active_transactions = 0;
 
+	spin_lock(&proc->inner_lock);
+	/*
+	 * The proc must outlive the thread, binder_free_thread() drops
+	 * this reference.  The thread reference keeps the thread around
+	 * until we are done with it here.
+	 */
+	proc->tmp_ref++;
+	atomic_inc(&thread->tmp_ref);
 	rb_erase(&thread->rb_node, &proc->threads);
+	thread->is_dead = 1;
 	t = thread->transaction_stack;
-	if (t && t->to_thread == thread)
-		send_reply = t;
+	if (t) {
+		spin_lock(&t->lock);
+		if (t->to_thread == thread)
+			send_reply = t;
+	}
 	while (t) {
+		last_t = t;
 		active_transactions++;
 		binder_debug(BINDER_DEBUG_DEAD_TRANSACTION,
 			     "binder: release %d:%d transaction %d "
@@ -2582,12 +3529,16 @@ static int binder_free_thread(struct binder_proc *proc,
 			t = t->from_parent;
 		} else
 			BUG();
+		spin_unlock(&last_t->lock);
+		if (t)
+			spin_lock(&t->lock);
 	}
+	spin_unlock(&proc->inner_lock);
+
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_release_work(proc, &thread->todo);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2598,12 +3549,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL)
+		return POLLERR;
 
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2621,6 +3574,46 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+static int binder_ioctl_set_ctx_mgr(struct binder_proc *proc)
+{
+	int ret = 0;
+	struct binder_node *new_node;
+
+	mutex_lock(&binder_context_mgr_node_lock);
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->cred->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->cred->euid,
+			       binder_context_mgr_uid);
+			ret = -EPERM;
+			goto out;
+		}
+	} else
+		binder_context_mgr_uid = current->cred->euid;
+	new_node = binder_new_node(proc, NULL);
+	if (new_node == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	binder_node_inner_lock(new_node);
+	new_node->local_weak_refs++;
+	new_node->local_strong_refs++;
+	new_node->has_strong_ref = 1;
+	new_node->has_weak_ref = 1;
+	binder_context_mgr_node = new_node;
+	binder_node_inner_unlock(new_node);
+	binder_put_node(new_node);
+out:
+	mutex_unlock(&binder_context_mgr_node_lock);
+	return ret;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2635,7 +3628,6 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2687,43 +3679,27 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		spin_lock(&proc->inner_lock);
+		proc->max_threads = max_threads;
+		spin_unlock(&proc->inner_lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
-			goto err;
-		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->cred->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->cred->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
+		ret = binder_ioctl_set_ctx_mgr(proc);
+		if (ret)
 			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
-		binder_free_thread(proc, thread);
+		binder_thread_release(proc, thread);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2742,9 +3718,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		spin_lock(&proc->inner_lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		spin_unlock(&proc->inner_lock);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2782,6 +3760,7 @@ static struct vm_operations_struct binder_vm_ops = {
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	int ret;
+	int i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2833,6 +3812,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2849,7 +3832,9 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
 	barrier();
+	mutex_lock(&proc->files_lock);
 	proc->files = get_files_struct(current);
+	mutex_unlock(&proc->files_lock);
 	proc->vma = vma;
 
 	/*printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p\n",
@@ -2873,6 +3858,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2882,22 +3868,33 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->files_lock);
+	mutex_init(&proc->outer_lock);
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->alloc_lock);
+	for (i = 0; i < BINDER_FREE_LIST_COUNT; i++)
+		INIT_LIST_HEAD(&proc->free_lists[i]);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_stats_created(BINDER_STAT_PROC);
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
 		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
+		/*
+		 * The proc may be freed while the file is open, so the
+		 * file only records the pid and looks the proc up again.
+		 */
 		proc->debugfs_entry = debugfs_create_file(strbuf, S_IRUGO,
-			binder_debugfs_dir_entry_proc, proc, &binder_proc_fops);
+			binder_debugfs_dir_entry_proc,
+			(void *)(unsigned long)proc->pid, &binder_proc_fops);
 	}
 
 	return 0;
@@ -2916,6 +3913,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2924,6 +3923,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2940,79 +3940,146 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
-static void binder_deferred_release(struct binder_proc *proc)
+static int binder_node_release(struct binder_node *node, int refs)
 {
+	struct binder_ref *ref;
 	struct hlist_node *pos;
-	struct binder_transaction *t;
+	int death = 0;
+	struct binder_proc *proc = node->proc;
+
+	binder_release_work(proc, &node->async_todo);
+
+	spin_lock(&node->lock);
+	spin_lock(&proc->inner_lock);
+	list_del_init(&node->work.entry);
+	/* the caller holds a temporary reference, see below */
+	BUG_ON(!node->tmp_refs);
+	if (hlist_empty(&node->refs) && node->tmp_refs == 1) {
+		spin_unlock(&proc->inner_lock);
+		spin_unlock(&node->lock);
+		binder_free_node(node);
+		return refs;
+	}
+
+	node->proc = NULL;
+	node->local_strong_refs = 0;
+	node->local_weak_refs = 0;
+	spin_unlock(&proc->inner_lock);
+
+	spin_lock(&binder_dead_nodes_lock);
+	hlist_add_head(&node->dead_node, &binder_dead_nodes);
+	spin_unlock(&binder_dead_nodes_lock);
+
+	hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
+		refs++;
+		if (ref->death) {
+			death++;
+			spin_lock(&ref->proc->inner_lock);
+			if (list_empty(&ref->death->work.entry)) {
+				ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+				list_add_tail(&ref->death->work.entry, &ref->proc->todo);
+				wake_up_interruptible(&ref->proc->wait);
+			} else
+				BUG();
+			spin_unlock(&ref->proc->inner_lock);
+		}
+	}
+	binder_debug(BINDER_DEBUG_DEAD_BINDER,
+		     "binder: node %d now dead, "
+		     "refs %d, death %d\n", node->debug_id,
+		     refs, death);
+	spin_unlock(&node->lock);
+	binder_put_node(node);
+
+	return refs;
+}
+
+static void binder_deferred_release(struct binder_proc *proc)
+{
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+
+	mutex_lock(&binder_context_mgr_node_lock);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
 			     proc->pid);
 		binder_context_mgr_node = NULL;
 	}
+	mutex_unlock(&binder_context_mgr_node_lock);
 
+	spin_lock(&proc->inner_lock);
+	/*
+	 * Senders may still hold temporary references; whoever drops the
+	 * last one frees the proc in binder_free_proc().
+	 */
+	proc->tmp_ref++;
+	proc->is_dead = 1;
 	threads = 0;
 	active_transactions = 0;
 	while ((n = rb_first(&proc->threads))) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
+
+		spin_unlock(&proc->inner_lock);
 		threads++;
-		active_transactions += binder_free_thread(proc, thread);
+		active_transactions += binder_thread_release(proc, thread);
+		spin_lock(&proc->inner_lock);
 	}
+
 	nodes = 0;
 	incoming_refs = 0;
 	while ((n = rb_first(&proc->nodes))) {
-		struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
 
 		nodes++;
+		/* dropped by binder_node_release() */
+		node->tmp_refs++;
 		rb_erase(&node->rb_node, &proc->nodes);
-		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		} else {
-			struct binder_ref *ref;
-			int death = 0;
-
-			node->proc = NULL;
-			node->local_strong_refs = 0;
-			node->local_weak_refs = 0;
-			hlist_add_head(&node->dead_node, &binder_dead_nodes);
-
-			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-				incoming_refs++;
-				if (ref->death) {
-					death++;
-					if (list_empty(&ref->death->work.entry)) {
-						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
-					} else
-						BUG();
-				}
-			}
-			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: node %d now dead, "
-				     "refs %d, death %d\n", node->debug_id,
-				     incoming_refs, death);
-		}
+		spin_unlock(&proc->inner_lock);
+		incoming_refs = binder_node_release(node, incoming_refs);
+		spin_lock(&proc->inner_lock);
 	}
+	spin_unlock(&proc->inner_lock);
+
 	outgoing_refs = 0;
+	mutex_lock(&proc->outer_lock);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
+	mutex_unlock(&proc->outer_lock);
+
+	binder_release_work(proc, &proc->todo);
+	binder_release_work(proc, &proc->delivered_death);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d threads %d, nodes %d (ref %d), "
+		     "refs %d, active transactions %d\n",
+		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     active_transactions);
+
+	binder_proc_dec_tmpref(proc);
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
 
+	BUG_ON(!list_empty(&proc->todo));
+	buffers = 0;
+	mutex_lock(&proc->alloc_lock);
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3025,29 +4092,38 @@ static void binder_deferred_release(struct binder_proc *proc)
 			       proc->pid, t->debug_id);
 			/*BUG();*/
 		}
-		binder_free_buf(proc, buffer);
+		binder_free_buf_locked(proc, buffer);
 		buffers++;
 	}
 
-	binder_stats_deleted(BINDER_STAT_PROC);
-
 	page_count = 0;
 	if (proc->pages) {
 		int i;
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
+			struct binder_lru_page *page = &proc->pages[i];
+			void *page_addr;
+
+			if (page->page_ptr == NULL)
+				continue;
+			page_addr = proc->buffer + i * PAGE_SIZE;
+			if (!binder_lru_del(page))
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
 					     "page %d at %p not freed\n",
 					     proc->pid, i,
 					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
+			unmap_kernel_range((unsigned long)page_addr,
+				PAGE_SIZE);
+			__free_page(page->page_ptr);
+			page->page_ptr = NULL;
+			page_count++;
 		}
+	}
+	mutex_unlock(&proc->alloc_lock);
+
+	binder_stats_deleted(BINDER_STAT_PROC);
+
+	if (proc->pages) {
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3055,11 +4131,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
@@ -3071,7 +4144,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3087,9 +4159,11 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			mutex_lock(&proc->files_lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			mutex_unlock(&proc->files_lock);
 		}
 
 		if (defer & BINDER_DEFERRED_FLUSH)
@@ -3098,7 +4172,6 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3118,27 +4191,44 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer)
 	mutex_unlock(&binder_deferred_lock);
 }
 
-static void print_binder_transaction(struct seq_file *m, const char *prefix,
-				     struct binder_transaction *t)
+/*
+ * The caller must hold proc->inner_lock.  t->buffer is only stable under
+ * the inner lock of the proc receiving the transaction, so it is only
+ * printed when that proc is the one being dumped.
+ */
+static void print_binder_transaction_ilocked(struct seq_file *m,
+					     struct binder_proc *proc,
+					     const char *prefix,
+					     struct binder_transaction *t)
 {
+	struct binder_proc *to_proc;
+	struct binder_buffer *buffer = t->buffer;
+
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
 	seq_printf(m,
 		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
-		   t->to_proc ? t->to_proc->pid : 0,
+		   to_proc ? to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
 		   t->code, t->flags, t->priority, t->need_reply);
-	if (t->buffer == NULL) {
+	spin_unlock(&t->lock);
+
+	if (proc != to_proc) {
+		seq_puts(m, "\n");
+		return;
+	}
+	if (buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
 	}
-	if (t->buffer->target_node)
-		seq_printf(m, " node %d",
-			   t->buffer->target_node->debug_id);
+	if (buffer->target_node)
+		seq_printf(m, " node %d", buffer->target_node->debug_id);
 	seq_printf(m, " size %zd:%zd data %p\n",
-		   t->buffer->data_size, t->buffer->offsets_size,
-		   t->buffer->data);
+		   buffer->data_size, buffer->offsets_size,
+		   buffer->data);
 }
 
 static void print_binder_buffer(struct seq_file *m, const char *prefix,
@@ -3150,9 +4240,11 @@ static void print_binder_buffer(struct seq_file *m, const char *prefix,
 		   buffer->transaction ? "active" : "delivered");
 }
 
-static void print_binder_work(struct seq_file *m, const char *prefix,
-			      const char *transaction_prefix,
-			      struct binder_work *w)
+static void print_binder_work_ilocked(struct seq_file *m,
+				      struct binder_proc *proc,
+				      const char *prefix,
+				      const char *transaction_prefix,
+				      struct binder_work *w)
 {
 	struct binder_node *node;
 	struct binder_transaction *t;
@@ -3160,7 +4252,8 @@ static void print_binder_work(struct seq_file *m, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		print_binder_transaction(m, transaction_prefix, t);
+		print_binder_transaction_ilocked(m, proc, transaction_prefix,
+						 t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
 		seq_printf(m, "%stransaction complete\n", prefix);
@@ -3185,9 +4278,9 @@ static void print_binder_work(struct seq_file *m, const char *prefix,
 	}
 }
 
-static void print_binder_thread(struct seq_file *m,
-				struct binder_thread *thread,
-				int print_always)
+static void print_binder_thread_ilocked(struct seq_file *m,
+					struct binder_thread *thread,
+					int print_always)
 {
 	struct binder_transaction *t;
 	struct binder_work *w;
@@ -3199,26 +4292,33 @@ static void print_binder_thread(struct seq_file *m,
 	t = thread->transaction_stack;
 	while (t) {
 		if (t->from == thread) {
-			print_binder_transaction(m,
-						 "    outgoing transaction", t);
+			print_binder_transaction_ilocked(m, thread->proc,
+					"    outgoing transaction", t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
-			print_binder_transaction(m,
-						 "    incoming transaction", t);
+			print_binder_transaction_ilocked(m, thread->proc,
+					"    incoming transaction", t);
 			t = t->to_parent;
 		} else {
-			print_binder_transaction(m, "    bad transaction", t);
+			print_binder_transaction_ilocked(m, thread->proc,
+					"    bad transaction", t);
 			t = NULL;
 		}
 	}
 	list_for_each_entry(w, &thread->todo, entry) {
-		print_binder_work(m, "    ", "    pending transaction", w);
+		print_binder_work_ilocked(m, thread->proc, "    ",
+					  "    pending transaction", w);
 	}
 	if (!print_always && m->count == header_pos)
 		m->count = start_pos;
 }
 
-static void print_binder_node(struct seq_file *m, struct binder_node *node)
+/*
+ * The caller must hold node->lock and, for live nodes, the inner lock of
+ * the owning proc (see binder_node_inner_lock()).
+ */
+static void print_binder_node_nilocked(struct seq_file *m,
+				       struct binder_node *node)
 {
 	struct binder_ref *ref;
 	struct hlist_node *pos;
@@ -3229,27 +4329,33 @@ static void print_binder_node(struct seq_file *m, struct binder_node *node)
 	hlist_for_each_entry(ref, pos, &node->refs, node_entry)
 		count++;
 
-	seq_printf(m, "  node %d: u%p c%p hs %d hw %d ls %d lw %d is %d iw %d",
+	seq_printf(m, "  node %d: u%p c%p hs %d hw %d ls %d lw %d is %d iw %d tr %d",
 		   node->debug_id, node->ptr, node->cookie,
 		   node->has_strong_ref, node->has_weak_ref,
 		   node->local_strong_refs, node->local_weak_refs,
-		   node->internal_strong_refs, count);
+		   node->internal_strong_refs, count, node->tmp_refs);
 	if (count) {
 		seq_puts(m, " proc");
 		hlist_for_each_entry(ref, pos, &node->refs, node_entry)
 			seq_printf(m, " %d", ref->proc->pid);
 	}
 	seq_puts(m, "\n");
-	list_for_each_entry(w, &node->async_todo, entry)
-		print_binder_work(m, "    ",
-				  "    pending async transaction", w);
+	if (node->proc) {
+		list_for_each_entry(w, &node->async_todo, entry)
+			print_binder_work_ilocked(m, node->proc, "    ",
+					"    pending async transaction", w);
+	}
 }
 
-static void print_binder_ref(struct seq_file *m, struct binder_ref *ref)
+/* The caller must hold the outer lock of the proc owning the ref. */
+static void print_binder_ref_olocked(struct seq_file *m,
+				     struct binder_ref *ref)
 {
+	spin_lock(&ref->node->lock);
 	seq_printf(m, "  ref %d: desc %d %snode %d s %d w %d d %p\n",
 		   ref->debug_id, ref->desc, ref->node->proc ? "" : "dead ",
 		   ref->node->debug_id, ref->strong, ref->weak, ref->death);
+	spin_unlock(&ref->node->lock);
 }
 
 static void print_binder_proc(struct seq_file *m,
@@ -3257,37 +4363,64 @@ static void print_binder_proc(struct seq_file *m,
 {
 	struct binder_work *w;
 	struct rb_node *n;
+	struct binder_node *last_node = NULL;
 	size_t start_pos = m->count;
 	size_t header_pos;
 
 	seq_printf(m, "proc %d\n", proc->pid);
 	header_pos = m->count;
 
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
-		print_binder_thread(m, rb_entry(n, struct binder_thread,
+		print_binder_thread_ilocked(m, rb_entry(n, struct binder_thread,
 						rb_node), print_all);
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node,
 						    rb_node);
-		if (print_all || node->has_async_transaction)
-			print_binder_node(m, node);
+		if (!print_all && !node->has_async_transaction)
+			continue;
+		/*
+		 * The node lock nests outside the inner lock, so hold a
+		 * temporary reference to keep the node in the tree while
+		 * the inner lock is dropped.
+		 */
+		node->tmp_refs++;
+		spin_unlock(&proc->inner_lock);
+		if (last_node)
+			binder_put_node(last_node);
+		binder_node_inner_lock(node);
+		print_binder_node_nilocked(m, node);
+		binder_node_inner_unlock(node);
+		last_node = node;
+		spin_lock(&proc->inner_lock);
 	}
+	spin_unlock(&proc->inner_lock);
+	if (last_node)
+		binder_put_node(last_node);
+
 	if (print_all) {
+		mutex_lock(&proc->outer_lock);
 		for (n = rb_first(&proc->refs_by_desc);
 		     n != NULL;
 		     n = rb_next(n))
-			print_binder_ref(m, rb_entry(n, struct binder_ref,
-						     rb_node_desc));
+			print_binder_ref_olocked(m, rb_entry(n, struct binder_ref,
+							     rb_node_desc));
+		mutex_unlock(&proc->outer_lock);
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
+	spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry)
-		print_binder_work(m, "  ", "  pending transaction", w);
+		print_binder_work_ilocked(m, proc, "  ",
+					  "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
 		seq_puts(m, "  has delivered dead binder\n");
 		break;
 	}
+	spin_unlock(&proc->inner_lock);
 	if (!print_all && m->count == header_pos)
 		m->count = start_pos;
 }
@@ -3310,7 +4443,9 @@ static const char *binder_return_strings[] = {
 	"BR_FINISHED",
 	"BR_DEAD_BINDER",
 	"BR_CLEAR_DEATH_NOTIFICATION_DONE",
-	"BR_FAILED_REPLY"
+	"BR_FAILED_REPLY",
+	"BR_TRANSACTION_SG",
+	"BR_REPLY_SG"
 };
 
 static const char *binder_command_strings[] = {
@@ -3330,7 +4465,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3351,17 +4488,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3369,11 +4510,13 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
@@ -3382,25 +4525,28 @@ static void print_binder_proc_stats(struct seq_file *m,
 {
 	struct binder_work *w;
 	struct rb_node *n;
-	int count, strong, weak;
+	int count, strong, weak, mapped, cached;
+	int i;
 
 	seq_printf(m, "proc %d\n", proc->pid);
+	spin_lock(&proc->inner_lock);
 	count = 0;
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  threads: %d\n", count);
 	seq_printf(m, "  requested threads: %d+%d/%d\n"
-			"  ready threads %d\n"
-			"  free async space %zd\n", proc->requested_threads,
+			"  ready threads %d\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
+			proc->ready_threads);
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
+	spin_unlock(&proc->inner_lock);
 	seq_printf(m, "  nodes: %d\n", count);
 	count = 0;
 	strong = 0;
 	weak = 0;
+	mutex_lock(&proc->outer_lock);
 	for (n = rb_first(&proc->refs_by_desc); n != NULL; n = rb_next(n)) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
@@ -3408,14 +4554,31 @@ static void print_binder_proc_stats(struct seq_file *m,
 		strong += ref->strong;
 		weak += ref->weak;
 	}
+	mutex_unlock(&proc->outer_lock);
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
+	seq_printf(m, "  free async space %zd\n", proc->free_async_space);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	mapped = 0;
+	cached = 0;
+	if (proc->pages) {
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (proc->pages[i].page_ptr == NULL)
+				continue;
+			mapped++;
+			if (!list_empty(&proc->pages[i].lru))
+				cached++;
+		}
+	}
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  pages: %d mapped, %d cached\n", mapped, cached);
 
 	count = 0;
+	spin_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3425,6 +4588,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 			break;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	seq_printf(m, "  pending transactions: %d\n", count);
 
 	print_binder_stats(m, "  ", &proc->stats);
@@ -3436,22 +4600,39 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	struct binder_proc *proc;
 	struct hlist_node *pos;
 	struct binder_node *node;
+	struct binder_node *last_node = NULL;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder state:\n");
 
+	spin_lock(&binder_dead_nodes_lock);
 	if (!hlist_empty(&binder_dead_nodes))
 		seq_puts(m, "dead nodes:\n");
-	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
-		print_binder_node(m, node);
+	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
+		/*
+		 * The temporary reference keeps the node on the list
+		 * while binder_dead_nodes_lock is dropped to print it.
+		 */
+		node->tmp_refs++;
+		spin_unlock(&binder_dead_nodes_lock);
+		if (last_node)
+			binder_put_node(last_node);
+		spin_lock(&node->lock);
+		print_binder_node_nilocked(m, node);
+		spin_unlock(&node->lock);
+		last_node = node;
+		spin_lock(&binder_dead_nodes_lock);
+	}
+	spin_unlock(&binder_dead_nodes_lock);
+	if (last_node)
+		binder_put_node(last_node);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3461,17 +4642,16 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	struct hlist_node *pos;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3481,28 +4661,34 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	struct hlist_node *pos;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder transactions:\n");
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
 static int binder_proc_show(struct seq_file *m, void *unused)
 {
-	struct binder_proc *proc = m->private;
-	int do_lock = !binder_debug_no_lock;
+	struct binder_proc *itr;
+	struct hlist_node *pos;
+	int pid = (unsigned long)m->private;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-	seq_puts(m, "binder proc state:\n");
-	print_binder_proc(m, proc, 1);
-	if (do_lock)
-		mutex_unlock(&binder_lock);
+	/*
+	 * binder_procs_lock is always taken here: the proc is looked up by
+	 * pid and may have been released since the file was opened.
+	 */
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(itr, pos, &binder_procs, proc_node) {
+		if (itr->pid == pid) {
+			seq_puts(m, "binder proc state:\n");
+			print_binder_proc(m, itr, 1);
+		}
+	}
+	mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3520,14 +4706,20 @@ static void print_binder_transaction_log_entry(struct seq_file *m,
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
 	struct binder_transaction_log *log = m->private;
+	unsigned int count = atomic_read(&log->cur) + 1;
+	unsigned int cur;
 	int i;
 
-	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
-			print_binder_transaction_log_entry(m, &log->entry[i]);
+	if (count > ARRAY_SIZE(log->entry) || log->full) {
+		cur = count % ARRAY_SIZE(log->entry);
+		count = ARRAY_SIZE(log->entry);
+	} else
+		cur = 0;
+	for (i = 0; i < count; i++) {
+		unsigned int index = cur++ % ARRAY_SIZE(log->entry);
+
+		print_binder_transaction_log_entry(m, &log->entry[index]);
 	}
-	for (i = 0; i < log->next; i++)
-		print_binder_transaction_log_entry(m, &log->entry[i]);
 	return 0;
 }
 
@@ -3565,6 +4757,8 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	if (!ret)
+		register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
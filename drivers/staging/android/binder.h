@@ -22,6 +22,8 @@
 
 #include <linux/ioctl.h>
 
+struct iovec;
+
 #define B_PACK_CHARS(c1, c2, c3, c4) \
 	((((c1)<<24)) | (((c2)<<16)) | (((c3)<<8)) | (c4))
 #define B_TYPE_LARGE 0x85
@@ -147,6 +149,18 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Used by BC_TRANSACTION_SG/BC_REPLY_SG to pass buffers that are copied
+ * straight into the target, and by BR_TRANSACTION_SG/BR_REPLY_SG to tell
+ * the target where they ended up.  The buffers are not scanned for
+ * binder objects.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	const struct iovec	*buffers;	/* scatter-gather list */
+	size_t		buffers_count;	/* number of entries in buffers */
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -249,6 +263,15 @@ enum BinderDriverReturnProtocol {
 	 * The the last transaction (either a bcTRANSACTION or
 	 * a bcATTEMPT_ACQUIRE) failed (e.g. out of memory).  No parameters.
 	 */
+
+	BR_TRANSACTION_SG = _IOR('r', 18, struct binder_transaction_data_sg),
+	BR_REPLY_SG = _IOR('r', 19, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the received command.  Sent instead
+	 * of BR_TRANSACTION and BR_REPLY when the sender used
+	 * bcTRANSACTION_SG or bcREPLY_SG.  The buffers list points into the
+	 * transaction buffer and is released with it by bcFREE_BUFFER.
+	 */
 };
 
 enum BinderDriverCommandProtocol {
@@ -324,6 +347,14 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command.  Each buffer is
+	 * copied once, directly from the sender into the target's
+	 * transaction buffer after the offsets array.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -20,10 +20,17 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
 #include <linux/time.h>
 #include "logger.h"
 
@@ -33,35 +40,64 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Offsets into the log are free-running: they only ever grow, wrapping at the
+ * limit of a size_t, and logger_offset() maps them into the buffer. An offset
+ * thus also tells how many bytes were ever written before it, and the data at
+ * offset 'off' has been overwritten once 'head' has moved past it.
+ *
+ * Writers reserve an entry under 'lock', which covers nothing but moving
+ * 'head' and 'w_off' forward, then fill it in and commit it with no lock held.
+ * Readers take no log lock at all; see logger_next_entry().
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	spinlock_t		lock;	/* lock for reserving entries */
+	size_t			w_off;	/* end of the last reserved entry */
+	size_t			head;	/* oldest entry, new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *mmap_hdr; /* offsets exported to mmap() */
+	struct logger_history	*history; /* compressed older entries */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by its 'mutex', which
+ * only serializes threads reading through the same file.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
+	struct mutex		mutex;	/* mutex protecting r_off */
 	size_t			r_off;	/* current read head offset */
+	bool			batch;	/* read() returns as many entries as fit */
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+	unsigned char		*hbuf;	/* a decompressed chunk of history */
+	size_t			hbuf_off; /* offset of its first entry */
+	size_t			hbuf_len; /* and its length */
+#endif
 };
 
+/*
+ * Entries are stored 4-byte aligned, so the 'len' and '__pad' words of an
+ * entry's header never wrap around the end of the buffer. '__pad' holds the
+ * entry's LOGGER_ENTRY_* state: it reads zero, as user space expects, once
+ * the entry is committed.
+ */
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_stride - returns the space taken by an entry of payload 'len' */
+#define logger_stride(len)	ALIGN(sizeof(struct logger_entry) + (len), 4)
+
+/* logger_before - is offset 'a' before offset 'b'? */
+#define logger_before(a, b)	((ssize_t) ((a) - (b)) < 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -86,38 +122,463 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * logger_entry_at - returns the entry at offset 'off'. Only its 'len' and
+ * '__pad' are sure not to wrap around the end of the buffer.
+ */
+static inline struct logger_entry *logger_entry_at(struct logger_log *log,
+						   size_t off)
+{
+	return (struct logger_entry *) (log->buffer + logger_offset(off));
+}
+
+/*
+ * logger_next_entry - find the next committed entry for 'reader', returning
+ * its length including the header, or zero if there is none yet.
+ *
+ * A reader that was lapped is moved up to the log's head first, and entries
+ * abandoned by their writer are skipped. Whatever is read from the entry
+ * afterwards must be checked with logger_lapped(), as a writer may overwrite
+ * it at any time.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold reader->mutex.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static size_t logger_next_entry(struct logger_log *log,
+				struct logger_reader *reader)
 {
-	__u16 val;
+	struct logger_entry *entry;
+	__u16 len, state;
+
+	while (1) {
+		size_t head = ACCESS_ONCE(log->head);
+
+		if (logger_before(reader->r_off, head))
+			reader->r_off = head;
+		if (reader->r_off == ACCESS_ONCE(log->w_off))
+			return 0;
+
+		/* pairs with the write barrier in logger_reserve() */
+		smp_rmb();
+		entry = logger_entry_at(log, reader->r_off);
+		len = ACCESS_ONCE(entry->len);
+		state = ACCESS_ONCE(entry->__pad);
+		smp_rmb();
+
+		if (logger_before(reader->r_off, ACCESS_ONCE(log->head)))
+			continue;
+		if (state == LOGGER_ENTRY_BUSY)
+			return 0;
+		if (state == LOGGER_ENTRY_COMMITTED)
+			return sizeof(struct logger_entry) + len;
+
+		reader->r_off += logger_stride(len);
+	}
+}
+
+/*
+ * logger_lapped - was the data at 'off' overwritten since it was read?
+ */
+static inline int logger_lapped(struct logger_log *log, size_t off)
+{
+	smp_rmb();
+	return logger_before(off, ACCESS_ONCE(log->head));
+}
+
+/*
+ * do_read_log - copies 'count' bytes at offset 'off' in 'log' to 'buf'
+ *
+ * The data must be checked with logger_lapped() afterwards.
+ */
+static void do_read_log(struct logger_log *log, size_t off, void *buf,
+			size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
 
-	switch (log->size - off) {
-	case 1:
-		memcpy(&val, log->buffer + off, 1);
-		memcpy(((char *) &val) + 1, log->buffer, 1);
+/* entries are compressed in chunks of up to this many bytes */
+#define LOGGER_CHUNK_SIZE	(16*1024)
+
+/*
+ * struct logger_chunk - a compressed run of consecutive entries
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in the history's chunks */
+	size_t			off;	/* offset of the first entry */
+	size_t			len;	/* uncompressed length */
+	size_t			clen;	/* compressed length */
+	__s32			sec;	/* time of the first entry */
+	unsigned char		data[0]; /* the LZO compressed entries */
+};
+
+/*
+ * struct logger_history - compressed copies of a log's entries
+ *
+ * The history keeps entries around after the ring buffer overwrites them.
+ * A worker compresses each chunk of the log as it fills, well before the
+ * writers come around to it again, and the oldest chunks are dropped once
+ * the compressed data exceeds 'size'. Chunks use the same offsets as the
+ * ring, so readers that fall behind the head carry on in the history.
+ *
+ * The structure lives as long as its log and is protected by 'mutex'.
+ */
+struct logger_history {
+	struct mutex		mutex;	/* mutex protecting the history */
+	struct work_struct	work;	/* compresses full chunks */
+	struct logger_reader	reader;	/* the compressor's read position */
+	struct list_head	chunks;	/* the chunks, oldest first */
+	size_t			start;	/* nothing is kept before this */
+	size_t			size;	/* room for compressed data */
+	size_t			used;	/* compressed bytes held */
+	size_t			len;	/* uncompressed bytes held */
+	unsigned char		*src;	/* a chunk to compress */
+	unsigned char		*dst;	/* and its compressed form */
+	void			*wrkmem; /* LZO working memory */
+};
+
+/*
+ * logger_compress_chunk - compress the next chunk of the log into its history
+ *
+ * A chunk is cut short where entries were skipped or lost, so it always
+ * holds consecutive entries. Returns -EAGAIN if there is no full chunk to
+ * compress yet.
+ *
+ * Caller must hold hist->mutex.
+ */
+static int logger_compress_chunk(struct logger_log *log,
+				 struct logger_history *hist)
+{
+	struct logger_reader *reader = &hist->reader;
+	struct logger_chunk *chunk;
+	size_t start, len = 0, clen, n;
+
+	n = logger_next_entry(log, reader);
+	start = reader->r_off;
+	while (n && len + ALIGN(n, 4) <= LOGGER_CHUNK_SIZE) {
+		do_read_log(log, reader->r_off, hist->src + len, ALIGN(n, 4));
+		if (logger_lapped(log, reader->r_off)) {
+			n = logger_next_entry(log, reader);
+			start = reader->r_off;
+			len = 0;
+			continue;
+		}
+
+		reader->r_off += ALIGN(n, 4);
+		len += ALIGN(n, 4);
+
+		n = logger_next_entry(log, reader);
+		if (reader->r_off != start + len)
+			break;
+	}
+
+	/* ran out of entries before the chunk was full; try again later */
+	if (!n && reader->r_off == start + len) {
+		reader->r_off = start;
+		return -EAGAIN;
+	}
+
+	if (lzo1x_1_compress(hist->src, len, hist->dst, &clen, hist->wrkmem))
+		return -EINVAL;
+
+	chunk = kmalloc(sizeof(struct logger_chunk) + clen, GFP_KERNEL);
+	if (!chunk)
+		return -ENOMEM;
+
+	chunk->off = start;
+	chunk->len = len;
+	chunk->clen = clen;
+	chunk->sec = ((struct logger_entry *) hist->src)->sec;
+	memcpy(chunk->data, hist->dst, clen);
+
+	list_add_tail(&chunk->list, &hist->chunks);
+	hist->used += clen;
+	hist->len += len;
+
+	while (hist->used > hist->size) {
+		chunk = list_first_entry(&hist->chunks, struct logger_chunk,
+					 list);
+		list_del(&chunk->list);
+		hist->used -= chunk->clen;
+		hist->len -= chunk->len;
+		hist->start = chunk->off + chunk->len;
+		kfree(chunk);
+	}
+
+	return 0;
+}
+
+static void logger_history_work(struct work_struct *work)
+{
+	struct logger_history *hist = container_of(work, struct logger_history,
+						   work);
+	struct logger_log *log = hist->reader.log;
+
+	mutex_lock(&hist->mutex);
+	while (ACCESS_ONCE(log->w_off) - hist->reader.r_off >= LOGGER_CHUNK_SIZE)
+		if (logger_compress_chunk(log, hist))
+			break;
+	mutex_unlock(&hist->mutex);
+}
+
+/*
+ * logger_history_kick - have the history catch up if the entry at 'off',
+ * of 'len' bytes, completed a chunk
+ */
+static inline void logger_history_kick(struct logger_log *log, size_t off,
+				       size_t len)
+{
+	if (log->history &&
+	    off / LOGGER_CHUNK_SIZE != (off + len) / LOGGER_CHUNK_SIZE)
+		schedule_work(&log->history->work);
+}
+
+/*
+ * logger_history_load - decompress the first chunk of history that ends
+ * after 'reader's offset, moving the reader up to it if need be
+ *
+ * Caller must hold reader->mutex.
+ */
+static int logger_history_load(struct logger_log *log,
+			       struct logger_reader *reader)
+{
+	struct logger_history *hist = log->history;
+	struct logger_chunk *chunk;
+	size_t len = LOGGER_CHUNK_SIZE;
+	int ret = -ENOENT;
+
+	if (!reader->hbuf) {
+		reader->hbuf = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		if (!reader->hbuf)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&hist->mutex);
+	list_for_each_entry(chunk, &hist->chunks, list) {
+		if (!logger_before(reader->r_off, chunk->off + chunk->len))
+			continue;
+
+		if (lzo1x_decompress_safe(chunk->data, chunk->clen,
+					  reader->hbuf, &len) ||
+		    len != chunk->len) {
+			ret = -EIO;
+			break;
+		}
+
+		if (logger_before(reader->r_off, chunk->off))
+			reader->r_off = chunk->off;
+		reader->hbuf_off = chunk->off;
+		reader->hbuf_len = len;
+		ret = 0;
 		break;
-	default:
-		memcpy(&val, log->buffer + off, 2);
 	}
+	mutex_unlock(&hist->mutex);
+
+	return ret;
+}
+
+/*
+ * logger_history_entry - find the next entry for 'reader' in the history,
+ * returning its length including the header, or zero if the reader is not
+ * behind the head or there is nothing left for it in the history. Then
+ * logger_next_entry() takes over.
+ *
+ * Caller must hold reader->mutex.
+ */
+static size_t logger_history_entry(struct logger_log *log,
+				   struct logger_reader *reader)
+{
+	struct logger_entry *entry;
+
+	if (!log->history)
+		return 0;
+
+	if (logger_before(reader->r_off, ACCESS_ONCE(log->history->start)))
+		reader->r_off = ACCESS_ONCE(log->history->start);
+
+	while (logger_before(reader->r_off, ACCESS_ONCE(log->head))) {
+		if (!reader->hbuf_len ||
+		    logger_before(reader->r_off, reader->hbuf_off) ||
+		    !logger_before(reader->r_off,
+				   reader->hbuf_off + reader->hbuf_len)) {
+			if (logger_history_load(log, reader))
+				return 0;
+			continue;
+		}
+
+		entry = (struct logger_entry *)
+			(reader->hbuf + reader->r_off - reader->hbuf_off);
+		if (entry->__pad == LOGGER_ENTRY_COMMITTED)
+			return sizeof(struct logger_entry) + entry->len;
+		reader->r_off += logger_stride(entry->len);
+	}
+
+	return 0;
+}
+
+/*
+ * do_read_history_to_user - reads the 'count' bytes of the entry found by
+ * logger_history_entry() into the user-space buffer 'buf'. Returns 'count'
+ * on success.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t do_read_history_to_user(struct logger_reader *reader,
+				       char __user *buf, size_t count)
+{
+	if (copy_to_user(buf, reader->hbuf + reader->r_off - reader->hbuf_off,
+			 count))
+		return -EFAULT;
+
+	return count;
+}
+
+/* logger_history_oldest - offset of the oldest entry kept for 'log' */
+static size_t logger_history_oldest(struct logger_log *log)
+{
+	return log->history ? ACCESS_ONCE(log->history->start) :
+			      ACCESS_ONCE(log->head);
+}
+
+/*
+ * logger_history_flush - drop the whole history of 'log'
+ *
+ * The log's head must already be moved up to the write offset.
+ */
+static void logger_history_flush(struct logger_log *log)
+{
+	struct logger_history *hist = log->history;
+	struct logger_chunk *chunk, *next;
+
+	if (!hist)
+		return;
+
+	mutex_lock(&hist->mutex);
+	list_for_each_entry_safe(chunk, next, &hist->chunks, list)
+		kfree(chunk);
+	INIT_LIST_HEAD(&hist->chunks);
+	hist->used = 0;
+	hist->len = 0;
+	hist->start = ACCESS_ONCE(log->head);
+	mutex_unlock(&hist->mutex);
+}
+
+/* logger_history_stats - fill in the history part of 'stats' */
+static void logger_history_stats(struct logger_log *log,
+				 struct logger_stats *stats)
+{
+	struct logger_history *hist = log->history;
+
+	if (!hist)
+		return;
+
+	mutex_lock(&hist->mutex);
+	stats->history_size = hist->size;
+	stats->history_used = hist->used;
+	stats->history_len = hist->len;
+	if (!list_empty(&hist->chunks))
+		stats->oldest_sec = list_first_entry(&hist->chunks,
+					struct logger_chunk, list)->sec;
+	mutex_unlock(&hist->mutex);
+}
+
+static void logger_history_release(struct logger_reader *reader)
+{
+	kfree(reader->hbuf);
+}
+
+static int __init logger_history_init(struct logger_log *log)
+{
+	struct logger_history *hist;
+
+	hist = kzalloc(sizeof(struct logger_history), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	hist->src = vmalloc(LOGGER_CHUNK_SIZE);
+	hist->dst = vmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE));
+	hist->wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!hist->src || !hist->dst || !hist->wrkmem) {
+		vfree(hist->src);
+		vfree(hist->dst);
+		vfree(hist->wrkmem);
+		kfree(hist);
+		return -ENOMEM;
+	}
+
+	mutex_init(&hist->mutex);
+	INIT_WORK(&hist->work, logger_history_work);
+	hist->reader.log = log;
+	INIT_LIST_HEAD(&hist->chunks);
+	hist->size = CONFIG_ANDROID_LOGGER_HISTORY_SIZE * 1024;
 
-	return sizeof(struct logger_entry) + val;
+	log->history = hist;
+
+	return 0;
 }
 
+#else
+
+static inline void logger_history_kick(struct logger_log *log, size_t off,
+				       size_t len)
+{
+}
+
+static inline size_t logger_history_entry(struct logger_log *log,
+					  struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline ssize_t do_read_history_to_user(struct logger_reader *reader,
+					      char __user *buf, size_t count)
+{
+	return -EINVAL;
+}
+
+static inline size_t logger_history_oldest(struct logger_log *log)
+{
+	return ACCESS_ONCE(log->head);
+}
+
+static inline void logger_history_flush(struct logger_log *log)
+{
+}
+
+static inline void logger_history_stats(struct logger_log *log,
+					struct logger_stats *stats)
+{
+}
+
+static inline void logger_history_release(struct logger_reader *reader)
+{
+}
+
+static inline int logger_history_init(struct logger_log *log)
+{
+	return 0;
+}
+
+#endif /* CONFIG_ANDROID_LOGGER_HISTORY */
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_off);
 	size_t len;
 
 	/*
@@ -125,8 +586,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,11 +598,48 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * do_read_batch_to_user - reads as many further whole entries from 'log' as
+ * fit into the 'count' bytes of the user-space buffer 'buf'. Returns the
+ * number of bytes read, stopping short at the first entry that is not yet
+ * committed, is overwritten while we read it or cannot be copied.
+ *
+ * Caller must hold reader->mutex.
+ */
+static size_t do_read_batch_to_user(struct logger_log *log,
+				    struct logger_reader *reader,
+				    char __user *buf,
+				    size_t count)
+{
+	size_t done = 0;
+	size_t len;
+
+	while (1) {
+		len = logger_history_entry(log, reader);
+		if (len) {
+			if (len > count - done ||
+			    do_read_history_to_user(reader, buf + done, len) < 0)
+				break;
+		} else {
+			len = logger_next_entry(log, reader);
+			if (!len || len > count - done)
+				break;
+			if (do_read_log_to_user(log, reader, buf + done, len) < 0)
+				break;
+			if (logger_lapped(log, reader->r_off))
+				break;
+		}
+
+		reader->r_off += ALIGN(len, 4);
+		done += len;
+	}
+
+	return done;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -149,16 +647,18 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or after LOGGER_SET_BATCH_READ
+ * 	  as many whole entries as fit into the buffer, back to back
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or more in batch mode. Will set
+ * errno to EINVAL if read buffer is insufficient to hold next entry.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	bool history;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -166,11 +666,15 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
+		mutex_lock(&reader->mutex);
+		ret = logger_history_entry(log, reader);
+		history = ret;
+		if (ret)
 			break;
+		ret = logger_next_entry(log, reader);
+		if (ret)
+			break;
+		mutex_unlock(&reader->mutex);
 
 		if (file->f_flags & O_NONBLOCK) {
 			ret = -EAGAIN;
@@ -186,149 +690,172 @@ start:
 	}
 
 	finish_wait(&log->wq, &wait);
-	if (ret)
+	if (ret < 0)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	/* get exactly one entry from the log */
+	if (count < ret)
+		ret = -EINVAL;
+	else if (history)
+		ret = do_read_history_to_user(reader, buf, ret);
+	else
+		ret = do_read_log_to_user(log, reader, buf, ret);
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	/*
+	 * Was it overwritten while we were at it? Then the next entry
+	 * replaces it in the user's buffer.
+	 */
+	if (unlikely(!history && logger_lapped(log, reader->r_off))) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+	if (ret > 0) {
+		reader->r_off += ALIGN(ret, 4);
+		if (reader->batch)
+			ret += do_read_batch_to_user(log, reader, buf + ret,
+						     count - ret);
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_advance_head - pull the head forward to the first entry at or after
+ * 'off', waiting for writers still filling in the entries it passes.
+ *
+ * Those writers cannot sleep until they commit, so the wait is short.
  *
- * Caller must hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void logger_advance_head(struct logger_log *log, size_t off)
 {
-	size_t count = 0;
+	struct logger_entry *entry;
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
+	while (logger_before(log->head, off)) {
+		entry = logger_entry_at(log, log->head);
+		while (ACCESS_ONCE(entry->__pad) == LOGGER_ENTRY_BUSY)
+			cpu_relax();
+		log->head += logger_stride(entry->len);
+	}
+	ACCESS_ONCE(log->mmap_hdr->head) = log->head;
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_reserve - reserve room for an entry of payload 'len', returning
+ * its offset
+ *
+ * Readers lapped by the new entry find out by looking at the head, which is
+ * moved before any of the space is reused. The entry is left busy until
+ * logger_commit().
+ *
+ * The caller must have preemption disabled until it commits the entry.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static size_t logger_reserve(struct logger_log *log, __u16 len)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	struct logger_entry *entry;
+	size_t off;
 
-	return 0;
+	spin_lock(&log->lock);
+
+	off = log->w_off;
+	logger_advance_head(log, off + logger_stride(len) - log->size);
+
+	/* the head must be seen to move before its entries are clobbered */
+	smp_wmb();
+	entry = logger_entry_at(log, off);
+	entry->len = len;
+	entry->__pad = LOGGER_ENTRY_BUSY;
+
+	/* ... and the entry must be stamped before it is seen */
+	smp_wmb();
+	log->w_off = off + logger_stride(len);
+	ACCESS_ONCE(log->mmap_hdr->w_off) = log->w_off;
+
+	spin_unlock(&log->lock);
+
+	return off;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * logger_commit - make the entry at 'off' readable, or have readers skip it
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static inline void logger_commit(struct logger_log *log, size_t off,
+				 __u16 state)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
-
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
-
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	smp_wmb();
+	ACCESS_ONCE(logger_entry_at(log, off)->__pad) = state;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The entry at 'off' must be reserved by the caller.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The entry at 'off' must be reserved by the caller, so we cannot sleep and
+ * fail rather than fault the user's pages in.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
+	int ret = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	off = logger_offset(off);
+	len = min(count, log->size - off);
 
-	log->w_off = logger_offset(log->w_off + count);
+	pagefault_disable();
+	if (len && __copy_from_user_inatomic(log->buffer + off, buf, len))
+		ret = -EFAULT;
+	else if (count != len &&
+		 __copy_from_user_inatomic(log->buffer, buf + len, count - len))
+		ret = -EFAULT;
+	pagefault_enable();
 
-	return count;
+	return ret ? ret : count;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is reserved, filled in and committed without sleeping, so that
+ * a writer lapping it never has to wait long. The user's pages are faulted
+ * in beforehand; should one of them go away in the meantime, the entry is
+ * discarded and we try again.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	const size_t hdr = offsetof(struct logger_entry, pid);
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	unsigned long seg;
+	ssize_t ret;
+	size_t off;
 
 	now = current_kernel_time();
 
@@ -342,38 +869,46 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+retry:
+	for (ret = 0, seg = 0; seg < nr_segs && ret < header.len; seg++) {
+		size_t len = min_t(size_t, iov[seg].iov_len, header.len - ret);
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+		if (fault_in_pages_readable(iov[seg].iov_base, len))
+			return -EFAULT;
+		ret += len;
+	}
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	preempt_disable();
+	off = logger_reserve(log, header.len);
 
-	while (nr_segs-- > 0) {
+	/* the entry's len and state are already set by logger_reserve() */
+	do_write_log(log, off + hdr, (void *) &header + hdr,
+		     sizeof(struct logger_entry) - hdr);
+
+	for (ret = 0, seg = 0; seg < nr_segs && ret < header.len; seg++) {
 		size_t len;
 		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		len = min_t(size_t, iov[seg].iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log,
+				off + sizeof(struct logger_entry) + ret,
+				iov[seg].iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			logger_commit(log, off, LOGGER_ENTRY_DISCARDED);
+			preempt_enable();
+			goto retry;
 		}
 
-		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	logger_commit(log, off, LOGGER_ENTRY_COMMITTED);
+	preempt_enable();
+
+	logger_history_kick(log, off, logger_stride(header.len));
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
@@ -409,12 +944,13 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_off = logger_history_oldest(log);
+		reader->batch = false;
+#ifdef CONFIG_ANDROID_LOGGER_HISTORY
+		reader->hbuf = NULL;
+		reader->hbuf_len = 0;
+#endif
 
 		file->private_data = reader;
 	} else
@@ -432,7 +968,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
+		logger_history_release(reader);
 		kfree(reader);
 	}
 
@@ -448,6 +984,37 @@ static int logger_release(struct inode *ignored, struct file *file)
  * chance that the writer can lap the reader in the interim between poll()
  * returning and the read() request.
  */
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the log read-only: a page holding a struct logger_mmap_header,
+ * followed by the ring buffer. Readers of the mapping consume entries on
+ * their own, without any system call.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long hdr_pfn = virt_to_phys(log->mmap_hdr) >> PAGE_SHIFT;
+	unsigned long buf_pfn = virt_to_phys(log->buffer) >> PAGE_SHIFT;
+	int ret;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start, hdr_pfn, PAGE_SIZE,
+			      vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE, buf_pfn,
+			       log->size, vma->vm_page_prot);
+}
+
 static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
@@ -462,22 +1029,53 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (logger_history_entry(log, reader) ||
+	    logger_next_entry(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_get_stats - report how much of 'log' is kept, and for how long
+ */
+static long logger_get_stats(struct logger_log *log, void __user *arg)
+{
+	struct logger_stats stats;
+	struct logger_entry entry;
+	size_t head;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.size = log->size;
+
+	head = ACCESS_ONCE(log->head);
+	stats.len = ACCESS_ONCE(log->w_off) - head;
+	if (stats.len) {
+		smp_rmb();
+		do_read_log(log, head, &entry, sizeof(entry));
+		if (!logger_lapped(log, head))
+			stats.oldest_sec = entry.sec;
+	}
+
+	logger_history_stats(log, &stats);
+
+	if (stats.oldest_sec)
+		stats.window = current_kernel_time().tv_sec - stats.oldest_sec;
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -488,10 +1086,11 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		if (!logger_history_entry(log, reader))
+			logger_next_entry(log, reader);
+		ret = ACCESS_ONCE(log->w_off) - reader->r_off;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,25 +1098,40 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		mutex_lock(&reader->mutex);
+		ret = logger_history_entry(log, reader);
+		if (!ret)
+			ret = logger_next_entry(log, reader);
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers find themselves behind the head and catch up */
+		preempt_disable();
+		spin_lock(&log->lock);
+		logger_advance_head(log, log->w_off);
+		spin_unlock(&log->lock);
+		preempt_enable();
+		logger_history_flush(log);
 		ret = 0;
 		break;
+	case LOGGER_GET_STATS:
+		ret = logger_get_stats(log, (void __user *) arg);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -526,6 +1140,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -535,10 +1150,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is page aligned, so that it
+ * can be mapped.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -548,8 +1164,7 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -577,10 +1192,21 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->mmap_hdr = (struct logger_mmap_header *)
+				get_zeroed_page(GFP_KERNEL);
+	if (unlikely(!log->mmap_hdr))
+		return -ENOMEM;
+	log->mmap_hdr->size = log->size;
+
+	if (logger_history_init(log))
+		printk(KERN_WARNING "logger: no history for log '%s'\n",
+		       log->misc.name);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_page((unsigned long) log->mmap_hdr);
 		return ret;
 	}
 
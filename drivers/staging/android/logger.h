@@ -45,5 +45,47 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* read many entries */
+#define LOGGER_GET_STATS		_IOR(__LOGGERIO, 6, struct logger_stats)
+
+/*
+ * struct logger_stats - how much of a log is kept, as of LOGGER_GET_STATS
+ *
+ * Entries overwritten in the ring buffer may still be kept, compressed, in
+ * the log's history. 'window' is how many seconds back the oldest entry
+ * kept in either goes.
+ */
+struct logger_stats {
+	__u32		size;		/* size of the ring buffer */
+	__u32		len;		/* bytes of entries in the ring buffer */
+	__u32		history_size;	/* room for history, 0 if none */
+	__u32		history_used;	/* compressed bytes in the history */
+	__u32		history_len;	/* bytes of entries in the history */
+	__s32		oldest_sec;	/* time of the oldest entry kept */
+	__u32		window;		/* seconds of logs kept */
+};
+
+/*
+ * struct logger_mmap_header - first page of a read-only mmap() of a log
+ *
+ * The ring buffer itself follows in the next page, so the mapping must be
+ * one page plus LOGGER_GET_LOG_BUF_SIZE bytes long. Offsets are free-running
+ * modulo 2^32 and are reduced modulo 'size' to index the buffer. Entries are
+ * stored 4-byte aligned and their '__pad' holds a LOGGER_ENTRY_* state.
+ *
+ * To consume an entry at 'off', a reader checks that 'off' is before
+ * 'w_off', then that the entry is committed, copies it and finally checks
+ * that 'head' has not moved past 'off' meanwhile, with read barriers in
+ * between. An entry is lost once 'head' has passed it.
+ */
+struct logger_mmap_header {
+	__u32		size;	/* size of the ring buffer */
+	__u32		w_off;	/* end of the last reserved entry */
+	__u32		head;	/* oldest entry */
+};
+
+#define LOGGER_ENTRY_COMMITTED	0	/* complete, may be read */
+#define LOGGER_ENTRY_BUSY	1	/* reserved, still being written */
+#define LOGGER_ENTRY_DISCARDED	2	/* abandoned, skipped by readers */
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,18 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Rather than walking every process each time it is called, the driver keeps
+ * an index of processes by oom_adj, updated on fork, exit and oom_adj writes,
+ * with an estimate of each one's RSS. Picking a victim only looks at the
+ * highest eligible oom_adj, and the lowmem_select tracepoint reports how long
+ * that took.
+ *
+ * With CONFIG_VMPRESSURE the driver also acts on critical memory pressure,
+ * which means reclaim is scanning pages without managing to free them. It
+ * then kills as if the minfree thresholds were pressure_scale times larger,
+ * before the free counts are low enough for the shrinker to do it and the
+ * system has spent seconds thrashing. Write 0 to pressure_scale to disable.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +47,12 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/vmpressure.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,9 +70,39 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+#ifdef CONFIG_VMPRESSURE
+static int lowmem_pressure_scale = 2;
+#endif
+
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * lowmem_index - thread group leaders, bucketed by oom_adj
+ *
+ * Each task's lowmem_rss is refreshed when it enters the index or its
+ * oom_adj is written, which the platform does whenever an application
+ * changes state, and when it is picked as a victim. The buckets are zeroed
+ * hlists, so tasks forked before our initcall are indexed all the same.
+ *
+ * Lock Ordering: tasklist_lock -> siglock -> lowmem_index_lock
+ *
+ * Both outer locks are taken with interrupts disabled, so lowmem_index_lock
+ * is always taken with spin_lock_irqsave(): otherwise an interrupt wanting
+ * siglock or tasklist_lock could arrive while it is held, and deadlock
+ * against a CPU holding one of those and spinning on lowmem_index_lock.
+ */
+static struct hlist_head lowmem_index[OOM_ADJUST_MAX - OOM_DISABLE + 1];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+/*
+ * number of victims picked whose RSS turns out to be gone before falling
+ * back to lowmem_scan_select()
+ */
+#define LOWMEM_SELECT_TRIES	4
+
+#define lowmem_bucket(oom_adj)	(&lowmem_index[(oom_adj) - OOM_DISABLE])
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,17 +127,230 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * lowmem_index_add - index the new thread group leader 'p'
+ *
+ * Called from copy_process() with tasklist_lock held for writing.
+ */
+void lowmem_index_add(struct task_struct *p)
 {
-	struct task_struct *p;
-	struct task_struct *selected = NULL;
-	int rem = 0;
+	unsigned long flags;
+
+	p->lowmem_rss = p->mm ? get_mm_rss(p->mm) : 0;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	hlist_add_head(&p->lowmem_node, lowmem_bucket(p->signal->oom_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * lowmem_index_del - remove the dead thread group leader 'p'
+ *
+ * Called from __unhash_process() with tasklist_lock held for writing.
+ */
+void lowmem_index_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	hlist_del_init(&p->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * lowmem_index_replace - 'new' took over as leader from 'old' in exec
+ *
+ * Called from de_thread() with tasklist_lock held for writing.
+ */
+void lowmem_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	new->lowmem_rss = old->lowmem_rss;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	hlist_del_init(&old->lowmem_node);
+	hlist_add_head(&new->lowmem_node, lowmem_bucket(new->signal->oom_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * lowmem_index_update - move the process of 'p' to its new oom_adj
+ *
+ * Called from the oom_adj and oom_score_adj writers with task_lock(p) and
+ * p's siglock held, and p's mm present.
+ */
+void lowmem_index_update(struct task_struct *p)
+{
+	struct task_struct *leader = p->group_leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!hlist_unhashed(&leader->lowmem_node)) {
+		leader->lowmem_rss = get_mm_rss(p->mm);
+		hlist_del(&leader->lowmem_node);
+		hlist_add_head(&leader->lowmem_node,
+			       lowmem_bucket(p->signal->oom_adj));
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * lowmem_index_select - pick the process with the highest oom_adj of at
+ * least 'min_adj', and the largest RSS estimate among those
+ *
+ * Returns it with a reference held, its oom_adj in 'oom_adj'.
+ */
+static struct task_struct *lowmem_index_select(int min_adj, int *oom_adj)
+{
+	struct task_struct *p, *selected = NULL;
+	struct hlist_node *node;
+	unsigned long flags;
+	int adj;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE); adj--) {
+		hlist_for_each_entry(p, node, lowmem_bucket(adj), lowmem_node) {
+			if (!p->lowmem_rss)
+				continue;
+			if (selected && p->lowmem_rss <= selected->lowmem_rss)
+				continue;
+			selected = p;
+		}
+		if (selected) {
+			get_task_struct(selected);
+			*oom_adj = adj;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	return selected;
+}
+
+/*
+ * lowmem_scan_select - like lowmem_index_select(), but by walking all
+ * processes and reading their RSS instead of trusting the estimates
+ *
+ * Used when the index keeps turning up processes that already dropped
+ * their mm. The estimate of every process looked at is refreshed.
+ */
+static struct task_struct *lowmem_scan_select(int min_adj, int *oom_adj)
+{
+	struct task_struct *p, *selected = NULL;
+	int selected_tasksize = 0;
 	int tasksize;
+	int adj;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		task_lock(p);
+		if (!p->mm) {
+			task_unlock(p);
+			p->lowmem_rss = 0;
+			continue;
+		}
+		adj = p->signal->oom_adj;
+		tasksize = get_mm_rss(p->mm);
+		task_unlock(p);
+		p->lowmem_rss = tasksize;
+		if (adj < min_adj || tasksize <= 0)
+			continue;
+		if (selected) {
+			if (adj < *oom_adj)
+				continue;
+			if (adj == *oom_adj && tasksize <= selected_tasksize)
+				continue;
+		}
+		selected = p;
+		selected_tasksize = tasksize;
+		*oom_adj = adj;
+	}
+	if (selected)
+		get_task_struct(selected);
+	read_unlock(&tasklist_lock);
+
+	return selected;
+}
+
+/*
+ * lowmem_min_adj - the lowest oom_adj to kill at with the current free
+ * memory, when the minfree thresholds are multiplied by 'scale'
+ *
+ * Returns OOM_ADJUST_MAX + 1 if no threshold is crossed.
+ */
+static int lowmem_min_adj(int other_free, int other_file, int scale)
+{
 	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] * scale &&
+		    other_file < lowmem_minfree[i] * scale)
+			return lowmem_adj[i];
+	}
+	return OOM_ADJUST_MAX + 1;
+}
+
+/*
+ * lowmem_kill - kill the best victim with an oom_adj of at least 'min_adj'
+ *
+ * Returns the RSS of the process killed, or 0 if there was none.
+ */
+static int lowmem_kill(int min_adj)
+{
+	struct task_struct *selected = NULL;
+	int tasksize = 0;
+	int selected_oom_adj = 0;
+	ktime_t start;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < LOWMEM_SELECT_TRIES; i++) {
+		selected = lowmem_index_select(min_adj, &selected_oom_adj);
+		if (!selected)
+			break;
+
+		/* refresh the estimate; it drops to zero if the mm is gone */
+		task_lock(selected);
+		tasksize = selected->mm ? get_mm_rss(selected->mm) : 0;
+		task_unlock(selected);
+		selected->lowmem_rss = tasksize;
+		if (tasksize > 0)
+			break;
+
+		put_task_struct(selected);
+		selected = NULL;
+	}
+	if (i == LOWMEM_SELECT_TRIES) {
+		selected = lowmem_scan_select(min_adj, &selected_oom_adj);
+		if (selected)
+			tasksize = selected->lowmem_rss;
+	}
+	trace_lowmem_select(min_adj, selected, selected_oom_adj, tasksize,
+			    ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	if (!selected)
+		return 0;
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_adj, tasksize);
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	do_send_sig_info(SIGKILL, SEND_SIG_FORCED, selected, true);
+	put_task_struct(selected);
+	return tasksize;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
+	int min_adj;
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
@@ -105,17 +366,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
-		}
-	}
+	min_adj = lowmem_min_adj(other_free, other_file, 1);
 	if (sc->nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
 			     sc->nr_to_scan, sc->gfp_mask, other_free, other_file,
@@ -129,58 +380,46 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
-	}
+	rem -= lowmem_kill(min_adj);
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+#ifdef CONFIG_VMPRESSURE
+static int
+lowmem_vmpressure_notify(struct notifier_block *self, unsigned long level,
+			 void *data)
+{
+	int min_adj;
+	int other_free, other_file;
+
+	if (level < VMPRESSURE_CRITICAL || lowmem_pressure_scale <= 0)
+		return NOTIFY_OK;
+
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return NOTIFY_OK;
+
+	other_free = global_page_state(NR_FREE_PAGES);
+	other_file = global_page_state(NR_FILE_PAGES) -
+					global_page_state(NR_SHMEM);
+	min_adj = lowmem_min_adj(other_free, other_file,
+				 lowmem_pressure_scale);
+	lowmem_print(3, "lowmem_vmpressure %lu, ofree %d %d, ma %d\n",
+		     level, other_free, other_file, min_adj);
+	if (min_adj == OOM_ADJUST_MAX + 1)
+		return NOTIFY_OK;
+
+	lowmem_kill(min_adj);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call	= lowmem_vmpressure_notify,
+};
+#endif
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -190,11 +429,17 @@ static int __init lowmem_init(void)
 {
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+#ifdef CONFIG_VMPRESSURE
+	vmpressure_register_notifier(&lowmem_vmpressure_nb);
+#endif
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+#ifdef CONFIG_VMPRESSURE
+	vmpressure_unregister_notifier(&lowmem_vmpressure_nb);
+#endif
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
 }
@@ -204,6 +449,10 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
+#ifdef CONFIG_VMPRESSURE
+module_param_named(pressure_scale, lowmem_pressure_scale, int,
+		   S_IRUGO | S_IWUSR);
+#endif
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
@@ -0,0 +1,235 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/sched.h>
+#include <linux/err.h>
+
+#include "zcomp.h"
+
+/*
+ * Compressors offered through the comp_algorithm attribute. Any
+ * other crypto compression algorithm can be selected by name too,
+ * these are just the ones listed.
+ */
+static const char * const backends[] = {
+	"lzo",
+	"lz4",
+	"deflate",
+	NULL
+};
+
+bool zcomp_available(const char *name)
+{
+	return crypto_has_comp(name, 0, 0);
+}
+
+/* List the built-in backends, the current one in square brackets */
+ssize_t zcomp_available_show(const char *cur, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!strcmp(cur, backends[i]))
+			sz += sprintf(buf + sz, "[%s] ", backends[i]);
+		else if (zcomp_available(backends[i]))
+			sz += sprintf(buf + sz, "%s ", backends[i]);
+	}
+	sz += sprintf(buf + sz, "\n");
+
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Allocate a new stream. The buffer is two pages because the
+ * compressor may expand incompressible input beyond PAGE_SIZE.
+ * Transform setup may sleep and allocate with GFP_KERNEL, so
+ * streams are only ever allocated from process context outside
+ * the I/O path.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/* Get an idle stream, or sleep until another user releases one */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_first_entry(&comp->idle_strm,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+/* Return a stream to the pool, or free it if the pool shrank */
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(zstrm);
+}
+
+/*
+ * Change the number of streams. New streams are allocated right
+ * away; when shrinking, idle streams above the limit are freed now
+ * and busy ones when they are released.
+ */
+bool zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+	LIST_HEAD(victims);
+
+	if (num_strm < 1)
+		return false;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = num_strm;
+	while (comp->avail_strm < num_strm) {
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp);
+
+		spin_lock(&comp->strm_lock);
+		if (!zstrm) {
+			comp->avail_strm--;
+			break;
+		}
+		list_add(&zstrm->list, &comp->idle_strm);
+		wake_up(&comp->strm_wait);
+	}
+	while (comp->avail_strm > num_strm &&
+			!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_move(&zstrm->list, &victims);
+		comp->avail_strm--;
+	}
+	spin_unlock(&comp->strm_lock);
+
+	while (!list_empty(&victims)) {
+		zstrm = list_first_entry(&victims, struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+
+	return true;
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	unsigned int len = 2 * PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				   zstrm->buffer, &len);
+	*dst_len = len;
+
+	return ret;
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	unsigned int dst_len = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &dst_len);
+	if (!ret && dst_len != PAGE_SIZE)
+		ret = -EINVAL;
+
+	return ret;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a pool of @max_strm streams using the crypto compression
+ * algorithm @name. All streams are allocated up front so that the
+ * I/O path never has to set up a transform; if only some of them
+ * can be allocated we run with fewer.
+ */
+struct zcomp *zcomp_create(const char *name, int max_strm)
+{
+	struct zcomp *comp;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	strlcpy(comp->name, name, sizeof(comp->name));
+
+	zcomp_set_max_streams(comp, max(max_strm, 1));
+	if (!comp->avail_strm) {
+		kfree(comp);
+		return NULL;
+	}
+
+	return comp;
+}
@@ -0,0 +1,57 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * A compression stream is everything a single (de)compression needs:
+ * a crypto transform, which owns the algorithm's working memory, and
+ * a destination buffer. Streams are handed out from a per-device pool
+ * so that I/O to different table slots can proceed in parallel.
+ */
+struct zcomp_strm {
+	/* compression/decompression buffer */
+	void *buffer;
+	struct crypto_comp *tfm;
+	/* entry in zcomp->idle_strm */
+	struct list_head list;
+};
+
+struct zcomp {
+	spinlock_t strm_lock;		/* protects the fields below */
+	struct list_head idle_strm;	/* streams not in use */
+	wait_queue_head_t strm_wait;	/* waiters for an idle stream */
+	int avail_strm;			/* streams allocated, idle or busy */
+	int max_strm;			/* upper bound on avail_strm */
+	char name[CRYPTO_MAX_ALG_NAME];	/* crypto algorithm name */
+};
+
+bool zcomp_available(const char *name);
+ssize_t zcomp_available_show(const char *cur, char *buf);
+
+struct zcomp *zcomp_create(const char *name, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+bool zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+
+#endif
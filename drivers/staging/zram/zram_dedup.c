@@ -0,0 +1,134 @@
+/*
+ * Content deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+/*
+ * Compressed objects are indexed by a hash of their contents in an
+ * rbtree under zram->dedup_lock. Different objects can share a
+ * checksum, so lookups compare the data of every node with an equal
+ * key. The lock nests inside the slot lock.
+ */
+
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len)
+{
+	return jhash(mem, len, 0);
+}
+
+static bool zram_dedup_match(struct zram *zram, struct zram_dentry *dentry,
+		const unsigned char *mem, size_t len)
+{
+	unsigned char *cmem;
+	bool match;
+
+	if (dentry->len != len)
+		return false;
+
+	cmem = zs_map_object(zram->mem_pool, dentry->handle, ZS_MM_RO);
+	match = !memcmp(cmem, mem, len);
+	zs_unmap_object(zram->mem_pool, dentry->handle);
+
+	return match;
+}
+
+/*
+ * Look for an object with the same @len bytes of compressed data
+ * as @mem. On success a reference is taken on the returned entry.
+ */
+struct zram_dentry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum)
+{
+	struct rb_node *node, *prev;
+	struct zram_dentry *dentry;
+
+	spin_lock(&zram->dedup_lock);
+	node = zram->dedup_tree.rb_node;
+	while (node) {
+		dentry = rb_entry(node, struct zram_dentry, rb_node);
+		if (checksum < dentry->checksum)
+			node = node->rb_left;
+		else if (checksum > dentry->checksum)
+			node = node->rb_right;
+		else
+			break;
+	}
+
+	if (!node)
+		goto miss;
+
+	/* Rewind to the first node with this checksum, then scan */
+	while ((prev = rb_prev(node))) {
+		dentry = rb_entry(prev, struct zram_dentry, rb_node);
+		if (dentry->checksum != checksum)
+			break;
+		node = prev;
+	}
+
+	for (; node; node = rb_next(node)) {
+		dentry = rb_entry(node, struct zram_dentry, rb_node);
+		if (dentry->checksum != checksum)
+			break;
+		if (zram_dedup_match(zram, dentry, mem, len)) {
+			dentry->refcount++;
+			spin_unlock(&zram->dedup_lock);
+			return dentry;
+		}
+	}
+
+miss:
+	spin_unlock(&zram->dedup_lock);
+	return NULL;
+}
+
+/* Publish a new object with a single reference */
+void zram_dedup_insert(struct zram *zram, struct zram_dentry *dentry)
+{
+	struct rb_node **p, *parent = NULL;
+	struct zram_dentry *entry;
+
+	dentry->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+	p = &zram->dedup_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct zram_dentry, rb_node);
+		if (dentry->checksum < entry->checksum)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&dentry->rb_node, parent, p);
+	rb_insert_color(&dentry->rb_node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drop a reference. Returns true if it was the last one, in which
+ * case the entry has been unlinked and the caller must free both
+ * the object and the entry.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_dentry *dentry)
+{
+	bool last;
+
+	spin_lock(&zram->dedup_lock);
+	last = !--dentry->refcount;
+	if (last)
+		rb_erase(&dentry->rb_node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+
+	return last;
+}
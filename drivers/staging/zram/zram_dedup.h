@@ -0,0 +1,37 @@
+/*
+ * Content deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/types.h>
+
+struct zram;
+
+/*
+ * A compressed object shared by one or more table entries. Table
+ * entries flagged ZRAM_DEDUP point here instead of at the object.
+ */
+struct zram_dentry {
+	struct rb_node rb_node;		/* in zram->dedup_tree */
+	u32 checksum;			/* of the compressed data */
+	u32 len;			/* compressed length */
+	unsigned long refcount;		/* table entries using it */
+	unsigned long handle;		/* zsmalloc object */
+};
+
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len);
+struct zram_dentry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum);
+void zram_dedup_insert(struct zram *zram, struct zram_dentry *dentry);
+bool zram_dedup_put(struct zram *zram, struct zram_dentry *dentry);
+
+#endif
@@ -23,15 +23,20 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/cpu.h>
 #include <linux/device.h>
+#include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/ktime.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -42,68 +47,82 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
-{
-	*v = *v + 1;
-}
-
-static void zram_stat_dec(u32 *v)
-{
-	*v = *v - 1;
-}
-
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
-{
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
-}
-
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+/*
+ * The page flags share their word with the ZRAM_ACCESS lock bit,
+ * which other CPUs set and clear atomically while spinning on it,
+ * so the flags are changed with atomic bitops as well.
+ */
+static int zram_test_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	return test_bit(flag, &zram->table[index].flags);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_set_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	zram_stat64_add(zram, v, 1);
+	set_bit(flag, &zram->table[index].flags);
 }
 
-static int zram_test_flag(struct zram *zram, u32 index,
+static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	clear_bit(flag, &zram->table[index].flags);
 }
 
-static void zram_set_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+/*
+ * Table entries are protected by a bit spinlock in their flags
+ * word instead of a device-wide lock, so I/O to different pages
+ * runs in parallel. Nothing may sleep while the slot is locked.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
 {
-	zram->table[index].flags |= BIT(flag);
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
 }
 
-static void zram_clear_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_slot_unlock(struct zram *zram, u32 index)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check whether the page is a single word repeated, which covers
+ * zero pages as well as 32-bit (and on 64-bit also 64-bit) fill
+ * patterns. Such pages are kept as just the value.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned long value)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (!value) {
+		memset(ptr, 0, PAGE_SIZE);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,76 +152,208 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+/*
+ * Pages written back live in page sized blocks of the backing
+ * device, tracked in a bitmap. Block 0 is never handed out so that
+ * a block index is never 0.
+ */
+static unsigned long zram_bdev_alloc_block(struct zram *zram)
 {
-	u32 clen;
-	void *obj;
+	unsigned long blk_idx = 1;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+retry:
+	blk_idx = find_next_zero_bit(zram->bd_bitmap, zram->bd_nr_pages,
+					blk_idx);
+	if (blk_idx >= zram->bd_nr_pages)
+		return 0;
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+	if (test_and_set_bit(blk_idx, zram->bd_bitmap))
+		goto retry;
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void zram_bdev_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk_idx, zram->bd_bitmap));
+	atomic64_dec(&zram->stats.bd_count);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Submit @bio to the backing device and wait for it */
+static int zram_bdev_submit_wait(struct bio *bio, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio->bi_private = &done;
+	bio->bi_end_io = zram_bdev_end_io;
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	return test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+}
+
+struct zram_bdev_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_fn(struct work_struct *work)
+{
+	struct zram_bdev_read_work *rw;
+	struct bio *bio;
+
+	rw = container_of(work, struct zram_bdev_read_work, work);
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		rw->ret = -ENOMEM;
 		return;
 	}
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+	bio->bi_bdev = rw->zram->bdev;
+	bio->bi_sector = rw->blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, rw->page, PAGE_SIZE, 0);
+	rw->ret = zram_bdev_submit_wait(bio, READ);
+	bio_put(bio);
+}
+
+/*
+ * Read block @blk_idx of the backing device into @page. This runs
+ * from our make_request function, where bios we submit are only
+ * issued once it returns, so the read is done by a worker. It has
+ * its own rescuer-backed workqueue: we may be called in reclaim,
+ * and in async mode from a work item on zram->wq itself.
+ */
+static int zram_bdev_read(struct zram *zram, unsigned long blk_idx,
+			  struct page *page)
+{
+	struct zram_bdev_read_work rw;
+
+	rw.zram = zram;
+	rw.page = page;
+	rw.blk_idx = blk_idx;
+	INIT_WORK_ONSTACK(&rw.work, zram_bdev_read_fn);
+	queue_work(zram->bd_wq, &rw.work);
+	flush_work(&rw.work);
+	destroy_work_on_stack(&rw.work);
+
+	atomic64_inc(&zram->stats.bd_reads);
+	if (unlikely(rw.ret)) {
+		pr_err("Backing device read failed! err=%d, block=%lu\n",
+			rw.ret, blk_idx);
+		atomic64_inc(&zram->stats.failed_reads);
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	return rw.ret;
+}
 
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+/* Read block @blk_idx into @mem, which may be a partial page buffer */
+static int zram_bdev_read_mem(struct zram *zram, unsigned long blk_idx,
+			      unsigned char *mem)
+{
+	struct page *page;
+	unsigned char *src;
+	int ret;
 
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
-	zram_stat_dec(&zram->stats.pages_stored);
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	ret = zram_bdev_read(zram, blk_idx, page);
+	if (!ret) {
+		src = kmap_atomic(page, KM_USER0);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src, KM_USER0);
+	}
+	__free_page(page);
+
+	return ret;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+/* Caller must hold the slot lock */
+static void zram_free_page(struct zram *zram, size_t index)
 {
-	struct page *page = bvec->bv_page;
-	void *user_mem;
+	u32 clen;
+	struct zram_dentry *dentry;
+	unsigned long handle = zram->table[index].handle;
+
+	/* A page being written back is gone, see zram_writeback() */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_bdev_free_block(zram, zram->table[index].element);
+		zram->table[index].element = 0;
+		atomic_dec(&zram->stats.pages_stored);
+		return;
+	}
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	kunmap_atomic(user_mem, KM_USER0);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
+			atomic_dec(&zram->stats.pages_zero);
+		atomic_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
 
-	flush_dcache_page(page);
-}
+	if (unlikely(!handle))
+		return;
 
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
-{
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		dentry = zram->table[index].dentry;
+		clen = dentry->len;
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		zram->table[index].dentry = NULL;
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+		atomic_dec(&zram->stats.pages_stored);
+		if (clen <= PAGE_SIZE / 2)
+			atomic_dec(&zram->stats.good_compress);
 
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem, KM_USER1);
-	kunmap_atomic(user_mem, KM_USER0);
+		/* The object lives on while other pages share it */
+		if (!zram_dedup_put(zram, dentry)) {
+			atomic_dec(&zram->stats.pages_deduped);
+			return;
+		}
 
-	flush_dcache_page(page);
+		zs_free(zram->mem_pool, dentry->handle);
+		kfree(dentry);
+		atomic64_sub(clen, &zram->stats.compr_size);
+		return;
+	}
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		clen = PAGE_SIZE;
+		__free_page(zram->table[index].page);
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		atomic_dec(&zram->stats.pages_expand);
+		goto out;
+	}
+
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, handle);
+	if (clen <= PAGE_SIZE / 2)
+		atomic_dec(&zram->stats.good_compress);
+
+out:
+	atomic64_sub(clen, &zram->stats.compr_size);
+	atomic_dec(&zram->stats.pages_stored);
+
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static inline int is_partial_io(struct bio_vec *bvec)
@@ -210,185 +361,245 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+/*
+ * Decompress the page at @index into @mem, which must be a full
+ * page. Caller must hold the slot lock and have checked that the
+ * page is not on the backing device.
+ */
+static int zram_decompress_page(struct zram *zram, struct zcomp_strm *zstrm,
+				unsigned char *mem, u32 index)
 {
 	int ret;
 	size_t clen;
-	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
-
-	page = bvec->bv_page;
+	ktime_t start;
+	unsigned long handle;
+	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, zram->table[index].element);
 		return 0;
 	}
 
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+	handle = zram->table[index].handle;
+	if (!handle) {
+		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
+		cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
 		return 0;
 	}
 
+	clen = zram->table[index].size;
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		handle = zram->table[index].dentry->handle;
+		clen = zram->table[index].dentry->len;
+	}
+
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	start = ktime_get();
+	ret = zcomp_decompress(zram->comp, zstrm, cmem, clen, mem);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &zram->stats.decompr_time);
+	zs_unmap_object(zram->mem_pool, handle);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		atomic64_inc(&zram->stats.failed_reads);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset, struct bio *bio)
+{
+	int ret = 0;
+	struct page *page;
+	struct zcomp_strm *zstrm;
+	unsigned long blk_idx = 0;
+	unsigned char *user_mem, *uncmem = NULL;
+
+	page = bvec->bv_page;
+
 	if (is_partial_io(bvec)) {
 		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			return -ENOMEM;
 		}
 	}
 
+	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
+	zram_slot_lock(zram, index);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB)))
+		blk_idx = zram->table[index].element;
+	else
+		ret = zram_decompress_page(zram, zstrm, uncmem, index);
+	zram_slot_unlock(zram, index);
 
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec) && !blk_idx && !ret)
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
-	}
 
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
+	zcomp_strm_release(zram->comp, zstrm);
+
+	/* Reading from the backing device sleeps, do it unmapped */
+	if (unlikely(blk_idx)) {
+		if (!is_partial_io(bvec)) {
+			ret = zram_bdev_read(zram, blk_idx, page);
+		} else {
+			ret = zram_bdev_read_mem(zram, blk_idx, uncmem);
+			if (!ret) {
+				user_mem = kmap_atomic(page, KM_USER0);
+				memcpy(user_mem + bvec->bv_offset,
+				       uncmem + offset, bvec->bv_len);
+				kunmap_atomic(user_mem, KM_USER0);
+			}
+		}
+	}
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+	if (ret)
 		return ret;
-	}
 
 	flush_dcache_page(page);
 
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
-{
-	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
-	unsigned char *cmem;
-
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
-
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem, KM_USER0);
-		return 0;
-	}
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
-	}
-
-	return 0;
-}
-
+/*
+ * Writes are done in three steps: compress into a stream taken from
+ * the pool, copy the result into a new zsmalloc object, then swap
+ * the new object into the table under the slot lock. Only the last
+ * step is serialized, and only against I/O to the same page.
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
-	int ret;
-	u32 store_offset;
+	int ret = 0;
 	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	ktime_t start;
+	int uncompressed = 0;
+	u32 checksum = 0;
+	unsigned long element, handle = 0, blk_idx = 0;
+	struct zram_dentry *dentry = NULL;
+	struct zcomp_strm *zstrm = NULL;
+	struct page *page, *page_store = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
+	zstrm = zcomp_strm_find(zram->comp);
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		zram_slot_lock(zram, index);
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB)))
+			blk_idx = zram->table[index].element;
+		else
+			ret = zram_decompress_page(zram, zstrm, uncmem, index);
+		zram_slot_unlock(zram, index);
+		if (unlikely(blk_idx))
+			ret = zram_bdev_read_mem(zram, blk_idx, uncmem);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-	else
+		kunmap_atomic(user_mem, KM_USER0);
+		user_mem = NULL;
+	} else {
 		uncmem = user_mem;
+	}
 
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+	if (page_same_filled(uncmem, &element)) {
+		if (user_mem)
+			kunmap_atomic(user_mem, KM_USER0);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_slot_lock(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		zram_slot_unlock(zram, index);
+		if (!element)
+			atomic_inc(&zram->stats.pages_zero);
+		atomic_inc(&zram->stats.pages_same);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	start = ktime_get();
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &zram->stats.compr_time);
 
-	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	if (!is_partial_io(bvec)) {
+		kunmap_atomic(user_mem, KM_USER0);
+		user_mem = NULL;
+		uncmem = NULL;
+	}
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
 
+	if (zram->dedup_enable && clen <= max_zpage_size) {
+		checksum = zram_dedup_checksum(zstrm->buffer, clen);
+		dentry = zram_dedup_find(zram, zstrm->buffer, clen, checksum);
+		if (dentry) {
+			/* Identical object already stored, share it */
+			zcomp_strm_release(zram->comp, zstrm);
+			zstrm = NULL;
+
+			zram_slot_lock(zram, index);
+			zram_free_page(zram, index);
+			zram->table[index].dentry = dentry;
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+			zram_slot_unlock(zram, index);
+			dentry = NULL;
+
+			atomic_inc(&zram->stats.pages_stored);
+			atomic_inc(&zram->stats.pages_deduped);
+			if (clen <= PAGE_SIZE / 2)
+				atomic_inc(&zram->stats.good_compress);
+			goto out;
+		}
+
+		/* Without memory for an entry, store it unshared */
+		dentry = kmalloc(sizeof(*dentry), GFP_NOIO);
+	}
+
 	/*
 	 * Page is incompressible. Store it as-is (uncompressed)
 	 * since we do not want to return too many disk write
@@ -404,74 +615,285 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
+		uncompressed = 1;
+		src = uncmem;
+		if (!is_partial_io(bvec))
+			src = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		if (!is_partial_io(bvec))
+			kunmap_atomic(src, KM_USER0);
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (!handle) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%zu\n", index, clen);
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, zstrm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+	}
+
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+
+	if (dentry) {
+		dentry->checksum = checksum;
+		dentry->len = clen;
+		dentry->handle = handle;
+		zram_dedup_insert(zram, dentry);
+	}
+
+	/*
+	 * Free memory associated with this sector now and publish
+	 * the new object.
+	 */
+	zram_slot_lock(zram, index);
+	zram_free_page(zram, index);
+	if (dentry) {
+		zram->table[index].dentry = dentry;
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	} else if (uncompressed) {
 		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	} else {
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
 	}
+	zram_slot_unlock(zram, index);
+	dentry = NULL;
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		ret = -ENOMEM;
-		goto out;
+	/* Update stats */
+	if (uncompressed)
+		atomic_inc(&zram->stats.pages_expand);
+	atomic64_add(clen, &zram->stats.compr_size);
+	atomic_inc(&zram->stats.pages_stored);
+	if (clen <= PAGE_SIZE / 2)
+		atomic_inc(&zram->stats.good_compress);
+
+out:
+	kfree(dentry);
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+	if (ret)
+		atomic64_inc(&zram->stats.failed_writes);
+	return ret;
+}
+
+/*
+ * Writeback moves pages from RAM to the backing device. A page is
+ * picked and uncompressed under its slot lock and flagged
+ * ZRAM_UNDER_WB, then written with others in one bio per run of
+ * contiguous blocks. Freeing or rewriting the page meanwhile clears
+ * the flag, as reading it clears ZRAM_IDLE; such a page keeps its
+ * memory and its block is released.
+ */
+#define ZRAM_WB_BATCH	32
+
+struct zram_wb_batch {
+	struct page *pages[ZRAM_WB_BATCH];
+	u32 index[ZRAM_WB_BATCH];
+	unsigned long blk_idx[ZRAM_WB_BATCH];
+	int nr;
+};
+
+/* Caller must hold the slot lock */
+static bool zram_wb_candidate(struct zram *zram, u32 index,
+			      enum zram_wb_mode mode)
+{
+	if (zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+	    !zram->table[index].handle)
+		return false;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return zram_test_flag(zram, index, ZRAM_IDLE);
+}
+
+/* Swap pages written without error into the table */
+static void zram_wb_commit(struct zram *zram, struct zram_wb_batch *wb,
+			   int first, int last, enum zram_wb_mode mode,
+			   int err)
+{
+	u32 index;
+	bool written;
+	int i;
+
+	for (i = first; i < last; i++) {
+		index = wb->index[i];
+		written = false;
+
+		zram_slot_lock(zram, index);
+		if (!err && zram_test_flag(zram, index, ZRAM_UNDER_WB) &&
+		    (mode != ZRAM_WB_IDLE ||
+		     zram_test_flag(zram, index, ZRAM_IDLE))) {
+			zram_free_page(zram, index);
+			zram->table[index].element = wb->blk_idx[i];
+			zram_set_flag(zram, index, ZRAM_WB);
+			atomic_inc(&zram->stats.pages_stored);
+			written = true;
+		} else {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		}
+		zram_slot_unlock(zram, index);
+
+		if (!written)
+			zram_bdev_free_block(zram, wb->blk_idx[i]);
+	}
+}
+
+static void zram_wb_flush(struct zram *zram, struct zram_wb_batch *wb,
+			  enum zram_wb_mode mode)
+{
+	struct bio *bio;
+	int i, done = 0, err;
+
+	while (done < wb->nr) {
+		bio = bio_alloc(GFP_KERNEL, wb->nr - done);
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = wb->blk_idx[done] << SECTORS_PER_PAGE_SHIFT;
+
+		/* The queue may take fewer pages per bio than we batch */
+		for (i = done; i < wb->nr; i++)
+			if (bio_add_page(bio, wb->pages[i], PAGE_SIZE, 0) !=
+					PAGE_SIZE)
+				break;
+
+		if (i > done) {
+			err = zram_bdev_submit_wait(bio, WRITE);
+			atomic64_add(i - done, &zram->stats.bd_writes);
+		} else {
+			err = -EIO;
+			i++;
+		}
+		bio_put(bio);
+
+		if (err)
+			pr_err("Backing device write failed! err=%d\n", err);
+		zram_wb_commit(zram, wb, done, i, mode, err);
+		done = i;
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
+	wb->nr = 0;
+}
+
+/*
+ * Write pages selected by @mode to the backing device and free
+ * their memory. Caller must hold init_lock.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	struct zram_wb_batch *wb;
+	struct zcomp_strm *zstrm;
+	unsigned long nr_pages = zram->disksize >> PAGE_SHIFT;
+	unsigned long blk_idx = 0;
+	unsigned char *mem;
+	bool picked;
+	u32 index;
+	int i, ret = 0;
+
+	if (!zram->backing_dev)
+		return -ENODEV;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return -ENOMEM;
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		wb->pages[i] = alloc_page(GFP_KERNEL);
+		if (!wb->pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
-#endif
 
-	memcpy(cmem, src, clen);
+	for (index = 0; index < nr_pages; index++) {
+		zram_slot_lock(zram, index);
+		picked = zram_wb_candidate(zram, index, mode);
+		zram_slot_unlock(zram, index);
+		if (!picked)
+			continue;
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+		if (!blk_idx) {
+			blk_idx = zram_bdev_alloc_block(zram);
+			if (!blk_idx) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
 
-	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
+		/* A bio covers contiguous blocks only */
+		if (wb->nr == ZRAM_WB_BATCH || (wb->nr &&
+		    blk_idx != wb->blk_idx[wb->nr - 1] + 1))
+			zram_wb_flush(zram, wb, mode);
+
+		zstrm = zcomp_strm_find(zram->comp);
+		mem = kmap_atomic(wb->pages[wb->nr], KM_USER0);
+		zram_slot_lock(zram, index);
+		picked = zram_wb_candidate(zram, index, mode) &&
+			 !zram_decompress_page(zram, zstrm, mem, index);
+		if (picked)
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_slot_unlock(zram, index);
+		kunmap_atomic(mem, KM_USER0);
+		zcomp_strm_release(zram->comp, zstrm);
+
+		if (picked) {
+			wb->index[wb->nr] = index;
+			wb->blk_idx[wb->nr] = blk_idx;
+			wb->nr++;
+			blk_idx = 0;
+		}
+		cond_resched();
+	}
 
-	return 0;
+	zram_wb_flush(zram, wb, mode);
+	if (blk_idx)
+		zram_bdev_free_block(zram, blk_idx);
 
 out:
-	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+	for (i = 0; i < ZRAM_WB_BATCH; i++)
+		if (wb->pages[i])
+			__free_page(wb->pages[i]);
+	kfree(wb);
+
 	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+/* Mark all pages in RAM idle, until they are next accessed */
+void zram_mark_idle(struct zram *zram)
 {
-	int ret;
+	unsigned long nr_pages = zram->disksize >> PAGE_SHIFT;
+	u32 index;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+	for (index = 0; index < nr_pages; index++) {
+		zram_slot_lock(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB) &&
+		    zram->table[index].handle)
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_slot_unlock(zram, index);
+		if (!(index % 1024))
+			cond_resched();
 	}
+}
 
-	return ret;
+static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
+			int offset, struct bio *bio, int rw)
+{
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
+
+	return zram_bvec_write(zram, bvec, index, offset);
 }
 
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
@@ -481,27 +903,20 @@ static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
-static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
+/*
+ * Handle segments [first, last) of @bio, the first of which starts
+ * at @offset in page @index.
+ */
+static int zram_bio_segs(struct zram *zram, struct bio *bio, int first,
+			 int last, u32 index, int offset, int rw)
 {
-	int i, offset;
-	u32 index;
+	int i;
 	struct bio_vec *bvec;
 
-	switch (rw) {
-	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
-		break;
-	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
-		break;
-	}
-
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
-
-	bio_for_each_segment(bvec, bio, i) {
+	for (i = first; i < last; i++) {
 		int max_transfer_size = PAGE_SIZE - offset;
 
+		bvec = bio_iovec_idx(bio, i);
 		if (bvec->bv_len > max_transfer_size) {
 			/*
 			 * zram_bvec_rw() can only make operation on a single
@@ -514,26 +929,199 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 			bv.bv_offset = bvec->bv_offset;
 
 			if (zram_bvec_rw(zram, &bv, index, offset, bio, rw) < 0)
-				goto out;
+				return -EIO;
 
 			bv.bv_len = bvec->bv_len - max_transfer_size;
 			bv.bv_offset += max_transfer_size;
 			if (zram_bvec_rw(zram, &bv, index+1, 0, bio, rw) < 0)
-				goto out;
+				return -EIO;
 		} else
 			if (zram_bvec_rw(zram, bvec, index, offset, bio, rw)
 			    < 0)
-				goto out;
+				return -EIO;
+
+		update_position(&index, &offset, bvec);
+	}
+
+	return 0;
+}
+
+/*
+ * In async mode a bio is cut into chunks of whole pages, one per
+ * online CPU at most, and the chunks are run by the per-device
+ * workqueue. The submitter, often a task in reclaim, only pays for
+ * queueing. The last chunk to finish completes the bio.
+ */
+struct zram_bio_work {
+	struct work_struct work;
+	struct zram_bio_ctx *ctx;
+	int first, last;	/* segment range */
+	u32 index;		/* page and offset of the first segment */
+	int offset;
+};
+
+struct zram_bio_ctx {
+	struct zram *zram;
+	struct bio *bio;
+	int rw;
+	int error;
+	atomic_t pending;	/* chunks not finished */
+	struct zram_bio_work works[0];
+};
+
+static void zram_bio_work_fn(struct work_struct *work)
+{
+	struct zram_bio_work *zw;
+	struct zram_bio_ctx *ctx;
+
+	zw = container_of(work, struct zram_bio_work, work);
+	ctx = zw->ctx;
+	if (zram_bio_segs(ctx->zram, ctx->bio, zw->first, zw->last,
+			  zw->index, zw->offset, ctx->rw))
+		ctx->error = 1;
+
+	if (!atomic_dec_and_test(&ctx->pending))
+		return;
+
+	if (ctx->error) {
+		bio_io_error(ctx->bio);
+	} else {
+		set_bit(BIO_UPTODATE, &ctx->bio->bi_flags);
+		bio_endio(ctx->bio, 0);
+	}
+	kfree(ctx);
+}
+
+/* Returns false if @bio has to be handled synchronously */
+static bool zram_queue_bio(struct zram *zram, struct bio *bio, int rw)
+{
+	int i, cpu, nr = 0, nr_works, chunk;
+	unsigned int bytes = 0;
+	int offset;
+	u32 index;
+	struct bio_vec *bvec;
+	struct zram_bio_ctx *ctx;
+	struct zram_bio_work *zw = NULL;
+
+	nr_works = min_t(int, num_online_cpus(),
+			 DIV_ROUND_UP(bio->bi_size, PAGE_SIZE));
+	if (!nr_works)
+		return false;
+
+	ctx = kmalloc(sizeof(*ctx) + nr_works * sizeof(ctx->works[0]),
+		      GFP_NOIO);
+	if (!ctx)
+		return false;
+
+	chunk = DIV_ROUND_UP(bio->bi_size, nr_works);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
+
+	for (i = bio->bi_idx; i < bio->bi_vcnt; i++) {
+		/*
+		 * Cut only at page boundaries: partial writes to a page
+		 * read, modify and write it back, so a page must not be
+		 * handled by two chunks at once.
+		 */
+		if (!zw || (!offset && bytes >= chunk && nr < nr_works)) {
+			if (zw)
+				zw->last = i;
+			zw = &ctx->works[nr++];
+			zw->ctx = ctx;
+			zw->first = i;
+			zw->index = index;
+			zw->offset = offset;
+			bytes = 0;
+		}
 
+		bvec = bio_iovec_idx(bio, i);
+		bytes += bvec->bv_len;
 		update_position(&index, &offset, bvec);
 	}
+	zw->last = bio->bi_vcnt;
+
+	ctx->zram = zram;
+	ctx->bio = bio;
+	ctx->rw = rw;
+	ctx->error = 0;
+	atomic_set(&ctx->pending, nr);
+
+	get_online_cpus();
+	cpu = raw_smp_processor_id();
+	for (i = 0; i < nr; i++) {
+		INIT_WORK(&ctx->works[i].work, zram_bio_work_fn);
+		queue_work_on(cpu, zram->wq, &ctx->works[i].work);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+	put_online_cpus();
+
+	return true;
+}
+
+/*
+ * Free the pages covered by a discard request. Pages only partly
+ * covered are left alone.
+ */
+static void zram_bio_discard(struct zram *zram, struct bio *bio)
+{
+	u32 index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	int offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
+	size_t n = bio->bi_size;
+
+	if (offset) {
+		if (n <= PAGE_SIZE - offset)
+			return;
+
+		n -= PAGE_SIZE - offset;
+		index++;
+	}
+
+	while (n >= PAGE_SIZE) {
+		zram_slot_lock(zram, index);
+		zram_free_page(zram, index);
+		zram_slot_unlock(zram, index);
+		atomic64_inc(&zram->stats.discard);
+		index++;
+		n -= PAGE_SIZE;
+	}
+}
+
+static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
+{
+	int offset;
+	u32 index;
+
+	if (unlikely(bio->bi_rw & REQ_DISCARD)) {
+		zram_bio_discard(zram, bio);
+		bio_endio(bio, 0);
+		return;
+	}
+
+	switch (rw) {
+	case READ:
+		atomic64_inc(&zram->stats.num_reads);
+		break;
+	case WRITE:
+		atomic64_inc(&zram->stats.num_writes);
+		break;
+	}
+
+	if (zram->async_io && zram_queue_bio(zram, bio, rw))
+		return;
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
+
+	if (zram_bio_segs(zram, bio, bio->bi_idx, bio->bi_vcnt, index, offset,
+			  rw)) {
+		bio_io_error(bio);
+		return;
+	}
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
-	return;
-
-out:
-	bio_io_error(bio);
 }
 
 /*
@@ -561,7 +1149,7 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	struct zram *zram = queue->queuedata;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		bio_io_error(bio);
 		return 0;
 	}
@@ -576,41 +1164,116 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
-void zram_reset_device(struct zram *zram)
+/* Caller must hold init_lock */
+static void zram_reset_bdev(struct zram *zram)
 {
-	size_t index;
+	if (!zram->backing_dev)
+		return;
 
-	mutex_lock(&zram->init_lock);
-	zram->init_done = 0;
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bd_bitmap);
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->bd_nr_pages = 0;
+}
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+/*
+ * Use the block device at @path to hold written back pages. It is
+ * opened exclusively until the device is reset.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	struct file *backing_dev;
+	struct inode *inode;
+	struct block_device *bdev;
+	unsigned long nr_pages, *bitmap;
 
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+	backing_dev = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		ret = PTR_ERR(backing_dev);
+		goto out;
+	}
 
-		if (!page)
-			continue;
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto close;
+	}
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto close;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto put;
 	}
 
+	zram_reset_bdev(zram);
+	zram->backing_dev = backing_dev;
+	zram->bdev = bdev;
+	zram->bd_bitmap = bitmap;
+	zram->bd_nr_pages = nr_pages;
+	mutex_unlock(&zram->init_lock);
+
+	pr_info("Using %s as backing device, %lu pages\n", path, nr_pages);
+	return 0;
+
+put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+close:
+	filp_close(backing_dev, NULL);
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
+void zram_reset_device(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	zram->init_done = 0;
+
+	/* Wait for bios handled asynchronously */
+	if (zram->wq)
+		flush_workqueue(zram->wq);
+
+	/* Free various per-device buffers */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
+
+	/*
+	 * Free all pages that are still in this zram device. A failed
+	 * zram_init_device() can get here with disksize set but no table.
+	 */
+	if (zram->table)
+		for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+			zram_free_page(zram, index);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_reset_bdev(zram);
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -634,16 +1297,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error allocating %s compression streams\n",
+			zram->compressor);
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -663,7 +1320,8 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -689,8 +1347,10 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_slot_unlock(zram, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -702,9 +1362,12 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	mutex_init(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_tree = RB_ROOT;
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -734,6 +1397,28 @@ static int create_device(struct zram *zram, int device_id)
 	zram->disk->private_data = zram;
 	snprintf(zram->disk->disk_name, 16, "zram%d", device_id);
 
+	/* For async mode, may be used in reclaim (swap) */
+	zram->wq = alloc_workqueue(zram->disk->disk_name, WQ_MEM_RECLAIM, 0);
+	if (!zram->wq) {
+		put_disk(zram->disk);
+		blk_cleanup_queue(zram->queue);
+		pr_warning("Error allocating workqueue for device %d\n",
+			device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram->bd_wq = alloc_workqueue("zram_bd", WQ_MEM_RECLAIM, 0);
+	if (!zram->bd_wq) {
+		destroy_workqueue(zram->wq);
+		put_disk(zram->disk);
+		blk_cleanup_queue(zram->queue);
+		pr_warning("Error allocating workqueue for device %d\n",
+			device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	/* Actual capacity set using syfs (/sys/block/zram<id>/disksize */
 	set_capacity(zram->disk, 0);
 
@@ -747,6 +1432,17 @@ static int create_device(struct zram *zram, int device_id)
 	blk_queue_io_min(zram->disk->queue, PAGE_SIZE);
 	blk_queue_io_opt(zram->disk->queue, PAGE_SIZE);
 
+	/*
+	 * Discards free whole pages. Freed pages read back as zeroes,
+	 * but parts of pages are not discarded, so only claim that when
+	 * requests always cover whole pages.
+	 */
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, zram->disk->queue);
+	blk_queue_max_discard_sectors(zram->disk->queue, UINT_MAX);
+	zram->disk->queue->limits.discard_granularity = PAGE_SIZE;
+	if (ZRAM_LOGICAL_BLOCK_SIZE == PAGE_SIZE)
+		zram->disk->queue->limits.discard_zeroes_data = 1;
+
 	add_disk(zram->disk);
 
 	ret = sysfs_create_group(&disk_to_dev(zram->disk)->kobj,
@@ -774,6 +1470,11 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	destroy_workqueue(zram->wq);
+	zram->wq = NULL;
+	destroy_workqueue(zram->bd_wq);
+	zram->bd_wq = NULL;
 }
 
 static int __init zram_init(void)
@@ -834,8 +1535,13 @@ static void __exit zram_exit(void)
 		zram = &devices[i];
 
 		destroy_device(zram);
-		if (zram->init_done)
+		if (zram->init_done) {
 			zram_reset_device(zram);
+		} else {
+			mutex_lock(&zram->init_lock);
+			zram_reset_bdev(zram);
+			mutex_unlock(&zram->init_lock);
+		}
 	}
 
 	unregister_blkdev(zram_major, "zram");
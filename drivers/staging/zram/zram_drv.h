@@ -18,7 +18,9 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,23 +28,14 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression algorithm, see zcomp_available_show() */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +44,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -71,44 +64,71 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one value repeated, stored in table[page_no].element */
+	ZRAM_SAME,
+
+	/* Page is a shared object, see zram_dedup.c */
+	ZRAM_DEDUP,
+
+	/* Slot lock bit, see zram_slot_lock() */
+	ZRAM_ACCESS,
+
+	/* Page is on the backing device, block index in element */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page not accessed since marked through the idle attribute */
+	ZRAM_IDLE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. The ZRAM_ACCESS bit of flags is
+ * a bit spinlock protecting the whole entry.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;		/* zsmalloc object */
+		struct page *page;		/* ZRAM_UNCOMPRESSED */
+		unsigned long element;		/* ZRAM_SAME, ZRAM_WB */
+		struct zram_dentry *dentry;	/* ZRAM_DEDUP */
+	};
+	unsigned long flags;
+	u16 size;	/* compressed object size */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+};
 
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic64_t compr_size;	/* compressed size of pages stored */
+	atomic64_t num_reads;	/* failed + successful */
+	atomic64_t num_writes;	/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
+	atomic64_t notify_free;	/* no. of swap slot free notifications */
+	atomic64_t discard;	/* no. of pages freed by discard requests */
+	atomic64_t compr_time;	/* ns spent compressing */
+	atomic64_t decompr_time;	/* ns spent decompressing */
+	atomic64_t bd_count;	/* no. of pages on the backing device */
+	atomic64_t bd_reads;	/* no. of reads from the backing device */
+	atomic64_t bd_writes;	/* no. of writes to the backing device */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of same filled pages, incl. zero */
+	atomic_t pages_deduped;	/* no. of pages sharing another's object */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;	/* pool of compression streams */
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,10 +139,36 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* Run bios from wq instead of the submitter, see zram_queue_bio() */
+	int async_io;
+	struct workqueue_struct *wq;
+	/* Backing device reads, see zram_bdev_read() */
+	struct workqueue_struct *bd_wq;
+	/* Upper bound on concurrent compressions, see zcomp_create() */
+	int max_comp_streams;
+	/* Crypto API name of the compression algorithm */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+
+	/* Share identical compressed pages, see zram_dedup.c */
+	int dedup_enable;
+	struct rb_root dedup_tree;
+	spinlock_t dedup_lock;
+
+	/* Backing device for written back pages, see zram_writeback() */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned long *bd_bitmap;	/* blocks in use; block 0 is unused */
+	unsigned long bd_nr_pages;
 
 	struct zram_stats stats;
 };
 
+/* Pages to write back, see zram_writeback() */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,		/* incompressible pages */
+	ZRAM_WB_IDLE,		/* pages marked idle */
+};
+
 extern struct zram *devices;
 extern unsigned int num_devices;
 #ifdef CONFIG_SYSFS
@@ -131,5 +177,8 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
 
 #endif
@@ -13,22 +13,14 @@
  */
 
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/mm.h>
+#include <linux/math64.h>
+#include <linux/string.h>
 
 #include "zram_drv.h"
 
-static u64 zram_stat64_read(struct zram *zram, u64 *v)
-{
-	u64 val;
-
-	spin_lock(&zram->stat64_lock);
-	val = *v;
-	spin_unlock(&zram->stat64_lock);
-
-	return val;
-}
-
 static struct zram *dev_to_zram(struct device *dev)
 {
 	int i;
@@ -112,13 +104,76 @@ static ssize_t reset_store(struct device *dev,
 	return len;
 }
 
+static ssize_t max_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->max_comp_streams);
+}
+
+static ssize_t max_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	long num;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtol(buf, 10, &num);
+	if (ret)
+		return ret;
+
+	if (num < 1)
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zcomp_set_max_streams(zram->comp, num);
+	zram->max_comp_streams = num;
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return zcomp_available_show(zram->compressor, buf);
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct zram *zram = dev_to_zram(dev);
+
+	strlcpy(name, buf, sizeof(name));
+	strim(name);
+
+	if (!zcomp_available(name))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change compressor for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->compressor, name, sizeof(zram->compressor));
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
 static ssize_t num_reads_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_reads));
+		(u64)atomic64_read(&zram->stats.num_reads));
 }
 
 static ssize_t num_writes_show(struct device *dev,
@@ -127,7 +182,7 @@ static ssize_t num_writes_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_writes));
+		(u64)atomic64_read(&zram->stats.num_writes));
 }
 
 static ssize_t invalid_io_show(struct device *dev,
@@ -136,7 +191,7 @@ static ssize_t invalid_io_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.invalid_io));
+		(u64)atomic64_read(&zram->stats.invalid_io));
 }
 
 static ssize_t notify_free_show(struct device *dev,
@@ -145,7 +200,40 @@ static ssize_t notify_free_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.notify_free));
+		(u64)atomic64_read(&zram->stats.notify_free));
+}
+
+static ssize_t discard_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.discard));
+}
+
+static ssize_t async_io_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->async_io);
+}
+
+static ssize_t async_io_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	zram->async_io = !!val;
+
+	return len;
 }
 
 static ssize_t zero_pages_show(struct device *dev,
@@ -153,7 +241,47 @@ static ssize_t zero_pages_show(struct device *dev,
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_zero));
+}
+
+static ssize_t same_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_same));
+}
+
+static ssize_t deduped_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_deduped));
+}
+
+static ssize_t dedup_enable_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->dedup_enable);
+}
+
+static ssize_t dedup_enable_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	zram->dedup_enable = !!val;
+
+	return len;
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -162,7 +290,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -171,7 +299,42 @@ static ssize_t compr_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.compr_size));
+		(u64)atomic64_read(&zram->stats.compr_size));
+}
+
+/* Uncompressed to compressed size, with two decimals */
+static ssize_t compr_ratio_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 orig, compr, ratio;
+	struct zram *zram = dev_to_zram(dev);
+
+	orig = (u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT;
+	compr = atomic64_read(&zram->stats.compr_size);
+	if (!compr)
+		return sprintf(buf, "0.00\n");
+
+	ratio = div64_u64(orig * 100, compr);
+
+	return sprintf(buf, "%llu.%02llu\n", ratio / 100, ratio % 100);
+}
+
+static ssize_t compr_time_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.compr_time));
+}
+
+static ssize_t decompr_time_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.decompr_time));
 }
 
 static ssize_t mem_used_total_show(struct device *dev,
@@ -181,38 +344,227 @@ static ssize_t mem_used_total_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
+		val = zs_get_total_size_bytes(zram->mem_pool) +
+			((u64)atomic_read(&zram->stats.pages_expand)
+				<< PAGE_SHIFT);
 	}
 
 	return sprintf(buf, "%llu\n", val);
 }
 
+/* Move objects out of sparsely used zspages and free those pages */
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t compacted_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zs_pool_stats pool_stats = { 0 };
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zs_pool_stats(zram->mem_pool, &pool_stats);
+	mutex_unlock(&zram->init_lock);
+
+	return sprintf(buf, "%lu\n", pool_stats.pages_compacted);
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	char *p;
+	ssize_t ret;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->backing_dev) {
+		mutex_unlock(&zram->init_lock);
+		return sprintf(buf, "none\n");
+	}
+
+	p = d_path(&zram->backing_dev->f_path, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+	} else {
+		ret = strlen(p);
+		memmove(buf, p, ret);
+		buf[ret++] = '\n';
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char *path;
+	struct zram *zram = dev_to_zram(dev);
+
+	path = kstrndup(buf, len, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	ret = zram_set_backing_dev(zram, strim(path));
+	kfree(path);
+
+	return ret ? ret : len;
+}
+
+/* Writing "all" marks every stored page idle */
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	zram_mark_idle(zram);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/* Writing "huge" or "idle" writes those pages to the backing device */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	enum zram_wb_mode mode;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_WB_HUGE;
+	else if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_WB_IDLE;
+	else
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	ret = zram_writeback(zram, mode);
+	mutex_unlock(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
+static ssize_t bd_count_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.bd_count));
+}
+
+static ssize_t bd_reads_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.bd_reads));
+}
+
+static ssize_t bd_writes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.bd_writes));
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
+static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
+		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
 static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
 static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
+static DEVICE_ATTR(discard, S_IRUGO, discard_show, NULL);
+static DEVICE_ATTR(async_io, S_IRUGO | S_IWUSR,
+		async_io_show, async_io_store);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(same_pages, S_IRUGO, same_pages_show, NULL);
+static DEVICE_ATTR(deduped_pages, S_IRUGO, deduped_pages_show, NULL);
+static DEVICE_ATTR(dedup_enable, S_IRUGO | S_IWUSR,
+		dedup_enable_show, dedup_enable_store);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
+static DEVICE_ATTR(compr_ratio, S_IRUGO, compr_ratio_show, NULL);
+static DEVICE_ATTR(compr_time, S_IRUGO, compr_time_show, NULL);
+static DEVICE_ATTR(decompr_time, S_IRUGO, decompr_time_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(compacted_pages, S_IRUGO, compacted_pages_show, NULL);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(bd_count, S_IRUGO, bd_count_show, NULL);
+static DEVICE_ATTR(bd_reads, S_IRUGO, bd_reads_show, NULL);
+static DEVICE_ATTR(bd_writes, S_IRUGO, bd_writes_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
 	&dev_attr_initstate.attr,
 	&dev_attr_reset.attr,
+	&dev_attr_max_comp_streams.attr,
+	&dev_attr_comp_algorithm.attr,
 	&dev_attr_num_reads.attr,
 	&dev_attr_num_writes.attr,
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
+	&dev_attr_discard.attr,
+	&dev_attr_async_io.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_deduped_pages.attr,
+	&dev_attr_dedup_enable.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
+	&dev_attr_compr_ratio.attr,
+	&dev_attr_compr_time.attr,
+	&dev_attr_decompr_time.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_compacted_pages.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
 	NULL,
 };
 
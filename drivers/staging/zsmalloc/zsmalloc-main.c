@@ -0,0 +1,938 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc stores objects of up to ZS_MAX_ALLOC_SIZE bytes, typically
+ * compressed pages. Objects are rounded up to one of ZS_SIZE_CLASSES
+ * size classes. Each class carves its objects out of "zspages": one
+ * to ZS_MAX_PAGES_PER_ZSPAGE order-0 pages, possibly highmem, that
+ * are treated as a single contiguous area. The number of pages is
+ * chosen per class to minimize the space left over at the end, and
+ * objects may straddle the boundary between two pages.
+ *
+ * Callers get an opaque handle, not an address. The handle points to
+ * a word holding the object's current location, and each object
+ * starts with a header holding its handle. This indirection lets
+ * zs_compact() move objects out of sparsely used zspages into fuller
+ * ones and free the emptied zspages, which undoes the fragmentation
+ * an allocator that cannot move objects accumulates over time.
+ *
+ * Objects must be mapped with zs_map_object() before being accessed.
+ * A mapped object is pinned: it will not be moved until it is
+ * unmapped. Mappings are per-cpu and atomic, so the caller must not
+ * sleep nor map a second object before unmapping the first.
+ *
+ * Locking: each size class has a spinlock protecting its zspages.
+ * The pin bit of a handle nests outside the class lock, except in
+ * compaction, which only ever trylocks it.
+ */
+
+#ifdef CONFIG_ZSMALLOC_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *zs_handle_cachep;
+static struct kmem_cache *zs_zspage_cachep;
+static struct dentry *zs_stat_root;
+
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+
+static gfp_t zs_meta_gfp(struct zs_pool *pool)
+{
+	return pool->flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE);
+}
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Pick the number of pages per zspage for objects of @class_size
+ * that leaves the smallest fraction of the zspage unused.
+ */
+static unsigned int get_pages_per_zspage(int class_size)
+{
+	unsigned int i, max_usedpc = 0, max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % class_size;
+		unsigned int usedpc = (zspage_size - waste) * 100 /
+					zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+/* Handles and object locations */
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~(1UL << HANDLE_PIN_BIT);
+}
+
+/* Store a location; the caller may hold the pin, so keep it set */
+static void record_obj(unsigned long handle, unsigned long obj, bool pinned)
+{
+	*(unsigned long *)handle = obj | (pinned ? 1UL << HANDLE_PIN_BIT : 0);
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static unsigned long location_to_obj(struct zspage *zspage, unsigned int idx)
+{
+	unsigned long obj;
+
+	obj = page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS;
+	obj |= idx & OBJ_INDEX_MASK;
+
+	return obj << OBJ_TAG_BITS;
+}
+
+static void obj_to_location(unsigned long obj, struct zspage **zspage,
+				unsigned int *idx)
+{
+	obj >>= OBJ_TAG_BITS;
+	*zspage = (struct zspage *)page_private(pfn_to_page(obj >>
+							OBJ_INDEX_BITS));
+	*idx = obj & OBJ_INDEX_MASK;
+}
+
+static void obj_page_offset(struct size_class *class, struct zspage *zspage,
+			unsigned int idx, struct page **page, int *offset)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+
+	*page = zspage->pages[off >> PAGE_SHIFT];
+	*offset = off & ~PAGE_MASK;
+}
+
+/*
+ * Map the first word of an object: its handle when allocated, the
+ * index of the next free object when free. Objects are word aligned
+ * so this word never straddles pages.
+ */
+static unsigned long *map_obj_head(struct size_class *class,
+			struct zspage *zspage, unsigned int idx)
+{
+	struct page *page;
+	int offset;
+
+	obj_page_offset(class, zspage, idx, &page, &offset);
+
+	return kmap_atomic(page, KM_USER0) + offset;
+}
+
+static void unmap_obj_head(unsigned long *head)
+{
+	kunmap_atomic(head, KM_USER0);
+}
+
+/* Fullness groups */
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	unsigned int inuse = zspage->inuse;
+	unsigned int max = class->objs_per_zspage;
+
+	if (!inuse)
+		return ZS_EMPTY;
+	if (inuse == max)
+		return ZS_FULL;
+	if (inuse * 4 <= max * ZS_ALMOST_FULL_QUARTERS)
+		return ZS_ALMOST_EMPTY;
+
+	return ZS_ALMOST_FULL;
+}
+
+/* Move a zspage to the list matching its use; class lock held */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	enum fullness_group oldfg = zspage->fullness;
+	enum fullness_group newfg = get_fullness_group(class, zspage);
+
+	if (newfg == oldfg)
+		return newfg;
+
+	if (oldfg < NR_ZS_FULLNESS) {
+		list_del_init(&zspage->list);
+		class->nr_fullness[oldfg]--;
+	}
+	if (newfg < NR_ZS_FULLNESS) {
+		list_add(&zspage->list, &class->fullness_list[newfg]);
+		class->nr_fullness[newfg]++;
+	}
+	zspage->fullness = newfg;
+
+	return newfg;
+}
+
+static struct zspage *first_zspage(struct size_class *class,
+				enum fullness_group fg)
+{
+	if (list_empty(&class->fullness_list[fg]))
+		return NULL;
+
+	return list_first_entry(&class->fullness_list[fg], struct zspage, list);
+}
+
+/* Zspage allocation */
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	struct size_class *class = zspage->class;
+	unsigned int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kmem_cache_free(zs_zspage_cachep, zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+/* Link all objects of a new zspage into its free list */
+static void init_zspage(struct size_class *class, struct zspage *zspage)
+{
+	unsigned int idx;
+	unsigned long *head;
+
+	for (idx = 0; idx < class->objs_per_zspage; idx++) {
+		head = map_obj_head(class, zspage, idx);
+		*head = (unsigned long)(idx + 1) << OBJ_TAG_BITS;
+		unmap_obj_head(head);
+	}
+	zspage->freeobj = 0;
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zspage *zspage;
+	struct page *page;
+	unsigned int i;
+
+	zspage = kmem_cache_zalloc(zs_zspage_cachep, zs_meta_gfp(pool));
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		page = alloc_page(pool->flags);
+		if (!page) {
+			while (i--)
+				__free_page(zspage->pages[i]);
+			kmem_cache_free(zs_zspage_cachep, zspage);
+			return NULL;
+		}
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+	init_zspage(class, zspage);
+
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	return zspage;
+}
+
+/* Object allocation within a zspage; class lock held */
+
+static unsigned int obj_malloc(struct size_class *class,
+			struct zspage *zspage, unsigned long handle)
+{
+	unsigned int idx = zspage->freeobj;
+	unsigned long *head;
+
+	head = map_obj_head(class, zspage, idx);
+	zspage->freeobj = *head >> OBJ_TAG_BITS;
+	*head = handle | OBJ_ALLOCATED_TAG;
+	unmap_obj_head(head);
+
+	zspage->inuse++;
+	class->obj_used++;
+
+	return idx;
+}
+
+static void obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned int idx)
+{
+	unsigned long *head;
+
+	head = map_obj_head(class, zspage, idx);
+	*head = (unsigned long)zspage->freeobj << OBJ_TAG_BITS;
+	unmap_obj_head(head);
+
+	zspage->freeobj = idx;
+	zspage->inuse--;
+	class->obj_used--;
+}
+
+/**
+ * zs_malloc - Allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: size of the object, at most ZS_MAX_ALLOC_SIZE
+ *
+ * Returns a handle to the new object, or 0 on failure. The pool's
+ * gfp flags decide whether this may sleep.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	unsigned long handle;
+	unsigned int idx;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cachep,
+						zs_meta_gfp(pool));
+	if (!handle)
+		return 0;
+
+	size += ZS_HANDLE_SIZE;
+	class = pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	zspage = first_zspage(class, ZS_ALMOST_FULL);
+	if (!zspage)
+		zspage = first_zspage(class, ZS_ALMOST_EMPTY);
+
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cachep, (void *)handle);
+			return 0;
+		}
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	idx = obj_malloc(class, zspage, handle);
+	record_obj(handle, location_to_obj(zspage, idx), false);
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+/**
+ * zs_free - Free an object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc(), may be 0
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	enum fullness_group fg;
+	unsigned int idx;
+
+	if (unlikely(!handle))
+		return;
+
+	/* Keep compaction from moving the object under us */
+	pin_tag(handle);
+	obj_to_location(handle_to_obj(handle), &zspage, &idx);
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, idx);
+	fg = fix_fullness_group(class, zspage);
+	if (fg == ZS_EMPTY)
+		class->zspages--;
+	spin_unlock(&class->lock);
+	unpin_tag(handle);
+
+	kmem_cache_free(zs_handle_cachep, (void *)handle);
+
+	if (fg == ZS_EMPTY)
+		free_zspage(pool, zspage);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/* Copy an object that straddles two pages to or from a buffer */
+
+static void zs_copy_from_obj(char *buf, struct page *pages[2],
+			int offset, int size)
+{
+	int sizes[2];
+	char *addr;
+
+	sizes[0] = PAGE_SIZE - offset;
+	sizes[1] = size - sizes[0];
+
+	addr = kmap_atomic(pages[0], KM_USER0);
+	memcpy(buf, addr + offset, sizes[0]);
+	kunmap_atomic(addr, KM_USER0);
+	addr = kmap_atomic(pages[1], KM_USER0);
+	memcpy(buf + sizes[0], addr, sizes[1]);
+	kunmap_atomic(addr, KM_USER0);
+}
+
+static void zs_copy_to_obj(char *buf, struct page *pages[2],
+			int offset, int size)
+{
+	int sizes[2];
+	char *addr;
+
+	sizes[0] = PAGE_SIZE - offset;
+	sizes[1] = size - sizes[0];
+
+	addr = kmap_atomic(pages[0], KM_USER0);
+	memcpy(addr + offset, buf, sizes[0]);
+	kunmap_atomic(addr, KM_USER0);
+	addr = kmap_atomic(pages[1], KM_USER0);
+	memcpy(addr, buf + sizes[0], sizes[1]);
+	kunmap_atomic(addr, KM_USER0);
+}
+
+/**
+ * zs_map_object - Get a pointer to an object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object will be accessed
+ *
+ * The object stays pinned, and preemption disabled, until
+ * zs_unmap_object(). Only one object per cpu may be mapped at a time.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct mapping_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	struct page *page;
+	unsigned int idx;
+	int offset;
+
+	BUG_ON(!handle);
+
+	pin_tag(handle);
+	obj_to_location(handle_to_obj(handle), &zspage, &idx);
+	class = zspage->class;
+	obj_page_offset(class, zspage, idx, &page, &offset);
+
+	area = &__get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
+
+	if (offset + class->size <= PAGE_SIZE) {
+		area->straddle = false;
+		area->vm_addr = kmap_atomic(page, KM_USER0);
+		return area->vm_addr + offset + ZS_HANDLE_SIZE;
+	}
+
+	area->straddle = true;
+	area->pages[0] = page;
+	area->pages[1] = zspage->pages[((unsigned long)idx * class->size >>
+						PAGE_SHIFT) + 1];
+	area->offset = offset;
+	area->size = class->size;
+	if (mm != ZS_MM_WO)
+		zs_copy_from_obj(area->vm_buf, area->pages, offset,
+				class->size);
+
+	return area->vm_buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct mapping_area *area = &__get_cpu_var(zs_map_area);
+
+	if (!area->straddle)
+		kunmap_atomic(area->vm_addr, KM_USER0);
+	else if (area->vm_mm != ZS_MM_RO)
+		/*
+		 * Write back the payload only: with ZS_MM_WO the header
+		 * was never copied in. Objects are 16 byte aligned, so
+		 * the payload still straddles the page boundary.
+		 */
+		zs_copy_to_obj(area->vm_buf + ZS_HANDLE_SIZE, area->pages,
+				area->offset + ZS_HANDLE_SIZE,
+				area->size - ZS_HANDLE_SIZE);
+
+	unpin_tag(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/* Compaction */
+
+/* Copy a whole object, header included, between two zspages */
+static void zs_object_copy(struct size_class *class,
+			struct zspage *d_zspage, unsigned int d_idx,
+			struct zspage *s_zspage, unsigned int s_idx)
+{
+	unsigned long s_pos = (unsigned long)s_idx * class->size;
+	unsigned long d_pos = (unsigned long)d_idx * class->size;
+	int len, s_off, d_off, size = class->size;
+	char *s_addr, *d_addr;
+
+	while (size) {
+		s_off = s_pos & ~PAGE_MASK;
+		d_off = d_pos & ~PAGE_MASK;
+		len = min3(size, (int)PAGE_SIZE - s_off, (int)PAGE_SIZE - d_off);
+
+		s_addr = kmap_atomic(s_zspage->pages[s_pos >> PAGE_SHIFT],
+					KM_USER0);
+		d_addr = kmap_atomic(d_zspage->pages[d_pos >> PAGE_SHIFT],
+					KM_USER1);
+		memcpy(d_addr + d_off, s_addr + s_off, len);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		s_pos += len;
+		d_pos += len;
+		size -= len;
+	}
+}
+
+/*
+ * Move objects from @src to @dst until @src is empty or @dst full.
+ * Returns -EBUSY if an object was pinned. Class lock held.
+ */
+static int migrate_zspage(struct size_class *class, struct zspage *src,
+			struct zspage *dst)
+{
+	unsigned long *head, word, handle;
+	unsigned int idx, new_idx;
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		if (dst->inuse == class->objs_per_zspage)
+			break;
+
+		head = map_obj_head(class, src, idx);
+		word = *head;
+		unmap_obj_head(head);
+
+		if (!(word & OBJ_ALLOCATED_TAG))
+			continue;
+
+		handle = word & ~OBJ_ALLOCATED_TAG;
+		if (!trypin_tag(handle))
+			return -EBUSY;
+
+		new_idx = obj_malloc(class, dst, handle);
+		zs_object_copy(class, dst, new_idx, src, idx);
+		record_obj(handle, location_to_obj(dst, new_idx), true);
+		unpin_tag(handle);
+
+		obj_free(class, src, idx);
+	}
+
+	return 0;
+}
+
+/* Number of pages compaction could free in this class */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->zspages * class->objs_per_zspage -
+			class->obj_used;
+	obj_wasted /= class->objs_per_zspage;
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zspage *src, *dst;
+	unsigned long freed = 0;
+	int ret;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class) &&
+	       (src = first_zspage(class, ZS_ALMOST_EMPTY))) {
+		/* Isolate the source so it is not picked as destination */
+		list_del_init(&src->list);
+		class->nr_fullness[ZS_ALMOST_EMPTY]--;
+		src->fullness = NR_ZS_FULLNESS;
+
+		ret = 0;
+		while (src->inuse) {
+			dst = first_zspage(class, ZS_ALMOST_FULL);
+			if (!dst)
+				dst = first_zspage(class, ZS_ALMOST_EMPTY);
+			if (!dst)
+				break;
+
+			ret = migrate_zspage(class, src, dst);
+			fix_fullness_group(class, dst);
+			if (ret)
+				break;
+		}
+
+		if (src->inuse) {
+			fix_fullness_group(class, src);
+			break;
+		}
+
+		class->zspages--;
+		spin_unlock(&class->lock);
+		free_zspage(pool, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Migrate objects to free partly used zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed. May be called from process
+ * context only.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		freed += __zs_compact(pool, pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
+static int zs_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+	unsigned long pages = 0;
+	int i;
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->size_class[i];
+
+		spin_lock(&class->lock);
+		pages += zs_can_compact(class);
+		spin_unlock(&class->lock);
+	}
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+/* Statistics */
+
+#ifdef CONFIG_DEBUG_FS
+
+static int zs_stats_classes_show(struct seq_file *s, void *v)
+{
+	struct zs_pool *pool = s->private;
+	unsigned long zspages, obj_allocated, obj_used, pages_used;
+	unsigned long almost_full, almost_empty, full;
+	unsigned long total_used = 0, total_pages = 0, total_wasted = 0;
+	int i;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %10s %16s %6s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"obj_allocated", "obj_used", "pages_used",
+			"full", "pages_per_zspage", "frag%");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->size_class[i];
+
+		spin_lock(&class->lock);
+		zspages = class->zspages;
+		obj_used = class->obj_used;
+		almost_full = class->nr_fullness[ZS_ALMOST_FULL];
+		almost_empty = class->nr_fullness[ZS_ALMOST_EMPTY];
+		full = class->nr_fullness[ZS_FULL];
+		spin_unlock(&class->lock);
+
+		if (!zspages)
+			continue;
+
+		obj_allocated = zspages * class->objs_per_zspage;
+		pages_used = zspages * class->pages_per_zspage;
+		total_used += obj_used * (class->size - ZS_HANDLE_SIZE);
+		total_pages += pages_used;
+		total_wasted += (obj_allocated - obj_used) * class->size;
+
+		seq_printf(s, " %5u %5d %11lu %12lu %13lu %10lu %10lu %10lu %16u %6lu\n",
+			class->index, class->size, almost_full, almost_empty,
+			obj_allocated, obj_used, pages_used, full,
+			class->pages_per_zspage,
+			(obj_allocated - obj_used) * 100 / obj_allocated);
+	}
+
+	seq_printf(s, "\n pages_used: %lu, bytes_stored: %lu, "
+			"bytes_free_in_zspages: %lu, pages_compacted: %ld\n",
+			total_pages, total_used, total_wasted,
+			atomic_long_read(&pool->pages_compacted));
+
+	return 0;
+}
+
+static int zs_stats_classes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_classes_show, inode->i_private);
+}
+
+static const struct file_operations zs_stat_classes_fops = {
+	.open		= zs_stats_classes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_stat_root)
+		return;
+
+	pool->stat_dentry = debugfs_create_dir(pool->name, zs_stat_root);
+	if (pool->stat_dentry)
+		debugfs_create_file("classes", S_IRUGO, pool->stat_dentry,
+					pool, &zs_stat_classes_fops);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove_recursive(pool->stat_dentry);
+}
+
+#else
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+}
+
+#endif
+
+/* Pool setup */
+
+/**
+ * zs_create_pool - Create a pool
+ * @name: name for statistics in debugfs (zsmalloc/<name>/classes)
+ * @flags: allocation flags for zspage pages, e.g. GFP_NOIO | __GFP_HIGHMEM
+ *
+ * Returns NULL on failure.
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	struct zs_pool *pool;
+	int i, j;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->name = kstrdup(name, GFP_KERNEL);
+	if (!pool->name)
+		goto fail;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class;
+
+		class = kzalloc(sizeof(*class), GFP_KERNEL);
+		if (!class)
+			goto fail;
+
+		spin_lock_init(&class->lock);
+		for (j = 0; j < NR_ZS_FULLNESS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+		class->index = i;
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+		pool->size_class[i] = class;
+	}
+
+	pool->flags = flags;
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	zs_pool_stat_create(pool);
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+
+fail:
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		kfree(pool->size_class[i]);
+	kfree(pool->name);
+	kfree(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	struct zspage *zspage;
+	int i, fg;
+
+	unregister_shrinker(&pool->shrinker);
+	zs_pool_stat_destroy(pool);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->size_class[i];
+
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++) {
+			if (list_empty(&class->fullness_list[fg]))
+				continue;
+
+			pr_info("Freeing non-empty class with size %d, "
+				"fullness group %d\n", class->size, fg);
+			while ((zspage = first_zspage(class, fg))) {
+				list_del(&zspage->list);
+				free_zspage(pool, zspage);
+			}
+		}
+		kfree(class);
+	}
+
+	kfree(pool->name);
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+static void zs_free_map_areas(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		free_page((unsigned long)area->vm_buf);
+		area->vm_buf = NULL;
+	}
+}
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		area->vm_buf = (char *)__get_free_page(GFP_KERNEL);
+		if (!area->vm_buf)
+			goto fail;
+	}
+
+	zs_handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					ZS_HANDLE_SIZE, 0, NULL);
+	zs_zspage_cachep = kmem_cache_create("zspage",
+					sizeof(struct zspage), 0, 0, NULL);
+	if (!zs_handle_cachep || !zs_zspage_cachep)
+		goto fail;
+
+#ifdef CONFIG_DEBUG_FS
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	if (!zs_stat_root)
+		pr_warning("zsmalloc: debugfs not available, "
+			"stats disabled\n");
+#endif
+
+	return 0;
+
+fail:
+	if (zs_handle_cachep)
+		kmem_cache_destroy(zs_handle_cachep);
+	if (zs_zspage_cachep)
+		kmem_cache_destroy(zs_zspage_cachep);
+	zs_free_map_areas();
+	return -ENOMEM;
+}
+
+static void __exit zs_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+	kmem_cache_destroy(zs_zspage_cachep);
+	kmem_cache_destroy(zs_handle_cachep);
+	zs_free_map_areas();
+}
+
+module_init(zs_init);
+module_exit(zs_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Allocator for compressed pages");
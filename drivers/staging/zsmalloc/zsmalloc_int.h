@@ -0,0 +1,121 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/mm.h>
+
+/*
+ * A zspage is made of up to this many order-0 pages. More pages per
+ * zspage lets odd-sized classes waste less at the end of the zspage.
+ */
+#define ZS_MAX_ZSPAGE_ORDER	2
+#define ZS_MAX_PAGES_PER_ZSPAGE	(1 << ZS_MAX_ZSPAGE_ORDER)
+
+/*
+ * Every object starts with a word holding its handle, which is what
+ * lets compaction find and update the handle of an object it moves.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+#define ZS_MIN_ALLOC_SHIFT	5
+#define ZS_MIN_ALLOC_SIZE	(1 << ZS_MIN_ALLOC_SHIFT)
+#define ZS_MAX_ALLOC_SIZE_INT	PAGE_SIZE
+
+/* Size classes are this far apart; must keep objects word aligned */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE_INT - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * An object is located by the pfn of the first page of its zspage
+ * and its index in the zspage, stored as
+ *   (pfn << OBJ_INDEX_BITS | index) << OBJ_TAG_BITS
+ * The tag bit is used as HANDLE_PIN_BIT in handles and as
+ * OBJ_ALLOCATED_TAG in object headers.
+ */
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define OBJ_INDEX_BITS		(ZS_MAX_ZSPAGE_ORDER + PAGE_SHIFT - \
+					ZS_MIN_ALLOC_SHIFT + 1)
+#define OBJ_INDEX_MASK		((1UL << OBJ_INDEX_BITS) - 1)
+
+/*
+ * A zspage is almost full when more than this many quarters of its
+ * objects are in use. Allocations go to almost full zspages first,
+ * compaction empties almost empty ones.
+ */
+#define ZS_ALMOST_FULL_QUARTERS	3
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	NR_ZS_FULLNESS,		/* also: not on any list */
+	ZS_EMPTY,
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list */
+	struct size_class *class;
+	unsigned int inuse;		/* objects allocated */
+	unsigned int freeobj;		/* first free object index */
+	enum fullness_group fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[NR_ZS_FULLNESS];
+	int size;			/* object size, including handle */
+	unsigned int index;
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	/* Statistics, protected by lock */
+	unsigned long zspages;
+	unsigned long obj_used;
+	unsigned long nr_fullness[NR_ZS_FULLNESS];
+};
+
+struct zs_pool {
+	char *name;
+	gfp_t flags;			/* for zspage pages */
+	struct size_class *size_class[ZS_SIZE_CLASSES];
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+
+	struct shrinker shrinker;
+	struct dentry *stat_dentry;
+};
+
+/*
+ * Per-cpu state of the object currently mapped by zs_map_object().
+ * Objects that straddle two pages are copied through vm_buf.
+ */
+struct mapping_area {
+	char *vm_buf;
+	char *vm_addr;			/* kmap of a non-straddling object */
+	enum zs_mapmode vm_mm;
+	struct page *pages[2];
+	int offset;
+	int size;
+	bool straddle;
+};
+
+#endif
@@ -39,6 +39,13 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Cap on block age so that cost-benefit scores fit in 32 bits */
+#define YAFFS_GC_MAX_AGE 0xffff
+
+/* Overwrites raise write_heat by 2, first writes lower it by 1 */
+#define YAFFS_HOT_HEAT 2
+#define YAFFS_MAX_HEAT 8
+
 #include "yaffs_ecc.h"
 
 /* Forward declarations */
@@ -499,6 +506,8 @@ static int yaffs_get_erased_chunks(struct yaffs_dev *dev)
 
 	if (dev->alloc_block > 0)
 		n += (dev->param.chunks_per_block - dev->alloc_page);
+	if (dev->cold_alloc_block > 0)
+		n += (dev->param.chunks_per_block - dev->cold_alloc_page);
 
 	return n;
 
@@ -520,9 +529,81 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 	}
 }
 
+/*
+ * Hot/cold allocation streams.
+ *
+ * With hot_cold set, yaffs2 allocates from two blocks at once: chunks of
+ * files that get overwritten, and object headers, go to the hot block;
+ * first writes of file data and chunks copied by gc go to the cold one.
+ * Blocks then tend to hold data of a similar lifetime, so that gc finds
+ * them either mostly stale or mostly live.
+ *
+ * The cold block is swapped into alloc_block/alloc_page for the duration
+ * of a write, so the allocator and the write error handling only ever see
+ * one allocation block.
+ *
+ * Scanning takes the copy of a chunk in the block with the highest
+ * sequence number as the current one, so no chunk may be written to a
+ * block older than one already holding chunks of its object. Each object
+ * records the newest block it wrote to in alloc_seq. A new object inherits
+ * freed_seq from its hash bucket, as its id may have been used by a freed
+ * object, and alloc_seq_floor covers objects that were written before the
+ * mount. If the preferred block is too old the other one is used, and if
+ * that is too old as well the preferred block is closed so that a new one,
+ * with the highest sequence number, is started.
+ */
+
+static void yaffs_swap_alloc_stream(struct yaffs_dev *dev)
+{
+	int block = dev->alloc_block;
+	u32 page = dev->alloc_page;
+
+	dev->alloc_block = dev->cold_alloc_block;
+	dev->alloc_page = dev->cold_alloc_page;
+	dev->cold_alloc_block = block;
+	dev->cold_alloc_page = page;
+}
+
+static int yaffs_alloc_stream_ok(struct yaffs_dev *dev, int block,
+				 unsigned min_seq)
+{
+	return block < 0 ||
+	    yaffs_get_block_info(dev, block)->seq_number >= min_seq;
+}
+
+static int yaffs_select_alloc_stream(struct yaffs_dev *dev,
+				     struct yaffs_obj *in, int cold)
+{
+	unsigned min_seq;
+
+	if (!dev->param.is_yaffs2)
+		return 0;
+
+	min_seq = in ? in->alloc_seq : 0;
+	if (min_seq < dev->alloc_seq_floor)
+		min_seq = dev->alloc_seq_floor;
+
+	if (!dev->param.hot_cold)
+		cold = 0;
+	else if (!yaffs_alloc_stream_ok(dev, cold ? dev->cold_alloc_block :
+					dev->alloc_block, min_seq) &&
+		 yaffs_alloc_stream_ok(dev, cold ? dev->alloc_block :
+				       dev->cold_alloc_block, min_seq))
+		cold = !cold;
+
+	if (cold)
+		yaffs_swap_alloc_stream(dev);
+
+	if (!yaffs_alloc_stream_ok(dev, dev->alloc_block, min_seq))
+		yaffs_skip_rest_of_block(dev);
+
+	return cold;
+}
+
 static int yaffs_write_new_chunk(struct yaffs_dev *dev,
-				 const u8 * data,
-				 struct yaffs_ext_tags *tags, int use_reserver)
+				 struct yaffs_obj *in, const u8 * data,
+				 struct yaffs_ext_tags *tags, int use_reserver,
+				 int cold)
 {
 	int attempts = 0;
 	int write_ok = 0;
@@ -530,6 +611,8 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 
 	yaffs2_checkpt_invalidate(dev);
 
+	cold = yaffs_select_alloc_stream(dev, in, cold);
+
 	do {
 		struct yaffs_block_info *bi = 0;
 		int erased_ok = 0;
@@ -610,6 +693,16 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 	if (!write_ok)
 		chunk = -1;
 
+	if (chunk >= 0 && in && dev->param.is_yaffs2)
+		in->alloc_seq = yaffs_get_block_info(dev,
+				chunk / dev->param.chunks_per_block)->seq_number;
+
+	if (cold) {
+		yaffs_swap_alloc_stream(dev);
+		if (chunk >= 0)
+			dev->n_cold_writes++;
+	}
+
 	if (attempts > 1) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"**>> yaffs write required %d attempts",
@@ -620,6 +713,90 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 	return chunk;
 }
 
+/*
+ * Writes up to *n_chunks chunks to consecutive pages of one block with a
+ * single request to the driver and sets *n_chunks to the number written.
+ * This is only done when nothing has to be checked first: the allocation
+ * block must be known to be erased and have room for at least two of the
+ * chunks. Returns the first chunk written, or -1 if the caller has to
+ * write the chunks one at a time.
+ */
+static int yaffs_write_new_chunks(struct yaffs_dev *dev,
+				  struct yaffs_obj *in, const u8 * data,
+				  struct yaffs_ext_tags *tags, int *n_chunks,
+				  int cold)
+{
+	struct yaffs_block_info *bi;
+	int n = *n_chunks;
+	int chunk = -1;
+	int i;
+
+	if (!dev->param.write_chunks_tags_fn || dev->param.inband_tags ||
+	    dev->param.always_check_erased || n < 2)
+		return -1;
+
+	if (n > YAFFS_MAX_WR_BATCH)
+		n = YAFFS_MAX_WR_BATCH;
+
+	if (!yaffs_check_alloc_available(dev, n))
+		return -1;
+
+	yaffs2_checkpt_invalidate(dev);
+
+	cold = yaffs_select_alloc_stream(dev, in, cold);
+
+	if (dev->alloc_block < 0) {
+		dev->alloc_block = yaffs_find_alloc_block(dev);
+		dev->alloc_page = 0;
+	}
+
+	if (dev->alloc_block >= 0) {
+		bi = yaffs_get_block_info(dev, dev->alloc_block);
+		if (n > dev->param.chunks_per_block - dev->alloc_page)
+			n = dev->param.chunks_per_block - dev->alloc_page;
+		if (!bi->skip_erased_check)
+			n = 0;
+	} else {
+		n = 0;
+	}
+
+	if (n >= 2) {
+		chunk = yaffs_alloc_chunk(dev, 0, NULL);
+		for (i = 1; i < n; i++)
+			yaffs_alloc_chunk(dev, 0, NULL);
+
+		if (yaffs_wr_chunks_tags_nand(dev, chunk, n, data, tags) ==
+		    YAFFS_OK) {
+			for (i = 0; i < n; i++)
+				yaffs_handle_chunk_wr_ok(dev, chunk + i,
+					data + i * dev->data_bytes_per_chunk,
+					&tags[i]);
+		} else {
+			/* Give the chunks back the way a failed single
+			 * write does, the caller retries them one by one.
+			 */
+			for (i = 0; i < n; i++)
+				yaffs_handle_chunk_wr_error(dev, chunk + i, 1);
+			chunk = -1;
+		}
+	}
+
+	if (chunk >= 0 && in && dev->param.is_yaffs2)
+		in->alloc_seq = yaffs_get_block_info(dev,
+				chunk / dev->param.chunks_per_block)->seq_number;
+
+	if (cold) {
+		yaffs_swap_alloc_stream(dev);
+		if (chunk >= 0)
+			dev->n_cold_writes += n;
+	}
+
+	if (chunk >= 0)
+		*n_chunks = n;
+
+	return chunk;
+}
+
 /*
  * Block retiring for handling a broken block.
  */
@@ -1394,10 +1571,51 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The number of cache chunks is a mount time parameter. Cached chunks are
+ *   hashed by object and chunk id, and kept on an LRU list with free entries
+ *   at the cold end. A partially written chunk stays in the cache until it
+ *   is pushed out or its file is flushed, so that short appends are gathered
+ *   into whole chunks instead of programming the same chunk again and again.
  */
 
+static inline struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+						   u32 obj_id, int chunk_id)
+{
+	return &dev->cache_hash[(obj_id * 7 + chunk_id) & dev->cache_hash_mask];
+}
+
+/* Attach a free cache entry to a chunk */
+static void yaffs_cache_attach(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link,
+		 yaffs_cache_bucket(dev, obj->obj_id, chunk_id));
+}
+
+static void yaffs_cache_clean(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		dev->n_dirty_caches--;
+	}
+}
+
+/* Discard a cache entry, dirty or not, and make it the first to reuse */
+static void yaffs_cache_drop(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->object) {
+		list_del_init(&cache->hash_link);
+		cache->object = NULL;
+	}
+	yaffs_cache_clean(dev, cache);
+	list_move_tail(&cache->lru, &dev->cache_lru);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1405,6 +1623,9 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	struct yaffs_cache *cache;
 	int n_caches = obj->my_dev->param.n_caches;
 
+	if (!dev->n_dirty_caches)
+		return 0;
+
 	for (i = 0; i < n_caches; i++) {
 		cache = &dev->cache[i];
 		if (cache->object == obj && cache->dirty)
@@ -1414,6 +1635,10 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
+/*
+ * Write out the dirty chunks of an object, lowest chunk id first.
+ * The chunks stay in the cache, clean.
+ */
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1423,7 +1648,7 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 	int chunk_written = 0;
 	int n_caches = obj->my_dev->param.n_caches;
 
-	if (n_caches > 0) {
+	if (n_caches > 0 && dev->n_dirty_caches > 0) {
 		do {
 			cache = NULL;
 
@@ -1441,15 +1666,14 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 			}
 
 			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+				/* Write it out */
 
 				chunk_written =
 				    yaffs_wr_data_obj(cache->object,
 						      cache->chunk_id,
 						      cache->data,
 						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
+				yaffs_cache_clean(dev, cache);
 			}
 
 		} while (cache && chunk_written > 0);
@@ -1479,7 +1703,7 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
+		for (i = 0; i < n_caches && !obj && dev->n_dirty_caches; i++) {
 			if (dev->cache[i].object && dev->cache[i].dirty)
 				obj = dev->cache[i].object;
 
@@ -1492,18 +1716,19 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 }
 
 /* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * First look for the least recently used clean one (free ones included).
+ * Then write out the least recently used dirty chunk that is complete, so
+ * that partial chunks get a chance to fill up.
+ * Then flush the object of the least recently used dirty one and look again.
  */
 static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
+	list_for_each_entry_reverse(cache, &dev->cache_lru, lru) {
+		if (!cache->dirty && !cache->locked) {
+			yaffs_cache_drop(dev, cache);
+			return cache;
 		}
 	}
 
@@ -1513,53 +1738,36 @@ static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
-
-	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_grab_chunk_worker(dev);
-
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	struct yaffs_obj *the_obj = NULL;
 
-			/* With locking we can't assume we can use entry zero */
+	if (dev->param.n_caches <= 0)
+		return NULL;
 
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+	cache = yaffs_grab_chunk_worker(dev);
+	if (cache)
+		return cache;
 
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
+	list_for_each_entry_reverse(cache, &dev->cache_lru, lru) {
+		if (cache->locked)
+			continue;
+		if (!the_obj)
+			the_obj = cache->object;
+		if (cache->n_bytes == dev->data_bytes_per_chunk) {
+			if (yaffs_wr_data_obj(cache->object, cache->chunk_id,
+					      cache->data, cache->n_bytes,
+					      1) > 0) {
+				yaffs_cache_drop(dev, cache);
+				return cache;
 			}
+			break;
+		}
+	}
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+	/* Only partial chunks left, or the write failed: flush and retry */
+	if (the_obj)
+		yaffs_flush_file_cache(the_obj);
 
-		}
-		return cache;
-	} else {
-		return NULL;
-        }
+	return yaffs_grab_chunk_worker(dev);
 }
 
 /* Find a cached chunk */
@@ -1567,41 +1775,32 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache;
 
-				return &dev->cache[i];
-			}
+	if (dev->param.n_caches > 0) {
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj->obj_id,
+						       chunk_id), hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id)
+				return cache;
 		}
 	}
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Mark the chunk most recently used */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
+		list_move(&cache->lru, &dev->cache_lru);
 
-		cache->last_use = dev->cache_last_use;
-
-		if (is_write)
+		if (is_write && !cache->dirty) {
 			cache->dirty = 1;
+			dev->n_dirty_caches++;
+		}
 	}
 }
 
@@ -1616,7 +1815,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		    yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_drop(object->my_dev, cache);
 	}
 }
 
@@ -1632,7 +1831,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_cache_drop(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -1654,6 +1853,7 @@ static void yaffs_unhash_obj(struct yaffs_obj *obj)
 static void yaffs_free_obj(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_obj_bucket *bucket;
 
 	yaffs_trace(YAFFS_TRACE_OS, "FreeObject %p inode %p",
 		obj, obj->my_inode);
@@ -1665,6 +1865,11 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	if (!list_empty(&obj->siblings))
 		YBUG();
 
+	/* The id can be reused from now on, even if the free is defered */
+	bucket = &dev->obj_bucket[yaffs_hash_fn(obj->obj_id)];
+	if (bucket->freed_seq < obj->alloc_seq)
+		bucket->freed_seq = obj->alloc_seq;
+
 	if (obj->my_inode) {
 		/* We're still hooked up to a cached inode.
 		 * Don't delete now, but mark for later deletion
@@ -1995,6 +2200,8 @@ struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 		the_obj->rename_allowed = 1;
 		the_obj->unlink_allowed = 1;
 		the_obj->obj_id = number;
+		the_obj->alloc_seq =
+		    dev->obj_bucket[yaffs_hash_fn(number)].freed_seq;
 		yaffs_hash_obj(the_obj);
 		the_obj->variant_type = type;
 		yaffs_load_current_time(the_obj, 1, 1);
@@ -2059,6 +2266,7 @@ static void yaffs_init_tnodes_and_objs(struct yaffs_dev *dev)
 	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
 		INIT_LIST_HEAD(&dev->obj_bucket[i].list);
 		dev->obj_bucket[i].count = 0;
+		dev->obj_bucket[i].freed_seq = 0;
 	}
 }
 
@@ -2306,6 +2514,7 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	dev->chunk_bits = NULL;
 
 	dev->alloc_block = -1;	/* force it to get a new one */
+	dev->cold_alloc_block = -1;
 
 	/* If the first allocation strategy fails, thry the alternate one */
 	dev->block_info =
@@ -2628,16 +2837,18 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 								&tags, 1);
 						new_chunk =
 						    yaffs_write_new_chunk(dev,
+									  object,
 									  (u8 *)
 									  oh,
 									  &tags,
-									  1);
+									  1, 1);
 					} else {
 						new_chunk =
 						    yaffs_write_new_chunk(dev,
+									  object,
 									  buffer,
 									  &tags,
-									  1);
+									  1, 1);
                                         }
 
 					if (new_chunk < 0) {
@@ -2715,6 +2926,32 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * yaffs_gc_score() rates a full block as a gc victim, higher is better.
+ *
+ * The greedy policy goes for the fewest pages in use. The cost-benefit
+ * policy weighs the space gained against the cost of copying the live
+ * pages, times the age of the block: age * (1 - u) / (1 + u) for a block
+ * with utilisation u. Old, mostly live blocks hold cold data and are
+ * worth collecting to get them out of the way, while young blocks are
+ * left alone for a while as more of their pages are likely to go stale.
+ */
+static unsigned yaffs_gc_score(struct yaffs_dev *dev,
+			       struct yaffs_block_info *bi, int pages_used)
+{
+	unsigned n_free = dev->param.chunks_per_block - pages_used;
+	unsigned age;
+
+	if (dev->param.gc_policy != YAFFS_GC_POLICY_COST_BENEFIT)
+		return n_free;
+
+	age = dev->seq_number - bi->seq_number + 1;
+	if (age > YAFFS_GC_MAX_AGE)
+		age = YAFFS_GC_MAX_AGE;
+
+	return age * n_free / (dev->param.chunks_per_block + pages_used);
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
@@ -2771,6 +3008,7 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 	if (!selected) {
 		int pages_used;
+		unsigned score;
 		int n_blocks =
 		    dev->internal_end_block - dev->internal_start_block + 1;
 		if (aggressive) {
@@ -2812,13 +3050,27 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 			pages_used = bi->pages_in_use - bi->soft_del_pages;
 
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
+			if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+			    pages_used >= dev->param.chunks_per_block)
+				continue;
+
+			/*
+			 * Cost-benefit may rate a block above threshold
+			 * higher than those below it, but only the latter
+			 * can be collected now.
+			 */
+			if (dev->param.gc_policy ==
+			    YAFFS_GC_POLICY_COST_BENEFIT &&
+			    pages_used > threshold)
+				continue;
+
+			score = yaffs_gc_score(dev, bi, pages_used);
+
+			if ((dev->gc_dirtiest < 1 || score > dev->gc_score)
 			    && yaffs_block_ok_for_gc(dev, bi)) {
 				dev->gc_dirtiest = dev->gc_block_finder;
 				dev->gc_pages_in_use = pages_used;
+				dev->gc_score = score;
 			}
 		}
 
@@ -3073,6 +3325,18 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 
 }
 
+/* Rewritten chunks make the file hot, appends cool it down */
+static u8 yaffs_next_write_heat(u8 heat, int rewrite)
+{
+	if (!rewrite) {
+		if (heat > 0)
+			heat--;
+	} else if (heat <= YAFFS_MAX_HEAT - 2) {
+		heat += 2;
+	}
+	return heat;
+}
+
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 * buffer, int n_bytes, int use_reserve)
 {
@@ -3116,10 +3380,15 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 		YBUG();
 	}
 
+	in->write_heat = yaffs_next_write_heat(in->write_heat,
+					       prev_chunk_id > 0);
+
 	new_chunk_id =
-	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve);
+	    yaffs_write_new_chunk(dev, in, buffer, &new_tags, use_reserve,
+				  in->write_heat < YAFFS_HOT_HEAT);
 
 	if (new_chunk_id > 0) {
+		dev->n_obj_writes++;
 		yaffs_put_chunk_in_file(in, inode_chunk, new_chunk_id, 0);
 
 		if (prev_chunk_id > 0)
@@ -3131,6 +3400,73 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 
 }
 
+/*
+ * Writes n_chunks whole chunks of a file, which follow each other in
+ * buffer, with batched writes. Returns the number of chunks written,
+ * 0 if the caller has to write them one at a time.
+ */
+static int yaffs_wr_data_objs(struct yaffs_obj *in, int inode_chunk,
+			      const u8 * buffer, int n_chunks)
+{
+	int prev_chunk_id[YAFFS_MAX_WR_BATCH];
+	struct yaffs_ext_tags prev_tags;
+
+	int new_chunk_id;
+	struct yaffs_ext_tags new_tags[YAFFS_MAX_WR_BATCH];
+
+	struct yaffs_dev *dev = in->my_dev;
+	u8 heat = in->write_heat;
+	int i;
+
+	if (!dev->param.write_chunks_tags_fn || n_chunks < 2)
+		return 0;
+
+	if (n_chunks > YAFFS_MAX_WR_BATCH)
+		n_chunks = YAFFS_MAX_WR_BATCH;
+
+	yaffs_check_gc(dev, 0);
+
+	/* As in yaffs_wr_data_obj(), tnodes are created before writing */
+	for (i = 0; i < n_chunks; i++) {
+		prev_chunk_id[i] = yaffs_find_chunk_in_file(in,
+						inode_chunk + i, &prev_tags);
+		if (prev_chunk_id[i] < 1 &&
+		    !yaffs_put_chunk_in_file(in, inode_chunk + i, 0, 0))
+			return 0;
+
+		yaffs_init_tags(&new_tags[i]);
+
+		new_tags[i].chunk_id = inode_chunk + i;
+		new_tags[i].obj_id = in->obj_id;
+		new_tags[i].serial_number =
+		    (prev_chunk_id[i] > 0) ? prev_tags.serial_number + 1 : 1;
+		new_tags[i].n_bytes = dev->data_bytes_per_chunk;
+
+		heat = yaffs_next_write_heat(heat, prev_chunk_id[i] > 0);
+	}
+
+	new_chunk_id =
+	    yaffs_write_new_chunks(dev, in, buffer, new_tags, &n_chunks,
+				   heat < YAFFS_HOT_HEAT);
+	if (new_chunk_id < 0)
+		return 0;
+
+	for (i = 0; i < n_chunks; i++) {
+		in->write_heat = yaffs_next_write_heat(in->write_heat,
+						       prev_chunk_id[i] > 0);
+		dev->n_obj_writes++;
+		yaffs_put_chunk_in_file(in, inode_chunk + i,
+					new_chunk_id + i, 0);
+
+		if (prev_chunk_id[i] > 0)
+			yaffs_chunk_del(dev, prev_chunk_id[i], 1, __LINE__);
+	}
+
+	yaffs_verify_file_sane(in);
+
+	return n_chunks;
+}
+
 
 
 static int yaffs_do_xattrib_mod(struct yaffs_obj *obj, int set,
@@ -3492,10 +3828,11 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
 
 		/* Create new chunk in NAND */
 		new_chunk_id =
-		    yaffs_write_new_chunk(dev, buffer, &new_tags,
-					  (prev_chunk_id > 0) ? 1 : 0);
+		    yaffs_write_new_chunk(dev, in, buffer, &new_tags,
+					  (prev_chunk_id > 0) ? 1 : 0, 0);
 
 		if (new_chunk_id >= 0) {
+			dev->n_obj_writes++;
 
 			in->hdr_chunk = new_chunk_id;
 
@@ -3538,6 +3875,34 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
+/*
+ * yaffs_file_rd_map() finds the NAND chunks holding n_chunks whole chunks
+ * of file data from a chunk aligned offset, so that the caller can read
+ * them itself. Holes are returned as -1.
+ * Fails if any of the chunks is in the short-op cache, since that data
+ * may be newer than what is on NAND.
+ */
+int yaffs_file_rd_map(struct yaffs_obj *in, loff_t offset, int n_chunks,
+		      int *nand_chunks)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int chunk;
+	u32 start;
+	int i;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	if (start)
+		return YAFFS_FAIL;
+	chunk++;
+
+	for (i = 0; i < n_chunks; i++, chunk++) {
+		if (yaffs_find_chunk_cache(in, chunk))
+			return YAFFS_FAIL;
+		nand_chunks[i] = yaffs_find_chunk_in_file(in, chunk, NULL);
+	}
+	return YAFFS_OK;
+}
+
 int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 {
 
@@ -3567,6 +3932,8 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 			n_copy = dev->data_bytes_per_chunk - start;
 
 		cache = yaffs_find_chunk_cache(in, chunk);
+		if (cache)
+			dev->cache_hits++;
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
@@ -3579,15 +3946,13 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				/* If we can't find the data in the cache, then load it up. */
 
 				if (!cache) {
+					dev->cache_misses++;
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_attach(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3703,20 +4068,23 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				struct yaffs_cache *cache;
 				/* If we can't find the data in the cache, then load the cache */
 				cache = yaffs_find_chunk_cache(in, chunk);
-
-				if (!cache
-				    && yaffs_check_alloc_available(dev, 1)) {
+				if (cache)
+					dev->cache_hits++;
+				else
+					dev->cache_misses++;
+
+				/* Every dirty chunk will need space */
+				if (!cache && yaffs_check_alloc_available(dev,
+						dev->n_dirty_caches + 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_attach(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
-									1)) {
+						dev->n_dirty_caches + 1)) {
 					/* Drop the cache if it was a read cache item and
 					 * no space check has been made for it.
 					 */
@@ -3740,7 +4108,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_cache_clean(dev, cache);
 					}
 
 				} else {
@@ -3769,14 +4137,27 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 			}
 
 		} else {
-			/* A full chunk. Write directly from the supplied buffer. */
+			/* A full chunk. Write directly from the supplied buffer,
+			 * along with any full chunks that follow it.
+			 */
+			int n_chunks = yaffs_wr_data_objs(in, chunk, buffer,
+					n / dev->data_bytes_per_chunk);
+			int i;
 
-			chunk_written =
-			    yaffs_wr_data_obj(in, chunk, buffer,
-					      dev->data_bytes_per_chunk, 0);
+			if (n_chunks > 0) {
+				chunk_written = 1;
+				n_copy = n_chunks * dev->data_bytes_per_chunk;
+			} else {
+				n_chunks = 1;
+				chunk_written =
+				    yaffs_wr_data_obj(in, chunk, buffer,
+						      dev->data_bytes_per_chunk,
+						      0);
+			}
 
 			/* Since we've overwritten the cached data, we better invalidate it. */
-			yaffs_invalidate_chunk_cache(in, chunk);
+			for (i = 0; i < n_chunks; i++)
+				yaffs_invalidate_chunk_cache(in, chunk + i);
 		}
 
 		if (chunk_written >= 0) {
@@ -4941,15 +5322,21 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
+	dev->cache_hash = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+	dev->n_dirty_caches = 0;
+
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		int n_buckets = 1;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
@@ -4959,18 +5346,31 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_lru);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
+
+		/* About one chunk per bucket */
+		while (n_buckets < dev->param.n_caches)
+			n_buckets <<= 1;
+
+		if (buf)
+			dev->cache_hash = buf =
+			    kmalloc(n_buckets * sizeof(struct list_head),
+				    GFP_NOFS);
 		if (!buf)
 			init_failed = 1;
 
-		dev->cache_last_use = 0;
+		dev->cache_hash_mask = n_buckets - 1;
+		for (i = 0; i < n_buckets && buf; i++)
+			INIT_LIST_HEAD(&dev->cache_hash[i]);
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -5012,6 +5412,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 				dev->n_free_chunks = 0;
 				dev->alloc_block = -1;
 				dev->alloc_page = -1;
+				dev->cold_alloc_block = -1;
 				dev->n_deleted_files = 0;
 				dev->n_unlinked_files = 0;
 				dev->n_bg_deletions = 0;
@@ -5047,11 +5448,16 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	/* Objects loaded from NAND may have chunks in any block up to here */
+	dev->alloc_seq_floor = dev->seq_number;
+
 	/* Zero out stats */
 	dev->n_page_reads = 0;
 	dev->n_page_writes = 0;
 	dev->n_erasures = 0;
 	dev->n_gc_copies = 0;
+	dev->n_obj_writes = 0;
+	dev->n_cold_writes = 0;
 	dev->n_retired_writes = 0;
 
 	dev->n_retired_blocks = 0;
@@ -5086,6 +5492,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 
 			kfree(dev->cache);
 			dev->cache = NULL;
+			kfree(dev->cache_hash);
+			dev->cache_hash = NULL;
 		}
 
 		kfree(dev->gc_cleanup_list);
@@ -5132,21 +5540,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the dirty chunks in the cache */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -83,7 +83,7 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -93,6 +93,9 @@
  */
 #define YAFFS_WR_ATTEMPTS		(5*64)
 
+/* Most chunks written with one request to the driver */
+#define YAFFS_MAX_WR_BATCH		8
+
 /* Sequence numbers are used in YAFFS2 to determine block allocation order.
  * The range is limited slightly to help distinguish bad numbers from good.
  * This also allows us to perhaps in the future use special numbers for
@@ -106,11 +109,16 @@
 /* Special sequence number for bad block that failed to be marked bad */
 #define YAFFS_SEQUENCE_BAD_BLOCK	0xFFFF0000
 
+/* Garbage collection victim selection policies */
+#define YAFFS_GC_POLICY_GREEDY		0	/* Fewest pages in use */
+#define YAFFS_GC_POLICY_COST_BENEFIT	1	/* Best age * free / cost */
+
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* In dev->cache_hash[] if object set */
+	struct list_head lru;	/* On dev->cache_lru, most recently used first */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -400,6 +408,7 @@ struct yaffs_obj {
 	u8 has_xattr:1;		/* This object has xattribs. Valid if xattr_known. */
 
 	u8 serial;		/* serial number of chunk in NAND. Cached here */
+	u8 write_heat;		/* Overwrite count, picks hot or cold block */
 	u16 sum;		/* sum of the name to speed searching */
 
 	struct yaffs_dev *my_dev;	/* The device I'm on */
@@ -418,6 +427,8 @@ struct yaffs_obj {
 
 	int n_data_chunks;	/* Number of data chunks attached to the file. */
 
+	unsigned alloc_seq;	/* seq_number of newest block written to */
+
 	u32 obj_id;		/* the object id value */
 
 	u32 yst_mode;
@@ -451,6 +462,7 @@ struct yaffs_obj {
 struct yaffs_obj_bucket {
 	struct list_head list;
 	int count;
+	unsigned freed_seq;	/* Newest alloc_seq freed from here */
 };
 
 /* yaffs_checkpt_obj holds the definition of an object as dumped
@@ -506,8 +518,10 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches, at most
+				 * YAFFS_MAX_SHORT_OP_CACHES. 10 to 20 is a
+				 * good bet, more helps with many files
+				 * written in small pieces.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -518,6 +532,9 @@ struct yaffs_param {
 
 	int refresh_period;	/* How often we should check to do a block refresh */
 
+	int gc_policy;		/* Victim selection, YAFFS_GC_POLICY_xxx */
+	int hot_cold;		/* Separate hot and cold data (yaffs2) */
+
 	/* Checkpoint control. Can be set before or after initialisation */
 	u8 skip_checkpt_rd;
 	u8 skip_checkpt_wr;
@@ -547,6 +564,24 @@ struct yaffs_param {
 	int (*query_block_fn) (struct yaffs_dev * dev, int block_no,
 			       enum yaffs_block_state * state,
 			       u32 * seq_number);
+	/* Optional, reads the tags of all chunks in a block in one go.
+	 * Must not touch the device state: it is called from a worker
+	 * thread while scanning.
+	 */
+	int (*read_block_tags_fn) (struct yaffs_dev * dev, int block_no,
+				   struct yaffs_ext_tags * tags);
+	/* Optional, reads the data of n_chunks consecutive chunks in one
+	 * request. Must not touch the device state or shared buffers, as
+	 * it is called without the device lock held.
+	 */
+	int (*read_chunks_fn) (struct yaffs_dev * dev, int nand_chunk,
+			       int n_chunks, u8 * data);
+	/* Optional, writes up to YAFFS_MAX_WR_BATCH consecutive chunks of
+	 * a block, data and tags, in one request.
+	 */
+	int (*write_chunks_tags_fn) (struct yaffs_dev * dev, int nand_chunk,
+				     int n_chunks, const u8 * data,
+				     const struct yaffs_ext_tags * tags);
 #endif
 
 	/* The remove_obj_fn function must be supplied by OS flavours that
@@ -645,6 +680,9 @@ struct yaffs_dev {
 	int alloc_block;	/* Current block being allocated off */
 	u32 alloc_page;
 	int alloc_block_finder;	/* Used to search for next allocation block */
+	int cold_alloc_block;	/* Block for cold data if hot_cold is set */
+	u32 cold_alloc_page;
+	unsigned alloc_seq_floor;	/* seq_number at mount */
 
 	/* Object and Tnode memory management */
 	void *allocator;
@@ -667,6 +705,7 @@ struct yaffs_dev {
 	unsigned gc_block_finder;
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
+	unsigned gc_score;
 	unsigned gc_not_done;
 	unsigned gc_block;
 	unsigned gc_chunk;
@@ -685,7 +724,10 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;
+	u32 cache_hash_mask;
+	struct list_head cache_lru;
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -719,6 +761,8 @@ struct yaffs_dev {
 	u32 n_erasures;
 	u32 n_erase_failures;
 	u32 n_gc_copies;
+	u32 n_obj_writes;	/* Chunks written other than by gc */
+	u32 n_cold_writes;
 	u32 all_gcs;
 	u32 passive_gc_count;
 	u32 oldest_dirty_gc_count;
@@ -734,6 +778,7 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
 
 };
 
@@ -801,6 +846,8 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_rd_map(struct yaffs_obj *obj, loff_t offset, int n_chunks,
+		      int *nand_chunks);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
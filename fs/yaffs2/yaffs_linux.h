@@ -25,9 +25,24 @@ struct yaffs_linux_context {
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
 	struct mutex gross_lock;	/* Gross locking mutex*/
+	atomic_t *block_readers;	/* Per block count of readers that
+					 * dropped gross_lock to read chunks,
+					 * see yaffs_readpage_pinned().
+					 */
+	wait_queue_head_t block_readers_wait;
+	int defer_flush;	/* Leave cached writes alone on close(),
+				 * see yaffs_file_flush().
+				 */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
+	u8 *batch_oob;		/* OOB of YAFFS_MAX_WR_BATCH pages, see
+				 * nandmtd2_write_chunks_tags().
+				 */
+	u8 *ra_buf;		/* YAFFS_RA_PAGES pages for batched reads,
+				 * see yaffs_readpages_pinned().
+				 */
+	struct mutex ra_lock;	/* Serializes users of ra_buf */
 	struct list_head search_contexts;
 	void (*put_super_fn) (struct super_block * sb);
 
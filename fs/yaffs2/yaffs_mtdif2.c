@@ -84,6 +84,58 @@ int nandmtd2_write_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		return YAFFS_FAIL;
 }
 
+/*
+ * Writes consecutive chunks of a block with one multi-page request, which
+ * lets the NAND driver overlap the programming of a page with the transfer
+ * of the next one. Tags go in the OOB area of each page, at an oobavail
+ * stride; inband tags are not supported.
+ * Called with the device locked, so the OOB buffer can be shared.
+ */
+int nandmtd2_write_chunks_tags(struct yaffs_dev *dev, int nand_chunk,
+			       int n_chunks, const u8 * data,
+			       const struct yaffs_ext_tags *tags)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	u8 *oob = yaffs_dev_to_lc(dev)->batch_oob;
+	struct mtd_oob_ops ops;
+	loff_t addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
+	struct yaffs_packed_tags2 pt;
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+	int retval;
+	int i;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_write_chunks_tags chunk %d n %d data %p",
+		nand_chunk, n_chunks, data);
+
+	if (dev->param.inband_tags || !oob ||
+	    n_chunks > YAFFS_MAX_WR_BATCH)
+		BUG();
+
+	memset(oob, 0xff, n_chunks * mtd->oobavail);
+	for (i = 0; i < n_chunks; i++) {
+		yaffs_pack_tags2(&pt, &tags[i], !dev->param.no_tags_ecc);
+		memcpy(&oob[i * mtd->oobavail], packed_tags_ptr,
+		       packed_tags_size);
+	}
+
+	memset(&ops, 0, sizeof(ops));
+	ops.mode = MTD_OOB_AUTO;
+	ops.len = n_chunks * dev->param.total_bytes_per_chunk;
+	ops.datbuf = (u8 *) data;
+	ops.ooblen = n_chunks * mtd->oobavail;
+	ops.oobbuf = oob;
+	retval = mtd->write_oob(mtd, addr, &ops);
+
+	if (retval == 0)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
 int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * data, struct yaffs_ext_tags *tags)
 {
@@ -165,6 +217,91 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		return YAFFS_FAIL;
 }
 
+/*
+ * Reads the tags of all the chunks in a block with one multi-page OOB read
+ * instead of a read per chunk. Only for tags in the OOB area: inband tags
+ * need the data read too.
+ */
+int nandmtd2_read_block_tags(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	struct mtd_oob_ops ops;
+	int n_chunks = dev->param.chunks_per_block;
+	loff_t addr = ((loff_t) block_no) * n_chunks *
+	    dev->param.total_bytes_per_chunk;
+	struct yaffs_packed_tags2 pt;
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+	u8 *oob;
+	int retval;
+	int i;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_read_block_tags block %d", block_no);
+
+	if (dev->param.inband_tags || packed_tags_size > mtd->oobavail)
+		return YAFFS_FAIL;
+
+	oob = kmalloc(n_chunks * mtd->oobavail, GFP_NOFS);
+	if (!oob)
+		return YAFFS_FAIL;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = n_chunks * mtd->oobavail;
+	ops.oobbuf = oob;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen) {
+		for (i = 0; i < n_chunks; i++) {
+			memcpy(packed_tags_ptr, &oob[i * mtd->oobavail],
+			       packed_tags_size);
+			yaffs_unpack_tags2(&tags[i], &pt,
+					   !dev->param.no_tags_ecc);
+		}
+	}
+
+	kfree(oob);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
+/*
+ * Reads the data of consecutive chunks with one request, and no tags.
+ * Like nandmtd2_read_chunk_tags() with no tags this uses no shared
+ * buffers; corrected ECC errors are reported as failures too, so that
+ * the caller reads the chunks again the normal way and handles them.
+ */
+int nandmtd2_read_chunks(struct yaffs_dev *dev, int nand_chunk,
+			 int n_chunks, u8 * data)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	loff_t addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
+	size_t len = n_chunks * dev->param.total_bytes_per_chunk;
+	size_t retlen = 0;
+	int retval;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_read_chunks chunk %d n %d data %p",
+		nand_chunk, n_chunks, data);
+
+	if (dev->param.inband_tags)
+		return YAFFS_FAIL;
+
+	retval = mtd->read(mtd, addr, len, &retlen, data);
+
+	if (retval == 0 && retlen == len)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
 int nandmtd2_mark_block_bad(struct yaffs_dev *dev, int block_no)
 {
 	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
@@ -20,8 +20,15 @@
 int nandmtd2_write_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			      const u8 * data,
 			      const struct yaffs_ext_tags *tags);
+int nandmtd2_write_chunks_tags(struct yaffs_dev *dev, int nand_chunk,
+			       int n_chunks, const u8 * data,
+			       const struct yaffs_ext_tags *tags);
 int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * data, struct yaffs_ext_tags *tags);
+int nandmtd2_read_block_tags(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags);
+int nandmtd2_read_chunks(struct yaffs_dev *dev, int nand_chunk,
+			 int n_chunks, u8 * data);
 int nandmtd2_mark_block_bad(struct yaffs_dev *dev, int block_no);
 int nandmtd2_query_block(struct yaffs_dev *dev, int block_no,
 			 enum yaffs_block_state *state, u32 * seq_number);
@@ -50,17 +50,70 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/*
+ * Reads the tags of every chunk in a block with a single request, if the
+ * driver can. Like the driver call, this does not touch the device state:
+ * accounting and handling ECC results are left to the caller.
+ */
+int yaffs_rd_block_tags_nand(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags)
+{
+	if (!dev->param.read_block_tags_fn)
+		return YAFFS_FAIL;
+
+	return dev->param.read_block_tags_fn(dev, block_no - dev->block_offset,
+					     tags);
+}
+
+/*
+ * Reads just the data of a chunk, for callers that do not hold the device
+ * lock. Nothing in dev is touched and ECC errors are not handled: on
+ * failure the caller should read again the normal way.
+ * The driver must support reading with no tags without using any shared
+ * buffers, which nandmtd2_read_chunk_tags() does unless inband tags are used.
+ */
+int yaffs_rd_chunk_data_nand(struct yaffs_dev *dev, int nand_chunk,
+			     u8 * buffer)
+{
+	if (!dev->param.read_chunk_tags_fn)
+		return YAFFS_FAIL;
+
+	return dev->param.read_chunk_tags_fn(dev, nand_chunk - dev->chunk_offset,
+					     buffer, NULL);
+}
+
+/*
+ * Reads the data of n_chunks consecutive chunks with one request, under
+ * the same rules as yaffs_rd_chunk_data_nand().
+ */
+int yaffs_rd_chunks_data_nand(struct yaffs_dev *dev, int nand_chunk,
+			      int n_chunks, u8 * buffer)
+{
+	if (n_chunks == 1)
+		return yaffs_rd_chunk_data_nand(dev, nand_chunk, buffer);
+
+	if (!dev->param.read_chunks_fn)
+		return YAFFS_FAIL;
+
+	return dev->param.read_chunks_fn(dev, nand_chunk - dev->chunk_offset,
+					 n_chunks, buffer);
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 * buffer, struct yaffs_ext_tags *tags)
 {
 
+	struct yaffs_block_info *bi =
+	    yaffs_get_block_info(dev, nand_chunk / dev->param.chunks_per_block);
+
 	dev->n_page_writes++;
 
 	nand_chunk -= dev->chunk_offset;
 
 	if (tags) {
-		tags->seq_number = dev->seq_number;
+		/* Not dev->seq_number: with hot_cold two blocks are open */
+		tags->seq_number = bi->seq_number;
 		tags->chunk_used = 1;
 		if (!yaffs_validate_tags(tags)) {
 			yaffs_trace(YAFFS_TRACE_ERROR, "Writing uninitialised tags");
@@ -81,6 +134,45 @@ int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 		return yaffs_tags_compat_wr(dev, nand_chunk, buffer, tags);
 }
 
+/*
+ * Writes n_chunks consecutive chunks of one block with one request. The
+ * data of the chunks follow each other in buffer.
+ */
+int yaffs_wr_chunks_tags_nand(struct yaffs_dev *dev, int nand_chunk,
+			      int n_chunks, const u8 * buffer,
+			      struct yaffs_ext_tags *tags)
+{
+	struct yaffs_block_info *bi =
+	    yaffs_get_block_info(dev, nand_chunk / dev->param.chunks_per_block);
+	int i;
+
+	if (!dev->param.write_chunks_tags_fn ||
+	    n_chunks > YAFFS_MAX_WR_BATCH)
+		return YAFFS_FAIL;
+
+	dev->n_page_writes += n_chunks;
+
+	nand_chunk -= dev->chunk_offset;
+
+	for (i = 0; i < n_chunks; i++) {
+		tags[i].seq_number = bi->seq_number;
+		tags[i].chunk_used = 1;
+		if (!yaffs_validate_tags(&tags[i])) {
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"Writing uninitialised tags");
+			YBUG();
+		}
+	}
+
+	yaffs_trace(YAFFS_TRACE_WRITE,
+		"Writing chunks %d..%d tags %d %d",
+		nand_chunk, nand_chunk + n_chunks - 1,
+		tags[0].obj_id, tags[0].chunk_id);
+
+	return dev->param.write_chunks_tags_fn(dev, nand_chunk, n_chunks,
+					       buffer, tags);
+}
+
 int yaffs_mark_bad(struct yaffs_dev *dev, int block_no)
 {
 	block_no -= dev->block_offset;
@@ -20,10 +20,23 @@
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * buffer, struct yaffs_ext_tags *tags);
 
+int yaffs_rd_block_tags_nand(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags);
+
+int yaffs_rd_chunk_data_nand(struct yaffs_dev *dev, int nand_chunk,
+			     u8 * buffer);
+
+int yaffs_rd_chunks_data_nand(struct yaffs_dev *dev, int nand_chunk,
+			      int n_chunks, u8 * buffer);
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 * buffer, struct yaffs_ext_tags *tags);
 
+int yaffs_wr_chunks_tags_nand(struct yaffs_dev *dev, int nand_chunk,
+			      int n_chunks, const u8 * buffer,
+			      struct yaffs_ext_tags *tags);
+
 int yaffs_mark_bad(struct yaffs_dev *dev, int block_no);
 
 int yaffs_query_init_block_state(struct yaffs_dev *dev,
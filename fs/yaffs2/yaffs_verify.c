@@ -135,7 +135,8 @@ void yaffs_verify_blocks(struct yaffs_dev *dev)
 	yaffs_trace(YAFFS_TRACE_VERIFY,
 		"%d blocks have illegal states",
 		illegal_states);
-	if (state_count[YAFFS_BLOCK_STATE_ALLOCATING] > 1)
+	if (state_count[YAFFS_BLOCK_STATE_ALLOCATING] >
+	    (dev->param.hot_cold ? 2 : 1))
 		yaffs_trace(YAFFS_TRACE_VERIFY,
 			"Too many allocating blocks");
 
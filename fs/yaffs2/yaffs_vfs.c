@@ -53,6 +53,7 @@
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/freezer.h>
+#include <linux/vmalloc.h>
 
 #include <asm/div64.h>
 
@@ -90,6 +91,7 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yaffs_mtdif.h"
 #include "yaffs_mtdif1.h"
 #include "yaffs_mtdif2.h"
+#include "yaffs_nand.h"
 
 unsigned int yaffs_trace_mask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
@@ -120,6 +122,12 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 	return yaffs_gc_control;
 }
 
+/*
+ * gross_lock is the one lock of a device: every yaffs_guts.c call, object
+ * and tnode tree, the block states, the allocator, the short op cache and
+ * gc are serialized on it. The only work done without it is reading file
+ * data from NAND in readpage and readpages, see yaffs_readpage_pinned().
+ */
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
@@ -922,7 +930,13 @@ static int yaffs_file_flush(struct file *file, fl_owner_t id)
 
 	yaffs_gross_lock(dev);
 
-	yaffs_flush_file(obj, 1, 0);
+	/*
+	 * With defer-flush, dirty chunks stay in the short op cache to be
+	 * combined with later writes. They are written by fsync(), sync_fs()
+	 * and inode eviction, or when the cache needs the space.
+	 */
+	if (!yaffs_dev_to_lc(dev)->defer_flush)
+		yaffs_flush_file(obj, 1, 0);
 
 	yaffs_gross_unlock(dev);
 
@@ -1109,6 +1123,9 @@ static void yaffs_evict_inode(struct inode *inode)
 	if (obj) {
 		dev = obj->my_dev;
 		yaffs_gross_lock(dev);
+		/* close() may have left the file dirty */
+		if (!deleteme)
+			yaffs_flush_file(obj, 0, 0);
 		yaffs_unstitch_obj(inode, obj);
 		yaffs_gross_unlock(dev);
 	}
@@ -1124,6 +1141,108 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 		sb->s_dirt = 1;
 }
 
+/* Most chunks a page can be read in without the gross lock */
+#define YAFFS_PINNED_RD_CHUNKS	8
+
+static int yaffs_chunk_to_block(struct yaffs_dev *dev, int nand_chunk)
+{
+	return (nand_chunk - dev->chunk_offset) / dev->param.chunks_per_block;
+}
+
+static void yaffs_unpin_blocks(struct yaffs_dev *dev, int *nand_chunks,
+			       int n_chunks)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	int i;
+
+	for (i = 0; i < n_chunks; i++) {
+		if (nand_chunks[i] < 0)
+			continue;
+		if (atomic_dec_and_test(&lc->block_readers
+				[yaffs_chunk_to_block(dev, nand_chunks[i])]))
+			wake_up(&lc->block_readers_wait);
+	}
+}
+
+/*
+ * Looks up the NAND chunks holding n_chunks chunks of obj from offset on
+ * and pins their blocks. Returns 0 if the chunks cannot be read pinned.
+ */
+static int yaffs_pin_blocks(struct yaffs_obj *obj, loff_t offset,
+			    int *nand_chunks, int n_chunks)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	int ok;
+	int i;
+
+	yaffs_gross_lock(dev);
+	ok = yaffs_file_rd_map(obj, offset, n_chunks, nand_chunks);
+	if (ok) {
+		for (i = 0; i < n_chunks; i++) {
+			if (nand_chunks[i] < 0)
+				continue;
+			atomic_inc(&yaffs_dev_to_lc(dev)->block_readers
+				[yaffs_chunk_to_block(dev, nand_chunks[i])]);
+			dev->n_page_reads++;
+		}
+	}
+	yaffs_gross_unlock(dev);
+
+	return ok;
+}
+
+/*
+ * yaffs_readpage_pinned() reads a page without holding the gross lock
+ * across the NAND reads, so that readers do not wait for each other, for
+ * writers or for gc while the flash is busy.
+ * The chunks are looked up under the gross lock and their blocks pinned:
+ * data on NAND does not change until its block is erased, and erasing a
+ * pinned block waits for the readers, see yaffs_erase_block_pinned().
+ * Returns -EAGAIN when the page has to be read with the gross lock held,
+ * which handles cached data, ECC errors and so on.
+ */
+static int yaffs_readpage_pinned(struct yaffs_obj *obj, struct page *pg,
+				 u8 *pg_buf)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	int chunk_size = dev->data_bytes_per_chunk;
+	int n_chunks = PAGE_CACHE_SIZE / chunk_size;
+	int nand_chunks[YAFFS_PINNED_RD_CHUNKS];
+	int ok;
+	int i;
+
+	if (!yaffs_dev_to_lc(dev)->block_readers ||
+	    n_chunks > YAFFS_PINNED_RD_CHUNKS ||
+	    n_chunks * chunk_size != PAGE_CACHE_SIZE)
+		return -EAGAIN;
+
+	ok = yaffs_pin_blocks(obj, (loff_t)pg->index << PAGE_CACHE_SHIFT,
+			      nand_chunks, n_chunks);
+	if (!ok)
+		return -EAGAIN;
+
+	for (i = 0; ok && i < n_chunks; i++) {
+		if (nand_chunks[i] < 0)
+			memset(pg_buf + i * chunk_size, 0, chunk_size);
+		else
+			ok = yaffs_rd_chunk_data_nand(dev, nand_chunks[i],
+					pg_buf + i * chunk_size) == YAFFS_OK;
+	}
+
+	yaffs_unpin_blocks(dev, nand_chunks, n_chunks);
+
+	return ok ? 0 : -EAGAIN;
+}
+
+static int yaffs_erase_block_pinned(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	wait_event(lc->block_readers_wait,
+		   !atomic_read(&lc->block_readers[block_no]));
+	return nandmtd_erase_block(dev, block_no);
+}
+
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 {
 	/* Lifted from jffs2 */
@@ -1148,12 +1267,17 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	ret = yaffs_readpage_pinned(obj, pg, pg_buf);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+	if (ret == -EAGAIN) {
+		yaffs_gross_lock(dev);
 
-	yaffs_gross_unlock(dev);
+		ret = yaffs_file_rd(obj, pg_buf,
+				    pg->index << PAGE_CACHE_SHIFT,
+				    PAGE_CACHE_SIZE);
+
+		yaffs_gross_unlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -1190,6 +1314,137 @@ static int yaffs_readpage(struct file *f, struct page *pg)
 	return ret;
 }
 
+/* Most pages of a read-ahead window read as one batch */
+#define YAFFS_RA_PAGES	8
+
+/*
+ * Reads n_pages consecutive pages like yaffs_readpage_pinned(), but reads
+ * each run of consecutive NAND chunks with one request, through the
+ * device's ra_buf. The buffer is allocated once at mount, as it takes a
+ * high order allocation, and its users take turns: the chip serves one
+ * request at a time anyway. On success the pages are up to date and
+ * unlocked; on failure they are left alone and -EAGAIN is returned.
+ */
+static int yaffs_readpages_pinned(struct yaffs_obj *obj, struct page **pgs,
+				  int n_pages)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u8 *ra_buf = lc->ra_buf;
+	int chunk_size = dev->data_bytes_per_chunk;
+	int chunks_per_page = PAGE_CACHE_SIZE / chunk_size;
+	int n_chunks = n_pages * chunks_per_page;
+	int nand_chunks[YAFFS_RA_PAGES * YAFFS_PINNED_RD_CHUNKS];
+	int ok;
+	int run;
+	int i;
+
+	if (!ra_buf || !lc->block_readers ||
+	    chunks_per_page > YAFFS_PINNED_RD_CHUNKS ||
+	    chunks_per_page * chunk_size != PAGE_CACHE_SIZE)
+		return -EAGAIN;
+
+	mutex_lock(&lc->ra_lock);
+
+	ok = yaffs_pin_blocks(obj, (loff_t)pgs[0]->index << PAGE_CACHE_SHIFT,
+			      nand_chunks, n_chunks);
+	if (!ok) {
+		mutex_unlock(&lc->ra_lock);
+		return -EAGAIN;
+	}
+
+	for (i = 0; ok && i < n_chunks; i += run) {
+		u8 *buf = ra_buf + i * chunk_size;
+
+		run = 1;
+		if (nand_chunks[i] < 0) {
+			memset(buf, 0, chunk_size);
+			continue;
+		}
+		while (i + run < n_chunks &&
+		       nand_chunks[i + run] == nand_chunks[i] + run)
+			run++;
+		ok = yaffs_rd_chunks_data_nand(dev, nand_chunks[i], run,
+					       buf) == YAFFS_OK;
+	}
+
+	yaffs_unpin_blocks(dev, nand_chunks, n_chunks);
+
+	if (!ok) {
+		mutex_unlock(&lc->ra_lock);
+		return -EAGAIN;
+	}
+
+	for (i = 0; i < n_pages; i++) {
+		u8 *pg_buf = kmap(pgs[i]);
+
+		memcpy(pg_buf, ra_buf + i * PAGE_CACHE_SIZE, PAGE_CACHE_SIZE);
+		flush_dcache_page(pgs[i]);
+		kunmap(pgs[i]);
+	}
+
+	mutex_unlock(&lc->ra_lock);
+
+	for (i = 0; i < n_pages; i++) {
+		SetPageUptodate(pgs[i]);
+		ClearPageError(pgs[i]);
+		UnlockPage(pgs[i]);
+	}
+
+	return 0;
+}
+
+static void yaffs_readpages_batch(struct file *f, struct page **pgs,
+				  int n_pages)
+{
+	struct yaffs_obj *obj = yaffs_dentry_to_obj(f->f_dentry);
+	int i;
+
+	if (n_pages > 1 && !yaffs_readpages_pinned(obj, pgs, n_pages))
+		return;
+
+	for (i = 0; i < n_pages; i++)
+		yaffs_readpage_unlock(f, pgs[i]);
+}
+
+/*
+ * Read-ahead: the pages are added to the page cache as read_cache_pages()
+ * does, and runs of consecutive pages read in batches, so that the chunks
+ * of a file written sequentially come in with multi-page NAND reads.
+ */
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages)
+{
+	struct page *pgs[YAFFS_RA_PAGES];
+	int n_pages = 0;
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages %u", nr_pages);
+
+	while (!list_empty(pages)) {
+		struct page *pg = list_entry(pages->prev, struct page, lru);
+
+		list_del(&pg->lru);
+		if (add_to_page_cache_lru(pg, mapping, pg->index, GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+		page_cache_release(pg);
+
+		if (n_pages == YAFFS_RA_PAGES ||
+		    (n_pages && pg->index != pgs[n_pages - 1]->index + 1)) {
+			yaffs_readpages_batch(f, pgs, n_pages);
+			n_pages = 0;
+		}
+		pgs[n_pages++] = pg;
+	}
+
+	if (n_pages)
+		yaffs_readpages_batch(f, pgs, n_pages);
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages done");
+	return 0;
+}
+
 /* writepage inspired by/stolen from smbfs */
 
 static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
@@ -1763,6 +2018,10 @@ struct yaffs_options {
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int gc_cost_benefit;
+	int hot_cold;
+	int cache_size;
+	int defer_flush;
 };
 
 #define MAX_OPT_LEN 30
@@ -1810,6 +2069,26 @@ static int yaffs_parse_options(struct yaffs_options *options,
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-on")) {
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden = 1;
+		} else if (!strcmp(cur_opt, "gc-greedy")) {
+			options->gc_cost_benefit = 0;
+		} else if (!strcmp(cur_opt, "gc-cost-benefit")) {
+			options->gc_cost_benefit = 1;
+		} else if (!strcmp(cur_opt, "hot-cold-off")) {
+			options->hot_cold = 0;
+		} else if (!strcmp(cur_opt, "hot-cold-on")) {
+			options->hot_cold = 1;
+		} else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->cache_size =
+			    simple_strtoul(cur_opt + 11, NULL, 0);
+			if (options->cache_size < 1 ||
+			    options->cache_size > YAFFS_MAX_SHORT_OP_CACHES) {
+				printk(KERN_INFO
+				       "yaffs: cache-size must be 1 to %d\n",
+				       YAFFS_MAX_SHORT_OP_CACHES);
+				error = 1;
+			}
+		} else if (!strcmp(cur_opt, "defer-flush")) {
+			options->defer_flush = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
@@ -1831,6 +2110,7 @@ static int yaffs_parse_options(struct yaffs_options *options,
 
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
+	.readpages = yaffs_readpages,
 	.writepage = yaffs_writepage,
 	.write_begin = yaffs_write_begin,
 	.write_end = yaffs_write_end,
@@ -1984,6 +2264,10 @@ static void yaffs_put_super(struct super_block *sb)
 		yaffs_dev_to_lc(dev)->spare_buffer = NULL;
 	}
 
+	kfree(yaffs_dev_to_lc(dev)->batch_oob);
+	kfree(yaffs_dev_to_lc(dev)->ra_buf);
+	vfree(yaffs_dev_to_lc(dev)->block_readers);
+
 	kfree(dev);
 }
 
@@ -2214,8 +2498,12 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	param->n_caches = (options.no_cache) ? 0 :
+	    (options.cache_size) ? options.cache_size : 10;
 	param->inband_tags = options.inband_tags;
+	param->gc_policy = options.gc_cost_benefit ?
+	    YAFFS_GC_POLICY_COST_BENEFIT : YAFFS_GC_POLICY_GREEDY;
+	param->hot_cold = (yaffs_version == 2) ? options.hot_cold : 0;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
 	param->disable_lazy_load = 1;
@@ -2259,10 +2547,19 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	if (yaffs_version == 2) {
 		param->write_chunk_tags_fn = nandmtd2_write_chunk_tags;
 		param->read_chunk_tags_fn = nandmtd2_read_chunk_tags;
+		param->read_block_tags_fn = nandmtd2_read_block_tags;
 		param->bad_block_fn = nandmtd2_mark_block_bad;
 		param->query_block_fn = nandmtd2_query_block;
 		yaffs_dev_to_lc(dev)->spare_buffer = 
 		                kmalloc(mtd->oobsize, GFP_NOFS);
+		if (!param->inband_tags) {
+			param->read_chunks_fn = nandmtd2_read_chunks;
+			context->batch_oob = kmalloc(YAFFS_MAX_WR_BATCH *
+						     mtd->oobavail, GFP_NOFS);
+		}
+		if (context->batch_oob)
+			param->write_chunks_tags_fn =
+			    nandmtd2_write_chunks_tags;
 		param->is_yaffs2 = 1;
 		param->total_bytes_per_chunk = mtd->writesize;
 		param->chunks_per_block = mtd->erasesize / mtd->writesize;
@@ -2282,6 +2579,23 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->erase_fn = nandmtd_erase_block;
 	param->initialise_flash_fn = nandmtd_initialise;
 
+	/* Pages can be read without the gross lock if the driver can read
+	 * data without tags and without the shared spare buffer.
+	 */
+	init_waitqueue_head(&context->block_readers_wait);
+	if (param->is_yaffs2 && !param->inband_tags)
+		context->block_readers = vzalloc(n_blocks * sizeof(atomic_t));
+	if (context->block_readers)
+		param->erase_fn = yaffs_erase_block_pinned;
+
+	/* Read-ahead batches need a buffer for YAFFS_RA_PAGES pages */
+	mutex_init(&context->ra_lock);
+	if (context->block_readers && param->read_chunks_fn)
+		context->ra_buf = kmalloc(YAFFS_RA_PAGES * PAGE_CACHE_SIZE,
+					  GFP_KERNEL);
+
+	context->defer_flush = options.defer_flush;
+
 	yaffs_dev_to_lc(dev)->put_super_fn = yaffs_mtd_put_super;
 
 	param->sb_dirty_fn = yaffs_touch_super;
@@ -2440,12 +2754,18 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 			param->n_reserved_blocks);
 	buf += sprintf(buf, "always_check_erased... %d\n",
 			param->always_check_erased);
+	buf += sprintf(buf, "gc_policy............. %s\n",
+			param->gc_policy == YAFFS_GC_POLICY_COST_BENEFIT ?
+			"cost-benefit" : "greedy");
+	buf += sprintf(buf, "hot_cold.............. %d\n", param->hot_cold);
 
 	return buf;
 }
 
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	unsigned wa = 0;
+
 	buf +=
 	    sprintf(buf, "data_bytes_per_chunk.. %d\n",
 		    dev->data_bytes_per_chunk);
@@ -2464,6 +2784,17 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_page_reads.......... %u\n", dev->n_page_reads);
 	buf += sprintf(buf, "n_erasures............ %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies........... %u\n", dev->n_gc_copies);
+	buf += sprintf(buf, "n_obj_writes.......... %u\n", dev->n_obj_writes);
+	buf += sprintf(buf, "n_cold_writes......... %u\n", dev->n_cold_writes);
+	/* NAND pages programmed per chunk written for files, in 1/100ths */
+	if (dev->n_obj_writes) {
+		u64 wa100 = (u64)dev->n_page_writes * 100;
+
+		do_div(wa100, dev->n_obj_writes);
+		wa = wa100;
+	}
+	buf += sprintf(buf, "write_amplification... %u.%02u\n",
+		       wa / 100, wa % 100);
 	buf += sprintf(buf, "all_gcs............... %u\n", dev->all_gcs);
 	buf +=
 	    sprintf(buf, "passive_gc_count...... %u\n", dev->passive_gc_count);
@@ -2484,6 +2815,8 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses.......... %u\n", dev->cache_misses);
+	buf += sprintf(buf, "n_dirty_caches........ %d\n", dev->n_dirty_caches);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
@@ -346,6 +346,7 @@ static int yaffs2_rd_checkpt_dev(struct yaffs_dev *dev)
 	u32 n_bytes;
 	u32 n_blocks =
 	    (dev->internal_end_block - dev->internal_start_block + 1);
+	int i;
 
 	int ok;
 
@@ -364,6 +365,16 @@ static int yaffs2_rd_checkpt_dev(struct yaffs_dev *dev)
 
 	if (!ok)
 		return 0;
+
+	/* Only alloc_block is recorded, so close a cold allocation block */
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++) {
+		struct yaffs_block_info *bi = yaffs_get_block_info(dev, i);
+
+		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING &&
+		    i != dev->alloc_block)
+			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+	}
+
 	n_bytes = n_blocks * dev->chunk_bit_stride;
 
 	ok = (yaffs2_checkpt_rd(dev, dev->chunk_bits, n_bytes) == n_bytes);
@@ -954,6 +965,43 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * While a block is scanned, the tags of the next block to scan are read
+ * ahead by an async worker, with a single multi-page read. The worker only
+ * calls the driver; accounting and ECC handling are done when the block's
+ * tags are used, in the scanning thread.
+ */
+struct yaffs2_scan_ahead {
+	struct yaffs_dev *dev;
+	int blk;
+	int result;
+	struct yaffs_ext_tags *tags;
+};
+
+static void yaffs2_scan_ahead_fn(void *data, async_cookie_t cookie)
+{
+	struct yaffs2_scan_ahead *sa = data;
+
+	sa->result = yaffs_rd_block_tags_nand(sa->dev, sa->blk, sa->tags);
+}
+
+static void yaffs2_scan_chunk_tags(struct yaffs_dev *dev,
+				   struct yaffs2_scan_ahead *sa, int blk,
+				   int c, struct yaffs_ext_tags *tags)
+{
+	if (!sa || sa->result != YAFFS_OK) {
+		yaffs_rd_chunk_tags_nand(dev,
+					 blk * dev->param.chunks_per_block + c,
+					 NULL, tags);
+		return;
+	}
+
+	*tags = sa->tags[c];
+	dev->n_page_reads++;
+	if (tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+		yaffs_handle_chunk_error(dev, yaffs_get_block_info(dev, blk));
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -987,6 +1035,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
 
+	LIST_HEAD(scan_domain);
+	struct yaffs2_scan_ahead ahead[2];
+	struct yaffs2_scan_ahead *sa = NULL;
+	struct yaffs_ext_tags *ahead_tags = NULL;
+	async_cookie_t cookie = 0;
+
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
 		dev->internal_start_block, dev->internal_end_block);
@@ -1086,6 +1140,18 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	if (dev->param.read_block_tags_fn && n_to_scan > 0)
+		ahead_tags = kmalloc(2 * dev->param.chunks_per_block *
+				     sizeof(struct yaffs_ext_tags), GFP_NOFS);
+	if (ahead_tags) {
+		ahead[0].dev = ahead[1].dev = dev;
+		ahead[0].tags = ahead_tags;
+		ahead[1].tags = ahead_tags + dev->param.chunks_per_block;
+		ahead[0].blk = block_index[end_iter].block;
+		cookie = async_schedule_domain(yaffs2_scan_ahead_fn, &ahead[0],
+					       &scan_domain);
+	}
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter; !alloc_failed && block_iter >= start_iter;
 	     block_iter--) {
@@ -1098,6 +1164,21 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		bi = yaffs_get_block_info(dev, blk);
 
+		/* wait for this block's tags, and start on the next block's */
+		if (ahead_tags) {
+			sa = &ahead[(end_iter - block_iter) & 1];
+			async_synchronize_cookie_domain(cookie + 1,
+							&scan_domain);
+			if (block_iter > start_iter) {
+				ahead[(end_iter - block_iter + 1) & 1].blk =
+				    block_index[block_iter - 1].block;
+				cookie = async_schedule_domain(
+					yaffs2_scan_ahead_fn,
+					&ahead[(end_iter - block_iter + 1) & 1],
+					&scan_domain);
+			}
+		}
+
 		state = bi->block_state;
 
 		deleted = 0;
@@ -1114,8 +1195,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			yaffs2_scan_chunk_tags(dev, sa, blk, c, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1573,6 +1653,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	}
 
+	/* the loop may have stopped early with a read ahead outstanding */
+	if (ahead_tags) {
+		async_synchronize_full_domain(&scan_domain);
+		kfree(ahead_tags);
+	}
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
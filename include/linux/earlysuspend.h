@@ -18,6 +18,7 @@
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/list.h>
+#include <linux/ktime.h>
 #endif
 
 /* The early_suspend structure defines suspend and resume hooks to be called
@@ -29,6 +30,10 @@
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
+ * Handlers that set async may be called concurrently with the other handlers
+ * of the same level, and only with those: all handlers of a level have
+ * returned before any handler of the next level is called.
+ * The time each handler took is reported in debugfs, in early_suspend.
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
@@ -41,6 +46,11 @@ struct early_suspend {
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	bool async;
+	ktime_t suspend_time;
+	ktime_t max_suspend_time;
+	ktime_t resume_time;
+	ktime_t max_resume_time;
 #endif
 };
 
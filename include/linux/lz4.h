@@ -0,0 +1,43 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  LZ4 is a byte-oriented LZ77 compressor that trades ratio for
+ *  speed: it has no entropy stage, so both directions are little
+ *  more than memory copies. The compressed data uses the LZ4 block
+ *  format (no frame header), so it can be produced and consumed by
+ *  the reference userspace implementation.
+ */
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MEM_COMPRESS	((1 << LZ4_HASH_LOG) * sizeof(u32))
+
+#define lz4_compressbound(isize)	((isize) + ((isize) / 255) + 16)
+
+/*
+ * Compress @src_len bytes at @src into @dst. On entry *dst_len is
+ * the size of @dst, on success it is the compressed length. Output
+ * never exceeds lz4_compressbound(src_len) bytes.
+ * This requires 'wrkmem' of size LZ4_MEM_COMPRESS.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * Safe decompression: never reads past @src + @src_len nor writes
+ * more than *dst_len bytes. On success *dst_len is the decompressed
+ * length.
+ */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK		0
+#define LZ4_E_OUTPUT_OVERRUN	(-1)
+#define LZ4_E_INPUT_OVERRUN	(-2)
+#define LZ4_E_LOOKBEHIND_OVERRUN	(-3)
+
+#endif
@@ -3,6 +3,8 @@
 
 /* For now we just replace the xt_owner.
  * FIXME: make iptables aware of qtaguid. */
+#include <linux/types.h>
+#include <linux/if.h>
 #include <linux/netfilter/xt_owner.h>
 
 #define XT_QTAGUID_UID    XT_OWNER_UID
@@ -10,4 +12,51 @@
 #define XT_QTAGUID_SOCKET XT_OWNER_SOCKET
 #define xt_qtaguid_match_info xt_owner_match_info
 
+/*
+ * Binary stats, read from /proc/net/xt_qtaguid/stats_bin.
+ *
+ * The file reads as a struct xt_qtaguid_stats_hdr followed by nr_records
+ * struct xt_qtaguid_stats_rec, one per {iface, acct_tag, uid, cnt_set} as
+ * in the text stats. The snapshot is taken by the first read after open()
+ * or after a write, and further reads and seeks return that same snapshot.
+ *
+ * Writing a __u64 generation restricts the next snapshot to the entries
+ * that changed since the snapshot that returned it; 0 gets them all. The
+ * write also rewinds the file, so the next read() returns the new header;
+ * with pread() and pwrite() the reader passes offset 0 itself. An
+ * entry that changed while a snapshot was taken may be reported again by
+ * the next one. Entries are only removed by the delete ctrl command, so
+ * a reader keeping its own totals should start over from generation 0
+ * when delete_cmds changes.
+ */
+#define XT_QTAGUID_STATS_VERSION 1
+
+struct xt_qtaguid_stats_hdr {
+	__u32 version;		/* XT_QTAGUID_STATS_VERSION */
+	__u32 rec_size;		/* sizeof(struct xt_qtaguid_stats_rec) */
+	__u64 generation;	/* to be written back for the next snapshot */
+	__u64 since;		/* the generation this snapshot started from */
+	__u64 delete_cmds;
+	__u32 nr_records;
+	__u32 pad;
+};
+
+enum {
+	XT_QTAGUID_TCP,
+	XT_QTAGUID_UDP,
+	XT_QTAGUID_PROTO_OTHER,
+	XT_QTAGUID_MAX_PROTOS
+};
+
+struct xt_qtaguid_stats_rec {
+	char iface[IFNAMSIZ];
+	__u64 acct_tag;		/* already shifted, as in the ctrl commands */
+	__u32 uid;
+	__u32 cnt_set;
+	struct {
+		__u64 bytes;
+		__u64 packets;
+	} rx[XT_QTAGUID_MAX_PROTOS], tx[XT_QTAGUID_MAX_PROTOS];
+};
+
 #endif /* _XT_QTAGUID_MATCH_H */
@@ -1277,6 +1277,10 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lowmem_node;	/* lowmemorykiller's index, by oom_adj */
+	unsigned long lowmem_rss;	/* its estimate of our RSS, in pages */
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
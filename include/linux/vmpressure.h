@@ -0,0 +1,33 @@
+#ifndef _LINUX_VMPRESSURE_H
+#define _LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+struct notifier_block;
+
+/*
+ * Memory pressure levels, derived from how many of the pages scanned by
+ * reclaim could actually be reclaimed. Notifier callbacks get the level
+ * as their action argument.
+ */
+enum vmpressure_levels {
+	VMPRESSURE_LOW = 0,
+	VMPRESSURE_MEDIUM,
+	VMPRESSURE_CRITICAL,
+	VMPRESSURE_NUM_LEVELS,
+};
+
+#ifdef CONFIG_VMPRESSURE
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+extern int vmpressure_register_notifier(struct notifier_block *nb);
+extern int vmpressure_unregister_notifier(struct notifier_block *nb);
+#else
+static inline void vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed)
+{
+}
+#endif
+
+#endif /* _LINUX_VMPRESSURE_H */
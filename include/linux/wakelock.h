@@ -16,7 +16,37 @@
 #ifndef _LINUX_WAKELOCK_H
 #define _LINUX_WAKELOCK_H
 
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Handle based access to userspace wake locks through /dev/wake_lock.
+ * WAKE_LOCK_IOCTL_GET_HANDLE takes a struct wake_lock_get_handle pointing
+ * to the name of a lock, as written to /sys/power/wake_lock, creates the
+ * lock if needed and fills in its handle. Handles stay valid for the life
+ * of the system. WAKE_LOCK_IOCTL_ACQUIRE takes a struct wake_lock_acquire,
+ * and WAKE_LOCK_IOCTL_RELEASE takes a handle.
+ */
+struct wake_lock_get_handle {
+	__u64 name;	/* user pointer to a NUL-terminated name */
+	__u32 handle;	/* returned */
+	__u32 __pad;
+};
+
+struct wake_lock_acquire {
+	__u32 handle;
+	__u32 __pad;
+	__s64 timeout;	/* in nanoseconds, 0 for none */
+};
+
+#define WAKE_LOCK_IOCTL_GET_HANDLE _IOWR('W', 0x40, struct wake_lock_get_handle)
+#define WAKE_LOCK_IOCTL_ACQUIRE    _IOW('W', 0x41, struct wake_lock_acquire)
+#define WAKE_LOCK_IOCTL_RELEASE    _IO('W', 0x42)
+
+#ifdef __KERNEL__
+
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/ktime.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
@@ -34,7 +64,9 @@ enum {
 
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
-	struct list_head    link;
+	struct hlist_node   node;        /* registry of all locks */
+	struct hlist_node   link;        /* active locks of its bucket */
+	struct rb_node      expire_node; /* active locks with a timeout */
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
@@ -45,6 +77,7 @@ struct wake_lock {
 		int             wakeup_count;
 		ktime_t         total_time;
 		ktime_t         prevent_suspend_time;
+		ktime_t         prevent_since;
 		ktime_t         max_time;
 		ktime_t         last_time;
 	} stat;
@@ -87,5 +120,7 @@ static inline long has_wake_lock(int type) { return 0; }
 
 #endif
 
+#endif /* __KERNEL__ */
+
 #endif
 
@@ -0,0 +1,51 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/types.h>
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(int min_adj, struct task_struct *p, int oom_adj,
+		 unsigned long size, s64 latency),
+
+	TP_ARGS(min_adj, p, oom_adj, size, latency),
+
+	TP_STRUCT__entry(
+		__field(int, min_adj)
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, oom_adj)
+		__field(unsigned long, size)
+		__field(s64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->min_adj = min_adj;
+		__entry->pid = p ? p->pid : 0;
+		if (p)
+			memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		else
+			__entry->comm[0] = '\0';
+		__entry->oom_adj = oom_adj;
+		__entry->size = size;
+		__entry->latency = latency;
+	),
+
+	TP_printk("min_adj=%d pid=%d comm=%s oom_adj=%d size=%lu latency_ns=%lld",
+		__entry->min_adj,
+		__entry->pid,
+		__entry->comm,
+		__entry->oom_adj,
+		__entry->size,
+		__entry->latency)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
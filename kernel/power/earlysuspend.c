@@ -13,10 +13,13 @@
  *
  */
 
+#include <linux/async.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -33,6 +36,9 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
+static LIST_HEAD(early_suspend_domain);
+static ktime_t early_suspend_time;
+static ktime_t late_resume_time;
 static void early_suspend(struct work_struct *work);
 static void late_resume(struct work_struct *work);
 static DECLARE_WORK(early_suspend_work, early_suspend);
@@ -45,6 +51,40 @@ enum {
 };
 static int state;
 
+static void call_early_suspend(struct early_suspend *h)
+{
+	ktime_t start = ktime_get();
+
+	if (debug_mask & DEBUG_VERBOSE)
+		pr_info("early_suspend: calling %pf\n", h->suspend);
+	h->suspend(h);
+	h->suspend_time = ktime_sub(ktime_get(), start);
+	if (h->suspend_time.tv64 > h->max_suspend_time.tv64)
+		h->max_suspend_time = h->suspend_time;
+}
+
+static void call_early_suspend_async(void *data, async_cookie_t cookie)
+{
+	call_early_suspend(data);
+}
+
+static void call_late_resume(struct early_suspend *h)
+{
+	ktime_t start = ktime_get();
+
+	if (debug_mask & DEBUG_VERBOSE)
+		pr_info("late_resume: calling %pf\n", h->resume);
+	h->resume(h);
+	h->resume_time = ktime_sub(ktime_get(), start);
+	if (h->resume_time.tv64 > h->max_resume_time.tv64)
+		h->max_resume_time = h->resume_time;
+}
+
+static void call_late_resume_async(void *data, async_cookie_t cookie)
+{
+	call_late_resume(data);
+}
+
 void register_early_suspend(struct early_suspend *handler)
 {
 	struct list_head *pos;
@@ -58,7 +98,7 @@ void register_early_suspend(struct early_suspend *handler)
 	}
 	list_add_tail(&handler->link, pos);
 	if ((state & SUSPENDED) && handler->suspend)
-		handler->suspend(handler);
+		call_early_suspend(handler);
 	mutex_unlock(&early_suspend_lock);
 }
 EXPORT_SYMBOL(register_early_suspend);
@@ -76,6 +116,9 @@ static void early_suspend(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	bool pending = false;
+	int level = 0;
+	ktime_t start;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -94,13 +137,26 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
+	start = ktime_get();
 	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL) {
-			if (debug_mask & DEBUG_VERBOSE)
-				pr_info("early_suspend: calling %pf\n", pos->suspend);
-			pos->suspend(pos);
+		/* async handlers of the previous level must be done */
+		if (pending && pos->level != level) {
+			async_synchronize_full_domain(&early_suspend_domain);
+			pending = false;
 		}
+		level = pos->level;
+		if (pos->suspend == NULL)
+			continue;
+		if (pos->async) {
+			async_schedule_domain(call_early_suspend_async, pos,
+					      &early_suspend_domain);
+			pending = true;
+		} else
+			call_early_suspend(pos);
 	}
+	if (pending)
+		async_synchronize_full_domain(&early_suspend_domain);
+	early_suspend_time = ktime_sub(ktime_get(), start);
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -119,6 +175,9 @@ static void late_resume(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	bool pending = false;
+	int level = 0;
+	ktime_t start;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -135,14 +194,26 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
+	start = ktime_get();
 	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
-		if (pos->resume != NULL) {
-			if (debug_mask & DEBUG_VERBOSE)
-				pr_info("late_resume: calling %pf\n", pos->resume);
-
-			pos->resume(pos);
+		/* async handlers of the previous level must be done */
+		if (pending && pos->level != level) {
+			async_synchronize_full_domain(&early_suspend_domain);
+			pending = false;
 		}
+		level = pos->level;
+		if (pos->resume == NULL)
+			continue;
+		if (pos->async) {
+			async_schedule_domain(call_late_resume_async, pos,
+					      &early_suspend_domain);
+			pending = true;
+		} else
+			call_late_resume(pos);
 	}
+	if (pending)
+		async_synchronize_full_domain(&early_suspend_domain);
+	late_resume_time = ktime_sub(ktime_get(), start);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -185,3 +256,56 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int early_suspend_debug_show(struct seq_file *s, void *unused)
+{
+	struct early_suspend *pos;
+
+	mutex_lock(&early_suspend_lock);
+	seq_printf(s, "early_suspend %lld ns, late_resume %lld ns\n",
+		   ktime_to_ns(early_suspend_time),
+		   ktime_to_ns(late_resume_time));
+	seq_puts(s, "level\tasync\tsuspend_time\tmax_suspend_time"
+		 "\tresume_time\tmax_resume_time\thandler\n");
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		seq_printf(s, "%d\t%d\t%lld\t%lld\t%lld\t%lld\t%pf\n",
+			   pos->level, pos->async,
+			   ktime_to_ns(pos->suspend_time),
+			   ktime_to_ns(pos->max_suspend_time),
+			   ktime_to_ns(pos->resume_time),
+			   ktime_to_ns(pos->max_resume_time),
+			   pos->suspend ? (void *)pos->suspend :
+					  (void *)pos->resume);
+	mutex_unlock(&early_suspend_lock);
+	return 0;
+}
+
+static int early_suspend_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_debug_show, NULL);
+}
+
+static const struct file_operations early_suspend_debug_fops = {
+	.open		= early_suspend_debug_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init early_suspend_debug_init(void)
+{
+	struct dentry *d;
+
+	d = debugfs_create_file("early_suspend", S_IRUGO, NULL, NULL,
+		&early_suspend_debug_fops);
+	if (!d) {
+		pr_err("Failed to create early_suspend debug file\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+late_initcall(early_suspend_debug_init);
+#endif
@@ -14,9 +14,16 @@
  */
 
 #include <linux/ctype.h>
+#include <linux/dcache.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/idr.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/rculist.h>
 #include <linux/wakelock.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
 
 #include "power.h"
 
@@ -30,23 +37,134 @@ enum {
 static int debug_mask = DEBUG_FAILURE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
-static DEFINE_MUTEX(tree_lock);
+#define USER_WAKE_LOCK_HASH_BITS	6
+#define USER_WAKE_LOCK_HASH_SIZE	(1 << USER_WAKE_LOCK_HASH_BITS)
+
+/*
+ * User wake locks are never freed, so lookups by name or by handle need
+ * no lock; index_lock only serializes creating them and walking the tree
+ * that keeps them sorted by name for the /sys/power listings.
+ */
+static DEFINE_MUTEX(index_lock);
 
 struct user_wake_lock {
-	struct rb_node		node;
+	struct hlist_node	node;
+	struct rb_node		sorted;
+	unsigned int		hash;
+	int			handle;
 	struct wake_lock	wake_lock;
 	char			name[0];
 };
-struct rb_root user_wake_locks;
+static struct hlist_head user_wake_locks[USER_WAKE_LOCK_HASH_SIZE];
+static struct rb_root user_wake_locks_sorted;
+static DEFINE_IDR(user_wake_lock_handles);
+
+static struct hlist_head *user_wake_lock_bucket(unsigned int hash)
+{
+	return &user_wake_locks[hash_32(hash, USER_WAKE_LOCK_HASH_BITS)];
+}
+
+static struct user_wake_lock *find_wake_lock_name(
+	const char *name, int name_len, unsigned int hash)
+{
+	struct user_wake_lock *l;
+	struct hlist_node *n;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(l, n, user_wake_lock_bucket(hash), node) {
+		if (l->hash == hash && !strncmp(l->name, name, name_len) &&
+		    !l->name[name_len]) {
+			rcu_read_unlock();
+			return l;
+		}
+	}
+	rcu_read_unlock();
+	return NULL;
+}
+
+/* Caller must hold index_lock */
+static void sort_wake_lock(struct user_wake_lock *l)
+{
+	struct rb_node **p = &user_wake_locks_sorted.rb_node;
+	struct rb_node *parent = NULL;
+	struct user_wake_lock *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct user_wake_lock, sorted);
+		if (strcmp(l->name, entry->name) < 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&l->sorted, parent, p);
+	rb_insert_color(&l->sorted, &user_wake_locks_sorted);
+}
+
+static struct user_wake_lock *create_wake_lock_name(
+	const char *name, int name_len, unsigned int hash)
+{
+	struct user_wake_lock *l;
+	int ret;
+
+	mutex_lock(&index_lock);
+
+	/* someone else may have created it since we looked */
+	l = find_wake_lock_name(name, name_len, hash);
+	if (l)
+		goto out;
+
+	if (!idr_pre_get(&user_wake_lock_handles, GFP_KERNEL)) {
+		l = ERR_PTR(-ENOMEM);
+		goto err_alloc;
+	}
+	l = kzalloc(sizeof(*l) + name_len + 1, GFP_KERNEL);
+	if (l == NULL) {
+		l = ERR_PTR(-ENOMEM);
+		goto err_alloc;
+	}
+	memcpy(l->name, name, name_len);
+	l->hash = hash;
+	wake_lock_init(&l->wake_lock, WAKE_LOCK_SUSPEND, l->name);
+	ret = idr_get_new(&user_wake_lock_handles, l, &l->handle);
+	if (ret) {
+		wake_lock_destroy(&l->wake_lock);
+		kfree(l);
+		l = ERR_PTR(ret);
+		goto err_alloc;
+	}
+	if (debug_mask & DEBUG_NEW)
+		pr_info("lookup_wake_lock_name: new wake lock %s, handle %d\n",
+			l->name, l->handle);
+	sort_wake_lock(l);
+	hlist_add_head_rcu(&l->node, user_wake_lock_bucket(hash));
+out:
+	mutex_unlock(&index_lock);
+	return l;
+
+err_alloc:
+	mutex_unlock(&index_lock);
+	if (debug_mask & DEBUG_FAILURE)
+		pr_err("lookup_wake_lock_name: failed to allocate "
+			"memory for %.*s\n", name_len, name);
+	return l;
+}
+
+/* convert timeout from nanoseconds to jiffies > 0 */
+static long wake_lock_timeout_jiffies(u64 timeout)
+{
+	timeout += (NSEC_PER_SEC / HZ) - 1;
+	do_div(timeout, (NSEC_PER_SEC / HZ));
+	if (timeout <= 0)
+		timeout = 1;
+	return timeout;
+}
 
 static struct user_wake_lock *lookup_wake_lock_name(
 	const char *buf, int allocate, long *timeoutptr)
 {
-	struct rb_node **p = &user_wake_locks.rb_node;
-	struct rb_node *parent = NULL;
 	struct user_wake_lock *l;
-	int diff;
-	u64 timeout;
+	unsigned int hash;
 	int name_len;
 	const char *arg;
 
@@ -62,62 +180,34 @@ static struct user_wake_lock *lookup_wake_lock_name(
 
 	/* Process timeout string */
 	if (timeoutptr && *arg) {
-		timeout = simple_strtoull(arg, (char **)&arg, 0);
+		u64 timeout = simple_strtoull(arg, (char **)&arg, 0);
 		while (isspace(*arg))
 			arg++;
 		if (*arg)
 			goto bad_arg;
-		/* convert timeout from nanoseconds to jiffies > 0 */
-		timeout += (NSEC_PER_SEC / HZ) - 1;
-		do_div(timeout, (NSEC_PER_SEC / HZ));
-		if (timeout <= 0)
-			timeout = 1;
-		*timeoutptr = timeout;
+		*timeoutptr = wake_lock_timeout_jiffies(timeout);
 	} else if (*arg)
 		goto bad_arg;
 	else if (timeoutptr)
 		*timeoutptr = 0;
 
-	/* Lookup wake lock in rbtree */
-	while (*p) {
-		parent = *p;
-		l = rb_entry(parent, struct user_wake_lock, node);
-		diff = strncmp(buf, l->name, name_len);
-		if (!diff && l->name[name_len])
-			diff = -1;
-		if (debug_mask & DEBUG_ERROR)
-			pr_info("lookup_wake_lock_name: compare %.*s %s %d\n",
-				name_len, buf, l->name, diff);
-
-		if (diff < 0)
-			p = &(*p)->rb_left;
-		else if (diff > 0)
-			p = &(*p)->rb_right;
-		else
-			return l;
+	/* Lookup wake lock in the name index */
+	hash = full_name_hash((const unsigned char *)buf, name_len);
+	l = find_wake_lock_name(buf, name_len, hash);
+	if (l) {
+		if (debug_mask & DEBUG_LOOKUP)
+			pr_info("lookup_wake_lock_name: found %s\n", l->name);
+		return l;
 	}
 
-	/* Allocate and add new wakelock to rbtree */
+	/* Allocate and add new wakelock to the index */
 	if (!allocate) {
 		if (debug_mask & DEBUG_ERROR)
 			pr_info("lookup_wake_lock_name: %.*s not found\n",
 				name_len, buf);
 		return ERR_PTR(-EINVAL);
 	}
-	l = kzalloc(sizeof(*l) + name_len + 1, GFP_KERNEL);
-	if (l == NULL) {
-		if (debug_mask & DEBUG_FAILURE)
-			pr_err("lookup_wake_lock_name: failed to allocate "
-				"memory for %.*s\n", name_len, buf);
-		return ERR_PTR(-ENOMEM);
-	}
-	memcpy(l->name, buf, name_len);
-	if (debug_mask & DEBUG_NEW)
-		pr_info("lookup_wake_lock_name: new wake lock %s\n", l->name);
-	wake_lock_init(&l->wake_lock, WAKE_LOCK_SUSPEND, l->name);
-	rb_link_node(&l->node, parent, p);
-	rb_insert_color(&l->node, &user_wake_locks);
-	return l;
+	return create_wake_lock_name(buf, name_len, hash);
 
 bad_arg:
 	if (debug_mask & DEBUG_ERROR)
@@ -126,27 +216,44 @@ bad_arg:
 	return ERR_PTR(-EINVAL);
 }
 
-ssize_t wake_lock_show(
-	struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+static struct user_wake_lock *lookup_wake_lock_handle(unsigned long handle)
+{
+	struct user_wake_lock *l;
+
+	if (handle > INT_MAX)
+		return NULL;
+	rcu_read_lock();
+	l = idr_find(&user_wake_lock_handles, handle);
+	rcu_read_unlock();
+	return l;
+}
+
+static ssize_t show_wake_locks(char *buf, int active)
 {
 	char *s = buf;
 	char *end = buf + PAGE_SIZE;
 	struct rb_node *n;
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
+	mutex_lock(&index_lock);
 
-	for (n = rb_first(&user_wake_locks); n != NULL; n = rb_next(n)) {
-		l = rb_entry(n, struct user_wake_lock, node);
-		if (wake_lock_active(&l->wake_lock))
+	for (n = rb_first(&user_wake_locks_sorted); n != NULL; n = rb_next(n)) {
+		l = rb_entry(n, struct user_wake_lock, sorted);
+		if (!wake_lock_active(&l->wake_lock) == !active)
 			s += scnprintf(s, end - s, "%s ", l->name);
 	}
 	s += scnprintf(s, end - s, "\n");
 
-	mutex_unlock(&tree_lock);
+	mutex_unlock(&index_lock);
 	return (s - buf);
 }
 
+ssize_t wake_lock_show(
+	struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return show_wake_locks(buf, 1);
+}
+
 ssize_t wake_lock_store(
 	struct kobject *kobj, struct kobj_attribute *attr,
 	const char *buf, size_t n)
@@ -154,12 +261,9 @@ ssize_t wake_lock_store(
 	long timeout;
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
 	l = lookup_wake_lock_name(buf, 1, &timeout);
-	if (IS_ERR(l)) {
-		n = PTR_ERR(l);
-		goto bad_name;
-	}
+	if (IS_ERR(l))
+		return PTR_ERR(l);
 
 	if (debug_mask & DEBUG_ACCESS)
 		pr_info("wake_lock_store: %s, timeout %ld\n", l->name, timeout);
@@ -168,8 +272,6 @@ ssize_t wake_lock_store(
 		wake_lock_timeout(&l->wake_lock, timeout);
 	else
 		wake_lock(&l->wake_lock);
-bad_name:
-	mutex_unlock(&tree_lock);
 	return n;
 }
 
@@ -177,22 +279,7 @@ bad_name:
 ssize_t wake_unlock_show(
 	struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	char *s = buf;
-	char *end = buf + PAGE_SIZE;
-	struct rb_node *n;
-	struct user_wake_lock *l;
-
-	mutex_lock(&tree_lock);
-
-	for (n = rb_first(&user_wake_locks); n != NULL; n = rb_next(n)) {
-		l = rb_entry(n, struct user_wake_lock, node);
-		if (!wake_lock_active(&l->wake_lock))
-			s += scnprintf(s, end - s, "%s ", l->name);
-	}
-	s += scnprintf(s, end - s, "\n");
-
-	mutex_unlock(&tree_lock);
-	return (s - buf);
+	return show_wake_locks(buf, 0);
 }
 
 ssize_t wake_unlock_store(
@@ -201,19 +288,91 @@ ssize_t wake_unlock_store(
 {
 	struct user_wake_lock *l;
 
-	mutex_lock(&tree_lock);
 	l = lookup_wake_lock_name(buf, 0, NULL);
-	if (IS_ERR(l)) {
-		n = PTR_ERR(l);
-		goto not_found;
-	}
+	if (IS_ERR(l))
+		return PTR_ERR(l);
 
 	if (debug_mask & DEBUG_ACCESS)
 		pr_info("wake_unlock_store: %s\n", l->name);
 
 	wake_unlock(&l->wake_lock);
-not_found:
-	mutex_unlock(&tree_lock);
 	return n;
 }
 
+static long user_wake_lock_ioctl(struct file *file, unsigned int cmd,
+				 unsigned long arg)
+{
+	struct wake_lock_get_handle get;
+	struct wake_lock_acquire req;
+	struct user_wake_lock *l;
+	long timeout;
+	char *name;
+
+	switch (cmd) {
+	case WAKE_LOCK_IOCTL_GET_HANDLE:
+		if (copy_from_user(&get, (void __user *)arg, sizeof(get)))
+			return -EFAULT;
+		name = strndup_user((const char __user *)(unsigned long)get.name,
+				    PAGE_SIZE);
+		if (IS_ERR(name))
+			return PTR_ERR(name);
+		l = lookup_wake_lock_name(name, 1, NULL);
+		kfree(name);
+		if (IS_ERR(l))
+			return PTR_ERR(l);
+		get.handle = l->handle;
+		if (copy_to_user((void __user *)arg, &get, sizeof(get)))
+			return -EFAULT;
+		return 0;
+
+	case WAKE_LOCK_IOCTL_ACQUIRE:
+		if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+			return -EFAULT;
+		l = lookup_wake_lock_handle(req.handle);
+		if (!l || req.timeout < 0)
+			return -EINVAL;
+		if (debug_mask & DEBUG_ACCESS)
+			pr_info("wake_lock_ioctl: %s, timeout %lld\n",
+				l->name, req.timeout);
+		if (req.timeout) {
+			timeout = wake_lock_timeout_jiffies(req.timeout);
+			wake_lock_timeout(&l->wake_lock, timeout);
+		} else
+			wake_lock(&l->wake_lock);
+		return 0;
+
+	case WAKE_LOCK_IOCTL_RELEASE:
+		l = lookup_wake_lock_handle(arg);
+		if (!l)
+			return -EINVAL;
+		if (debug_mask & DEBUG_ACCESS)
+			pr_info("wake_unlock_ioctl: %s\n", l->name);
+		wake_unlock(&l->wake_lock);
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+static const struct file_operations user_wake_lock_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = user_wake_lock_ioctl,
+	.compat_ioctl = user_wake_lock_ioctl,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice user_wake_lock_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "wake_lock",
+	.fops = &user_wake_lock_fops,
+};
+
+static int __init user_wake_lock_init(void)
+{
+	int ret;
+
+	ret = misc_register(&user_wake_lock_misc);
+	if (ret)
+		pr_err("user_wake_lock_init: misc_register failed\n");
+	return ret;
+}
+device_initcall(user_wake_lock_init);
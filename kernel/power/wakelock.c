@@ -14,6 +14,7 @@
  */
 
 #include <linux/module.h>
+#include <linux/hash.h>
 #include <linux/platform_device.h>
 #include <linux/rtc.h>
 #include <linux/suspend.h>
@@ -40,10 +41,53 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
 #define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
-static DEFINE_SPINLOCK(list_lock);
-static LIST_HEAD(inactive_locks);
-static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
-static int current_event_num;
+#define WAKE_LOCK_HASH_BITS              6
+#define WAKE_LOCK_HASH_SIZE              (1 << WAKE_LOCK_HASH_BITS)
+
+/*
+ * Every initialized lock is in the registry, hashed by its address. The
+ * bucket lock protects the flags, stats and active list link of the locks
+ * in the bucket, so locking and unlocking a wake lock without a timeout
+ * only contends with the other locks of its bucket. The registry is walked
+ * to report stats and to print or account for all active locks.
+ */
+struct wake_lock_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+	struct hlist_head active;
+};
+static struct wake_lock_bucket wake_lock_registry[WAKE_LOCK_HASH_SIZE] = {
+	[0 ... WAKE_LOCK_HASH_SIZE - 1] = {
+		.lock = __SPIN_LOCK_UNLOCKED(wake_lock_registry.lock),
+	},
+};
+
+/*
+ * The active locks of one type. held counts the ones without a timeout, so
+ * that while any of those is held nothing else has to be looked at. The
+ * ones with a timeout are in expire_tree, ordered by expiry: only the
+ * expired ones at the left and the last one to expire are ever looked at.
+ *
+ * The lock protects expire_tree and the expiry of the locks in it, and for
+ * WAKE_LOCK_SUSPEND the expire timer. WAKE_LOCK_AUTO_EXPIRE is only changed
+ * with both this and the bucket lock held, so a lock found without it under
+ * its bucket lock alone stays out of the tree. Bucket locks nest inside.
+ */
+struct wake_lock_type {
+	spinlock_t lock;
+	struct rb_root expire_tree;
+	atomic_t held;
+};
+#define WAKE_LOCK_TYPE_INIT(type) {					\
+	.lock = __SPIN_LOCK_UNLOCKED(wake_lock_types[type].lock),	\
+}
+static struct wake_lock_type wake_lock_types[WAKE_LOCK_TYPE_COUNT] = {
+	[WAKE_LOCK_SUSPEND] = WAKE_LOCK_TYPE_INIT(WAKE_LOCK_SUSPEND),
+	[WAKE_LOCK_IDLE] = WAKE_LOCK_TYPE_INIT(WAKE_LOCK_IDLE),
+};
+#define suspend_locks (&wake_lock_types[WAKE_LOCK_SUSPEND])
+
+static atomic_t current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
 suspend_state_t requested_suspend_state = PM_SUSPEND_MEM;
@@ -55,9 +99,18 @@ static struct wake_lock suspend_backoff_lock;
 
 static unsigned suspend_short_count;
 
+static inline struct wake_lock_bucket *wake_lock_bucket(struct wake_lock *lock)
+{
+	return &wake_lock_registry[hash_ptr(lock, WAKE_LOCK_HASH_BITS)];
+}
+
+static inline struct wake_lock_type *wake_lock_type_of(struct wake_lock *lock)
+{
+	return &wake_lock_types[lock->flags & WAKE_LOCK_TYPE_MASK];
+}
+
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
-static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
@@ -106,7 +159,7 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		total_time = ktime_add(total_time, add_time);
 		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
 			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+				ktime_sub(now, lock->stat.prevent_since));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
@@ -123,24 +176,23 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 static int wakelock_stats_show(struct seq_file *m, void *unused)
 {
 	unsigned long irqflags;
+	struct wake_lock_bucket *b;
 	struct wake_lock *lock;
-	int ret;
-	int type;
+	struct hlist_node *n;
 
-	spin_lock_irqsave(&list_lock, irqflags);
-
-	ret = seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
+	seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
 			"\ttotal_time\tsleep_time\tmax_time\tlast_change\n");
-	list_for_each_entry(lock, &inactive_locks, link)
-		ret = print_lock_stat(m, lock);
-	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
-		list_for_each_entry(lock, &active_wake_locks[type], link)
-			ret = print_lock_stat(m, lock);
+	for (b = wake_lock_registry;
+	     b < wake_lock_registry + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock_irqsave(&b->lock, irqflags);
+		hlist_for_each_entry(lock, n, &b->head, node)
+			print_lock_stat(m, lock);
+		spin_unlock_irqrestore(&b->lock, irqflags);
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
 }
 
+/* Caller must hold the bucket lock of the lock */
 static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 {
 	ktime_t duration;
@@ -160,104 +212,200 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 		lock->stat.max_time = duration;
 	lock->stat.last_time = ktime_get();
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
+		duration = ktime_sub(now, lock->stat.prevent_since);
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
 		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
 }
 
-static void update_sleep_wait_stats_locked(int done)
+/*
+ * Account the time the active suspend locks kept the system awake with
+ * the main lock released. Each lock remembers since when it has not been
+ * accounted, so the registry is walked one bucket at a time. Called with
+ * interrupts off and no bucket lock held.
+ */
+static void update_sleep_wait_stats(int done)
 {
+	struct wake_lock_bucket *b;
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
+	struct hlist_node *n;
+	ktime_t now, etime, add;
 	int expired;
 
-	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
+	for (b = wake_lock_registry;
+	     b < wake_lock_registry + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock(&b->lock);
+		now = ktime_get();
+		hlist_for_each_entry(lock, n, &b->active, link) {
+			if ((lock->flags & WAKE_LOCK_TYPE_MASK) !=
+			    WAKE_LOCK_SUSPEND)
+				continue;
+			expired = get_expired_time(lock, &etime);
+			if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
+				add = ktime_sub(expired ? etime : now,
+						lock->stat.prevent_since);
+				lock->stat.prevent_suspend_time = ktime_add(
+					lock->stat.prevent_suspend_time, add);
+			}
+			lock->stat.prevent_since = now;
+			if (done || expired)
+				lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
+				lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
 		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+		spin_unlock(&b->lock);
 	}
-	last_sleep_time_update = now;
 }
 #endif
 
 
-static void expire_wake_lock(struct wake_lock *lock)
+/* Caller must hold t->lock and the bucket lock of the lock */
+static void wake_lock_expire_insert(struct wake_lock_type *t,
+				    struct wake_lock *lock)
+{
+	struct rb_node **p = &t->expire_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *l;
+
+	while (*p) {
+		parent = *p;
+		l = rb_entry(parent, struct wake_lock, expire_node);
+		if (time_before(lock->expires, l->expires))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &t->expire_tree);
+}
+
+/*
+ * Take the lock off the active list, and out of the expiry tree or the
+ * held count; the flags are left alone. Caller must hold the bucket lock,
+ * and t->lock if the lock has a timeout. Returns whether it was the last
+ * lock of the type held without a timeout.
+ */
+static bool wake_lock_dequeue_locked(struct wake_lock_type *t,
+				     struct wake_lock *lock)
+{
+	bool last = false;
+
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return false;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->expire_node, &t->expire_tree);
+	else
+		last = atomic_dec_and_test(&t->held);
+	hlist_del_init(&lock->link);
+	return last;
+}
+
+/*
+ * Take the bucket lock of the lock, and the lock of its type before it if
+ * the lock is in the expiry tree or is about to be put there. Interrupts
+ * must be off. Returns whether the type lock was taken.
+ */
+static bool wake_lock_lock_state(struct wake_lock_type *t,
+				 struct wake_lock_bucket *b,
+				 struct wake_lock *lock, bool timed)
+{
+	if (!timed) {
+		spin_lock(&b->lock);
+		if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE))
+			return false;
+		spin_unlock(&b->lock);
+	}
+	spin_lock(&t->lock);
+	spin_lock(&b->lock);
+	return true;
+}
+
+/* Caller must hold t->lock and the bucket lock of the lock */
+static void expire_wake_lock(struct wake_lock_type *t, struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	wake_lock_dequeue_locked(t, lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
 }
 
-/* Caller must acquire the list_lock spinlock */
+/* Caller must have interrupts off and hold no bucket lock */
 static void print_active_locks(int type)
 {
+	struct wake_lock_bucket *b;
 	struct wake_lock *lock;
-	bool print_expired = true;
+	struct hlist_node *n;
+	bool print_expired;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry(lock, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout > 0)
-				pr_info("active wake lock %s, time left %ld\n",
-					lock->name, timeout);
-			else if (print_expired)
-				pr_info("wake lock %s, expired\n", lock->name);
-		} else {
-			pr_info("active wake lock %s\n", lock->name);
-			if (!(debug_mask & DEBUG_EXPIRE))
-				print_expired = false;
+	print_expired = !atomic_read(&wake_lock_types[type].held) ||
+			(debug_mask & DEBUG_EXPIRE);
+	for (b = wake_lock_registry;
+	     b < wake_lock_registry + WAKE_LOCK_HASH_SIZE; b++) {
+		spin_lock(&b->lock);
+		hlist_for_each_entry(lock, n, &b->active, link) {
+			if ((lock->flags & WAKE_LOCK_TYPE_MASK) != type)
+				continue;
+			if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
+				long timeout = lock->expires - jiffies;
+				if (timeout > 0)
+					pr_info("active wake lock %s, "
+						"time left %ld\n",
+						lock->name, timeout);
+				else if (print_expired)
+					pr_info("wake lock %s, expired\n",
+						lock->name);
+			} else {
+				pr_info("active wake lock %s\n", lock->name);
+			}
 		}
+		spin_unlock(&b->lock);
 	}
 }
 
+/* Caller must hold the lock of the type and no bucket lock */
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock_type *t;
+	struct wake_lock_bucket *b;
+	struct wake_lock *lock;
+	struct rb_node *node;
+	unsigned long now = jiffies;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	t = &wake_lock_types[type];
+	if (atomic_read(&t->held))
+		return -1;
+	while ((node = rb_first(&t->expire_tree))) {
+		lock = rb_entry(node, struct wake_lock, expire_node);
+		if (time_after(lock->expires, now))
+			break;
+		b = wake_lock_bucket(lock);
+		spin_lock(&b->lock);
+		expire_wake_lock(t, lock);
+		spin_unlock(&b->lock);
 	}
-	return max_timeout;
+	node = rb_last(&t->expire_tree);
+	if (!node)
+		return 0;
+	lock = rb_entry(node, struct wake_lock, expire_node);
+	return lock->expires - now;
 }
 
 long has_wake_lock(int type)
 {
 	long ret;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
+	struct wake_lock_type *t = &wake_lock_types[type];
+	spin_lock_irqsave(&t->lock, irqflags);
 	ret = has_wake_lock_locked(type);
 	if (ret && (debug_mask & DEBUG_WAKEUP) && type == WAKE_LOCK_SUSPEND)
 		print_active_locks(type);
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock_irqrestore(&t->lock, irqflags);
 	return ret;
 }
 
@@ -280,7 +428,7 @@ static void suspend(struct work_struct *work)
 		return;
 	}
 
-	entry_event_num = current_event_num;
+	entry_event_num = atomic_read(&current_event_num);
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
@@ -308,7 +456,7 @@ static void suspend(struct work_struct *work)
 		suspend_short_count = 0;
 	}
 
-	if (current_event_num == entry_event_num) {
+	if (atomic_read(&current_event_num) == entry_event_num) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: pm_suspend returned with no event\n");
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
@@ -322,7 +470,7 @@ static void expire_wake_locks(unsigned long data)
 	unsigned long irqflags;
 	if (debug_mask & DEBUG_EXPIRE)
 		pr_info("expire_wake_locks: start\n");
-	spin_lock_irqsave(&list_lock, irqflags);
+	spin_lock_irqsave(&suspend_locks->lock, irqflags);
 	if (debug_mask & DEBUG_SUSPEND)
 		print_active_locks(WAKE_LOCK_SUSPEND);
 	has_lock = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
@@ -330,7 +478,7 @@ static void expire_wake_locks(unsigned long data)
 		pr_info("expire_wake_locks: done, has_lock %ld\n", has_lock);
 	if (has_lock == 0)
 		queue_work(suspend_work_queue, &suspend_work);
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock_irqrestore(&suspend_locks->lock, irqflags);
 }
 static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
 
@@ -360,6 +508,7 @@ static struct platform_device power_device = {
 void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 {
 	unsigned long irqflags = 0;
+	struct wake_lock_bucket *b;
 
 	if (name)
 		lock->name = name;
@@ -373,61 +522,94 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.wakeup_count = 0;
 	lock->stat.total_time = ktime_set(0, 0);
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
+	lock->stat.prevent_since = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
 	lock->stat.last_time = ktime_set(0, 0);
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
-	INIT_LIST_HEAD(&lock->link);
-	spin_lock_irqsave(&list_lock, irqflags);
-	list_add(&lock->link, &inactive_locks);
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	INIT_HLIST_NODE(&lock->link);
+	b = wake_lock_bucket(lock);
+	spin_lock_irqsave(&b->lock, irqflags);
+	hlist_add_head(&lock->node, &b->head);
+	spin_unlock_irqrestore(&b->lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
 
 void wake_lock_destroy(struct wake_lock *lock)
 {
 	unsigned long irqflags;
+	struct wake_lock_bucket *b = wake_lock_bucket(lock);
+	struct wake_lock_type *t = wake_lock_type_of(lock);
+#ifdef CONFIG_WAKELOCK_STAT
+	typeof(lock->stat) stat;
+#endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
-	spin_lock_irqsave(&list_lock, irqflags);
-	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	spin_lock_irqsave(&t->lock, irqflags);
+	spin_lock(&b->lock);
+	wake_lock_dequeue_locked(t, lock);
+	lock->flags &= ~(WAKE_LOCK_INITIALIZED | WAKE_LOCK_ACTIVE |
+			 WAKE_LOCK_AUTO_EXPIRE);
 #ifdef CONFIG_WAKELOCK_STAT
-	if (lock->stat.count) {
-		deleted_wake_locks.stat.count += lock->stat.count;
-		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
+	stat = lock->stat;
+#endif
+	hlist_del(&lock->node);
+	spin_unlock(&b->lock);
+	spin_unlock_irqrestore(&t->lock, irqflags);
+
+#ifdef CONFIG_WAKELOCK_STAT
+	if (stat.count) {
+		b = wake_lock_bucket(&deleted_wake_locks);
+		spin_lock_irqsave(&b->lock, irqflags);
+		deleted_wake_locks.stat.count += stat.count;
+		deleted_wake_locks.stat.expire_count += stat.expire_count;
 		deleted_wake_locks.stat.total_time =
 			ktime_add(deleted_wake_locks.stat.total_time,
-				  lock->stat.total_time);
+				  stat.total_time);
 		deleted_wake_locks.stat.prevent_suspend_time =
 			ktime_add(deleted_wake_locks.stat.prevent_suspend_time,
-				  lock->stat.prevent_suspend_time);
+				  stat.prevent_suspend_time);
 		deleted_wake_locks.stat.max_time =
 			ktime_add(deleted_wake_locks.stat.max_time,
-				  lock->stat.max_time);
+				  stat.max_time);
+		spin_unlock_irqrestore(&b->lock, irqflags);
 	}
 #endif
-	list_del(&lock->link);
-	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_destroy);
 
+/*
+ * A lock without a timeout only needs its bucket lock: it is counted in
+ * held, which is what has_wake_lock() looks at first. The type lock is
+ * only taken when the lock enters or leaves the expiry tree. A lock that
+ * loses its timeout is counted before it leaves the tree, and one that
+ * gains one is put in the tree before it is uncounted, so a held lock is
+ * never missed.
+ */
 static void wake_lock_internal(
 	struct wake_lock *lock, long timeout, int has_timeout)
 {
 	int type;
 	unsigned long irqflags;
 	long expire_in;
+	struct wake_lock_type *t;
+	struct wake_lock_bucket *b;
+	bool type_locked;
+	bool was_held;
 
-	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
+	t = &wake_lock_types[type];
+	b = wake_lock_bucket(lock);
+	local_irq_save(irqflags);
+	type_locked = wake_lock_lock_state(t, b, lock, has_timeout);
 	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
 #ifdef CONFIG_WAKELOCK_STAT
-	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup) {
+	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup &&
+	    xchg(&wait_for_wakeup, 0)) {
 		if (debug_mask & DEBUG_WAKEUP)
 			pr_info("wakeup wake lock: %s\n", lock->name);
-		wait_for_wakeup = 0;
 		lock->stat.wakeup_count++;
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
@@ -436,13 +618,19 @@ static void wake_lock_internal(
 		lock->stat.last_time = ktime_get();
 	}
 #endif
+	was_held = (lock->flags & (WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE))
+		== WAKE_LOCK_ACTIVE;
+	if (!has_timeout && !was_held)
+		atomic_inc(&t->held);
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->expire_node, &t->expire_tree);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
+		hlist_add_head(&lock->link, &b->active);
 #ifdef CONFIG_WAKELOCK_STAT
 		lock->stat.last_time = ktime_get();
 #endif
 	}
-	list_del(&lock->link);
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -450,22 +638,38 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		wake_lock_expire_insert(t, lock);
+		if (was_held)
+			atomic_dec(&t->held);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
-		list_add(&lock->link, &active_wake_locks[type]);
 	}
+#ifdef CONFIG_WAKELOCK_STAT
+	/* With the main lock released, every suspend lock prevents suspend */
+	if (type == WAKE_LOCK_SUSPEND && lock != &main_wake_lock &&
+	    !wake_lock_active(&main_wake_lock) &&
+	    !(lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)) {
+		lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+		lock->stat.prevent_since = ktime_get();
+	}
+#endif
+	spin_unlock(&b->lock);
+
 	if (type == WAKE_LOCK_SUSPEND) {
-		current_event_num++;
+		atomic_inc(&current_event_num);
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
-		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats(1);
 #endif
+		/*
+		 * The expire timer is only touched under the type lock. An
+		 * untimed lock taken without it leaves the timer alone: while
+		 * the lock is counted in held the timer finds nothing to do,
+		 * and the unlock that drops held to zero re-arms it.
+		 */
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
 		else
@@ -475,7 +679,7 @@ static void wake_lock_internal(
 				pr_info("wake_lock: %s, start expire timer, "
 					"%ld\n", lock->name, expire_in);
 			mod_timer(&expire_timer, jiffies + expire_in);
-		} else {
+		} else if (type_locked) {
 			if (del_timer(&expire_timer))
 				if (debug_mask & DEBUG_EXPIRE)
 					pr_info("wake_lock: %s, stop expire timer\n",
@@ -484,7 +688,9 @@ static void wake_lock_internal(
 				queue_work(suspend_work_queue, &suspend_work);
 		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	if (type_locked)
+		spin_unlock(&t->lock);
+	local_irq_restore(irqflags);
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -503,40 +709,63 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
+	struct wake_lock_type *t;
+	struct wake_lock_bucket *b;
+	bool type_locked, timed, last;
+
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
+	t = &wake_lock_types[type];
+	b = wake_lock_bucket(lock);
+	local_irq_save(irqflags);
+	type_locked = wake_lock_lock_state(t, b, lock, false);
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 0);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	timed = lock->flags & WAKE_LOCK_AUTO_EXPIRE;
+	last = wake_lock_dequeue_locked(t, lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
+	spin_unlock(&b->lock);
+
 	if (type == WAKE_LOCK_SUSPEND) {
-		long has_lock = has_wake_lock_locked(type);
-		if (has_lock > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_unlock: %s, start expire timer, "
-					"%ld\n", lock->name, has_lock);
-			mod_timer(&expire_timer, jiffies + has_lock);
-		} else {
-			if (del_timer(&expire_timer))
+		/* Nothing changes while other untimed locks are held */
+		if (timed || last) {
+			long has_lock;
+
+			if (!type_locked) {
+				spin_lock(&t->lock);
+				type_locked = true;
+			}
+			has_lock = has_wake_lock_locked(type);
+			if (has_lock > 0) {
 				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_unlock: %s, stop expire "
-						"timer\n", lock->name);
-			if (has_lock == 0)
-				queue_work(suspend_work_queue, &suspend_work);
+					pr_info("wake_unlock: %s, start expire "
+						"timer, %ld\n", lock->name,
+						has_lock);
+				mod_timer(&expire_timer, jiffies + has_lock);
+			} else {
+				if (del_timer(&expire_timer))
+					if (debug_mask & DEBUG_EXPIRE)
+						pr_info("wake_unlock: %s, stop "
+							"expire timer\n",
+							lock->name);
+				if (has_lock == 0)
+					queue_work(suspend_work_queue,
+						   &suspend_work);
+			}
 		}
 		if (lock == &main_wake_lock) {
 			if (debug_mask & DEBUG_SUSPEND)
 				print_active_locks(WAKE_LOCK_SUSPEND);
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats(0);
 #endif
 		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	if (type_locked)
+		spin_unlock(&t->lock);
+	local_irq_restore(irqflags);
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -562,10 +791,6 @@ static const struct file_operations wakelock_stats_fops = {
 static int __init wakelocks_init(void)
 {
 	int ret;
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
-		INIT_LIST_HEAD(&active_wake_locks[i]);
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -0,0 +1,139 @@
+/*
+ *  LZ4 block compressor
+ *
+ *  A single-pass greedy LZ77 parser: a hash of the next four input
+ *  bytes indexes the last position they were seen at, and a match is
+ *  emitted as soon as one is confirmed. There is no lazy evaluation
+ *  and no entropy coding, which keeps it several times faster than
+ *  LZO at a small cost in ratio.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned_le32(p) * 2654435761U) >>
+		(32 - LZ4_HASH_LOG);
+}
+
+/* Emit a length that did not fit in its token nibble */
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - LZ4_MFLIMIT;
+	const unsigned char * const matchlimit = iend - LZ4_LASTLITERALS;
+	const unsigned char *ip = src, *anchor = src, *ref;
+	unsigned char * const oend = dst + *dst_len;
+	unsigned char *op = dst, *token;
+	u32 *table = wrkmem;
+	size_t len;
+	u32 h, search = 1U << LZ4_SKIP_TRIGGER;
+
+	if (src_len < LZ4_MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+	table[lz4_hash(ip)] = 0;
+	ip++;
+
+	while (ip < mflimit) {
+		h = lz4_hash(ip);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ip - ref > LZ4_MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) !=
+		    get_unaligned((const u32 *)ip)) {
+			ip += search++ >> LZ4_SKIP_TRIGGER;
+			continue;
+		}
+		search = 1U << LZ4_SKIP_TRIGGER;
+
+		/* Extend the match backwards over pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Worst case for literals, offset and the last literals */
+		len = ip - anchor;
+		if (op + 1 + len + len / 255 + 2 + LZ4_LASTLITERALS > oend)
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		token = op++;
+		if (len >= LZ4_RUN_MASK) {
+			*token = LZ4_RUN_MASK << LZ4_ML_BITS;
+			op = lz4_put_length(op, len - LZ4_RUN_MASK);
+		} else {
+			*token = len << LZ4_ML_BITS;
+		}
+		memcpy(op, anchor, len);
+		op += len;
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		ip += LZ4_MINMATCH;
+		ref += LZ4_MINMATCH;
+		anchor = ip;
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		len = ip - anchor;
+		if (len >= LZ4_ML_MASK) {
+			if (op + 1 + len / 255 + LZ4_LASTLITERALS > oend)
+				return LZ4_E_OUTPUT_OVERRUN;
+			*token |= LZ4_ML_MASK;
+			op = lz4_put_length(op, len - LZ4_ML_MASK);
+		} else {
+			*token |= len;
+		}
+		anchor = ip;
+
+		if (ip >= mflimit)
+			break;
+
+		/* Index a position inside the match to help the next one */
+		table[lz4_hash(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	len = iend - anchor;
+	if (op + 1 + len + len / 255 > oend)
+		return LZ4_E_OUTPUT_OVERRUN;
+
+	if (len >= LZ4_RUN_MASK) {
+		*op++ = LZ4_RUN_MASK << LZ4_ML_BITS;
+		op = lz4_put_length(op, len - LZ4_RUN_MASK);
+	} else {
+		*op++ = len << LZ4_ML_BITS;
+	}
+	memcpy(op, anchor, len);
+	op += len;
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
@@ -0,0 +1,102 @@
+/*
+ *  LZ4 block decompressor
+ *
+ *  Every length and offset read from the input is checked against
+ *  both buffers, so corrupted input yields an error rather than an
+ *  out-of-bounds access.
+ */
+
+#ifndef STATIC
+#include <linux/module.h>
+#include <linux/kernel.h>
+#endif
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Read the extension bytes of a length whose nibble was saturated */
+static inline int lz4_get_length(const unsigned char **ipp,
+		const unsigned char *iend, size_t *len)
+{
+	const unsigned char *ip = *ipp;
+	unsigned char s;
+
+	do {
+		if (unlikely(ip >= iend))
+			return LZ4_E_INPUT_OVERRUN;
+		s = *ip++;
+		*len += s;
+	} while (s == 255);
+
+	*ipp = ip;
+	return LZ4_E_OK;
+}
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char * const iend = src + src_len;
+	unsigned char * const oend = dst + *dst_len;
+	const unsigned char *ip = src;
+	unsigned char *op = dst, *ref;
+	unsigned int token;
+	size_t len, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		len = token >> LZ4_ML_BITS;
+		if (len == LZ4_RUN_MASK &&
+		    lz4_get_length(&ip, iend, &len))
+			return LZ4_E_INPUT_OVERRUN;
+
+		if (unlikely(len > iend - ip))
+			return LZ4_E_INPUT_OVERRUN;
+		if (unlikely(len > oend - op))
+			return LZ4_E_OUTPUT_OVERRUN;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* The last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		if (unlikely(iend - ip < 2))
+			return LZ4_E_INPUT_OVERRUN;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > op - dst))
+			return LZ4_E_LOOKBEHIND_OVERRUN;
+
+		len = token & LZ4_ML_MASK;
+		if (len == LZ4_ML_MASK &&
+		    lz4_get_length(&ip, iend, &len))
+			return LZ4_E_INPUT_OVERRUN;
+		len += LZ4_MINMATCH;
+
+		if (unlikely(len > oend - op))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* Overlapping copy repeats the last @offset bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+#ifndef STATIC
+EXPORT_SYMBOL_GPL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ *  lz4defs.h -- constants of the LZ4 block format
+ *
+ *  A block is a sequence of (token, literals, offset, match) groups.
+ *  The token holds the literal length in its high nibble and the
+ *  match length minus LZ4_MINMATCH in its low nibble; a nibble of 15
+ *  is extended by following bytes, each adding up to 255. The last
+ *  group carries literals only.
+ */
+
+#define LZ4_MINMATCH		4
+
+/* The last match must start at least this far from the end */
+#define LZ4_MFLIMIT		12
+
+/* The last bytes of a block are always literals */
+#define LZ4_LASTLITERALS	5
+
+#define LZ4_MAX_DISTANCE	65535
+
+#define LZ4_ML_BITS		4
+#define LZ4_ML_MASK		((1U << LZ4_ML_BITS) - 1)
+#define LZ4_RUN_BITS		(8 - LZ4_ML_BITS)
+#define LZ4_RUN_MASK		((1U << LZ4_RUN_BITS) - 1)
+
+/* Skip ahead faster through data that does not compress */
+#define LZ4_SKIP_TRIGGER	6
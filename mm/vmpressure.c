@@ -0,0 +1,369 @@
+/* mm/vmpressure.c
+ *
+ * Memory pressure notifications, based on reclaim efficiency.
+ *
+ * Free memory alone says little about how hard the system is working to
+ * keep it free: with enough clean page cache the free counts look healthy
+ * right up to the point where reclaim starts evicting the working set and
+ * everything stalls. What does give this away is the ratio of pages
+ * reclaimed to pages scanned. We accumulate both over a window of scanned
+ * pages and turn the ratio into a level, which is reported to in-kernel
+ * notifiers and to userspace through /dev/vmpressure.
+ *
+ * Userspace protocol: each open file listens for events at or above a
+ * threshold level, "low" by default. Writing "<level>" changes it; writing
+ * "<level> <fd>" also registers an eventfd to be signalled. poll() reports
+ * the file readable when an event has occurred since the last read, and
+ * read() returns the level of the latest such event as text.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/eventfd.h>
+#include <linux/notifier.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+#include <linux/vmpressure.h>
+
+/* Pages scanned before the reclaim efficiency is evaluated */
+#define VMPRESSURE_WIN	(SWAP_CLUSTER_MAX * 16)
+
+/* Pressure, in percent of scanned pages not reclaimed, for each level */
+static unsigned int vmpressure_level_med = 60;
+static unsigned int vmpressure_level_critical = 95;
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+/* reclaim accounting, fed from shrink_zone */
+static DEFINE_SPINLOCK(vmpressure_sr_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+
+/*
+ * vmpressure_seq[l] counts events at level l or above; a listener with
+ * threshold l has something to read when it differs from what it saw.
+ */
+static DEFINE_SPINLOCK(vmpressure_event_lock);
+static unsigned long vmpressure_seq[VMPRESSURE_NUM_LEVELS];
+static enum vmpressure_levels vmpressure_last;
+static DECLARE_WAIT_QUEUE_HEAD(vmpressure_wait);
+
+/* open files, for eventfd delivery */
+static DEFINE_MUTEX(vmpressure_listeners_lock);
+static LIST_HEAD(vmpressure_listeners);
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+struct vmpressure_listener {
+	struct list_head list;
+	enum vmpressure_levels threshold;
+	unsigned long seen;
+	struct eventfd_ctx *efd;
+};
+
+static enum vmpressure_levels vmpressure_calc_level(unsigned long scanned,
+						    unsigned long reclaimed)
+{
+	unsigned long pressure;
+
+	/* reclaimed can exceed scanned when freeing huge or slab pages */
+	if (reclaimed >= scanned)
+		return VMPRESSURE_LOW;
+
+	pressure = (scanned - reclaimed) * 100 / scanned;
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static void vmpressure_event(enum vmpressure_levels level)
+{
+	struct vmpressure_listener *l;
+	int i;
+
+	spin_lock(&vmpressure_event_lock);
+	for (i = 0; i <= level; i++)
+		vmpressure_seq[i]++;
+	vmpressure_last = level;
+	spin_unlock(&vmpressure_event_lock);
+	wake_up_interruptible(&vmpressure_wait);
+
+	mutex_lock(&vmpressure_listeners_lock);
+	list_for_each_entry(l, &vmpressure_listeners, list)
+		if (l->efd && level >= l->threshold)
+			eventfd_signal(l->efd, 1);
+	mutex_unlock(&vmpressure_listeners_lock);
+
+	blocking_notifier_call_chain(&vmpressure_notifier, level, NULL);
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	unsigned long scanned, reclaimed;
+
+	spin_lock(&vmpressure_sr_lock);
+	scanned = vmpressure_scanned;
+	reclaimed = vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_sr_lock);
+
+	/* another run of the work already consumed the window */
+	if (!scanned)
+		return;
+
+	vmpressure_event(vmpressure_calc_level(scanned, reclaimed));
+}
+
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+/**
+ * vmpressure() - account reclaim efficiency
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called from global reclaim after each pass over a zone's LRU lists.
+ * This is on the reclaim path, so it only accumulates the numbers and
+ * leaves the evaluation and the notifications to a work item.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	/*
+	 * Allocations that can neither do I/O nor use highmem or movable
+	 * pages have their own reasons to fail reclaim; they say nothing
+	 * about the pressure on the system as a whole.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_sr_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	scanned = vmpressure_scanned;
+	spin_unlock(&vmpressure_sr_lock);
+
+	if (scanned < VMPRESSURE_WIN)
+		return;
+	schedule_work(&vmpressure_work);
+}
+
+int vmpressure_register_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_register_notifier);
+
+int vmpressure_unregister_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_unregister_notifier);
+
+static int vmpressure_parse_level(const char *str, size_t len)
+{
+	int i;
+
+	for (i = 0; i < VMPRESSURE_NUM_LEVELS; i++)
+		if (strlen(vmpressure_str_levels[i]) == len &&
+		    !strncmp(str, vmpressure_str_levels[i], len))
+			return i;
+	return -EINVAL;
+}
+
+/* has an event at or above the listener's threshold not been read yet? */
+static bool vmpressure_pending(struct vmpressure_listener *l)
+{
+	bool ret;
+
+	spin_lock(&vmpressure_event_lock);
+	ret = vmpressure_seq[l->threshold] != l->seen;
+	spin_unlock(&vmpressure_event_lock);
+	return ret;
+}
+
+static int vmpressure_open(struct inode *inode, struct file *file)
+{
+	struct vmpressure_listener *l;
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (unlikely(ret))
+		return ret;
+
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (unlikely(!l))
+		return -ENOMEM;
+
+	l->threshold = VMPRESSURE_LOW;
+	spin_lock(&vmpressure_event_lock);
+	l->seen = vmpressure_seq[l->threshold];
+	spin_unlock(&vmpressure_event_lock);
+
+	mutex_lock(&vmpressure_listeners_lock);
+	list_add_tail(&l->list, &vmpressure_listeners);
+	mutex_unlock(&vmpressure_listeners_lock);
+
+	file->private_data = l;
+	return 0;
+}
+
+static int vmpressure_release(struct inode *ignored, struct file *file)
+{
+	struct vmpressure_listener *l = file->private_data;
+
+	mutex_lock(&vmpressure_listeners_lock);
+	list_del(&l->list);
+	mutex_unlock(&vmpressure_listeners_lock);
+
+	if (l->efd)
+		eventfd_ctx_put(l->efd);
+	kfree(l);
+	return 0;
+}
+
+static ssize_t vmpressure_read(struct file *file, char __user *buf,
+			       size_t len, loff_t *pos)
+{
+	struct vmpressure_listener *l = file->private_data;
+	enum vmpressure_levels level;
+	char tmp[16];
+	int ret;
+
+	while (!vmpressure_pending(l)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(vmpressure_wait,
+					       vmpressure_pending(l));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&vmpressure_event_lock);
+	l->seen = vmpressure_seq[l->threshold];
+	level = vmpressure_last;
+	spin_unlock(&vmpressure_event_lock);
+
+	/* the latest event may be below the threshold that woke us */
+	if (level < l->threshold)
+		level = l->threshold;
+
+	ret = scnprintf(tmp, sizeof(tmp), "%s\n", vmpressure_str_levels[level]);
+	if (len < ret)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, ret))
+		return -EFAULT;
+	return ret;
+}
+
+static ssize_t vmpressure_write(struct file *file, const char __user *buf,
+				size_t len, loff_t *pos)
+{
+	struct vmpressure_listener *l = file->private_data;
+	struct eventfd_ctx *efd = NULL;
+	char tmp[32], *sep;
+	size_t level_len;
+	int level, fd;
+
+	if (len >= sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(tmp, buf, len))
+		return -EFAULT;
+	tmp[len] = '\0';
+
+	sep = strpbrk(tmp, " \n");
+	level_len = sep ? sep - tmp : len;
+	level = vmpressure_parse_level(tmp, level_len);
+	if (level < 0)
+		return level;
+
+	if (sep && *sep == ' ') {
+		if (sscanf(sep + 1, "%d", &fd) != 1)
+			return -EINVAL;
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	mutex_lock(&vmpressure_listeners_lock);
+	spin_lock(&vmpressure_event_lock);
+	l->threshold = level;
+	l->seen = vmpressure_seq[level];
+	spin_unlock(&vmpressure_event_lock);
+	if (efd) {
+		swap(l->efd, efd);
+		if (efd)
+			eventfd_ctx_put(efd);
+	}
+	mutex_unlock(&vmpressure_listeners_lock);
+
+	return len;
+}
+
+static unsigned int vmpressure_poll(struct file *file, poll_table *wait)
+{
+	struct vmpressure_listener *l = file->private_data;
+
+	poll_wait(file, &vmpressure_wait, wait);
+	return vmpressure_pending(l) ? POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations vmpressure_fops = {
+	.owner = THIS_MODULE,
+	.open = vmpressure_open,
+	.release = vmpressure_release,
+	.read = vmpressure_read,
+	.write = vmpressure_write,
+	.poll = vmpressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice vmpressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "vmpressure",
+	.fops = &vmpressure_fops,
+};
+
+static int __init vmpressure_init(void)
+{
+	int ret;
+
+	ret = misc_register(&vmpressure_misc);
+	if (unlikely(ret)) {
+		printk(KERN_ERR "vmpressure: failed to register misc device!\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+module_param_named(level_medium, vmpressure_level_med, uint, S_IRUGO | S_IWUSR);
+module_param_named(level_critical, vmpressure_level_critical, uint,
+		   S_IRUGO | S_IWUSR);
+
+module_init(vmpressure_init);
+
+MODULE_LICENSE("GPL");
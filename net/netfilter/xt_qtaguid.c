@@ -15,11 +15,14 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
+#include <linux/rculist.h>
 #include <linux/skbuff.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 #include <net/addrconf.h>
 #include <net/sock.h>
@@ -45,6 +48,7 @@ static unsigned int proc_iface_perms = S_IRUGO;
 module_param_named(iface_perms, proc_iface_perms, uint, S_IRUGO | S_IWUSR);
 
 static struct proc_dir_entry *xt_qtaguid_stats_file;
+static struct proc_dir_entry *xt_qtaguid_stats_bin_file;
 static unsigned int proc_stats_perms = S_IRUGO;
 module_param_named(stats_perms, proc_stats_perms, uint, S_IRUGO | S_IWUSR);
 
@@ -124,6 +128,12 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  * Notice how sock_tag_list_lock is held sometimes when uid_tag_data_tree_lock
  * is acquired.
  *
+ * The packet path takes none of the global locks: iface_stat_list,
+ * sock_tag_hash and tag_counter_set_hash are read under rcu_read_lock(),
+ * their locks only serialize the writers, and nothing is freed from them
+ * before a grace period has passed. The same goes for the tag_stats, whose
+ * per-cpu counters are updated after dropping tag_stat_list_lock.
+ *
  * Call tree with all lock holders as of 2011-09-25:
  *
  * iface_stat_all_proc_read()
@@ -132,11 +142,11 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  *
  * qtaguid_ctrl_proc_read()
  *   sock_tag_list_lock
- *     (sock_tag_tree)
+ *     (sock_tag_hash)
  *     (struct proc_qtu_data->sock_tag_list)
  *   prdebug_full_state()
  *     sock_tag_list_lock
- *       (sock_tag_tree)
+ *       (sock_tag_hash)
  *     uid_tag_data_tree_lock
  *       (uid_tag_data_tree)
  *       (proc_qtu_data_tree)
@@ -146,6 +156,10 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  *   iface_stat_list_lock
  *     struct iface_stat->tag_stat_list_lock
  *
+ * qtaguid_stats_bin_read()
+ *   iface_stat_list_lock
+ *     struct iface_stat->tag_stat_list_lock
+ *
  * qtudev_open()
  *   uid_tag_data_tree_lock
  *
@@ -178,15 +192,15 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  * qtaguid_mt()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       rcu_read_lock
+ *         (iface_stat_list)
+ *         get_sock_stat()
+ *           (sock_tag_hash)
+ *         struct iface_stat->tag_stat_list_lock
+ *           (struct iface_stat->tag_stat_tree)
  *         tag_stat_update()
  *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *             (tag_counter_set_hash)
  *
  *
  * qtaguid_ctrl_parse()
@@ -200,7 +214,7 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  *     tag_counter_set_list_lock
  *   ctrl_cmd_tag()
  *     sock_tag_list_lock
- *       (sock_tag_tree)
+ *       (sock_tag_hash)
  *       get_tag_ref()
  *         uid_tag_data_tree_lock
  *           (uid_tag_data_tree)
@@ -214,10 +228,12 @@ static struct proc_dir_entry *iface_stat_all_procfile;
 static LIST_HEAD(iface_stat_list);
 static DEFINE_SPINLOCK(iface_stat_list_lock);
 
-static struct rb_root sock_tag_tree = RB_ROOT;
+#define SOCK_TAG_HASH_BITS 8
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
 static DEFINE_SPINLOCK(sock_tag_list_lock);
 
-static struct rb_root tag_counter_set_tree = RB_ROOT;
+#define TAG_COUNTER_SET_HASH_BITS 6
+static struct hlist_head tag_counter_set_hash[1 << TAG_COUNTER_SET_HASH_BITS];
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
 
 static struct rb_root uid_tag_data_tree = RB_ROOT;
@@ -227,6 +243,12 @@ static struct rb_root proc_qtu_data_tree = RB_ROOT;
 /* No proc_qtu_data_tree_lock; use uid_tag_data_tree_lock */
 
 static struct qtaguid_event_counts qtu_events;
+
+/*
+ * Bumped by every binary stats snapshot; counters remember the value
+ * current when they last changed, see struct xt_qtaguid_stats_hdr.
+ */
+static atomic64_t qtu_stats_gen;
 /*----------------------------------------------*/
 static bool can_manipulate_uids(void)
 {
@@ -248,14 +270,55 @@ static bool can_read_other_uid_stats(uid_t uid)
 		|| in_egroup_p(proc_stats_readall_gid);
 }
 
-static inline void dc_add_byte_packets(struct data_counters *counters, int set,
+/* Called from the matching function, with BHs off */
+static inline void dc_add_byte_packets(struct data_counters_pcpu *pcpu,
+				  int set,
 				  enum ifs_tx_rx direction,
 				  enum ifs_proto ifs_proto,
 				  int bytes,
 				  int packets)
 {
-	counters->bpc[set][direction][ifs_proto].bytes += bytes;
-	counters->bpc[set][direction][ifs_proto].packets += packets;
+	struct data_counters_pcpu *counters = &pcpu[smp_processor_id()];
+	u64 gen = atomic64_read(&qtu_stats_gen);
+
+	u64_stats_update_begin(&counters->syncp);
+	counters->dc.bpc[set][direction][ifs_proto].bytes += bytes;
+	counters->dc.bpc[set][direction][ifs_proto].packets += packets;
+	counters->gen = gen;
+	u64_stats_update_end(&counters->syncp);
+}
+
+/*
+ * Add up the per-cpu counters of a tag_stat into sum.
+ * Returns the stats generation of their latest change.
+ */
+u64 data_counters_sum(const struct data_counters_pcpu *pcpu,
+		      struct data_counters *sum)
+{
+	struct byte_packet_counters *total = &sum->bpc[0][0][0];
+	const struct byte_packet_counters *part;
+	const int nr_counters = sizeof(*sum) / sizeof(*total);
+	struct data_counters snap;
+	unsigned int start;
+	u64 gen, max_gen = 0;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		do {
+			start = u64_stats_fetch_begin(&pcpu[cpu].syncp);
+			snap = pcpu[cpu].dc;
+			gen = pcpu[cpu].gen;
+		} while (u64_stats_fetch_retry(&pcpu[cpu].syncp, start));
+		max_gen = max(max_gen, gen);
+
+		part = &snap.bpc[0][0][0];
+		for (i = 0; i < nr_counters; i++) {
+			total[i].bytes += part[i].bytes;
+			total[i].packets += part[i].packets;
+		}
+	}
+	return max_gen;
 }
 
 static inline uint64_t dc_sum_bytes(struct data_counters *counters,
@@ -339,20 +402,21 @@ static struct tag_stat *tag_stat_tree_search(struct rb_root *root, tag_t tag)
 	return rb_entry(&node->node, struct tag_stat, tn.node);
 }
 
-static void tag_counter_set_tree_insert(struct tag_counter_set *data,
-					struct rb_root *root)
+static struct hlist_head *tag_counter_set_bucket(tag_t tag)
 {
-	tag_node_tree_insert(&data->tn, root);
+	return &tag_counter_set_hash[hash_64(tag, TAG_COUNTER_SET_HASH_BITS)];
 }
 
-static struct tag_counter_set *tag_counter_set_tree_search(struct rb_root *root,
-							   tag_t tag)
+/* Caller must hold tag_counter_set_list_lock or rcu_read_lock() */
+static struct tag_counter_set *tag_counter_set_lookup(tag_t tag)
 {
-	struct tag_node *node = tag_node_tree_search(root, tag);
-	if (!node)
-		return NULL;
-	return rb_entry(&node->node, struct tag_counter_set, tn.node);
+	struct tag_counter_set *tcs;
+	struct hlist_node *pos;
 
+	hlist_for_each_entry_rcu(tcs, pos, tag_counter_set_bucket(tag), node)
+		if (tcs->tag == tag)
+			return tcs;
+	return NULL;
 }
 
 static void tag_ref_tree_insert(struct tag_ref *data, struct rb_root *root)
@@ -368,63 +432,47 @@ static struct tag_ref *tag_ref_tree_search(struct rb_root *root, tag_t tag)
 	return rb_entry(&node->node, struct tag_ref, tn.node);
 }
 
-static struct sock_tag *sock_tag_tree_search(struct rb_root *root,
-					     const struct sock *sk)
+static struct hlist_head *sock_tag_bucket(const struct sock *sk)
 {
-	struct rb_node *node = root->rb_node;
-
-	while (node) {
-		struct sock_tag *data = rb_entry(node, struct sock_tag,
-						 sock_node);
-		if (sk < data->sk)
-			node = node->rb_left;
-		else if (sk > data->sk)
-			node = node->rb_right;
-		else
-			return data;
-	}
-	return NULL;
+	return &sock_tag_hash[hash_ptr(sk, SOCK_TAG_HASH_BITS)];
 }
 
-static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
+/* Caller must hold sock_tag_list_lock or rcu_read_lock() */
+static struct sock_tag *sock_tag_lookup(const struct sock *sk)
 {
-	struct rb_node **new = &(root->rb_node), *parent = NULL;
+	struct sock_tag *st_entry;
+	struct hlist_node *pos;
 
-	/* Figure out where to put new node */
-	while (*new) {
-		struct sock_tag *this = rb_entry(*new, struct sock_tag,
-						 sock_node);
-		parent = *new;
-		if (data->sk < this->sk)
-			new = &((*new)->rb_left);
-		else if (data->sk > this->sk)
-			new = &((*new)->rb_right);
-		else
-			BUG();
-	}
+	hlist_for_each_entry_rcu(st_entry, pos, sock_tag_bucket(sk), sock_node)
+		if (st_entry->sk == sk)
+			return st_entry;
+	return NULL;
+}
 
-	/* Add new node and rebalance tree. */
-	rb_link_node(&data->sock_node, parent, new);
-	rb_insert_color(&data->sock_node, root);
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_insert(struct sock_tag *st_entry)
+{
+	BUG_ON(sock_tag_lookup(st_entry->sk));
+	hlist_add_head_rcu(&st_entry->sock_node, sock_tag_bucket(st_entry->sk));
 }
 
-static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
+/*
+ * Free sock_tags already unhashed, and collected on st_to_free_list
+ * through their list member.
+ */
+static void sock_tag_list_free(struct list_head *st_to_free_list)
 {
-	struct rb_node *node;
-	struct sock_tag *st_entry;
+	struct sock_tag *st_entry, *next;
 
-	node = rb_first(st_to_free_tree);
-	while (node) {
-		st_entry = rb_entry(node, struct sock_tag, sock_node);
-		node = rb_next(node);
+	list_for_each_entry_safe(st_entry, next, st_to_free_list, list) {
 		CT_DEBUG("qtaguid: %s(): "
 			 "erase st: sk=%p tag=0x%llx (uid=%u)\n", __func__,
 			 st_entry->sk,
 			 st_entry->tag,
 			 get_uid_from_tag(st_entry->tag));
-		rb_erase(&st_entry->sock_node, st_to_free_tree);
+		list_del(&st_entry->list);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		kfree_rcu(st_entry, rcu);
 	}
 }
 
@@ -745,17 +793,17 @@ static int get_active_counter_set(tag_t tag)
 		 tag, get_uid_from_tag(tag));
 	/* For now we only handle UID tags for active sets */
 	tag = get_utag_from_tag(tag);
-	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
+	rcu_read_lock();
+	tcs = tag_counter_set_lookup(tag);
 	if (tcs)
-		active_set = tcs->active_set;
-	spin_unlock_bh(&tag_counter_set_list_lock);
+		active_set = ACCESS_ONCE(tcs->active_set);
+	rcu_read_unlock();
 	return active_set;
 }
 
 /*
  * Find the entry for tracking the specified interface.
- * Caller must hold iface_stat_list_lock
+ * Caller must hold iface_stat_list_lock or rcu_read_lock()
  */
 static struct iface_stat *get_iface_entry(const char *ifname)
 {
@@ -768,7 +816,7 @@ static struct iface_stat *get_iface_entry(const char *ifname)
 	}
 
 	/* Iterate over interfaces */
-	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
 		if (!strcmp(ifname, iface_entry->ifname))
 			goto done;
 	}
@@ -941,7 +989,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1125,26 +1173,24 @@ done_put:
 	in_dev_put(in_dev);
 }
 
+/* Caller must hold sock_tag_list_lock */
 static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 {
 	MT_DEBUG("qtaguid: get_sock_stat_nl(sk=%p)\n", sk);
-	return sock_tag_tree_search(&sock_tag_tree, sk);
+	return sock_tag_lookup(sk);
 }
 
+/* Caller must hold rcu_read_lock() */
 static struct sock_tag *get_sock_stat(const struct sock *sk)
 {
-	struct sock_tag *sock_tag_entry;
 	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
 	if (!sk)
 		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+	return sock_tag_lookup(sk);
 }
 
 static void
-data_counters_update(struct data_counters *dc, int set,
+data_counters_update(struct data_counters_pcpu *dc, int set,
 		     enum ifs_tx_rx direction, int proto, int bytes)
 {
 	switch (proto) {
@@ -1225,7 +1271,7 @@ static void tag_stat_update(struct tag_stat *tag_entry,
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
+	data_counters_update(tag_entry->counters, active_set, direction,
 			     proto, bytes);
 	if (tag_entry->parent_counters)
 		data_counters_update(tag_entry->parent_counters, active_set,
@@ -1244,7 +1290,10 @@ static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
 		 " (uid=%u)\n", __func__,
 		 iface_entry, tag, get_uid_from_tag(tag));
-	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry), GFP_ATOMIC);
+	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry) +
+				     nr_cpu_ids *
+				     sizeof(new_tag_stat_entry->counters[0]),
+				     GFP_ATOMIC);
 	if (!new_tag_stat_entry) {
 		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
 		goto done;
@@ -1262,7 +1311,6 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	struct tag_stat *tag_stat_entry;
 	tag_t tag, acct_tag;
 	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
 	struct sock_tag *sock_tag_entry;
 	struct iface_stat *iface_entry;
 	struct tag_stat *new_tag_stat;
@@ -1270,12 +1318,14 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
 		 ifname, uid, sk, direction, proto, bytes);
 
+	/* Nothing found below is freed before rcu_read_unlock() */
+	rcu_read_lock();
 
 	iface_entry = get_iface_entry(ifname);
 	if (!iface_entry) {
 		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
 		       ifname);
-		return;
+		goto unlock;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
@@ -1302,17 +1352,14 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
 	spin_lock_bh(&iface_entry->tag_stat_list_lock);
 
+	/*
+	 * Updating the {acct_tag, uid_tag} entry handles both stats:
+	 * {0, uid_tag} will also get updated.
+	 */
 	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
 					      tag);
-	if (tag_stat_entry) {
-		/*
-		 * Updating the {acct_tag, uid_tag} entry handles both stats:
-		 * {0, uid_tag} will also get updated.
-		 */
-		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
-	}
+	if (tag_stat_entry)
+		goto unlock_update;
 
 	/* Loop over tag list under this interface for {0,uid_tag} */
 	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
@@ -1323,18 +1370,25 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 		 * No parent counters. So
 		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
 		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
-	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
+		tag_stat_entry = create_if_tag_stat(iface_entry, uid_tag);
+		if (!tag_stat_entry)
+			goto unlock_update;
 	}
 
 	if (acct_tag) {
 		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
+		if (new_tag_stat)
+			new_tag_stat->parent_counters =
+				tag_stat_entry->counters;
+		tag_stat_entry = new_tag_stat;
 	}
-	tag_stat_update(new_tag_stat, direction, proto, bytes);
+
+unlock_update:
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	if (tag_stat_entry)
+		tag_stat_update(tag_stat_entry, direction, proto, bytes);
+unlock:
+	rcu_read_unlock();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1725,7 +1779,8 @@ static void prdebug_full_state(int indent_level, const char *fmt, ...)
 	va_end(args);
 
 	spin_lock_bh(&sock_tag_list_lock);
-	prdebug_sock_tag_tree(indent_level, &sock_tag_tree);
+	prdebug_sock_tag_hash(indent_level, sock_tag_hash,
+			      ARRAY_SIZE(sock_tag_hash));
 	spin_unlock_bh(&sock_tag_list_lock);
 
 	spin_lock_bh(&sock_tag_list_lock);
@@ -1756,9 +1811,10 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 	char *outp = page;
 	int len;
 	uid_t uid;
-	struct rb_node *node;
+	struct hlist_node *pos;
 	struct sock_tag *sock_tag_entry;
 	int item_index = 0;
+	int i;
 	int indent_level = 0;
 	long f_count;
 
@@ -1774,37 +1830,36 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 		page, items_to_skip, char_count, *eof);
 
 	spin_lock_bh(&sock_tag_list_lock);
-	for (node = rb_first(&sock_tag_tree);
-	     node;
-	     node = rb_next(node)) {
-		if (item_index++ < items_to_skip)
-			continue;
-		sock_tag_entry = rb_entry(node, struct sock_tag, sock_node);
-		uid = get_uid_from_tag(sock_tag_entry->tag);
-		CT_DEBUG("qtaguid: proc_read(): sk=%p tag=0x%llx (uid=%u) "
-			 "pid=%u\n",
-			 sock_tag_entry->sk,
-			 sock_tag_entry->tag,
-			 uid,
-			 sock_tag_entry->pid
-			);
-		f_count = atomic_long_read(
-			&sock_tag_entry->socket->file->f_count);
-		len = snprintf(outp, char_count,
-			       "sock=%p tag=0x%llx (uid=%u) pid=%u "
-			       "f_count=%lu\n",
-			       sock_tag_entry->sk,
-			       sock_tag_entry->tag, uid,
-			       sock_tag_entry->pid, f_count);
-		if (len >= char_count) {
-			spin_unlock_bh(&sock_tag_list_lock);
-			*outp = '\0';
-			return outp - page;
+	for (i = 0; i < ARRAY_SIZE(sock_tag_hash); i++)
+		hlist_for_each_entry(sock_tag_entry, pos, &sock_tag_hash[i],
+				     sock_node) {
+			if (item_index++ < items_to_skip)
+				continue;
+			uid = get_uid_from_tag(sock_tag_entry->tag);
+			CT_DEBUG("qtaguid: proc_read(): sk=%p tag=0x%llx "
+				 "(uid=%u) pid=%u\n",
+				 sock_tag_entry->sk,
+				 sock_tag_entry->tag,
+				 uid,
+				 sock_tag_entry->pid
+				);
+			f_count = atomic_long_read(
+				&sock_tag_entry->socket->file->f_count);
+			len = snprintf(outp, char_count,
+				       "sock=%p tag=0x%llx (uid=%u) pid=%u "
+				       "f_count=%lu\n",
+				       sock_tag_entry->sk,
+				       sock_tag_entry->tag, uid,
+				       sock_tag_entry->pid, f_count);
+			if (len >= char_count) {
+				spin_unlock_bh(&sock_tag_list_lock);
+				*outp = '\0';
+				return outp - page;
+			}
+			outp += len;
+			char_count -= len;
+			(*num_items_returned)++;
 		}
-		outp += len;
-		char_count -= len;
-		(*num_items_returned)++;
-	}
 	spin_unlock_bh(&sock_tag_list_lock);
 
 	if (item_index++ >= items_to_skip) {
@@ -1864,12 +1919,14 @@ static int ctrl_cmd_delete(const char *input)
 	int res, argc;
 	struct iface_stat *iface_entry;
 	struct rb_node *node;
+	struct hlist_node *pos, *next;
 	struct sock_tag *st_entry;
-	struct rb_root st_to_free_tree = RB_ROOT;
+	LIST_HEAD(st_to_free_list);
 	struct tag_stat *ts_entry;
 	struct tag_counter_set *tcs_entry;
 	struct tag_ref *tr_entry;
 	struct uid_tag_data *utd_entry;
+	int i;
 
 	argc = sscanf(input, "%c %llu %u", &cmd, &acct_tag, &uid);
 	CT_DEBUG("qtaguid: ctrl_delete(%s): argc=%d cmd=%c "
@@ -1901,52 +1958,56 @@ static int ctrl_cmd_delete(const char *input)
 
 	/* Delete socket tags */
 	spin_lock_bh(&sock_tag_list_lock);
-	node = rb_first(&sock_tag_tree);
-	while (node) {
-		st_entry = rb_entry(node, struct sock_tag, sock_node);
-		entry_uid = get_uid_from_tag(st_entry->tag);
-		node = rb_next(node);
-		if (entry_uid != uid)
-			continue;
+	for (i = 0; i < ARRAY_SIZE(sock_tag_hash); i++)
+		hlist_for_each_entry_safe(st_entry, pos, next,
+					  &sock_tag_hash[i], sock_node) {
+			entry_uid = get_uid_from_tag(st_entry->tag);
+			if (entry_uid != uid)
+				continue;
 
-		CT_DEBUG("qtaguid: ctrl_delete(%s): st tag=0x%llx (uid=%u)\n",
-			 input, st_entry->tag, entry_uid);
-
-		if (!acct_tag || st_entry->tag == tag) {
-			rb_erase(&st_entry->sock_node, &sock_tag_tree);
-			/* Can't sockfd_put() within spinlock, do it later. */
-			sock_tag_tree_insert(st_entry, &st_to_free_tree);
-			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
-			BUG_ON(tr_entry->num_sock_tags <= 0);
-			tr_entry->num_sock_tags--;
-			/*
-			 * TODO: remove if, and start failing.
-			 * This is a hack to work around the fact that in some
-			 * places we have "if (IS_ERR_OR_NULL(pqd_entry))"
-			 * and are trying to work around apps
-			 * that didn't open the /dev/xt_qtaguid.
-			 */
-			if (st_entry->list.next && st_entry->list.prev)
-				list_del(&st_entry->list);
+			CT_DEBUG("qtaguid: ctrl_delete(%s): "
+				 "st tag=0x%llx (uid=%u)\n",
+				 input, st_entry->tag, entry_uid);
+
+			if (!acct_tag || st_entry->tag == tag) {
+				hlist_del_rcu(&st_entry->sock_node);
+				tr_entry = lookup_tag_ref(st_entry->tag, NULL);
+				BUG_ON(tr_entry->num_sock_tags <= 0);
+				tr_entry->num_sock_tags--;
+				/*
+				 * TODO: remove if, and start failing.
+				 * This is a hack to work around the fact that
+				 * in some places we have
+				 * "if (IS_ERR_OR_NULL(pqd_entry))"
+				 * and are trying to work around apps
+				 * that didn't open the /dev/xt_qtaguid.
+				 */
+				if (st_entry->list.next && st_entry->list.prev)
+					list_del(&st_entry->list);
+				/*
+				 * Can't sockfd_put() within spinlock,
+				 * do it later.
+				 */
+				list_add(&st_entry->list, &st_to_free_list);
+			}
 		}
-	}
 	spin_unlock_bh(&sock_tag_list_lock);
 
-	sock_tag_tree_erase(&st_to_free_tree);
+	sock_tag_list_free(&st_to_free_list);
 
 	/* Delete tag counter-sets */
 	spin_lock_bh(&tag_counter_set_list_lock);
 	/* Counter sets are only on the uid tag, not full tag */
-	tcs_entry = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
+	tcs_entry = tag_counter_set_lookup(tag);
 	if (tcs_entry) {
 		CT_DEBUG("qtaguid: ctrl_delete(%s): "
 			 "erase tcs: tag=0x%llx (uid=%u) set=%d\n",
 			 input,
-			 tcs_entry->tn.tag,
-			 get_uid_from_tag(tcs_entry->tn.tag),
+			 tcs_entry->tag,
+			 get_uid_from_tag(tcs_entry->tag),
 			 tcs_entry->active_set);
-		rb_erase(&tcs_entry->tn.node, &tag_counter_set_tree);
-		kfree(tcs_entry);
+		hlist_del_rcu(&tcs_entry->node);
+		kfree_rcu(tcs_entry, rcu);
 	}
 	spin_unlock_bh(&tag_counter_set_list_lock);
 
@@ -1977,7 +2038,7 @@ static int ctrl_cmd_delete(const char *input)
 					 entry_uid);
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				kfree_rcu(ts_entry, rcu);
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
@@ -2047,7 +2108,7 @@ static int ctrl_cmd_counter_set(const char *input)
 
 	tag = make_tag_from_uid(uid);
 	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
+	tcs = tag_counter_set_lookup(tag);
 	if (!tcs) {
 		tcs = kzalloc(sizeof(*tcs), GFP_ATOMIC);
 		if (!tcs) {
@@ -2058,8 +2119,9 @@ static int ctrl_cmd_counter_set(const char *input)
 			res = -ENOMEM;
 			goto err;
 		}
-		tcs->tn.tag = tag;
-		tag_counter_set_tree_insert(tcs, &tag_counter_set_tree);
+		tcs->tag = tag;
+		tcs->active_set = counter_set;
+		hlist_add_head_rcu(&tcs->node, tag_counter_set_bucket(tag));
 		CT_DEBUG("qtaguid: ctrl_counterset(%s): added tcs tag=0x%llx "
 			 "(uid=%u) set=%d\n",
 			 input, tag, get_uid_from_tag(tag), counter_set);
@@ -2141,11 +2203,26 @@ static int ctrl_cmd_tag(const char *input)
 	tag_ref_entry->num_sock_tags++;
 	if (sock_tag_entry) {
 		struct tag_ref *prev_tag_ref_entry;
+		struct sock_tag *new_st_entry;
 
 		CT_DEBUG("qtaguid: ctrl_tag(%s): retag for sk=%p "
 			 "st@%p ...->f_count=%ld\n",
 			 input, el_socket->sk, sock_tag_entry,
 			 atomic_long_read(&el_socket->file->f_count));
+		/*
+		 * The packet path may be reading the tag without locks,
+		 * so retagging swaps in a new entry.
+		 */
+		new_st_entry = kmemdup(sock_tag_entry, sizeof(*new_st_entry),
+				       GFP_ATOMIC);
+		if (!new_st_entry) {
+			pr_err("qtaguid: ctrl_tag(%s): "
+			       "socket tag alloc failed\n",
+			       input);
+			spin_unlock_bh(&sock_tag_list_lock);
+			res = -ENOMEM;
+			goto err_tag_unref_put;
+		}
 		/*
 		 * This is a re-tagging, so release the sock_fd that was
 		 * locked at the time of the 1st tagging.
@@ -2158,7 +2235,17 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
-		sock_tag_entry->tag = full_tag;
+		new_st_entry->tag = full_tag;
+		hlist_replace_rcu(&sock_tag_entry->sock_node,
+				  &new_st_entry->sock_node);
+		/* Not on a proc_qtu_data list if /dev/xt_qtaguid wasn't open */
+		spin_lock_bh(&uid_tag_data_tree_lock);
+		if (sock_tag_entry->list.next)
+			list_replace(&sock_tag_entry->list,
+				     &new_st_entry->list);
+		spin_unlock_bh(&uid_tag_data_tree_lock);
+		kfree_rcu(sock_tag_entry, rcu);
+		sock_tag_entry = new_st_entry;
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2197,7 +2284,7 @@ static int ctrl_cmd_tag(const char *input)
 				 &pqd_entry->sock_tag_list);
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
-		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_insert(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2261,7 +2348,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * The socket already belongs to the current process
 	 * so it can do whatever it wants to it.
 	 */
-	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&sock_tag_entry->sock_node);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2298,7 +2385,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	kfree_rcu(sock_tag_entry, rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2374,6 +2461,9 @@ struct proc_print_info {
 	char **num_items_returned;
 	struct iface_stat *iface_entry;
 	struct tag_stat *ts_entry;
+	/* ts_entry's counters, summed up once the first line is printed */
+	struct data_counters cnts;
+	bool cnts_valid;
 	int item_index;
 	int items_to_skip;
 	int char_count;
@@ -2412,7 +2502,11 @@ static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 		}
 		if (ppi->item_index++ < ppi->items_to_skip)
 			return 0;
-		cnts = &ppi->ts_entry->counters;
+		if (!ppi->cnts_valid) {
+			data_counters_sum(ppi->ts_entry->counters, &ppi->cnts);
+			ppi->cnts_valid = true;
+		}
+		cnts = &ppi->cnts;
 		len = snprintf(
 			ppi->outp, ppi->char_count,
 			"%d %s 0x%llx %u %u "
@@ -2453,6 +2547,8 @@ static bool pp_sets(struct proc_print_info *ppi)
 {
 	int len;
 	int counter_set;
+
+	ppi->cnts_valid = false;
 	for (counter_set = 0; counter_set < IFS_MAX_COUNTER_SETS;
 	     counter_set++) {
 		len = pp_stats_line(ppi, counter_set);
@@ -2539,6 +2635,231 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 	return ppi.outp - page;
 }
 
+/*------------------------------------------*/
+/*
+ * Binary stats snapshot, see struct xt_qtaguid_stats_hdr.
+ * The snapshot is built on the first read and kept until the next write.
+ */
+struct stats_bin_snapshot {
+	struct mutex lock;
+	u64 since;
+	/* header and records, vmalloc()ed */
+	void *buf;
+	size_t len;
+};
+
+static int stats_bin_count(void)
+{
+	struct iface_stat *iface_entry;
+	struct rb_node *node;
+	int count = 0;
+
+	spin_lock_bh(&iface_stat_list_lock);
+	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+		spin_lock_bh(&iface_entry->tag_stat_list_lock);
+		for (node = rb_first(&iface_entry->tag_stat_tree);
+		     node;
+		     node = rb_next(node))
+			count++;
+		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	}
+	spin_unlock_bh(&iface_stat_list_lock);
+
+	return count * IFS_MAX_COUNTER_SETS;
+}
+
+static void stats_bin_fill_rec(struct xt_qtaguid_stats_rec *rec,
+			       struct iface_stat *iface_entry, tag_t tag,
+			       struct data_counters *cnts, int cnt_set)
+{
+	int proto;
+
+	strlcpy(rec->iface, iface_entry->ifname, sizeof(rec->iface));
+	rec->acct_tag = get_atag_from_tag(tag);
+	rec->uid = get_uid_from_tag(tag);
+	rec->cnt_set = cnt_set;
+	for (proto = 0; proto < IFS_MAX_PROTOS; proto++) {
+		rec->rx[proto].bytes = cnts->bpc[cnt_set][IFS_RX][proto].bytes;
+		rec->rx[proto].packets =
+			cnts->bpc[cnt_set][IFS_RX][proto].packets;
+		rec->tx[proto].bytes = cnts->bpc[cnt_set][IFS_TX][proto].bytes;
+		rec->tx[proto].packets =
+			cnts->bpc[cnt_set][IFS_TX][proto].packets;
+	}
+}
+
+/*
+ * Fill in up to max_recs records changed since the given generation.
+ * Returns the number of records, or -ENOSPC if they didn't all fit.
+ */
+static int stats_bin_fill(struct xt_qtaguid_stats_rec *recs, int max_recs,
+			  u64 since)
+{
+	struct iface_stat *iface_entry;
+	struct tag_stat *ts_entry;
+	struct data_counters cnts;
+	struct rb_node *node;
+	int nr_recs = 0;
+	int cnt_set;
+	tag_t tag;
+
+	spin_lock_bh(&iface_stat_list_lock);
+	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+		spin_lock_bh(&iface_entry->tag_stat_list_lock);
+		for (node = rb_first(&iface_entry->tag_stat_tree);
+		     node;
+		     node = rb_next(node)) {
+			ts_entry = rb_entry(node, struct tag_stat, tn.node);
+			tag = ts_entry->tn.tag;
+			if (!can_read_other_uid_stats(get_uid_from_tag(tag)))
+				continue;
+			if (data_counters_sum(ts_entry->counters, &cnts) < since)
+				continue;
+			if (nr_recs + IFS_MAX_COUNTER_SETS > max_recs) {
+				nr_recs = -ENOSPC;
+				goto unlock;
+			}
+			for (cnt_set = 0; cnt_set < IFS_MAX_COUNTER_SETS;
+			     cnt_set++)
+				stats_bin_fill_rec(&recs[nr_recs++],
+						   iface_entry, tag, &cnts,
+						   cnt_set);
+		}
+		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	}
+	spin_unlock_bh(&iface_stat_list_lock);
+	return nr_recs;
+
+unlock:
+	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	spin_unlock_bh(&iface_stat_list_lock);
+	return nr_recs;
+}
+
+static int stats_bin_take_snapshot(struct stats_bin_snapshot *snap)
+{
+	struct xt_qtaguid_stats_hdr *hdr;
+	int max_recs, nr_recs;
+	u64 gen;
+
+	/*
+	 * Changes from now on are stamped with the new generation. The
+	 * packet path stamps under rcu_read_lock(), so once a grace period
+	 * has passed every change stamped with an older one is visible here.
+	 */
+	gen = atomic64_inc_return(&qtu_stats_gen);
+	synchronize_rcu();
+
+	do {
+		/* Leave some room for entries created meanwhile */
+		max_recs = unlikely(module_passive) ? 0 :
+			stats_bin_count() + 16 * IFS_MAX_COUNTER_SETS;
+		snap->len = sizeof(*hdr) +
+			max_recs * sizeof(struct xt_qtaguid_stats_rec);
+		snap->buf = vmalloc(snap->len);
+		if (!snap->buf)
+			return -ENOMEM;
+
+		nr_recs = 0;
+		if (likely(!module_passive))
+			nr_recs = stats_bin_fill(snap->buf + sizeof(*hdr),
+						 max_recs, snap->since);
+		if (nr_recs < 0) {
+			vfree(snap->buf);
+			snap->buf = NULL;
+		}
+	} while (nr_recs < 0);
+
+	hdr = snap->buf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = XT_QTAGUID_STATS_VERSION;
+	hdr->rec_size = sizeof(struct xt_qtaguid_stats_rec);
+	hdr->generation = gen;
+	hdr->since = snap->since;
+	hdr->delete_cmds = atomic64_read(&qtu_events.delete_cmds);
+	hdr->nr_records = nr_recs;
+	snap->len = sizeof(*hdr) +
+		nr_recs * sizeof(struct xt_qtaguid_stats_rec);
+
+	CT_DEBUG("qtaguid: stats_bin: gen=%llu since=%llu recs=%d\n",
+		 gen, snap->since, nr_recs);
+	return 0;
+}
+
+static int qtaguid_stats_bin_open(struct inode *inode, struct file *file)
+{
+	struct stats_bin_snapshot *snap;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	mutex_init(&snap->lock);
+	file->private_data = snap;
+	return 0;
+}
+
+static int qtaguid_stats_bin_release(struct inode *inode, struct file *file)
+{
+	struct stats_bin_snapshot *snap = file->private_data;
+
+	vfree(snap->buf);
+	kfree(snap);
+	return 0;
+}
+
+static ssize_t qtaguid_stats_bin_read(struct file *file, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct stats_bin_snapshot *snap = file->private_data;
+	ssize_t res;
+
+	mutex_lock(&snap->lock);
+	if (!snap->buf) {
+		res = stats_bin_take_snapshot(snap);
+		if (res)
+			goto out;
+	}
+	res = simple_read_from_buffer(buf, count, ppos, snap->buf, snap->len);
+out:
+	mutex_unlock(&snap->lock);
+	return res;
+}
+
+/*
+ * Takes the generation to start the next snapshot from, and rewinds the
+ * file so that the next read() starts at its header.
+ */
+static ssize_t qtaguid_stats_bin_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct stats_bin_snapshot *snap = file->private_data;
+	u64 since;
+
+	if (count != sizeof(since))
+		return -EINVAL;
+	if (copy_from_user(&since, buf, sizeof(since)))
+		return -EFAULT;
+
+	mutex_lock(&snap->lock);
+	snap->since = since;
+	vfree(snap->buf);
+	snap->buf = NULL;
+	snap->len = 0;
+	*ppos = 0;
+	mutex_unlock(&snap->lock);
+	return count;
+}
+
+static const struct file_operations qtaguid_stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = qtaguid_stats_bin_open,
+	.release = qtaguid_stats_bin_release,
+	.read = qtaguid_stats_bin_read,
+	.write = qtaguid_stats_bin_write,
+	.llseek = default_llseek,
+};
+
 /*------------------------------------------*/
 static int qtudev_open(struct inode *inode, struct file *file)
 {
@@ -2612,7 +2933,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 	struct proc_qtu_data  *pqd_entry = file->private_data;
 	struct uid_tag_data  *utd_entry = pqd_entry->parent_tag_data;
 	struct sock_tag *st_entry;
-	struct rb_root st_to_free_tree = RB_ROOT;
+	LIST_HEAD(st_to_free_list);
 	struct list_head *entry, *next;
 	struct tag_ref *tr;
 
@@ -2656,10 +2977,9 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		tr->num_sock_tags--;
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
-		rb_erase(&st_entry->sock_node, &sock_tag_tree);
-		list_del(&st_entry->list);
+		hlist_del_rcu(&st_entry->sock_node);
 		/* Can't sockfd_put() within spinlock, do it later. */
-		sock_tag_tree_insert(st_entry, &st_to_free_tree);
+		list_move(&st_entry->list, &st_to_free_list);
 
 		/*
 		 * Try to free the utd_entry if no other proc_qtu_data is
@@ -2680,7 +3000,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 	spin_unlock_bh(&sock_tag_list_lock);
 
 
-	sock_tag_tree_erase(&st_to_free_tree);
+	sock_tag_list_free(&st_to_free_list);
 
 	prdebug_full_state(0, "%s(): pid=%u tgid=%u", __func__,
 			   current->pid, current->tgid);
@@ -2736,8 +3056,21 @@ static int __init qtaguid_proc_register(struct proc_dir_entry **res_procdir)
 	 * TODO: add support counter hacking
 	 * xt_qtaguid_stats_file->write_proc = qtaguid_stats_proc_write;
 	 */
+
+	xt_qtaguid_stats_bin_file = proc_create("stats_bin",
+						proc_stats_perms,
+						*res_procdir,
+						&qtaguid_stats_bin_fops);
+	if (!xt_qtaguid_stats_bin_file) {
+		pr_err("qtaguid: failed to create xt_qtaguid/stats_bin "
+			"file\n");
+		ret = -ENOMEM;
+		goto no_stats_bin_entry;
+	}
 	return 0;
 
+no_stats_bin_entry:
+	remove_proc_entry("stats", *res_procdir);
 no_stats_entry:
 	remove_proc_entry("ctrl", *res_procdir);
 no_ctrl_entry:
@@ -11,8 +11,12 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock_types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -179,6 +183,19 @@ struct data_counters {
 	struct byte_packet_counters bpc[IFS_MAX_COUNTER_SETS][IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
 };
 
+/*
+ * One CPU's share of a tag_stat's counters. They are only updated from
+ * the matching CPU, with BHs off, and summed up for reading.
+ * alloc_percpu() may sleep, but tag_stats are created from the packet
+ * path, so each tag_stat carries an array of these indexed by cpu.
+ */
+struct data_counters_pcpu {
+	struct data_counters dc;
+	/* stats generation in effect when dc last changed */
+	u64 gen;
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
 	struct rb_node node;
@@ -187,16 +204,23 @@ struct tag_node {
 
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct data_counters_pcpu *parent_counters;
+	/* Freed after a grace period, the packet path updates unlocked */
+	struct rcu_head rcu;
+	/* nr_cpu_ids of them */
+	struct data_counters_pcpu counters[0];
 };
 
 struct iface_stat {
-	struct list_head list;  /* in iface_stat_list */
+	/*
+	 * In iface_stat_list. Entries are never removed, and the packet
+	 * path finds them under rcu_read_lock() only.
+	 */
+	struct list_head list;
 	char *ifname;
 	bool active;
 	/* net_dev is only valid for active iface_stat */
@@ -234,7 +258,8 @@ struct iface_stat_work {
  * These structs need to be looked up by sock and pid.
  */
 struct sock_tag {
-	struct rb_node sock_node;
+	/* In sock_tag_hash; looked up from the packet path under RCU */
+	struct hlist_node sock_node;
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -242,7 +267,12 @@ struct sock_tag {
 	struct list_head list;   /* in proc_qtu_data.sock_tag_list */
 	pid_t pid;
 
+	/*
+	 * Never changed once the entry is hashed: a retag replaces the
+	 * entry, so that lockless readers can't see a torn 64bit tag.
+	 */
 	tag_t tag;
+	struct rcu_head rcu;
 };
 
 struct qtaguid_event_counts {
@@ -275,10 +305,15 @@ struct qtaguid_event_counts {
 	atomic64_t match_no_sk_file;
 };
 
-/* Track the set active_set for the given tag. */
+/*
+ * Track the set active_set for the given tag.
+ * In tag_counter_set_hash; looked up from the packet path under RCU.
+ */
 struct tag_counter_set {
-	struct tag_node tn;
+	struct hlist_node node;
+	tag_t tag;
 	int active_set;
+	struct rcu_head rcu;
 };
 
 /*----------------------------------------------*/
@@ -327,4 +362,7 @@ struct proc_qtu_data {
 };
 
 /*----------------------------------------------*/
+u64 data_counters_sum(const struct data_counters_pcpu *pcpu,
+		      struct data_counters *sum);
+
 #endif  /* ifndef __XT_QTAGUID_INTERNAL_H__ */
@@ -152,6 +152,7 @@ char *pp_tag_ref(struct tag_ref *tr)
 char *pp_tag_stat(struct tag_stat *ts)
 {
 	char *tn_str;
+	struct data_counters counters;
 	char *counters_str;
 	char *parent_counters_str;
 	char *res;
@@ -162,8 +163,10 @@ char *pp_tag_stat(struct tag_stat *ts)
 		return res;
 	}
 	tn_str = pp_tag_node(&ts->tn);
-	counters_str = pp_data_counters(&ts->counters, true);
-	parent_counters_str = pp_data_counters(ts->parent_counters, false);
+	data_counters_sum(ts->counters, &counters);
+	counters_str = pp_data_counters(&counters, true);
+	parent_counters_str = pp_data_counters(
+		ts->parent_counters ? &ts->parent_counters->dc : NULL, false);
 	res = kasprintf(GFP_ATOMIC,
 			"tag_stat@%p{%s, counters=%s, parent_counters=%s}",
 			ts, tn_str, counters_str, parent_counters_str);
@@ -226,7 +229,7 @@ char *pp_sock_tag(struct sock_tag *st)
 	}
 	tag_str = pp_tag_t(&st->tag);
 	res = kasprintf(GFP_ATOMIC, "sock_tag@%p{"
-			"sock_node=rb_node{...}, "
+			"sock_node=hlist_node{...}, "
 			"sk=%p socket=%p (f_count=%lu), list=list_head{...}, "
 			"pid=%u, tag=%s}",
 			st, st->sk, st->socket, atomic_long_read(
@@ -278,33 +281,28 @@ char *pp_proc_qtu_data(struct proc_qtu_data *pqd)
 }
 
 /*------------------------------------------*/
-void prdebug_sock_tag_tree(int indent_level,
-			   struct rb_root *sock_tag_tree)
+void prdebug_sock_tag_hash(int indent_level,
+			   struct hlist_head *sock_tag_hash, int size)
 {
-	struct rb_node *node;
+	struct hlist_node *node;
 	struct sock_tag *sock_tag_entry;
 	char *str;
+	int i;
 
 	if (!unlikely(qtaguid_debug_mask & DDEBUG_MASK))
 		return;
 
-	if (RB_EMPTY_ROOT(sock_tag_tree)) {
-		str = "sock_tag_tree=rb_root{}";
-		pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
-		return;
-	}
-
-	str = "sock_tag_tree=rb_root{";
+	str = "sock_tag_hash=hlist_head[]{";
 	pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
 	indent_level++;
-	for (node = rb_first(sock_tag_tree);
-	     node;
-	     node = rb_next(node)) {
-		sock_tag_entry = rb_entry(node, struct sock_tag, sock_node);
-		str = pp_sock_tag(sock_tag_entry);
-		pr_debug("%*d: %s,\n", indent_level*2, indent_level, str);
-		kfree(str);
-	}
+	for (i = 0; i < size; i++)
+		hlist_for_each_entry(sock_tag_entry, node, &sock_tag_hash[i],
+				     sock_node) {
+			str = pp_sock_tag(sock_tag_entry);
+			pr_debug("%*d: %s,\n", indent_level*2, indent_level,
+				 str);
+			kfree(str);
+		}
 	indent_level--;
 	str = "}";
 	pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
@@ -27,8 +27,8 @@ char *pp_proc_qtu_data(struct proc_qtu_data *pqd);
 /*------------------------------------------*/
 void prdebug_sock_tag_list(int indent_level,
 			   struct list_head *sock_tag_list);
-void prdebug_sock_tag_tree(int indent_level,
-			   struct rb_root *sock_tag_tree);
+void prdebug_sock_tag_hash(int indent_level,
+			   struct hlist_head *sock_tag_hash, int size);
 void prdebug_proc_qtu_data_tree(int indent_level,
 				struct rb_root *proc_qtu_data_tree);
 void prdebug_tag_ref_tree(int indent_level, struct rb_root *tag_ref_tree);
@@ -86,8 +86,8 @@ void prdebug_sock_tag_list(int indent_level,
 {
 }
 static inline
-void prdebug_sock_tag_tree(int indent_level,
-			   struct rb_root *sock_tag_tree)
+void prdebug_sock_tag_hash(int indent_level,
+			   struct hlist_head *sock_tag_hash, int size)
 {
 }
 static inline
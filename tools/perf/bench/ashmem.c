@@ -0,0 +1,285 @@
+/*
+ *
+ * ashmem.c
+ *
+ * ashmem: Benchmarks for Android shared memory
+ *
+ * pin: pin/unpin throughput of N processes, each working on a region of
+ *      its own, while other processes keep purging unpinned ranges
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+
+#include "../../../include/linux/ashmem.h"
+
+#define ASHMEM_DEVICE		"/dev/ashmem"
+#define MAX_SHRINKERS		64
+
+static int workers = 4;
+static int pages = 256;
+static int chunk = 4;
+static int loops = 100000;
+static int shrinkers = 1;
+
+static const struct option options[] = {
+	OPT_INTEGER('w', "workers", &workers,
+		    "Specify number of processes pinning and unpinning"),
+	OPT_INTEGER('p', "pages", &pages,
+		    "Specify number of pages in each region"),
+	OPT_INTEGER('c', "chunk", &chunk,
+		    "Specify number of pages per pin and unpin"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of unpin/pin rounds per worker"),
+	OPT_INTEGER('s', "shrinkers", &shrinkers,
+		    "Specify number of processes purging unpinned ranges"),
+	OPT_END()
+};
+
+static const char * const bench_ashmem_pin_usage[] = {
+	"perf bench ashmem pin <options>",
+	NULL
+};
+
+static long page_size;
+static int ready_pipe[2];
+static int start_pipe[2];
+
+/* Chunks each worker found purged when pinning them again */
+static unsigned long *purged;
+
+static void signal_ready(void)
+{
+	char c = 0;
+
+	if (write(ready_pipe[1], &c, 1) != 1)
+		die("ashmem: cannot signal readiness\n");
+}
+
+/* Waits for n children to be ready, giving up if one of them died */
+static void wait_ready(int n)
+{
+	struct pollfd pfd = { .fd = ready_pipe[0], .events = POLLIN };
+	int status;
+	char c;
+
+	while (n > 0) {
+		if (poll(&pfd, 1, 1000) > 0) {
+			if (read(ready_pipe[0], &c, 1) == 1)
+				n--;
+		} else if (waitpid(-1, &status, WNOHANG) > 0) {
+			die("ashmem: a child died before it was ready\n");
+		}
+	}
+}
+
+static void wait_start(void)
+{
+	char c;
+
+	if (read(start_pipe[0], &c, 1) < 0)
+		die("ashmem: cannot wait for the start\n");
+}
+
+static pid_t spawn(void (*fn)(int), int index)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("ashmem: fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		close(ready_pipe[0]);
+		close(start_pipe[1]);
+		fn(index);
+		exit(0);
+	}
+	return pid;
+}
+
+static int region_open(void)
+{
+	int fd = open(ASHMEM_DEVICE, O_RDWR);
+
+	if (fd < 0)
+		die("ashmem: cannot open %s: %s\n", ASHMEM_DEVICE,
+		    strerror(errno));
+	return fd;
+}
+
+static int region_pin(int fd, unsigned int cmd, int first)
+{
+	struct ashmem_pin pin = {
+		.offset = first * page_size,
+		.len = chunk * page_size,
+	};
+	int ret = ioctl(fd, cmd, &pin);
+
+	if (ret < 0)
+		die("ashmem: %s failed: %s\n",
+		    cmd == ASHMEM_PIN ? "ASHMEM_PIN" : "ASHMEM_UNPIN",
+		    strerror(errno));
+	return ret;
+}
+
+/*
+ * Unpins the chunks of its region in turn and pins each one again half
+ * a region later, so that half of every region sits on the LRU for the
+ * shrinkers to purge. A chunk found purged is written again, as a cache
+ * would refill it.
+ */
+static void worker(int index)
+{
+	int n_chunks = pages / chunk;
+	size_t size = (size_t)pages * page_size;
+	unsigned long n = 0;
+	int fd = region_open();
+	char *map;
+	int i;
+
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0)
+		die("ashmem: ASHMEM_SET_SIZE failed: %s\n", strerror(errno));
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		die("ashmem: cannot map a region: %s\n", strerror(errno));
+	memset(map, 1, size);
+
+	signal_ready();
+	wait_start();
+
+	for (i = 0; i < loops; i++) {
+		int first = ((i + n_chunks / 2) % n_chunks) * chunk;
+
+		region_pin(fd, ASHMEM_UNPIN, (i % n_chunks) * chunk);
+		if (region_pin(fd, ASHMEM_PIN, first) == ASHMEM_WAS_PURGED) {
+			memset(map + first * page_size, 1, chunk * page_size);
+			n++;
+		}
+	}
+
+	purged[index] = n;
+}
+
+/* Purges all unpinned ranges until it is killed */
+static void shrinker(int index __used)
+{
+	int fd = region_open();
+
+	if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0)
+		die("ashmem: ASHMEM_PURGE_ALL_CACHES failed: %s\n",
+		    strerror(errno));
+
+	signal_ready();
+	wait_start();
+
+	for (;;)
+		ioctl(fd, ASHMEM_PURGE_ALL_CACHES);
+}
+
+int bench_ashmem_pin(int argc, const char **argv,
+		     const char *prefix __used)
+{
+	pid_t shrinker_pids[MAX_SHRINKERS];
+	struct timeval start, stop, diff;
+	unsigned long total_purged = 0;
+	unsigned long long result_usec;
+	unsigned long long ops;
+	int status;
+	int i;
+
+	argc = parse_options(argc, argv, options, bench_ashmem_pin_usage, 0);
+	if (workers < 1 || loops < 1 || chunk < 1 || pages < 2 * chunk ||
+	    shrinkers < 0 || shrinkers > MAX_SHRINKERS)
+		usage_with_options(bench_ashmem_pin_usage, options);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	purged = mmap(NULL, workers * sizeof(*purged),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (purged == MAP_FAILED)
+		die("ashmem: out of memory\n");
+
+	if (pipe(ready_pipe) || pipe(start_pipe))
+		die("ashmem: pipe failed: %s\n", strerror(errno));
+
+	for (i = 0; i < shrinkers; i++)
+		shrinker_pids[i] = spawn(shrinker, i);
+	for (i = 0; i < workers; i++)
+		spawn(worker, i);
+	close(ready_pipe[1]);
+	close(start_pipe[0]);
+	wait_ready(shrinkers + workers);
+
+	gettimeofday(&start, NULL);
+	close(start_pipe[1]);
+	for (i = 0; i < workers; i++) {
+		if (wait(&status) < 0)
+			die("ashmem: wait failed: %s\n", strerror(errno));
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			die("ashmem: a worker failed\n");
+	}
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	for (i = 0; i < shrinkers; i++) {
+		kill(shrinker_pids[i], SIGKILL);
+		waitpid(shrinker_pids[i], &status, 0);
+	}
+	close(ready_pipe[0]);
+
+	for (i = 0; i < workers; i++)
+		total_purged += purged[i];
+	munmap(purged, workers * sizeof(*purged));
+
+	/* An unpin and a pin per round */
+	ops = 2ULL * loops * workers;
+	result_usec = diff.tv_sec * 1000000ULL + diff.tv_usec;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d workers with %d pages each, %d shrinkers\n",
+		       workers, pages, shrinkers);
+		printf("# %d pages per pin and unpin, %d rounds per worker\n\n",
+		       chunk, loops);
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec, (unsigned long)(diff.tv_usec / 1000));
+
+		printf(" %14lf usecs/op\n",
+		       (double)result_usec / (double)(ops / workers));
+		printf(" %14llu ops/sec\n",
+		       result_usec ? ops * 1000000ULL / result_usec : 0);
+		printf(" %14lu chunks purged\n", total_purged);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu %lu\n", diff.tv_sec,
+		       (unsigned long)(diff.tv_usec / 1000), total_purged);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
@@ -4,6 +4,10 @@
 extern int bench_sched_messaging(int argc, const char **argv, const char *prefix);
 extern int bench_sched_pipe(int argc, const char **argv, const char *prefix);
 extern int bench_mem_memcpy(int argc, const char **argv, const char *prefix __used);
+extern int bench_binder_pairs(int argc, const char **argv, const char *prefix);
+extern int bench_binder_sg(int argc, const char **argv, const char *prefix);
+extern int bench_ashmem_pin(int argc, const char **argv, const char *prefix);
+extern int bench_logger_flood(int argc, const char **argv, const char *prefix);
 
 #define BENCH_FORMAT_DEFAULT_STR	"default"
 #define BENCH_FORMAT_DEFAULT		0
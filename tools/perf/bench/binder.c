@@ -0,0 +1,676 @@
+/*
+ *
+ * binder.c
+ *
+ * binder: Benchmarks for the Android binder driver
+ *
+ * pairs: transactions of N client processes, each calling a server
+ *        process of its own, so that unrelated callers run in parallel
+ *
+ * sg:    round trips of 4 KiB to 4 MiB payloads made of a few pieces,
+ *        gathered into a flat parcel vs. passed as a scatter-gather list
+ *
+ * The servers hand their nodes to the clients through a small registry
+ * that takes the place of servicemanager, so the benchmark needs to be
+ * the context manager: stop servicemanager before running it.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../../drivers/staging/android/binder.h"
+
+#define BINDER_DEVICE		"/dev/binder"
+
+static const char *device = BINDER_DEVICE;
+static size_t map_size = 128 * 1024;
+
+/* Transaction codes of the registry and the servers */
+enum {
+	CODE_REGISTER = 1,	/* server to registry: node and index */
+	CODE_LOOKUP,		/* client to registry: index, returns node */
+	CODE_PING,		/* client to server */
+};
+
+struct registration {
+	struct flat_binder_object obj;
+	int index;
+};
+
+/* One binder connection with its pending commands */
+struct bb {
+	int fd;
+	void *map;
+	uint8_t out[512];
+	size_t out_len;
+	uint8_t in[512];
+};
+
+/* Pipes the children report to and wait on */
+static int ready_pipe[2];
+static int start_pipe[2];
+
+static void bb_open(struct bb *b)
+{
+	struct binder_version version;
+
+	memset(b, 0, sizeof(*b));
+	b->fd = open(device, O_RDWR);
+	if (b->fd < 0)
+		die("binder: cannot open %s: %s\n", device, strerror(errno));
+	if (ioctl(b->fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION)
+		die("binder: %s speaks another protocol version\n", device);
+	b->map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, b->fd, 0);
+	if (b->map == MAP_FAILED)
+		die("binder: cannot map %s: %s\n", device, strerror(errno));
+}
+
+static void bb_put(struct bb *b, uint32_t cmd, const void *arg, size_t size)
+{
+	if (b->out_len + sizeof(cmd) + size > sizeof(b->out))
+		die("binder: too many commands queued\n");
+	memcpy(b->out + b->out_len, &cmd, sizeof(cmd));
+	memcpy(b->out + b->out_len + sizeof(cmd), arg, size);
+	b->out_len += sizeof(cmd) + size;
+}
+
+static void bb_transact(struct bb *b, uint32_t cmd, uint32_t handle,
+			uint32_t code, const void *data, size_t size,
+			const size_t *offsets, size_t offsets_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	bb_put(b, cmd, &tr, sizeof(tr));
+}
+
+static void bb_free(struct bb *b, const struct binder_transaction_data *tr)
+{
+	bb_put(b, BC_FREE_BUFFER, &tr->data.ptr.buffer, sizeof(void *));
+}
+
+/* Writes the queued commands and reads what the driver has for us */
+static size_t bb_talk(struct bb *b)
+{
+	struct binder_write_read bwr;
+
+	bwr.write_size = b->out_len;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)b->out;
+	bwr.read_size = sizeof(b->in);
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)b->in;
+
+	while (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0)
+		if (errno != EINTR)
+			die("binder: BINDER_WRITE_READ: %s\n",
+			    strerror(errno));
+
+	b->out_len = 0;
+	return bwr.read_consumed;
+}
+
+/*
+ * Talks to the driver until a transaction or a reply comes in, answering
+ * reference count requests on the way. The driver returns a transaction
+ * as the last command read, so nothing is left behind.
+ */
+static uint32_t bb_wait(struct bb *b, struct binder_transaction_data *tr)
+{
+	for (;;) {
+		size_t len = bb_talk(b);
+		size_t pos = 0;
+
+		while (pos + sizeof(uint32_t) <= len) {
+			uint32_t cmd;
+			void *arg = b->in + pos + sizeof(cmd);
+
+			memcpy(&cmd, b->in + pos, sizeof(cmd));
+			pos += sizeof(cmd) + _IOC_SIZE(cmd);
+
+			switch (cmd) {
+			case BR_TRANSACTION:
+			case BR_REPLY:
+			case BR_TRANSACTION_SG:
+			case BR_REPLY_SG:
+				/* binder_transaction_data comes first */
+				memcpy(tr, arg, sizeof(*tr));
+				return cmd;
+			case BR_INCREFS:
+				bb_put(b, BC_INCREFS_DONE, arg,
+				       sizeof(struct binder_ptr_cookie));
+				break;
+			case BR_ACQUIRE:
+				bb_put(b, BC_ACQUIRE_DONE, arg,
+				       sizeof(struct binder_ptr_cookie));
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+			case BR_ERROR:
+				die("binder: transaction failed\n");
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+static void signal_ready(void)
+{
+	char c = 0;
+
+	if (write(ready_pipe[1], &c, 1) != 1)
+		die("binder: cannot signal readiness\n");
+}
+
+/* Waits for n children to be ready, giving up if one of them died */
+static void wait_ready(int n)
+{
+	struct pollfd pfd = { .fd = ready_pipe[0], .events = POLLIN };
+	int status;
+	char c;
+
+	while (n > 0) {
+		if (poll(&pfd, 1, 1000) > 0) {
+			if (read(ready_pipe[0], &c, 1) == 1)
+				n--;
+		} else if (waitpid(-1, &status, WNOHANG) > 0) {
+			die("binder: a child died before it was ready\n");
+		}
+	}
+}
+
+static pid_t spawn(void (*fn)(int), int index)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("binder: fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		close(ready_pipe[0]);
+		close(start_pipe[1]);
+		fn(index);
+		exit(0);
+	}
+	return pid;
+}
+
+static int n_servers;
+
+static void registry(int index __used)
+{
+	uint32_t *handles = calloc(n_servers, sizeof(*handles));
+	struct flat_binder_object obj;
+	size_t offset = 0;
+	struct bb b;
+
+	if (!handles)
+		die("binder: out of memory\n");
+
+	bb_open(&b);
+	if (ioctl(b.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("binder: cannot become the context manager, "
+		    "is servicemanager running? %s\n", strerror(errno));
+	bb_put(&b, BC_ENTER_LOOPER, NULL, 0);
+	signal_ready();
+
+	for (;;) {
+		struct binder_transaction_data tr;
+		const struct registration *reg;
+		int i;
+
+		bb_wait(&b, &tr);
+		switch (tr.code) {
+		case CODE_REGISTER:
+			/* Keep the reference once the buffer is freed */
+			reg = tr.data.ptr.buffer;
+			i = reg->index;
+			if (i >= 0 && i < n_servers) {
+				handles[i] = reg->obj.handle;
+				bb_put(&b, BC_ACQUIRE, &handles[i],
+				       sizeof(handles[i]));
+			}
+			bb_free(&b, &tr);
+			bb_transact(&b, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+			break;
+		case CODE_LOOKUP:
+			memcpy(&i, tr.data.ptr.buffer, sizeof(i));
+			memset(&obj, 0, sizeof(obj));
+			obj.type = BINDER_TYPE_HANDLE;
+			obj.handle = (i >= 0 && i < n_servers) ? handles[i] : 0;
+			bb_free(&b, &tr);
+			bb_transact(&b, BC_REPLY, 0, 0, &obj, sizeof(obj),
+				    &offset, sizeof(offset));
+			break;
+		default:
+			bb_free(&b, &tr);
+			bb_transact(&b, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+			break;
+		}
+	}
+}
+
+static void server(int index)
+{
+	struct binder_transaction_data tr;
+	struct registration reg;
+	size_t offset = 0;
+	struct bb b;
+
+	bb_open(&b);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.flags = FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	reg.obj.binder = &reg;
+	reg.index = index;
+	bb_transact(&b, BC_TRANSACTION, 0, CODE_REGISTER, &reg, sizeof(reg),
+		    &offset, sizeof(offset));
+	if (bb_wait(&b, &tr) != BR_REPLY)
+		die("binder: server %d could not register\n", index);
+	bb_free(&b, &tr);
+
+	bb_put(&b, BC_ENTER_LOOPER, NULL, 0);
+	signal_ready();
+
+	for (;;) {
+		bb_wait(&b, &tr);
+		bb_free(&b, &tr);
+		bb_transact(&b, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+	}
+}
+
+/* Looks up the node of server index and keeps a reference to it */
+static uint32_t lookup(struct bb *b, int index)
+{
+	const struct flat_binder_object *obj;
+	struct binder_transaction_data tr;
+	uint32_t handle;
+
+	bb_transact(b, BC_TRANSACTION, 0, CODE_LOOKUP, &index, sizeof(index),
+		    NULL, 0);
+	if (bb_wait(b, &tr) != BR_REPLY || tr.data_size < sizeof(*obj))
+		die("binder: lookup of server %d failed\n", index);
+	obj = tr.data.ptr.buffer;
+	handle = obj->handle;
+	if (!handle)
+		die("binder: server %d is not registered\n", index);
+	bb_put(b, BC_ACQUIRE, &handle, sizeof(handle));
+	bb_free(b, &tr);
+
+	return handle;
+}
+
+static void wait_start(void)
+{
+	char c;
+
+	/* Returns when the parent closes the pipe */
+	if (read(start_pipe[0], &c, 1) < 0)
+		die("binder: cannot wait for the start\n");
+}
+
+static int loops = 10000;
+
+static void pair_client(int index)
+{
+	struct binder_transaction_data tr;
+	uint32_t handle;
+	struct bb b;
+	int i;
+
+	bb_open(&b);
+	handle = lookup(&b, index);
+	signal_ready();
+	wait_start();
+
+	for (i = 0; i < loops; i++) {
+		bb_transact(&b, BC_TRANSACTION, handle, CODE_PING,
+			    &i, sizeof(i), NULL, 0);
+		if (bb_wait(&b, &tr) != BR_REPLY)
+			die("binder: unexpected transaction\n");
+		bb_free(&b, &tr);
+	}
+}
+
+static pid_t *pids;
+static int n_pids;
+
+/* Starts the registry and n servers */
+static void start_servers(int n)
+{
+	int i;
+
+	if (pipe(ready_pipe) || pipe(start_pipe))
+		die("binder: pipe failed: %s\n", strerror(errno));
+
+	n_servers = n;
+	pids = calloc(1 + 2 * n, sizeof(*pids));
+	if (!pids)
+		die("binder: out of memory\n");
+	n_pids = 0;
+
+	pids[n_pids++] = spawn(registry, 0);
+	wait_ready(1);
+	for (i = 0; i < n; i++)
+		pids[n_pids++] = spawn(server, i);
+	wait_ready(n);
+}
+
+static void stop_servers(void)
+{
+	int i;
+
+	for (i = 0; i < n_pids; i++) {
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+	free(pids);
+	close(ready_pipe[0]);
+	close(ready_pipe[1]);
+	close(start_pipe[0]);
+}
+
+/* Starts the clients and returns the time they all took */
+static void run_clients(void (*fn)(int), int n, struct timeval *diff)
+{
+	struct timeval start, stop;
+	pid_t *clients = calloc(n, sizeof(*clients));
+	int status;
+	int i;
+
+	if (!clients)
+		die("binder: out of memory\n");
+
+	for (i = 0; i < n; i++)
+		clients[i] = spawn(fn, i);
+	wait_ready(n);
+
+	gettimeofday(&start, NULL);
+	close(start_pipe[1]);
+	for (i = 0; i < n; i++) {
+		if (waitpid(clients[i], &status, 0) != clients[i] ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			die("binder: client %d failed\n", i);
+	}
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, diff);
+
+	free(clients);
+}
+
+static int pairs = 4;
+
+static const struct option pairs_options[] = {
+	OPT_INTEGER('p', "pairs", &pairs,
+		    "Specify number of client/server pairs"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of transactions per client"),
+	OPT_END()
+};
+
+static const char * const bench_binder_pairs_usage[] = {
+	"perf bench binder pairs <options>",
+	NULL
+};
+
+int bench_binder_pairs(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	struct timeval diff;
+	unsigned long long result_usec;
+	double ops;
+
+	argc = parse_options(argc, argv, pairs_options,
+			     bench_binder_pairs_usage, 0);
+	if (pairs < 1 || loops < 1)
+		usage_with_options(bench_binder_pairs_usage, pairs_options);
+
+	start_servers(pairs);
+	run_clients(pair_client, pairs, &diff);
+	stop_servers();
+
+	result_usec = diff.tv_sec * 1000000ULL + diff.tv_usec;
+	ops = (double)pairs * loops;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d client/server pairs, %d transactions each\n\n",
+		       pairs, loops);
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec, (unsigned long) (diff.tv_usec / 1000));
+		printf(" %14lf usecs/op per pair\n",
+		       (double)result_usec / (double)loops);
+		printf(" %14d ops/sec\n",
+		       (int)(ops / ((double)result_usec / 1000000.0)));
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n", diff.tv_sec,
+		       (unsigned long) (diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
+
+#define SG_MIN_SIZE	4096
+#define SG_MAX_PIECES	64
+
+struct sg_result {
+	size_t size;
+	double flat_usec;
+	double sg_usec;
+};
+
+static int sg_pieces = 4;
+static int sg_loops = 200;
+static int sg_max_kb = 4096;
+static struct sg_result *sg_results;
+static int sg_n_results;
+
+static void sg_call(struct bb *b, uint32_t handle, int use_sg,
+		    struct iovec *iov, size_t size, uint8_t *flat)
+{
+	struct binder_transaction_data_sg tr_sg;
+	struct binder_transaction_data tr;
+	int header = 0;
+	uint8_t *p;
+	int i;
+
+	if (use_sg) {
+		memset(&tr_sg, 0, sizeof(tr_sg));
+		tr_sg.transaction_data.target.handle = handle;
+		tr_sg.transaction_data.code = CODE_PING;
+		tr_sg.transaction_data.data_size = sizeof(header);
+		tr_sg.transaction_data.data.ptr.buffer = &header;
+		tr_sg.buffers = iov;
+		tr_sg.buffers_count = sg_pieces;
+		bb_put(b, BC_TRANSACTION_SG, &tr_sg, sizeof(tr_sg));
+	} else {
+		/* What a parcel does today: gather the pieces, then send */
+		for (i = 0, p = flat; i < sg_pieces; i++) {
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+		bb_transact(b, BC_TRANSACTION, handle, CODE_PING,
+			    flat, size, NULL, 0);
+	}
+
+	if (bb_wait(b, &tr) != BR_REPLY)
+		die("binder: unexpected transaction\n");
+	bb_free(b, &tr);
+}
+
+/* Returns the usecs per round trip of a payload of size bytes */
+static double sg_time(struct bb *b, uint32_t handle, int use_sg,
+		      const uint8_t *src, size_t size, uint8_t *flat)
+{
+	struct iovec iov[SG_MAX_PIECES];
+	struct timeval start, stop, diff;
+	size_t piece = size / sg_pieces;
+	int i;
+
+	for (i = 0; i < sg_pieces; i++) {
+		iov[i].iov_base = (void *)(src + i * piece);
+		iov[i].iov_len = i < sg_pieces - 1 ? piece :
+			size - i * piece;
+	}
+
+	/* The first call populates the target's buffer pages */
+	sg_call(b, handle, use_sg, iov, size, flat);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < sg_loops; i++)
+		sg_call(b, handle, use_sg, iov, size, flat);
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	return (diff.tv_sec * 1000000.0 + diff.tv_usec) / sg_loops;
+}
+
+static void sg_client(int index __used)
+{
+	size_t max = sg_results[sg_n_results - 1].size;
+	uint8_t *src = malloc(max);
+	uint8_t *flat = malloc(max);
+	uint32_t handle;
+	struct bb b;
+	int i;
+
+	if (!src || !flat)
+		die("binder: out of memory\n");
+	memset(src, 0x5a, max);
+
+	bb_open(&b);
+	handle = lookup(&b, 0);
+	signal_ready();
+	wait_start();
+
+	for (i = 0; i < sg_n_results; i++) {
+		struct sg_result *r = &sg_results[i];
+
+		r->flat_usec = sg_time(&b, handle, 0, src, r->size, flat);
+		r->sg_usec = sg_time(&b, handle, 1, src, r->size, flat);
+	}
+}
+
+static const struct option sg_options[] = {
+	OPT_INTEGER('l', "loop", &sg_loops,
+		    "Specify number of transactions per payload size"),
+	OPT_INTEGER('b', "buffers", &sg_pieces,
+		    "Specify number of pieces each payload is made of"),
+	OPT_INTEGER('s', "max-size", &sg_max_kb,
+		    "Specify largest payload in KiB"),
+	OPT_END()
+};
+
+static const char * const bench_binder_sg_usage[] = {
+	"perf bench binder sg <options>",
+	NULL
+};
+
+int bench_binder_sg(int argc, const char **argv,
+		    const char *prefix __used)
+{
+	struct timeval diff;
+	size_t size;
+	int i;
+
+	argc = parse_options(argc, argv, sg_options,
+			     bench_binder_sg_usage, 0);
+	if (sg_loops < 1 || sg_pieces < 1 || sg_pieces > SG_MAX_PIECES ||
+	    sg_max_kb < SG_MIN_SIZE / 1024)
+		usage_with_options(bench_binder_sg_usage, sg_options);
+
+	/*
+	 * The driver maps at most 4 MiB per process, and a transaction
+	 * buffer has to fit in there with its header, so the largest
+	 * payload is cut down to a page less than the mapping.
+	 */
+	map_size = 4 * 1024 * 1024;
+
+	sg_n_results = 0;
+	for (size = SG_MIN_SIZE; size <= (size_t)sg_max_kb * 1024; size *= 2)
+		sg_n_results++;
+	sg_results = mmap(NULL, sg_n_results * sizeof(*sg_results),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			  -1, 0);
+	if (sg_results == MAP_FAILED)
+		die("binder: out of memory\n");
+	for (i = 0, size = SG_MIN_SIZE; i < sg_n_results; i++, size *= 2) {
+		sg_results[i].size = size;
+		if (size > map_size - 4096)
+			sg_results[i].size = map_size - 4096;
+	}
+
+	start_servers(1);
+	run_clients(sg_client, 1, &diff);
+	stop_servers();
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d transactions per size, payload in %d pieces\n\n",
+		       sg_loops, sg_pieces);
+		printf(" %10s %14s %14s %10s %10s\n", "size [KiB]",
+		       "flat usecs/op", "sg usecs/op", "flat MB/s", "sg MB/s");
+		for (i = 0; i < sg_n_results; i++) {
+			struct sg_result *r = &sg_results[i];
+
+			printf(" %10lu %14.2lf %14.2lf %10.1lf %10.1lf\n",
+			       (unsigned long)(r->size / 1024),
+			       r->flat_usec, r->sg_usec,
+			       r->size / r->flat_usec, r->size / r->sg_usec);
+		}
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		for (i = 0; i < sg_n_results; i++)
+			printf("%lu %.2lf %.2lf\n",
+			       (unsigned long)sg_results[i].size,
+			       sg_results[i].flat_usec, sg_results[i].sg_usec);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	munmap(sg_results, sg_n_results * sizeof(*sg_results));
+	return 0;
+}
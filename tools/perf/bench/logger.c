@@ -0,0 +1,281 @@
+/*
+ *
+ * logger.c
+ *
+ * logger: Benchmarks for the Android logger driver
+ *
+ * flood: N writer processes logging as fast as they can to one log
+ *        while M reader processes follow it, as logcat does
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "../../../drivers/staging/android/logger.h"
+
+#define LOGGER_DEVICE		"/dev/log/main"
+#define MAX_READERS		64
+
+static const char *device = LOGGER_DEVICE;
+static int writers = 8;
+static int readers = 2;
+static int loops = 100000;
+static int msg_size = 100;
+
+static const struct option options[] = {
+	OPT_STRING('d', "device", &device, "path",
+		   "Specify the log device (default: " LOGGER_DEVICE ")"),
+	OPT_INTEGER('w', "writers", &writers,
+		    "Specify number of writer processes"),
+	OPT_INTEGER('r', "readers", &readers,
+		    "Specify number of reader processes"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of messages per writer"),
+	OPT_INTEGER('s', "size", &msg_size,
+		    "Specify message size in bytes"),
+	OPT_END()
+};
+
+static const char * const bench_logger_flood_usage[] = {
+	"perf bench logger flood <options>",
+	NULL
+};
+
+static int ready_pipe[2];
+static int start_pipe[2];
+
+/* Entries and bytes each reader got, updated as it goes */
+struct reader_count {
+	unsigned long entries;
+	unsigned long long bytes;
+};
+
+static struct reader_count *counts;
+
+static void signal_ready(void)
+{
+	char c = 0;
+
+	if (write(ready_pipe[1], &c, 1) != 1)
+		die("logger: cannot signal readiness\n");
+}
+
+/* Waits for n children to be ready, giving up if one of them died */
+static void wait_ready(int n)
+{
+	struct pollfd pfd = { .fd = ready_pipe[0], .events = POLLIN };
+	int status;
+	char c;
+
+	while (n > 0) {
+		if (poll(&pfd, 1, 1000) > 0) {
+			if (read(ready_pipe[0], &c, 1) == 1)
+				n--;
+		} else if (waitpid(-1, &status, WNOHANG) > 0) {
+			die("logger: a child died before it was ready\n");
+		}
+	}
+}
+
+static void wait_start(void)
+{
+	char c;
+
+	if (read(start_pipe[0], &c, 1) < 0)
+		die("logger: cannot wait for the start\n");
+}
+
+static pid_t spawn(void (*fn)(int), int index)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("logger: fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		close(ready_pipe[0]);
+		close(start_pipe[1]);
+		fn(index);
+		exit(0);
+	}
+	return pid;
+}
+
+static int log_open(int flags)
+{
+	int fd = open(device, flags);
+
+	if (fd < 0)
+		die("logger: cannot open %s: %s\n", device, strerror(errno));
+	return fd;
+}
+
+/* Writes messages the way liblog does: priority, tag and text */
+static void writer(int index __used)
+{
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	char tag[] = "perf-bench";
+	char *msg = malloc(msg_size);
+	struct iovec vec[3];
+	int fd = log_open(O_WRONLY);
+	int i;
+
+	if (!msg)
+		die("logger: out of memory\n");
+	memset(msg, 'x', msg_size - 1);
+	msg[msg_size - 1] = '\0';
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = tag;
+	vec[1].iov_len = sizeof(tag);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_size;
+
+	signal_ready();
+	wait_start();
+
+	for (i = 0; i < loops; i++)
+		while (writev(fd, vec, 3) < 0)
+			if (errno != EINTR && errno != EAGAIN)
+				die("logger: write failed: %s\n",
+				    strerror(errno));
+}
+
+/* Follows the log until it is killed, skipping what was there before */
+static void reader(int index)
+{
+	struct reader_count *count = &counts[index];
+	char buf[LOGGER_ENTRY_MAX_LEN + 1];
+	int fd = log_open(O_RDONLY | O_NONBLOCK);
+	ssize_t len;
+
+	while (read(fd, buf, LOGGER_ENTRY_MAX_LEN) > 0)
+		;
+	if (fcntl(fd, F_SETFL, 0) < 0)
+		die("logger: fcntl failed: %s\n", strerror(errno));
+
+	signal_ready();
+	wait_start();
+
+	for (;;) {
+		len = read(fd, buf, LOGGER_ENTRY_MAX_LEN);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			die("logger: read failed: %s\n", strerror(errno));
+		}
+		count->entries++;
+		count->bytes += len;
+	}
+}
+
+int bench_logger_flood(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	pid_t reader_pids[MAX_READERS];
+	struct timeval start, stop, diff;
+	unsigned long long result_usec;
+	unsigned long long written;
+	unsigned long long read_entries = 0;
+	int status;
+	int i;
+
+	argc = parse_options(argc, argv, options, bench_logger_flood_usage, 0);
+	if (writers < 1 || loops < 1 || readers < 0 || readers > MAX_READERS ||
+	    msg_size < 1 || msg_size > (int)LOGGER_ENTRY_MAX_PAYLOAD - 16)
+		usage_with_options(bench_logger_flood_usage, options);
+
+	counts = mmap(NULL, MAX_READERS * sizeof(*counts),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counts == MAP_FAILED)
+		die("logger: out of memory\n");
+
+	if (pipe(ready_pipe) || pipe(start_pipe))
+		die("logger: pipe failed: %s\n", strerror(errno));
+
+	for (i = 0; i < readers; i++)
+		reader_pids[i] = spawn(reader, i);
+	for (i = 0; i < writers; i++)
+		spawn(writer, i);
+	close(ready_pipe[1]);
+	close(start_pipe[0]);
+	wait_ready(readers + writers);
+
+	gettimeofday(&start, NULL);
+	close(start_pipe[1]);
+	for (i = 0; i < writers; i++) {
+		if (wait(&status) < 0)
+			die("logger: wait failed: %s\n", strerror(errno));
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			die("logger: a writer failed\n");
+	}
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	/* What the readers have not caught up with by now is lost to them */
+	for (i = 0; i < readers; i++) {
+		kill(reader_pids[i], SIGKILL);
+		waitpid(reader_pids[i], &status, 0);
+		read_entries += counts[i].entries;
+	}
+	close(ready_pipe[0]);
+	munmap(counts, MAX_READERS * sizeof(*counts));
+
+	written = (unsigned long long)loops * writers;
+	result_usec = diff.tv_sec * 1000000ULL + diff.tv_usec;
+	if (!result_usec)
+		result_usec = 1;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d writers, %d readers on %s\n", writers, readers,
+		       device);
+		printf("# %d messages of %d bytes per writer\n\n", loops,
+		       msg_size);
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec, (unsigned long)(diff.tv_usec / 1000));
+
+		printf(" %14llu writes/sec\n",
+		       written * 1000000ULL / result_usec);
+		printf(" %14lf usecs/write per writer\n",
+		       (double)result_usec / (double)loops);
+		if (readers)
+			printf(" %14llu reads/sec per reader\n",
+			       read_entries * 1000000ULL / result_usec /
+			       readers);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu %llu\n", diff.tv_sec,
+		       (unsigned long)(diff.tv_usec / 1000),
+		       readers ? read_entries / readers : 0);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
@@ -13,6 +13,9 @@
  * Available subsystem list:
  *  sched ... scheduler and IPC mechanism
  *  mem   ... memory access performance
+ *  binder ... Android binder IPC
+ *  ashmem ... Android shared memory
+ *  logger ... Android logger
  *
  */
 
@@ -58,6 +61,39 @@ static struct bench_suite mem_suites[] = {
 	  NULL             }
 };
 
+static struct bench_suite binder_suites[] = {
+	{ "pairs",
+	  "Transactions of client/server pairs running in parallel",
+	  bench_binder_pairs },
+	{ "sg",
+	  "Large payloads as a flat parcel and as a scatter-gather list",
+	  bench_binder_sg },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL               }
+};
+
+static struct bench_suite ashmem_suites[] = {
+	{ "pin",
+	  "Pin and unpin of many regions while they are being purged",
+	  bench_ashmem_pin },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL             }
+};
+
+static struct bench_suite logger_suites[] = {
+	{ "flood",
+	  "Many writers logging at once while readers follow the log",
+	  bench_logger_flood },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL               }
+};
+
 struct bench_subsys {
 	const char *name;
 	const char *summary;
@@ -71,6 +107,15 @@ static struct bench_subsys subsystems[] = {
 	{ "mem",
 	  "memory access performance",
 	  mem_suites },
+	{ "binder",
+	  "Android binder IPC",
+	  binder_suites },
+	{ "ashmem",
+	  "Android shared memory",
+	  ashmem_suites },
+	{ "logger",
+	  "Android logger",
+	  logger_suites },
 	{ "all",		/* sentinel: easy for help */
 	  "test all subsystem (pseudo subsystem)",
 	  NULL },
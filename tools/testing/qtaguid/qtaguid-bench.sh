@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Packet rate through the xt_qtaguid match over a veth pair.
+#
+# usage: qtaguid-bench.sh [seconds] [jobs] [sockets]
+#
+# The far end of the pair lives in a network namespace of its own, where
+# qtaguid-flood -r discards the packets. The rate is measured three ways:
+#
+# - plain:    no iptables rule, so no qtaguid match at all
+# - untagged: an owner/qtaguid rule on the output interface, sockets not
+#             tagged, so packets are accounted to the sender's uid only
+# - tagged:   the same rule, every socket tagged, so packets are also
+#             accounted to a tag of their own
+#
+# The difference to 'plain' is the cost of the match. Run it as root with
+# qtaguid-flood built next to it, on an otherwise idle system, and with
+# more jobs than CPUs to see how the accounting scales.
+#
+
+DURATION=${1:-10}
+JOBS=${2:-1}
+SOCKETS=${3:-16}
+
+NS=qtaguid-bench
+DEV=qtb0
+PEER=qtb1
+ADDR=10.199.0.1
+PEER_ADDR=10.199.0.2
+PORT=9999
+RULE="OUTPUT -o $DEV -p udp -m owner --socket-exists"
+
+FLOOD=$(dirname "$0")/qtaguid-flood
+
+if [ ! -x "$FLOOD" ]; then
+	echo "build qtaguid-flood first: make -C $(dirname "$0")" >&2
+	exit 1
+fi
+
+cleanup()
+{
+	iptables -D $RULE 2>/dev/null
+	[ -n "$SINK" ] && kill $SINK 2>/dev/null
+	ip link del $DEV 2>/dev/null
+	ip netns del $NS 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+set -e
+ip netns add $NS
+ip link add $DEV type veth peer name $PEER
+ip link set $PEER netns $NS
+ip addr add $ADDR/24 dev $DEV
+ip link set $DEV up
+ip netns exec $NS ip addr add $PEER_ADDR/24 dev $PEER
+ip netns exec $NS ip link set $PEER up
+ip netns exec $NS ip link set lo up
+ip netns exec $NS "$FLOOD" -r $PORT &
+SINK=$!
+set +e
+
+run()
+{
+	printf "%-10s " "$1:"
+	shift
+	"$FLOOD" -t $DURATION -j $JOBS -s $SOCKETS "$@" $PEER_ADDR $PORT
+}
+
+echo "# $JOBS jobs, $SOCKETS sockets each, $DURATION s per run"
+run plain -n
+iptables -A $RULE
+run untagged -n
+run tagged
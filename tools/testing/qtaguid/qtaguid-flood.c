@@ -0,0 +1,233 @@
+/*
+ * qtaguid-flood: send UDP packets from tagged sockets as fast as possible
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ *
+ * Each job opens a number of UDP sockets, tags each with an accounting
+ * tag of its own through /proc/net/xt_qtaguid/ctrl and sends small
+ * packets on them in turn for the given time. With an xt_qtaguid rule on
+ * the output interface every packet is matched and accounted to its tag,
+ * so the rate compared to a run without the rule is the cost of the
+ * match. See qtaguid-bench.sh, which runs it over a veth pair.
+ *
+ * With -r it is the receiving end instead and discards what it gets.
+ *
+ * Compile with:
+ *
+ * gcc -o qtaguid-flood qtaguid-flood.c -lrt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define QTAGUID_CTRL	"/proc/net/xt_qtaguid/ctrl"
+#define QTAGUID_DEV	"/dev/xt_qtaguid"
+#define MAX_SOCKETS	1024
+
+struct result {
+	unsigned long long sent;
+	double elapsed;
+};
+
+static int jobs = 1;
+static int n_sockets = 16;
+static int seconds = 10;
+static int size = 64;
+static int untagged;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: qtaguid-flood [-j jobs] [-s sockets] [-t seconds] "
+		"[-l length] [-n] host port\n"
+		"       qtaguid-flood -r port\n"
+		"  -j  processes sending at once (default 1)\n"
+		"  -s  sockets per process, each with its own tag "
+		"(default 16)\n"
+		"  -t  seconds to send for (default 10)\n"
+		"  -l  UDP payload length (default 64)\n"
+		"  -n  do not tag the sockets\n"
+		"  -r  receive and discard packets on port\n");
+	exit(2);
+}
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ctrl(int fd, const char *fmt, int sock, unsigned long long tag)
+{
+	char cmd[64];
+	int len;
+
+	len = snprintf(cmd, sizeof(cmd), fmt, sock, tag, (unsigned)getuid());
+	if (write(fd, cmd, len) != len)
+		fail("qtaguid-flood: " QTAGUID_CTRL);
+}
+
+/* Sends for the given time, counting the packets sent */
+static void flood(int job, const struct sockaddr_in *to, struct result *res)
+{
+	int socks[MAX_SOCKETS];
+	char *buf = calloc(1, size);
+	int ctrl_fd = -1;
+	double start;
+	int i, round;
+
+	if (!buf)
+		fail("qtaguid-flood: calloc");
+
+	if (!untagged) {
+		/* Tags are only cleaned up for us while this stays open */
+		open(QTAGUID_DEV, O_RDONLY);
+		ctrl_fd = open(QTAGUID_CTRL, O_WRONLY);
+		if (ctrl_fd < 0)
+			fail("qtaguid-flood: " QTAGUID_CTRL);
+	}
+
+	for (i = 0; i < n_sockets; i++) {
+		unsigned long long tag = job * n_sockets + i + 1;
+
+		socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		if (socks[i] < 0)
+			fail("qtaguid-flood: socket");
+		if (connect(socks[i], (const struct sockaddr *)to,
+			    sizeof(*to)) < 0)
+			fail("qtaguid-flood: connect");
+		if (ctrl_fd >= 0)
+			ctrl(ctrl_fd, "t %d %llu %u", socks[i], tag << 32);
+	}
+
+	res->sent = 0;
+	start = now();
+	for (round = 1; ; round++) {
+		for (i = 0; i < n_sockets; i++)
+			if (send(socks[i], buf, size, 0) == size)
+				res->sent++;
+		if (!(round % 64)) {
+			res->elapsed = now() - start;
+			if (res->elapsed >= seconds)
+				break;
+		}
+	}
+
+	for (i = 0; i < n_sockets; i++) {
+		if (ctrl_fd >= 0)
+			ctrl(ctrl_fd, "u %d", socks[i], 0);
+		close(socks[i]);
+	}
+}
+
+static void sink(int port)
+{
+	struct sockaddr_in addr;
+	char buf[65536];
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0)
+		fail("qtaguid-flood: socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fail("qtaguid-flood: bind");
+
+	for (;;)
+		recv(fd, buf, sizeof(buf), 0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long total = 0;
+	double rate = 0;
+	struct sockaddr_in to;
+	struct result res;
+	int results[2];
+	int c, i, status;
+
+	while ((c = getopt(argc, argv, "j:s:t:l:nr:")) != -1) {
+		switch (c) {
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 's':
+			n_sockets = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			size = atoi(optarg);
+			break;
+		case 'n':
+			untagged = 1;
+			break;
+		case 'r':
+			sink(atoi(optarg));
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2 || jobs < 1 || n_sockets < 1 ||
+	    n_sockets > MAX_SOCKETS || seconds < 1 || size < 1 ||
+	    size > 65507)
+		usage();
+
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(atoi(argv[optind + 1]));
+	if (inet_pton(AF_INET, argv[optind], &to.sin_addr) != 1)
+		usage();
+
+	if (pipe(results) < 0)
+		fail("qtaguid-flood: pipe");
+
+	for (i = 0; i < jobs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			fail("qtaguid-flood: fork");
+		if (!pid) {
+			flood(i, &to, &res);
+			if (write(results[1], &res, sizeof(res)) !=
+			    sizeof(res))
+				fail("qtaguid-flood: write");
+			exit(0);
+		}
+	}
+	close(results[1]);
+
+	while (read(results[0], &res, sizeof(res)) == sizeof(res)) {
+		total += res.sent;
+		rate += res.sent / res.elapsed;
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			return 1;
+
+	printf("%llu packets in %d s: %.0f packets/s\n",
+	       total, seconds, rate);
+	return 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Helpers for the yaffs2 benchmarks, to be sourced: a simulated NAND
+# device from nandsim with yaffs2 mounted on it.
+#
+# The chip is large page SLC, with 2 KiB pages and 128 KiB blocks. Set
+# NANDSIM_DELAYS=1 to have nandsim busy-wait for typical SLC timings
+# (25 us page read, 200 us program, 2 ms erase) instead of running at
+# memory speed, and NANDSIM_CACHE to a file to keep the pages there
+# rather than in RAM, which large chips need.
+#
+
+NANDSIM_MNT=${NANDSIM_MNT:-/mnt/yaffs-bench}
+
+# nandsim_load <size in MiB>: 128, 256, 512 or 1024
+nandsim_load()
+{
+	case $1 in
+	128)	id=0xf1 ;;
+	256)	id=0xda ;;
+	512)	id=0xdc ;;
+	1024)	id=0xd3 ;;
+	*)	echo "nandsim: no chip of $1 MiB" >&2; return 1 ;;
+	esac
+
+	set -- first_id_byte=0x20 second_id_byte=$id fourth_id_byte=0x15
+	if [ -n "$NANDSIM_DELAYS" ]; then
+		set -- "$@" do_delays=1 access_delay=25 programm_delay=200 \
+			erase_delay=2 output_cycle=25 input_cycle=25
+	fi
+	[ -n "$NANDSIM_CACHE" ] && set -- "$@" cache_file="$NANDSIM_CACHE"
+
+	modprobe nandsim "$@" || return 1
+	modprobe mtdblock 2>/dev/null
+
+	NANDSIM_MTD=$(awk -F: '/"NAND simulator/ { print $1; exit }' \
+		/proc/mtd)
+	if [ -z "$NANDSIM_MTD" ]; then
+		echo "nandsim: no NAND simulator in /proc/mtd" >&2
+		return 1
+	fi
+	mkdir -p $NANDSIM_MNT
+}
+
+# yaffs_mount [mount options]
+yaffs_mount()
+{
+	mount -t yaffs2 ${1:+-o $1} /dev/mtdblock${NANDSIM_MTD#mtd} \
+		$NANDSIM_MNT
+}
+
+yaffs_umount()
+{
+	umount $NANDSIM_MNT
+}
+
+# yaffs_stat <field>: a counter of the mounted device from /proc/yaffs
+yaffs_stat()
+{
+	awk -v f="$1" '$1 ~ "^" f "\\.*$" { print $2; exit }' /proc/yaffs
+}
+
+nandsim_unload()
+{
+	grep -q " $NANDSIM_MNT " /proc/mounts && umount $NANDSIM_MNT
+	rmmod nandsim 2>/dev/null
+}
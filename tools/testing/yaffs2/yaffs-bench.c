@@ -0,0 +1,389 @@
+/*
+ * yaffs-bench: file system load for measuring yaffs2 on nandsim
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ *
+ * rw: reader processes read a file over and over while writer
+ *     processes overwrite files of their own and fsync them, which keeps
+ *     the garbage collector busy. The readers drop the file from the
+ *     page cache before each pass, so every pass reads NAND. Reader
+ *     throughput with writers running, compared to readers alone, shows
+ *     how much reads are held up by writes and gc.
+ *
+ * fsync: appends short records to a file and fsyncs after each, as a
+ *        SQLite journal does, and reports the latency of each append
+ *        and fsync pair.
+ *
+ * seq: writes a file sequentially and fsyncs it, then reads it back
+ *      twice from NAND: with readahead, and without it a page at a
+ *      time, so that batched reads can be compared to single pages.
+ *
+ * Run it on an otherwise idle yaffs2 mount; see yaffs-bench.sh,
+ * yaffs-fsync.sh and yaffs-seq.sh.
+ *
+ * Compile with:
+ *
+ * gcc -o yaffs-bench yaffs-bench.c -lrt
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define IO_SIZE		65536
+
+struct result {
+	int writer;
+	unsigned long long bytes;
+	double elapsed;
+};
+
+static int readers = 2;
+static int writers;
+static int seconds = 10;
+static int read_mib = 8;
+static int write_mib = 4;
+static int appends = 1000;
+static int append_size = 512;
+static int seq_mib = 16;
+static int io_kib = 64;
+static const char *dir;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: yaffs-bench rw [-r readers] [-w writers] [-t seconds] "
+		"[-s MiB] [-S MiB] dir\n"
+		"       yaffs-bench fsync [-n appends] [-l length] dir\n"
+		"       yaffs-bench seq [-s MiB] [-b KiB] dir\n"
+		"  -r  processes reading one file (default 2)\n"
+		"  -w  processes overwriting a file each (default 0)\n"
+		"  -t  seconds to run for (default 10)\n"
+		"  -s  size of the file read (default 8, 16 for seq)\n"
+		"  -S  size of each written file (default 4)\n"
+		"  -n  appends to make (default 1000)\n"
+		"  -l  bytes per append (default 512)\n"
+		"  -b  KiB per read and write (default 64)\n");
+	exit(2);
+}
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *path(const char *name, int index)
+{
+	static char buf[4096];
+
+	snprintf(buf, sizeof(buf), "%s/%s-%d", dir, name, index);
+	return buf;
+}
+
+/* Writes size bytes of a pattern to fd from offset, fsyncing at the end */
+static void fill(int fd, off_t offset, off_t size, char *buf)
+{
+	off_t done;
+
+	for (done = 0; done < size; done += IO_SIZE) {
+		memset(buf, (offset + done) / IO_SIZE, IO_SIZE);
+		if (pwrite(fd, buf, IO_SIZE, offset + done) != IO_SIZE)
+			fail("yaffs-bench: write");
+	}
+	if (fsync(fd) < 0)
+		fail("yaffs-bench: fsync");
+}
+
+static void reader(const char *file, struct result *res)
+{
+	off_t size = (off_t)read_mib << 20;
+	char *buf = malloc(IO_SIZE);
+	double start = now();
+	int fd = open(file, O_RDONLY);
+	off_t off;
+
+	if (fd < 0 || !buf)
+		fail("yaffs-bench: reader");
+
+	res->bytes = 0;
+	do {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		for (off = 0; off < size; off += IO_SIZE) {
+			if (pread(fd, buf, IO_SIZE, off) != IO_SIZE)
+				fail("yaffs-bench: read");
+			res->bytes += IO_SIZE;
+		}
+		res->elapsed = now() - start;
+	} while (res->elapsed < seconds);
+	close(fd);
+}
+
+/* Overwrites its file a MiB at a time, syncing after each */
+static void writer(int index, struct result *res)
+{
+	off_t size = (off_t)write_mib << 20;
+	char *buf = malloc(IO_SIZE);
+	double start = now();
+	int fd = open(path("write", index), O_WRONLY | O_CREAT, 0644);
+	off_t off = 0;
+
+	if (fd < 0 || !buf)
+		fail("yaffs-bench: writer");
+
+	res->bytes = 0;
+	do {
+		fill(fd, off, 1 << 20, buf);
+		res->bytes += 1 << 20;
+		off = (off + (1 << 20)) % size;
+		res->elapsed = now() - start;
+	} while (res->elapsed < seconds);
+	close(fd);
+}
+
+static int bench_rw(int argc, char **argv)
+{
+	unsigned long long bytes[2] = { 0, 0 };
+	double rate[2] = { 0, 0 };
+	struct result res;
+	char *file, *buf;
+	int results[2];
+	int c, i, fd, status;
+
+	while ((c = getopt(argc, argv, "r:w:t:s:S:")) != -1) {
+		switch (c) {
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 'w':
+			writers = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			read_mib = atoi(optarg);
+			break;
+		case 'S':
+			write_mib = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1 || readers < 1 || writers < 0 ||
+	    seconds < 1 || read_mib < 1 || write_mib < 1)
+		usage();
+	dir = argv[optind];
+
+	/* The files exist before the clock starts */
+	file = strdup(path("read", 0));
+	buf = malloc(IO_SIZE);
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (!file || !buf || fd < 0)
+		fail("yaffs-bench: setup");
+	fill(fd, 0, (off_t)read_mib << 20, buf);
+	close(fd);
+	for (i = 0; i < writers; i++) {
+		fd = open(path("write", i), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			fail("yaffs-bench: setup");
+		fill(fd, 0, (off_t)write_mib << 20, buf);
+		close(fd);
+	}
+
+	if (pipe(results) < 0)
+		fail("yaffs-bench: pipe");
+
+	for (i = 0; i < readers + writers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			fail("yaffs-bench: fork");
+		if (!pid) {
+			res.writer = i >= readers;
+			if (res.writer)
+				writer(i - readers, &res);
+			else
+				reader(file, &res);
+			if (write(results[1], &res, sizeof(res)) !=
+			    sizeof(res))
+				fail("yaffs-bench: write");
+			exit(0);
+		}
+	}
+	close(results[1]);
+
+	while (read(results[0], &res, sizeof(res)) == sizeof(res)) {
+		bytes[res.writer] += res.bytes;
+		rate[res.writer] += res.bytes / res.elapsed;
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			return 1;
+
+	printf("read:  %d processes, %llu MiB, %.2f MiB/s\n",
+	       readers, bytes[0] >> 20, rate[0] / (1 << 20));
+	if (writers)
+		printf("write: %d processes, %llu MiB, %.2f MiB/s\n",
+		       writers, bytes[1] >> 20, rate[1] / (1 << 20));
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int bench_fsync(int argc, char **argv)
+{
+	double *lat, start, total = 0;
+	char *buf;
+	int c, i, fd;
+
+	while ((c = getopt(argc, argv, "n:l:")) != -1) {
+		switch (c) {
+		case 'n':
+			appends = atoi(optarg);
+			break;
+		case 'l':
+			append_size = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1 || appends < 1 || append_size < 1)
+		usage();
+	dir = argv[optind];
+
+	lat = calloc(appends, sizeof(*lat));
+	buf = malloc(append_size);
+	fd = open(path("journal", 0), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+		  0644);
+	if (!lat || !buf || fd < 0)
+		fail("yaffs-bench: setup");
+	memset(buf, 'j', append_size);
+
+	for (i = 0; i < appends; i++) {
+		start = now();
+		if (write(fd, buf, append_size) != append_size)
+			fail("yaffs-bench: write");
+		if (fsync(fd) < 0)
+			fail("yaffs-bench: fsync");
+		lat[i] = now() - start;
+		total += lat[i];
+	}
+	close(fd);
+
+	qsort(lat, appends, sizeof(*lat), cmp_double);
+	printf("%d appends of %d bytes: mean %.0f us, median %.0f us, "
+	       "99%% %.0f us, max %.0f us\n", appends, append_size,
+	       total / appends * 1e6, lat[appends / 2] * 1e6,
+	       lat[appends * 99 / 100] * 1e6, lat[appends - 1] * 1e6);
+	return 0;
+}
+
+/*
+ * Reads the whole file in len byte requests with the given readahead
+ * advice, returns MiB/s. With POSIX_FADV_RANDOM each request is read
+ * from NAND as it is, so page sized requests read a page at a time.
+ */
+static double seq_read(int fd, off_t size, char *buf, size_t len,
+		       int advice)
+{
+	double start;
+	off_t off;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, 0, 0, advice);
+	start = now();
+	for (off = 0; off < size; off += len)
+		if (pread(fd, buf, len, off) != (ssize_t)len)
+			fail("yaffs-bench: read");
+	return size / (now() - start) / (1 << 20);
+}
+
+static int bench_seq(int argc, char **argv)
+{
+	size_t len;
+	off_t size, off;
+	double start, write_rate;
+	char *buf;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "s:b:")) != -1) {
+		switch (c) {
+		case 's':
+			seq_mib = atoi(optarg);
+			break;
+		case 'b':
+			io_kib = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1 || seq_mib < 1 || io_kib < 1 ||
+	    io_kib > 1024 || (seq_mib << 10) % io_kib)
+		usage();
+	dir = argv[optind];
+
+	len = (size_t)io_kib << 10;
+	size = (off_t)seq_mib << 20;
+	buf = malloc(len);
+	fd = open(path("seq", 0), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (!buf || fd < 0)
+		fail("yaffs-bench: setup");
+	memset(buf, 's', len);
+
+	start = now();
+	for (off = 0; off < size; off += len)
+		if (write(fd, buf, len) != (ssize_t)len)
+			fail("yaffs-bench: write");
+	if (fsync(fd) < 0)
+		fail("yaffs-bench: fsync");
+	write_rate = seq_mib / (now() - start);
+
+	printf("%d MiB in %d KiB requests\n", seq_mib, io_kib);
+	printf("write:                %.2f MiB/s\n", write_rate);
+	printf("read, readahead:      %.2f MiB/s\n",
+	       seq_read(fd, size, buf, len, POSIX_FADV_SEQUENTIAL));
+	printf("read, page at a time: %.2f MiB/s\n",
+	       seq_read(fd, size, buf, sysconf(_SC_PAGESIZE),
+			POSIX_FADV_RANDOM));
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage();
+	if (!strcmp(argv[1], "rw"))
+		return bench_rw(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "fsync"))
+		return bench_fsync(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "seq"))
+		return bench_seq(argc - 1, argv + 1);
+	usage();
+	return 2;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# yaffs2 on nandsim: reads against writes and garbage collection.
+#
+# usage: yaffs-bench.sh [seconds] [readers] [writers] [mount options]
+#
+# A fresh yaffs2 file system is mounted on a 128 MiB nandsim chip (see
+# nandsim.sh for NANDSIM_DELAYS). The readers first run alone, then with
+# the writers, which overwrite their files and keep gc busy. With reads
+# that do not wait for writes the read rate should drop little; run the
+# same script on kernels with and without a change to compare them.
+# Run it as root with yaffs-bench built next to it, on an otherwise idle
+# system, and with more processes than CPUs to see how reads scale.
+#
+
+DURATION=${1:-10}
+READERS=${2:-2}
+WRITERS=${3:-2}
+OPTIONS=$4
+
+HERE=$(dirname "$0")
+BENCH=$HERE/yaffs-bench
+
+if [ ! -x "$BENCH" ]; then
+	echo "build yaffs-bench first: make -C $HERE" >&2
+	exit 1
+fi
+
+. "$HERE/nandsim.sh"
+trap nandsim_unload EXIT INT TERM
+
+set -e
+nandsim_load 128
+yaffs_mount "$OPTIONS"
+set +e
+
+echo "# $READERS readers, $WRITERS writers, $DURATION s per run"
+echo "## readers alone"
+"$BENCH" rw -t $DURATION -r $READERS $NANDSIM_MNT
+echo "## readers and writers"
+erased=$(yaffs_stat n_erasures)
+"$BENCH" rw -t $DURATION -r $READERS -w $WRITERS $NANDSIM_MNT
+echo "blocks erased: $(($(yaffs_stat n_erasures) - erased))"
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# yaffs2 on nandsim: latency of short appends, each followed by fsync.
+#
+# usage: yaffs-fsync.sh [appends] [bytes per append]
+#
+# "yaffs-bench fsync" is run on a fresh 128 MiB nandsim chip (see
+# nandsim.sh for NANDSIM_DELAYS) once for each short op cache setup:
+# no cache, the default 10 chunks and 64 chunks. Besides the latency,
+# the pages programmed and read per append are taken from /proc/yaffs:
+# a partial chunk that has to be read back before it is written again
+# shows up as reads, and every fsync of a partial chunk as a write.
+#
+
+APPENDS=${1:-1000}
+LENGTH=${2:-512}
+
+HERE=$(dirname "$0")
+BENCH=$HERE/yaffs-bench
+
+if [ ! -x "$BENCH" ]; then
+	echo "build yaffs-bench first: make -C $HERE" >&2
+	exit 1
+fi
+
+. "$HERE/nandsim.sh"
+trap nandsim_unload EXIT INT TERM
+
+set -e
+nandsim_load 128
+set +e
+
+for options in no-cache "" cache-size=64; do
+	yaffs_mount "$options" || exit 1
+	writes=$(yaffs_stat n_page_writes)
+	reads=$(yaffs_stat n_page_reads)
+	echo "## ${options:-default}"
+	"$BENCH" fsync -n $APPENDS -l $LENGTH $NANDSIM_MNT
+	awk -v w=$(($(yaffs_stat n_page_writes) - writes)) \
+	    -v r=$(($(yaffs_stat n_page_reads) - reads)) -v n=$APPENDS \
+		'BEGIN { printf "per append: %.2f pages written, " \
+			 "%.2f pages read\n", w / n, r / n }'
+	rm -f $NANDSIM_MNT/journal-0
+	yaffs_umount
+done
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# yaffs2 mount time on nandsim, from the checkpoint and by full scan.
+#
+# usage: yaffs-mount-time.sh [chip MiB] [percent full] [runs]
+#
+# The chip is filled to the given level with a mix of small and large
+# files and unmounted, which writes a checkpoint. It is then mounted
+# again, first normally, which reads the checkpoint, then with
+# no-checkpoint-read, which scans every block as after an unclean
+# shutdown. Each mount is timed, and the pages read to mount are taken
+# from /proc/yaffs. Set NANDSIM_DELAYS=1 (see nandsim.sh) for NAND
+# timings closer to a real part, and NANDSIM_CACHE for chips of 512 MiB
+# and more.
+#
+
+SIZE=${1:-256}
+FULL=${2:-75}
+RUNS=${3:-3}
+
+HERE=$(dirname "$0")
+. "$HERE/nandsim.sh"
+trap nandsim_unload EXIT INT TERM
+
+set -e
+nandsim_load $SIZE
+yaffs_mount
+set +e
+
+# A tenth of the data in 4 KiB files, the rest in 1 MiB files
+target=$((SIZE * 1024 * FULL / 100))
+small=$((target / 10 / 4))
+large=$(((target - small * 4) / 1024))
+mkdir $NANDSIM_MNT/small
+i=0
+while [ $i -lt $small ]; do
+	dd if=/dev/zero of=$NANDSIM_MNT/small/$i bs=4k count=1 2>/dev/null
+	i=$((i + 1))
+done
+i=0
+while [ $i -lt $large ]; do
+	dd if=/dev/zero of=$NANDSIM_MNT/large-$i bs=1M count=1 2>/dev/null
+	i=$((i + 1))
+done
+sync
+yaffs_umount
+
+# mount_time [mount options]: seconds to mount, and pages read doing it
+mount_time()
+{
+	start=$(date +%s.%N)
+	yaffs_mount "$1" || exit 1
+	stop=$(date +%s.%N)
+	awk -v a=$start -v b=$stop -v n=$(yaffs_stat n_page_reads) \
+		'BEGIN { printf "%.3f s, %d pages read\n", b - a, n }'
+	yaffs_umount
+}
+
+echo "# $SIZE MiB chip, $FULL% full: $small small files, $large large"
+run=1
+while [ $run -le $RUNS ]; do
+	printf "checkpoint: "
+	mount_time
+	printf "full scan:  "
+	mount_time no-checkpoint-read
+	run=$((run + 1))
+done
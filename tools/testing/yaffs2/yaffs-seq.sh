@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# yaffs2 on nandsim: sequential write and read throughput.
+#
+# usage: yaffs-seq.sh [MiB] [mount options]
+#
+# "yaffs-bench seq" is run on a fresh 128 MiB nandsim chip with 4 KiB
+# and with 64 KiB requests. The file is read back twice. The first pass
+# uses readahead, so runs of pages go to NAND as batched MTD reads. The
+# second pass turns readahead off (POSIX_FADV_RANDOM) and reads a page
+# per request, so every page is a read of its own. The two rates
+# compare the two paths on the same kernel. NAND costs set the gap: use
+# NANDSIM_DELAYS=1 (see nandsim.sh) for timings closer to a real part.
+#
+
+SIZE=${1:-16}
+OPTIONS=$2
+
+HERE=$(dirname "$0")
+BENCH=$HERE/yaffs-bench
+
+if [ ! -x "$BENCH" ]; then
+	echo "build yaffs-bench first: make -C $HERE" >&2
+	exit 1
+fi
+
+. "$HERE/nandsim.sh"
+trap nandsim_unload EXIT INT TERM
+
+set -e
+nandsim_load 128
+yaffs_mount "$OPTIONS"
+set +e
+
+for kib in 4 64; do
+	"$BENCH" seq -s $SIZE -b $kib $NANDSIM_MNT
+	rm -f $NANDSIM_MNT/seq-0
+done